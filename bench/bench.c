@@ -0,0 +1,214 @@
+// nftw is an X/Open extension, not exposed by ftw.h without _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#include "bench.h"
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec * (uint64_t)1e9 + tv.tv_nsec;
+}
+
+/*
+ * xorshift64*, runs are reproducible from the same seed, which must not be 0
+ */
+uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in [0, 1)
+double bench_rand_unit(uint64_t *state)
+{
+    return (bench_rand(state) >> 11) * (1.0 / (double)(1ULL << 53));
+}
+
+static int latency_cmp(const void *a, const void *b)
+{
+    uint64_t la = *(const uint64_t *)a, lb = *(const uint64_t *)b;
+    return la < lb ? -1 : la > lb;
+}
+
+/*
+ * Nearest rank percentile, `p` in [0, 100], the latencies are sorted in place
+ */
+uint64_t bench_percentile(Latencies *latencies, double p)
+{
+    size_t n = vec_size(*latencies);
+
+    if (n == 0)
+        return 0;
+
+    qsort(latencies->data, n, sizeof(uint64_t), latency_cmp);
+
+    size_t rank = (size_t)(p / 100.0 * n + 0.5);
+    rank        = rank == 0 ? 1 : rank > n ? n : rank;
+
+    return vec_at(*latencies, rank - 1);
+}
+
+void bench_summarize(Latencies *latencies, Latency_Summary *summary)
+{
+    double total = 0.0;
+
+    *summary     = (Latency_Summary){.count = vec_size(*latencies)};
+    if (summary->count == 0)
+        return;
+
+    for (size_t i = 0; i < summary->count; ++i)
+        total += vec_at(*latencies, i);
+
+    summary->mean = total / summary->count;
+    summary->p50  = bench_percentile(latencies, 50.0);
+    summary->p99  = bench_percentile(latencies, 99.0);
+    summary->p999 = bench_percentile(latencies, 99.9);
+    summary->max  = vec_at(*latencies, summary->count - 1);
+}
+
+void bench_histogram_init(Histogram *h)
+{
+    memset(h, 0x00, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+/*
+ * Values below 2^HISTOGRAM_SUB_BITS have a bucket each, the others go in
+ * one of the HISTOGRAM_SUB_BITS sub-buckets of their power of two
+ */
+static size_t histogram_bucket(uint64_t value)
+{
+    if (value < (1 << HISTOGRAM_SUB_BITS))
+        return value;
+
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    size_t sub =
+        (value >> shift) & (((uint64_t)1 << HISTOGRAM_SUB_BITS) - 1);
+
+    return ((size_t)(shift + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+// Highest value falling in the bucket
+uint64_t bench_histogram_bucket_max(size_t bucket)
+{
+    if (bucket < (1 << HISTOGRAM_SUB_BITS))
+        return bucket;
+
+    int shift    = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    uint64_t low = (((uint64_t)1 << HISTOGRAM_SUB_BITS) + sub) << shift;
+
+    return low + (((uint64_t)1 << shift) - 1);
+}
+
+void bench_histogram_add(Histogram *h, uint64_t value)
+{
+    h->buckets[histogram_bucket(value)]++;
+    h->count++;
+    h->total += value;
+    h->min = value < h->min ? value : h->min;
+    h->max = value > h->max ? value : h->max;
+}
+
+void bench_histogram_merge(Histogram *dst, const Histogram *src)
+{
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        dst->buckets[i] += src->buckets[i];
+
+    dst->count += src->count;
+    dst->total += src->total;
+    dst->min = src->min < dst->min ? src->min : dst->min;
+    dst->max = src->max > dst->max ? src->max : dst->max;
+}
+
+/*
+ * Nearest rank percentile, `p` in [0, 100], as the highest value of the
+ * bucket holding the rank, never past the largest value recorded
+ */
+uint64_t bench_histogram_percentile(const Histogram *h, double p)
+{
+    uint64_t seen = 0;
+
+    if (h->count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+    rank          = rank == 0 ? 1 : rank > h->count ? h->count : rank;
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = bench_histogram_bucket_max(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+// nftw carries no user pointer
+static Disk_Usage *disk_usage = NULL;
+
+static int disk_usage_add(const char *path, const struct stat *st, int flag,
+                          struct FTW *ftw)
+{
+    const char *name = path + ftw->base;
+
+    (void)flag;
+
+    if (!S_ISREG(st->st_mode))
+        return 0;
+
+    disk_usage->bytes += st->st_size;
+
+    if (strncmp(name, "wal-", 4) == 0) {
+        disk_usage->wal_files++;
+        disk_usage->wal_bytes += st->st_size;
+    } else if (strncmp(name, "c-", 2) == 0) {
+        disk_usage->log_files++;
+    } else if (strncmp(name, "i-", 2) == 0) {
+        disk_usage->index_files++;
+    }
+
+    return 0;
+}
+
+int bench_disk_usage(const char *path, Disk_Usage *usage)
+{
+    *usage     = (Disk_Usage){0};
+    disk_usage = usage;
+    return nftw(path, disk_usage_add, 16, FTW_PHYS);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+/*
+ * Remove the data of a previous run, a missing directory is fine
+ */
+int bench_remove_dir(const char *path)
+{
+    if (nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS) < 0 &&
+        errno != ENOENT) {
+        fprintf(stderr, "Can't remove %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
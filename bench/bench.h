@@ -0,0 +1,71 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "vec.h"
+#include <stddef.h>
+#include <stdint.h>
+
+typedef VEC(uint64_t) Latencies;
+
+// Sub-buckets per power of two, values are off by 1/32 at most
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_BUCKETS  ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+/*
+ * Log-linear histogram of latencies, of fixed size however many samples are
+ * recorded, for runs too long to keep them all
+ */
+typedef struct histogram {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    double total;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+typedef struct latency_summary {
+    size_t count;
+    double mean;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} Latency_Summary;
+
+/*
+ * Files left on disk by a run, WAL segments are preallocated so their bytes
+ * are the room reserved rather than the data logged
+ */
+typedef struct disk_usage {
+    size_t bytes;
+    size_t wal_files;
+    size_t wal_bytes;
+    size_t log_files;
+    size_t index_files;
+} Disk_Usage;
+
+uint64_t bench_now_ns(void);
+
+uint64_t bench_rand(uint64_t *state);
+
+double bench_rand_unit(uint64_t *state);
+
+uint64_t bench_percentile(Latencies *latencies, double p);
+
+void bench_summarize(Latencies *latencies, Latency_Summary *summary);
+
+void bench_histogram_init(Histogram *h);
+
+void bench_histogram_add(Histogram *h, uint64_t value);
+
+void bench_histogram_merge(Histogram *dst, const Histogram *src);
+
+uint64_t bench_histogram_percentile(const Histogram *h, double p);
+
+uint64_t bench_histogram_bucket_max(size_t bucket);
+
+int bench_disk_usage(const char *path, Disk_Usage *usage);
+
+int bench_remove_dir(const char *path);
+
+#endif
@@ -0,0 +1,291 @@
+#include "bench.h"
+#include "binary.h"
+#include "protocol.h"
+#include "timeseries.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#define BASE_TIMESTAMP 1710033421000000000ULL
+// Timestamp, value and the size of each record
+#define RECORD_SIZE    (sizeof(uint64_t) * 3)
+
+/*
+ * Inputs and outputs shared by the cases, `sink` keeps the compiler from
+ * dropping the results nobody reads
+ */
+typedef struct codec_data {
+    size_t length;
+    Record *records;
+    Record *decoded;
+    const Record **refs;
+    uint64_t *words;
+    double_t *values;
+    uint8_t *binary;
+    uint8_t *text;
+    size_t text_size;
+    volatile uint64_t sink;
+} Codec_Data;
+
+typedef struct codec_case {
+    const char *name;
+    void (*run)(Codec_Data *);
+} Codec_Case;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-n records] [-r rounds] [-S seed]\n"
+            "\n"
+            "  -n  records encoded and decoded by each round, 4096 by\n"
+            "      default, sized to stay in cache\n"
+            "  -r  rounds of each case, the fastest is reported, 200\n"
+            "  -S  seed of the generator, 42 by default\n",
+            name);
+}
+
+static uint64_t now_cycles(void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void run_write_i64(Codec_Data *d)
+{
+    for (size_t i = 0; i < d->length; ++i)
+        write_i64(d->binary + i * sizeof(uint64_t), d->words[i]);
+}
+
+static void run_read_i64(Codec_Data *d)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < d->length; ++i)
+        sum += read_i64(d->binary + i * sizeof(uint64_t));
+    d->sink = sum;
+}
+
+static void run_write_f64(Codec_Data *d)
+{
+    for (size_t i = 0; i < d->length; ++i)
+        write_f64(d->binary + i * sizeof(uint64_t), d->values[i]);
+}
+
+static void run_read_f64(Codec_Data *d)
+{
+    double_t sum = 0.0;
+    for (size_t i = 0; i < d->length; ++i)
+        sum += read_f64(d->binary + i * sizeof(uint64_t));
+    d->sink = (uint64_t)sum;
+}
+
+static void run_write_i64_array(Codec_Data *d)
+{
+    write_i64_array(d->binary, d->words, d->length);
+}
+
+static void run_read_i64_array(Codec_Data *d)
+{
+    read_i64_array(d->words, d->binary, d->length);
+    d->sink = d->words[d->length - 1];
+}
+
+static void run_write_f64_array(Codec_Data *d)
+{
+    write_f64_array(d->binary, d->values, d->length);
+}
+
+static void run_read_f64_array(Codec_Data *d)
+{
+    read_f64_array(d->values, d->binary, d->length);
+    d->sink = (uint64_t)d->values[d->length - 1];
+}
+
+static void run_record_write(Codec_Data *d)
+{
+    uint8_t *ptr = d->binary;
+    for (size_t i = 0; i < d->length; ++i)
+        ptr += ts_record_write(&d->records[i], ptr);
+}
+
+static void run_record_read(Codec_Data *d)
+{
+    const uint8_t *ptr = d->binary;
+    for (size_t i = 0; i < d->length; ++i)
+        ptr += ts_record_read(&d->decoded[i], ptr);
+    d->sink = d->decoded[d->length - 1].timestamp;
+}
+
+static void run_record_read_batch(Codec_Data *d)
+{
+    d->sink = ts_record_read_batch(d->decoded, d->binary, d->length);
+}
+
+static void run_record_batch_write(Codec_Data *d)
+{
+    d->sink = ts_record_batch_write(d->refs, d->binary, d->length);
+}
+
+static void run_encode_array(Codec_Data *d)
+{
+    ssize_t n = encode_array_header(d->length, d->text);
+    for (size_t i = 0; i < d->length; ++i)
+        n += encode_array_record(d->records[i].timestamp, d->records[i].value,
+                                 d->text + n);
+    d->sink = n;
+}
+
+static void run_decode_array(Codec_Data *d)
+{
+    Response rs = {0};
+    d->sink     = decode_response(d->text, &rs);
+    free_response(&rs);
+}
+
+// The decoders read what the matching encoder has written just before
+static const Codec_Case cases[] = {
+    {"write_i64", run_write_i64},
+    {"read_i64", run_read_i64},
+    {"write_i64_array", run_write_i64_array},
+    {"read_i64_array", run_read_i64_array},
+    {"write_f64", run_write_f64},
+    {"read_f64", run_read_f64},
+    {"write_f64_array", run_write_f64_array},
+    {"read_f64_array", run_read_f64_array},
+    {"ts_record_write", run_record_write},
+    {"ts_record_read", run_record_read},
+    {"ts_record_read_batch", run_record_read_batch},
+    {"ts_record_batch_write", run_record_batch_write},
+    {"encode_array_record", run_encode_array},
+    {"decode_response", run_decode_array},
+};
+
+/*
+ * Fastest of `rounds` runs of the case, the first one warms up the caches
+ * and it's not accounted
+ */
+static void measure(const Codec_Case *c, Codec_Data *d, size_t rounds,
+                    uint64_t *ns, uint64_t *cycles)
+{
+    *ns     = UINT64_MAX;
+    *cycles = UINT64_MAX;
+
+    c->run(d);
+
+    for (size_t i = 0; i < rounds; ++i) {
+        uint64_t t0 = bench_now_ns();
+        uint64_t c0 = now_cycles();
+        c->run(d);
+        uint64_t c1 = now_cycles();
+        uint64_t t1 = bench_now_ns();
+        *ns         = t1 - t0 < *ns ? t1 - t0 : *ns;
+        *cycles     = c1 - c0 < *cycles ? c1 - c0 : *cycles;
+    }
+}
+
+static int codec_data_init(Codec_Data *d, size_t length, uint64_t seed)
+{
+    uint64_t rng = seed;
+
+    d->length    = length;
+    d->records   = calloc(length, sizeof(*d->records));
+    d->decoded   = calloc(length, sizeof(*d->decoded));
+    d->refs      = calloc(length, sizeof(*d->refs));
+    d->words     = calloc(length, sizeof(*d->words));
+    d->values    = calloc(length, sizeof(*d->values));
+    // The batch header comes on top of the records
+    d->binary    = calloc(length + 1, RECORD_SIZE);
+    d->text_size = (length + 1) * ARRAY_RECORD_MAX_SIZE;
+    d->text      = calloc(1, d->text_size);
+
+    if (!d->records || !d->decoded || !d->refs || !d->words || !d->values ||
+        !d->binary || !d->text)
+        return -1;
+
+    for (size_t i = 0; i < length; ++i) {
+        d->records[i].timestamp = BASE_TIMESTAMP + i * (uint64_t)1e9 +
+                                  bench_rand(&rng) % (uint64_t)1e6;
+        d->records[i].value     = bench_rand_unit(&rng) * 1000.0 - 500.0;
+        d->records[i].is_set    = 1;
+        d->refs[i]              = &d->records[i];
+        d->words[i]             = d->records[i].timestamp;
+        d->values[i]            = d->records[i].value;
+    }
+
+    return 0;
+}
+
+static void codec_data_destroy(Codec_Data *d)
+{
+    free(d->records);
+    free(d->decoded);
+    free(d->refs);
+    free(d->words);
+    free(d->values);
+    free(d->binary);
+    free(d->text);
+}
+
+int main(int argc, char **argv)
+{
+    size_t length = 4096, rounds = 200;
+    uint64_t seed = 42;
+    Codec_Data d  = {0};
+    int opt       = 0;
+    int err       = EXIT_FAILURE;
+
+    while ((opt = getopt(argc, argv, "n:r:S:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            length = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            rounds = strtoull(optarg, NULL, 10);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (length == 0 || rounds == 0 || seed == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (codec_data_init(&d, length, seed) < 0)
+        goto exit;
+
+    printf("%-24s %12s %12s\n", "codec", "ns/record", "cycles/record");
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        uint64_t ns = 0, cycles = 0;
+        measure(&cases[i], &d, rounds, &ns, &cycles);
+#ifdef HAVE_RDTSC
+        printf("%-24s %12.2f %12.2f\n", cases[i].name, (double)ns / length,
+               (double)cycles / length);
+#else
+        printf("%-24s %12.2f %12s\n", cases[i].name, (double)ns / length,
+               "-");
+#endif
+    }
+
+    err = EXIT_SUCCESS;
+
+exit:
+    codec_data_destroy(&d);
+
+    return err;
+}
@@ -0,0 +1,210 @@
+#include "bench.h"
+#include "timeseries.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Fixed so that runs write the very same data
+#define BASE_TIMESTAMP 1710033421000000000ULL
+
+typedef struct ingest_options {
+    const char *db;
+    size_t series_nr;
+    size_t points_nr;
+    uint64_t cadence;
+    double ooo_ratio;
+    size_t ooo_window;
+    double dup_ratio;
+    uint64_t seed;
+} Ingest_Options;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-s series] [-n points] [-c cadence ms] [-o ooo ratio] "
+            "[-w ooo window] [-d dup ratio] [-S seed] [-D db]\n"
+            "\n"
+            "  -s  series written, 10 by default\n"
+            "  -n  points per series, 10000 by default\n"
+            "  -c  milliseconds between two points of a series, 1000\n"
+            "  -o  ratio of points out of order, in [0, 1], 0 by default\n"
+            "  -w  max delay of the points out of order, in points, 60\n"
+            "  -d  ratio of points repeating the last timestamp, 0\n"
+            "  -S  seed of the generator, 42 by default\n"
+            "  -D  DB to write under logdata, wiped first, bench-ingest\n",
+            name);
+}
+
+static int parse_options(int argc, char **argv, Ingest_Options *opts)
+{
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "s:n:c:o:w:d:S:D:h")) != -1) {
+        switch (opt) {
+        case 's':
+            opts->series_nr = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            opts->points_nr = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            opts->cadence = strtoull(optarg, NULL, 10) * (uint64_t)1e6;
+            break;
+        case 'o':
+            opts->ooo_ratio = strtod(optarg, NULL);
+            break;
+        case 'w':
+            opts->ooo_window = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            opts->dup_ratio = strtod(optarg, NULL);
+            break;
+        case 'S':
+            opts->seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'D':
+            opts->db = optarg;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (opts->series_nr == 0 || opts->points_nr == 0 || opts->cadence == 0 ||
+        opts->ooo_window == 0 || opts->seed == 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Timestamp of the next point of a series at `step`, a share of the points
+ * repeat the last one or come late, up to `ooo_window` points back, never
+ * before the first point of the series
+ */
+static uint64_t next_timestamp(const Ingest_Options *opts, uint64_t *rng,
+                               size_t step, uint64_t last)
+{
+    uint64_t ts = BASE_TIMESTAMP + step * opts->cadence;
+    double dice = bench_rand_unit(rng);
+
+    if (step > 0 && dice < opts->dup_ratio)
+        return last;
+
+    if (step > 0 && dice < opts->dup_ratio + opts->ooo_ratio) {
+        size_t delay = 1 + bench_rand(rng) % opts->ooo_window;
+        delay        = delay > step ? step : delay;
+        // Off the cadence so it's not a duplicate
+        return ts - delay * opts->cadence + 1 +
+               bench_rand(rng) % (opts->cadence - 1);
+    }
+
+    return ts;
+}
+
+int main(int argc, char **argv)
+{
+    Ingest_Options opts = {
+        .db         = "bench-ingest",
+        .series_nr  = 10,
+        .points_nr  = 10000,
+        .cadence    = 1000 * (uint64_t)1e6,
+        .ooo_ratio  = 0.0,
+        .ooo_window = 60,
+        .dup_ratio  = 0.0,
+        .seed       = 42,
+    };
+    char path[512];
+    Latencies latencies;
+    Latency_Summary summary;
+    Disk_Usage disk;
+    size_t errors = 0;
+    int err       = EXIT_FAILURE;
+
+    if (parse_options(argc, argv, &opts) < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    snprintf(path, sizeof(path), "logdata/%s", opts.db);
+    if (bench_remove_dir(path) < 0)
+        return EXIT_FAILURE;
+
+    Timeseries_DB *db   = tsdb_init(opts.db);
+    Timeseries **series = calloc(opts.series_nr, sizeof(*series));
+    uint64_t *last      = calloc(opts.series_nr, sizeof(*last));
+    vec_init(latencies, opts.series_nr * opts.points_nr);
+    if (!db || !series || !last || !latencies.data)
+        goto exit;
+
+    for (size_t i = 0; i < opts.series_nr; ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "bench.%zu", i);
+        series[i] = ts_create(db, name, 0, DP_INSERT);
+        if (!series[i])
+            goto exit;
+    }
+
+    uint64_t rng   = opts.seed;
+    uint64_t start = bench_now_ns();
+
+    // Series are written in turns, as points would come in from a fleet
+    for (size_t step = 0; step < opts.points_nr; ++step) {
+        for (size_t i = 0; i < opts.series_nr; ++i) {
+            uint64_t ts    = next_timestamp(&opts, &rng, step, last[i]);
+            double_t value = bench_rand_unit(&rng) * 100.0;
+            uint64_t t0    = bench_now_ns();
+            if (ts_insert(series[i], ts, value) < 0)
+                errors++;
+            vec_push(latencies, bench_now_ns() - t0);
+            last[i] = ts > last[i] ? ts : last[i];
+        }
+    }
+
+    uint64_t elapsed = bench_now_ns() - start;
+    size_t total     = opts.series_nr * opts.points_nr;
+
+    for (size_t i = 0; i < opts.series_nr; ++i) {
+        ts_close(series[i]);
+        series[i] = NULL;
+    }
+
+    tsdb_close(db);
+    db = NULL;
+
+    if (bench_disk_usage(path, &disk) < 0)
+        goto exit;
+
+    bench_summarize(&latencies, &summary);
+
+    printf("series             %zu\n", opts.series_nr);
+    printf("points             %zu\n", total);
+    printf("errors             %zu\n", errors);
+    printf("elapsed            %.3f s\n", elapsed / 1e9);
+    printf("throughput         %.0f points/s\n", total / (elapsed / 1e9));
+    printf("latency p50        %" PRIu64 " ns\n", summary.p50);
+    printf("latency p99        %" PRIu64 " ns\n", summary.p99);
+    printf("latency p999       %" PRIu64 " ns\n", summary.p999);
+    printf("latency max        %" PRIu64 " ns\n", summary.max);
+    // Partitions, indexes and catalog, the WAL is preallocated
+    printf("bytes written      %zu\n", disk.bytes - disk.wal_bytes);
+    printf("wal files          %zu (%zu bytes)\n", disk.wal_files,
+           disk.wal_bytes);
+    printf("partition files    %zu\n", disk.log_files);
+    printf("index files        %zu\n", disk.index_files);
+
+    err = EXIT_SUCCESS;
+
+exit:
+    for (size_t i = 0; series && i < opts.series_nr; ++i)
+        if (series[i])
+            ts_close(series[i]);
+    tsdb_close(db);
+    free(series);
+    free(last);
+    vec_destroy(latencies);
+
+    return err;
+}
@@ -0,0 +1,415 @@
+#include "bench.h"
+#include "client.h"
+#include "protocol.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_HOST   "127.0.0.1"
+#define DEFAULT_PORT   17678
+// Points of an INSERT, the server takes up to 32 but the query is 512 bytes
+#define MAX_BATCH_SIZE 16
+#define QUERY_SIZE     512
+
+typedef enum { OP_INSERT, OP_SELECT, OP_NR } Load_Op;
+
+/*
+ * Latency of a request measured from the time it was due to be sent, which
+ * accounts for the time spent waiting for the previous ones to complete, or
+ * from the time it was actually sent, the service time alone
+ */
+typedef enum { LATENCY_CORRECTED, LATENCY_SERVICE, LATENCY_NR } Latency_Kind;
+
+static const char *op_names[OP_NR]           = {"insert", "select"};
+static const char *latency_names[LATENCY_NR] = {"corrected", "service"};
+
+typedef struct load_options {
+    const char *host;
+    int port;
+    const char *db;
+    size_t connections;
+    size_t series_nr;
+    double duration;
+    double rate;
+    double select_ratio;
+    size_t batch;
+    uint64_t window;
+    uint64_t seed;
+    int histogram;
+} Load_Options;
+
+/*
+ * A connection to the server driven by its own thread, requests are either
+ * sent back to back, closed loop, or on a fixed schedule, open loop, the
+ * share of the target rate of the connection
+ */
+typedef struct load_worker {
+    pthread_t thread;
+    Client client;
+    const Load_Options *opts;
+    uint64_t rng;
+    uint64_t start;
+    uint64_t end;
+    uint64_t interval;
+    size_t requests;
+    size_t errors;
+    int failed;
+    Histogram latencies[OP_NR][LATENCY_NR];
+} Load_Worker;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-a host] [-p port] [-c connections] [-s series] "
+            "[-d duration s] [-r rate] [-m select ratio] [-b batch] "
+            "[-w window ms] [-S seed] [-D db] [-H]\n"
+            "\n"
+            "  -a  host of the server, 127.0.0.1 by default\n"
+            "  -p  port of the server, 17678 by default\n"
+            "  -c  connections, one thread each, 8 by default\n"
+            "  -s  series written and read, 100 by default\n"
+            "  -d  seconds the load lasts, 10 by default\n"
+            "  -r  requests per second over all the connections, 0 by\n"
+            "      default, sending them back to back\n"
+            "  -m  ratio of SELECT among the requests, in [0, 1], 0.1\n"
+            "  -b  points of each INSERT, up to %d, 1 by default\n"
+            "  -w  milliseconds of the most recent points a SELECT asks\n"
+            "      for, 1000 by default\n"
+            "  -S  seed of the generator, 42 by default\n"
+            "  -D  DB to write to, bench-load by default\n"
+            "  -H  print the latency histograms too\n",
+            name, MAX_BATCH_SIZE);
+}
+
+static int parse_options(int argc, char **argv, Load_Options *opts)
+{
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "a:p:c:s:d:r:m:b:w:S:D:Hh")) != -1) {
+        switch (opt) {
+        case 'a':
+            opts->host = optarg;
+            break;
+        case 'p':
+            opts->port = atoi(optarg);
+            break;
+        case 'c':
+            opts->connections = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            opts->series_nr = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            opts->duration = strtod(optarg, NULL);
+            break;
+        case 'r':
+            opts->rate = strtod(optarg, NULL);
+            break;
+        case 'm':
+            opts->select_ratio = strtod(optarg, NULL);
+            break;
+        case 'b':
+            opts->batch = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            opts->window = strtoull(optarg, NULL, 10) * (uint64_t)1e6;
+            break;
+        case 'S':
+            opts->seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'D':
+            opts->db = optarg;
+            break;
+        case 'H':
+            opts->histogram = 1;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (opts->connections == 0 || opts->series_nr == 0 ||
+        opts->duration <= 0 || opts->rate < 0 || opts->batch == 0 ||
+        opts->batch > MAX_BATCH_SIZE || opts->seed == 0)
+        return -1;
+
+    return 0;
+}
+
+static uint64_t now_realtime_ns(void)
+{
+    struct timespec tv;
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return tv.tv_sec * (uint64_t)1e9 + tv.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+    struct timespec tv = {.tv_sec  = deadline / (uint64_t)1e9,
+                          .tv_nsec = deadline % (uint64_t)1e9};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tv, NULL) == EINTR)
+        ;
+}
+
+/*
+ * Next request of the mix, the points of an INSERT are stamped by the server
+ * as they come in, a SELECT reads the last `window` nanoseconds of a series
+ */
+static Load_Op next_query(Load_Worker *w, char *query)
+{
+    const Load_Options *opts = w->opts;
+    size_t series            = bench_rand(&w->rng) % opts->series_nr;
+    int n                    = 0;
+
+    if (bench_rand_unit(&w->rng) < opts->select_ratio) {
+        uint64_t t1 = now_realtime_ns();
+        snprintf(query, QUERY_SIZE,
+                 "SELECT load.%zu FROM %s RANGE %" PRIu64 " TO %" PRIu64 "\n",
+                 series, opts->db, t1 - opts->window, t1);
+        return OP_SELECT;
+    }
+
+    n = snprintf(query, QUERY_SIZE, "INSERT load.%zu INTO %s", series,
+                 opts->db);
+    for (size_t i = 0; i < opts->batch; ++i)
+        n += snprintf(query + n, QUERY_SIZE - n, "%s * %.3f",
+                      i == 0 ? "" : ",", bench_rand_unit(&w->rng) * 100.0);
+    snprintf(query + n, QUERY_SIZE - n, "\n");
+
+    return OP_INSERT;
+}
+
+static void *load_worker_run(void *arg)
+{
+    Load_Worker *w = arg;
+    char query[QUERY_SIZE];
+    Response rs;
+
+    uint64_t due = w->start;
+    uint64_t now = bench_now_ns();
+
+    while (now < w->end) {
+        // Closed loop, the next request is due as soon as the last completes
+        if (w->interval == 0)
+            due = now;
+        else if (due >= w->end)
+            break;
+        else if (due > now)
+            sleep_until(due);
+
+        Load_Op op    = next_query(w, query);
+        uint64_t sent = bench_now_ns();
+
+        if (client_send_command(&w->client, query) < 0 ||
+            client_recv_response(&w->client, &rs) < 0) {
+            fprintf(stderr, "Connection lost: %s\n", strerror(errno));
+            w->failed = 1;
+            break;
+        }
+
+        now = bench_now_ns();
+
+        // Errors come back as plain strings, anything but the Ok of a write
+        if (rs.type == STRING_RSP &&
+            strcmp(rs.string_response.message, "Ok") != 0)
+            w->errors++;
+        free_response(&rs);
+
+        w->requests++;
+        bench_histogram_add(&w->latencies[op][LATENCY_CORRECTED], now - due);
+        bench_histogram_add(&w->latencies[op][LATENCY_SERVICE], now - sent);
+
+        // Late requests keep their schedule, their delay is the latency the
+        // clients of a busy server would see
+        due += w->interval;
+    }
+
+    return NULL;
+}
+
+static int create_series(const Load_Options *opts, Client *c)
+{
+    char query[QUERY_SIZE];
+    Response rs;
+
+    // Answers an error when the DB already exists, which is fine
+    snprintf(query, sizeof(query), "CREATE %s\n", opts->db);
+    if (client_send_command(c, query) < 0 || client_recv_response(c, &rs) < 0)
+        return -1;
+
+    for (size_t i = 0; i < opts->series_nr; ++i) {
+        snprintf(query, sizeof(query), "CREATE load.%zu INTO %s\n", i,
+                 opts->db);
+        if (client_send_command(c, query) < 0 ||
+            client_recv_response(c, &rs) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void print_histogram(const char *op, const char *kind,
+                            const Histogram *h)
+{
+    uint64_t seen = 0;
+
+    printf("\n%s %s latency histogram\n", op, kind);
+    printf("%14s %12s %10s\n", "up to (us)", "count", "percentile");
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        if (h->buckets[i] == 0)
+            continue;
+        seen += h->buckets[i];
+        printf("%14.3f %12" PRIu64 " %10.5f\n",
+               bench_histogram_bucket_max(i) / 1e3, h->buckets[i],
+               seen * 100.0 / h->count);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Load_Options opts = {
+        .host         = DEFAULT_HOST,
+        .port         = DEFAULT_PORT,
+        .db           = "bench-load",
+        .connections  = 8,
+        .series_nr    = 100,
+        .duration     = 10.0,
+        .rate         = 0.0,
+        .select_ratio = 0.1,
+        .batch        = 1,
+        .window       = 1000 * (uint64_t)1e6,
+        .seed         = 42,
+    };
+    struct connect_options conn_opts = {0};
+    Histogram latencies[OP_NR][LATENCY_NR];
+    size_t requests = 0, errors = 0, failed = 0;
+    size_t connected = 0, started = 0;
+    int err         = EXIT_FAILURE;
+
+    if (parse_options(argc, argv, &opts) < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // A server going away must fail the writes, not kill the run
+    signal(SIGPIPE, SIG_IGN);
+
+    conn_opts.s_family   = AF_INET;
+    conn_opts.s_addr     = (char *)opts.host;
+    conn_opts.s_port     = opts.port;
+
+    Load_Worker *workers = calloc(opts.connections, sizeof(*workers));
+    if (!workers)
+        return EXIT_FAILURE;
+
+    // All connected upfront, from a single thread as the lookup of the host
+    // isn't thread safe
+    for (size_t i = 0; i < opts.connections; ++i) {
+        client_init(&workers[i].client, &conn_opts);
+        if (client_connect(&workers[i].client) < 0)
+            goto exit;
+        connected++;
+    }
+
+    if (create_series(&opts, &workers[0].client) < 0) {
+        fprintf(stderr, "Can't create the series: %s\n", strerror(errno));
+        goto exit;
+    }
+
+    uint64_t interval =
+        opts.rate > 0 ? (uint64_t)(opts.connections * 1e9 / opts.rate) : 0;
+    uint64_t start = bench_now_ns();
+    uint64_t end   = start + (uint64_t)(opts.duration * 1e9);
+
+    for (size_t i = 0; i < opts.connections; ++i) {
+        Load_Worker *w = &workers[i];
+        w->opts        = &opts;
+        w->rng         = opts.seed + i;
+        w->interval    = interval;
+        // Spread the schedules so the connections don't send in bursts
+        w->start = start + interval * i / opts.connections;
+        w->end   = end;
+        for (size_t op = 0; op < OP_NR; ++op)
+            for (size_t k = 0; k < LATENCY_NR; ++k)
+                bench_histogram_init(&w->latencies[op][k]);
+    }
+
+    for (; started < opts.connections; ++started)
+        if (pthread_create(&workers[started].thread, NULL, load_worker_run,
+                           &workers[started]) != 0)
+            break;
+
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(workers[i].thread, NULL);
+
+    uint64_t elapsed = bench_now_ns() - start;
+
+    for (size_t op = 0; op < OP_NR; ++op)
+        for (size_t k = 0; k < LATENCY_NR; ++k)
+            bench_histogram_init(&latencies[op][k]);
+
+    for (size_t i = 0; i < started; ++i) {
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        failed += workers[i].failed;
+        for (size_t op = 0; op < OP_NR; ++op)
+            for (size_t k = 0; k < LATENCY_NR; ++k)
+                bench_histogram_merge(&latencies[op][k],
+                                      &workers[i].latencies[op][k]);
+    }
+
+    printf("connections        %zu (%zu lost)\n", started, failed);
+    if (opts.rate > 0)
+        printf("target rate        %.0f requests/s\n", opts.rate);
+    else
+        printf("target rate        closed loop\n");
+    printf("elapsed            %.3f s\n", elapsed / 1e9);
+    printf("requests           %zu\n", requests);
+    printf("errors             %zu\n", errors);
+    printf("throughput         %.0f requests/s\n", requests / (elapsed / 1e9));
+    printf("points written     %.0f points/s\n",
+           latencies[OP_INSERT][LATENCY_SERVICE].count * opts.batch / (elapsed / 1e9));
+
+    printf("\n%-7s %-10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "op",
+           "latency", "count", "mean us", "p50", "p90", "p99", "p99.9",
+           "p99.99", "max");
+    for (size_t op = 0; op < OP_NR; ++op) {
+        for (size_t k = 0; k < LATENCY_NR; ++k) {
+            const Histogram *h = &latencies[op][k];
+            if (h->count == 0)
+                continue;
+            printf("%-7s %-10s %10" PRIu64
+                   " %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                   op_names[op], latency_names[k], h->count,
+                   h->total / h->count / 1e3,
+                   bench_histogram_percentile(h, 50.0) / 1e3,
+                   bench_histogram_percentile(h, 90.0) / 1e3,
+                   bench_histogram_percentile(h, 99.0) / 1e3,
+                   bench_histogram_percentile(h, 99.9) / 1e3,
+                   bench_histogram_percentile(h, 99.99) / 1e3, h->max / 1e3);
+        }
+    }
+
+    for (size_t op = 0; opts.histogram && op < OP_NR; ++op)
+        for (size_t k = 0; k < LATENCY_NR; ++k)
+            if (latencies[op][k].count > 0)
+                print_histogram(op_names[op], latency_names[k],
+                                &latencies[op][k]);
+
+    err = failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+exit:
+    for (size_t i = 0; i < connected; ++i)
+        client_disconnect(&workers[i].client);
+    free(workers);
+
+    return err;
+}
@@ -0,0 +1,355 @@
+#include "bench.h"
+#include "block_cache.h"
+#include "timeseries.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BASE_TIMESTAMP 1710033421000000000ULL
+// Points left in each of the in-memory chunks, below the WAL flush threshold
+#define CHUNK_POINTS   10
+// Seconds between the points of the in-memory chunks, all in one chunk
+#define CHUNK_SPACING  60
+#define SHORT_RANGE    10
+
+typedef enum { FORMAT_TEXT, FORMAT_JSON, FORMAT_CSV } Format;
+
+typedef struct query_options {
+    const char *db;
+    size_t series_nr;
+    size_t points_nr;
+    uint64_t cadence;
+    size_t queries;
+    size_t long_range;
+    size_t cache_size;
+    uint64_t seed;
+    Format format;
+} Query_Options;
+
+/*
+ * Where the points of a tier live, `step` apart from `start`, the same for
+ * every series
+ */
+typedef struct tier {
+    const char *name;
+    uint64_t start;
+    uint64_t step;
+    size_t length;
+} Tier;
+
+typedef struct result {
+    const char *tier;
+    const char *op;
+    size_t misses;
+    double points;
+    Latency_Summary latency;
+} Result;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-s series] [-n points] [-c cadence ms] [-q queries] "
+            "[-l long range] [-C cache size] [-S seed] [-f format] [-D db]\n"
+            "\n"
+            "  -s  series preloaded, 4 by default\n"
+            "  -n  points per series flushed to disk, 50000 by default\n"
+            "  -c  milliseconds between two points of a series, 1000\n"
+            "  -q  queries per tier and kind, 1000 by default\n"
+            "  -l  points of the long ranges on disk, 1000 by default\n"
+            "  -C  block cache size in MB, 64 by default, 0 disables it\n"
+            "  -S  seed of the generator, 42 by default\n"
+            "  -f  output format, text, json or csv, text by default\n"
+            "  -D  DB to write under logdata, wiped first, bench-query\n",
+            name);
+}
+
+static int parse_options(int argc, char **argv, Query_Options *opts)
+{
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "s:n:c:q:l:C:S:f:D:h")) != -1) {
+        switch (opt) {
+        case 's':
+            opts->series_nr = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            opts->points_nr = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            opts->cadence = strtoull(optarg, NULL, 10) * (uint64_t)1e6;
+            break;
+        case 'q':
+            opts->queries = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            opts->long_range = strtoull(optarg, NULL, 10);
+            break;
+        case 'C':
+            opts->cache_size = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'S':
+            opts->seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            if (strcmp(optarg, "json") == 0)
+                opts->format = FORMAT_JSON;
+            else if (strcmp(optarg, "csv") == 0)
+                opts->format = FORMAT_CSV;
+            else if (strcmp(optarg, "text") == 0)
+                opts->format = FORMAT_TEXT;
+            else
+                return -1;
+            break;
+        case 'D':
+            opts->db = optarg;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (opts->series_nr == 0 || opts->points_nr < opts->long_range ||
+        opts->cadence == 0 || opts->queries == 0 || opts->long_range == 0 ||
+        opts->seed == 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Write the dataset, the bulk of it is flushed to the partitions, then two
+ * chunks worth of points are left in memory, the first one rotated into the
+ * prev chunk by the second one
+ */
+static int preload(const Query_Options *opts, Timeseries **series,
+                   Tier tiers[3])
+{
+    uint64_t last = BASE_TIMESTAMP + (opts->points_nr - 1) * opts->cadence;
+    uint64_t prev = (last / (uint64_t)1e9 + TS_CHUNK_SIZE) * (uint64_t)1e9;
+    uint64_t head = prev + TS_CHUNK_SIZE * (uint64_t)1e9;
+    uint64_t step = CHUNK_SPACING * (uint64_t)1e9;
+
+    tiers[0] = (Tier){"disk", BASE_TIMESTAMP, opts->cadence, opts->points_nr};
+    tiers[1] = (Tier){"prev", prev, step, CHUNK_POINTS};
+    tiers[2] = (Tier){"head", head, step, CHUNK_POINTS};
+
+    for (size_t i = 0; i < opts->series_nr; ++i) {
+        for (size_t j = 0; j < opts->points_nr; ++j)
+            if (ts_insert(series[i], BASE_TIMESTAMP + j * opts->cadence,
+                          (double_t)j) < 0)
+                return -1;
+
+        if (ts_flush_chunks(series[i]) < 0)
+            return -1;
+
+        for (size_t t = 1; t < 3; ++t)
+            for (size_t j = 0; j < CHUNK_POINTS; ++j)
+                if (ts_insert(series[i], tiers[t].start + j * step,
+                              (double_t)j) < 0)
+                    return -1;
+    }
+
+    return 0;
+}
+
+static void run_find(const Query_Options *opts, Timeseries **series,
+                     const Tier *tier, uint64_t *rng, Latencies *latencies,
+                     Result *result)
+{
+    Record r;
+
+    vec_size(*latencies) = 0;
+    *result = (Result){.tier = tier->name, .op = "find", .points = 1.0};
+
+    for (size_t q = 0; q < opts->queries; ++q) {
+        const Timeseries *ts = series[bench_rand(rng) % opts->series_nr];
+        uint64_t timestamp =
+            tier->start + (bench_rand(rng) % tier->length) * tier->step;
+        uint64_t t0 = bench_now_ns();
+        int err     = ts_find(ts, timestamp, &r);
+        vec_push(*latencies, bench_now_ns() - t0);
+        if (err != 0 || r.timestamp != timestamp)
+            result->misses++;
+    }
+
+    bench_summarize(latencies, &result->latency);
+}
+
+/*
+ * Ranges spanning `length` points of the tier from a random one, the misses
+ * count the ranges not returning the `expected` points
+ */
+static void run_range(const Query_Options *opts, Timeseries **series,
+                      const Tier *tier, const char *op, size_t length,
+                      size_t expected, uint64_t *rng, Latencies *latencies,
+                      Result *result)
+{
+    size_t total         = 0;
+
+    vec_size(*latencies) = 0;
+    *result              = (Result){.tier = tier->name, .op = op};
+
+    for (size_t q = 0; q < opts->queries; ++q) {
+        Points points;
+        const Timeseries *ts = series[bench_rand(rng) % opts->series_nr];
+        size_t first         = bench_rand(rng) % (tier->length - length + 1);
+        uint64_t t0          = tier->start + first * tier->step;
+        uint64_t t1          = t0 + (length - 1) * tier->step;
+
+        vec_new(points);
+        uint64_t start = bench_now_ns();
+        int err        = ts_range(ts, t0, t1, &points);
+        vec_push(*latencies, bench_now_ns() - start);
+        if (err < 0 || vec_size(points) != expected)
+            result->misses++;
+        total += vec_size(points);
+        vec_destroy(points);
+    }
+
+    result->points = (double)total / opts->queries;
+    bench_summarize(latencies, &result->latency);
+}
+
+static void report(const Query_Options *opts, const Result *results, size_t n,
+                   const Block_Cache_Stats *cache)
+{
+    switch (opts->format) {
+    case FORMAT_TEXT:
+        printf("%-6s %-12s %8s %8s %10s %10s %10s %10s %10s\n", "tier", "op",
+               "misses", "points", "mean_ns", "p50_ns", "p99_ns", "p999_ns",
+               "max_ns");
+        for (size_t i = 0; i < n; ++i)
+            printf("%-6s %-12s %8zu %8.1f %10.0f %10" PRIu64 " %10" PRIu64
+                   " %10" PRIu64 " %10" PRIu64 "\n",
+                   results[i].tier, results[i].op, results[i].misses,
+                   results[i].points, results[i].latency.mean,
+                   results[i].latency.p50, results[i].latency.p99,
+                   results[i].latency.p999, results[i].latency.max);
+        printf("block cache hits %" PRIu64 " misses %" PRIu64 "\n",
+               cache->hits, cache->misses);
+        break;
+    case FORMAT_CSV:
+        printf("tier,op,queries,misses,points,mean_ns,p50_ns,p99_ns,p999_ns,"
+               "max_ns\n");
+        for (size_t i = 0; i < n; ++i)
+            printf("%s,%s,%zu,%zu,%.1f,%.0f,%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                   ",%" PRIu64 "\n",
+                   results[i].tier, results[i].op, results[i].latency.count,
+                   results[i].misses, results[i].points,
+                   results[i].latency.mean, results[i].latency.p50,
+                   results[i].latency.p99, results[i].latency.p999,
+                   results[i].latency.max);
+        break;
+    case FORMAT_JSON:
+        printf("{\"benchmark\":\"query\",\"series\":%zu,\"points\":%zu,"
+               "\"cadence_ns\":%" PRIu64 ",\"seed\":%" PRIu64 ","
+               "\"cache\":{\"hits\":%" PRIu64 ",\"misses\":%" PRIu64 "},"
+               "\"results\":[",
+               opts->series_nr, opts->points_nr, opts->cadence, opts->seed,
+               cache->hits, cache->misses);
+        for (size_t i = 0; i < n; ++i)
+            printf("%s{\"tier\":\"%s\",\"op\":\"%s\",\"queries\":%zu,"
+                   "\"misses\":%zu,\"points\":%.1f,\"mean_ns\":%.0f,"
+                   "\"p50_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64
+                   ",\"p999_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}",
+                   i == 0 ? "" : ",", results[i].tier, results[i].op,
+                   results[i].latency.count, results[i].misses,
+                   results[i].points, results[i].latency.mean,
+                   results[i].latency.p50, results[i].latency.p99,
+                   results[i].latency.p999, results[i].latency.max);
+        printf("]}\n");
+        break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Query_Options opts = {
+        .db         = "bench-query",
+        .series_nr  = 4,
+        .points_nr  = 50000,
+        .cadence    = 1000 * (uint64_t)1e6,
+        .queries    = 1000,
+        .long_range = 1000,
+        .cache_size = (size_t)64 << 20,
+        .seed       = 42,
+        .format     = FORMAT_TEXT,
+    };
+    char path[512];
+    Tier tiers[3];
+    Result results[12];
+    Latencies latencies;
+    Block_Cache_Stats cache;
+    size_t n = 0;
+    int err  = EXIT_FAILURE;
+
+    if (parse_options(argc, argv, &opts) < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    snprintf(path, sizeof(path), "logdata/%s", opts.db);
+    if (bench_remove_dir(path) < 0)
+        return EXIT_FAILURE;
+
+    if (opts.cache_size > 0 && block_cache_init(opts.cache_size) < 0)
+        return EXIT_FAILURE;
+
+    Timeseries_DB *db   = tsdb_init(opts.db);
+    Timeseries **series = calloc(opts.series_nr, sizeof(*series));
+    vec_init(latencies, opts.queries);
+    if (!db || !series || !latencies.data)
+        goto exit;
+
+    for (size_t i = 0; i < opts.series_nr; ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "bench.%zu", i);
+        series[i] = ts_create(db, name, 0, DP_INSERT);
+        if (!series[i])
+            goto exit;
+    }
+
+    if (preload(&opts, series, tiers) < 0) {
+        fprintf(stderr, "Can't preload the dataset\n");
+        goto exit;
+    }
+
+    uint64_t rng = opts.seed;
+
+    for (size_t t = 0; t < 3; ++t) {
+        size_t long_range = t == 0 ? opts.long_range : tiers[t].length;
+        run_find(&opts, series, &tiers[t], &rng, &latencies, &results[n++]);
+        size_t short_range = SHORT_RANGE < long_range ? SHORT_RANGE
+                                                      : long_range;
+        run_range(&opts, series, &tiers[t], "range_short", short_range,
+                  short_range, &rng, &latencies, &results[n++]);
+        run_range(&opts, series, &tiers[t], "range_long", long_range,
+                  long_range, &rng, &latencies, &results[n++]);
+    }
+
+    // From the oldest point on disk to the newest in memory, as a tier made
+    // of just its two ends
+    uint64_t newest = tiers[2].start + (CHUNK_POINTS - 1) * tiers[2].step;
+    Tier all        = {"all", BASE_TIMESTAMP, newest - BASE_TIMESTAMP, 2};
+    run_range(&opts, series, &all, "range_all", 2,
+              opts.points_nr + CHUNK_POINTS * 2, &rng, &latencies,
+              &results[n++]);
+
+    block_cache_stats(&cache);
+    report(&opts, results, n, &cache);
+
+    err = EXIT_SUCCESS;
+
+exit:
+    for (size_t i = 0; series && i < opts.series_nr; ++i)
+        if (series[i])
+            ts_close(series[i]);
+    tsdb_close(db);
+    free(series);
+    vec_destroy(latencies);
+    block_cache_destroy();
+
+    return err;
+}
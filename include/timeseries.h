@@ -1,16 +1,23 @@
 #ifndef TIMESERIES_H
 #define TIMESERIES_H
 
+#include "arena.h"
+#include "catalog.h"
 #include "partition.h"
 #include "vec.h"
 #include "wal.h"
 #include <math.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <time.h>
 
 #define TS_NAME_MAX_LENGTH 1 << 9
-#define TS_CHUNK_SIZE      900 // 15 min
+#define TS_CHUNK_SIZE      900   // 15 min, default width of the chunks
+#define TS_CHUNK_MAX_SIZE  86400 // 1 day
+#define TS_CHUNK_BUCKETS   900   // Most buckets of a chunk, 1 per second
+#define TS_FLUSH_MIN_SIZE  WAL_FRAME_SIZE // A single point
+#define TS_FLUSH_MAX_SIZE  (1 << 26)      // 64MB of WAL frames
 #define TS_MAX_PARTITIONS  16
 #define DATA_PATH_SIZE     1 << 8
 
@@ -46,10 +53,29 @@ extern size_t ts_record_write(const Record *r, uint8_t *buf);
 
 extern size_t ts_record_read(Record *r, const uint8_t *buf);
 
+extern size_t ts_record_read_batch(Record *r, const uint8_t *buf,
+                                   size_t count);
+
 extern size_t ts_record_batch_write(const Record *r[], uint8_t *buf,
                                     size_t count);
 
-typedef VEC(Record) Points;
+// Same layout as VEC(Record), named to be forward declared
+typedef struct points {
+    size_t size;
+    size_t capacity;
+    Record *data;
+} Points;
+
+/*
+ * Bucket of a chunk, appended to by the owner of the series while readers
+ * scan it, `size` and `data` are published with release stores and loaded
+ * with acquire ones, readers take a Points snapshot of it
+ */
+typedef struct chunk_bucket {
+    _Atomic size_t size;
+    size_t capacity;
+    _Atomic(Record *) data;
+} Chunk_Bucket;
 
 /*
  * Time series chunk, main data structure to handle the time-series, it carries
@@ -57,14 +83,25 @@ typedef VEC(Record) Points;
  * columns data. Data are stored in a single array, using a base_offset as a
  * strating timestamp, resulting in the timestamps fitting in the allocated
  * space.
+ *
+ * The `width` buckets, each covering `span` seconds, are allocated from the
+ * arena of the chunk, released all at once when the chunk is destroyed, each
+ * bucket allocates room for its points on the first one set, sorted by
+ * timestamp. Chunks up to TS_CHUNK_BUCKETS seconds get a bucket per second,
+ * wider ones share each bucket among more seconds. `memory` is the size of
+ * the arena as reported to the memory accountant.
  */
 typedef struct timeseries_chunk {
-    Wal wal;
+    Arena arena;
+    Wal_Chunk wal;
     uint64_t base_offset;
     uint64_t start_ts;
     uint64_t end_ts;
     size_t max_index;
-    Points points[TS_CHUNK_SIZE];
+    size_t memory;
+    size_t width;
+    size_t span;
+    Chunk_Bucket *points;
 } Timeseries_Chunk;
 
 /*
@@ -73,15 +110,37 @@ typedef struct timeseries_chunk {
  * are stored in 2 Timeseries_Chunk, a current and latest timestamp one and one
  * to account for out of order points that will be merged later when flushing
  * on disk.
+ *
+ * Writes are expected from a single thread at a time, reads can run
+ * concurrently with them from any thread, the version is bumped around every
+ * structural change of the in-memory chunks so that readers can detect a torn
+ * view and retry.
+ *
+ * Series belonging to a DB are registered in its catalog, which keeps their
+ * id, policy, retention, chunk settings and partitions across restarts.
+ *
+ * Chunks span `chunk_size` seconds and are flushed once the WAL frames of the
+ * head one reach `flush_size` bytes, both are resolved on open from the
+ * settings of the series, the defaults of the DB or TS_CHUNK_SIZE and
+ * TS_FLUSH_SIZE, in this order.
+ *
+ * Points are logged into the WAL shared by the series of the DB, tagged with
+ * the id of the series and of their chunk, no WAL when it's NULL.
  */
 typedef struct timeseries {
+    atomic_uint_fast64_t version;
+    uint64_t id;
+    Catalog *catalog;
     int64_t retention;
     char name[TS_NAME_MAX_LENGTH];
     char db_data_path[DATA_PATH_SIZE];
     Timeseries_Chunk head;
     Timeseries_Chunk prev;
+    Wal *wal;
     Partition partitions[TS_MAX_PARTITIONS];
     size_t partition_nr;
+    size_t chunk_size;
+    size_t flush_size;
     Duplication_Policy policy;
 } Timeseries;
 
@@ -91,14 +150,34 @@ extern void ts_close(Timeseries *ts);
 
 extern int ts_insert(Timeseries *ts, uint64_t timestamp, double_t value);
 
+extern int ts_insert_batch(Timeseries *ts, const Record *records,
+                           size_t length);
+
 extern int ts_find(const Timeseries *ts, uint64_t timestamp, Record *r);
 
 extern int ts_range(const Timeseries *ts, uint64_t t0, uint64_t t1, Points *p);
 
+extern int ts_range_with_allocator(const Timeseries *ts, uint64_t t0,
+                                   uint64_t t1, Points *p,
+                                   Allocator allocator);
+
+extern int ts_block_reads(const Timeseries *ts, uint64_t t0, uint64_t t1,
+                          Block_Reads *reads, size_t max, Allocator allocator);
+
 extern void ts_print(const Timeseries *ts);
 
+extern size_t ts_memory(const Timeseries *ts);
+
+extern int ts_flush_chunks(Timeseries *ts);
+
+/*
+ * DB of series, the points not flushed yet are replayed from its WAL into
+ * their series on init, then flushed to their partitions.
+ */
 typedef struct timeseries_db {
     char data_path[DATA_PATH_SIZE];
+    Catalog *catalog;
+    Wal *wal;
 } Timeseries_DB;
 
 extern Timeseries_DB *tsdb_init(const char *data_path);
@@ -108,6 +187,29 @@ extern void tsdb_close(Timeseries_DB *tsdb);
 extern Timeseries *ts_create(const Timeseries_DB *tsdb, const char *name,
                              int64_t retention, Duplication_Policy policy);
 
+extern Timeseries *ts_create_with_labels(const Timeseries_DB *tsdb,
+                                        const char *name, int64_t retention,
+                                        Duplication_Policy policy,
+                                        const Label *labels, size_t label_nr);
+
+extern Timeseries *ts_create_with_settings(const Timeseries_DB *tsdb,
+                                          const char *name, int64_t retention,
+                                          Duplication_Policy policy,
+                                          const Chunk_Settings *settings,
+                                          const Label *labels, size_t label_nr);
+
 extern Timeseries *ts_get(const Timeseries_DB *tsdb, const char *name);
 
+extern int tsdb_set_defaults(Timeseries_DB *tsdb,
+                             const Chunk_Settings *defaults);
+
+typedef VEC(char *) Series_Names;
+
+extern int tsdb_series(const Timeseries_DB *tsdb, const char *pattern,
+                       Series_Names *names);
+
+extern int tsdb_series_by_labels(const Timeseries_DB *tsdb,
+                                 const Label *matchers, size_t matcher_nr,
+                                 Series_Names *names);
+
 #endif
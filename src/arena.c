@@ -19,14 +19,14 @@ static uintptr_t align_forward(uintptr_t ptr, size_t alignment)
     return p;
 }
 
-static void *arena_alloc_aligned(Arena *a, size_t size, size_t alignment)
+static void *arena_bump(Arena *a, size_t size, size_t alignment)
 {
     uintptr_t curr_ptr = (uintptr_t)a->base + (uintptr_t)a->offset;
     uintptr_t offset   = align_forward(curr_ptr, alignment);
     offset -= (uintptr_t)a->base;
 
-    if (offset + size > a->size)
-        return 0;
+    if (!a->base || offset + size > a->size)
+        return NULL;
 
     a->committed += size;
     void *ptr = (uint8_t *)a->base + offset;
@@ -35,6 +35,48 @@ static void *arena_alloc_aligned(Arena *a, size_t size, size_t alignment)
     return ptr;
 }
 
+/*
+ * Move on to the block following the current one, reusing it if it's large
+ * enough for `size`, or linking a new one in its place otherwise
+ */
+static int arena_grow(Arena *a, size_t size, size_t alignment)
+{
+    Arena_Block **next = a->current ? &a->current->next : &a->blocks;
+    Arena_Block *block = *next;
+    size_t needed      = size + alignment;
+
+    if (!block || block->size < needed) {
+        size_t block_size = needed > ARENA_BLOCK_SIZE ? needed
+                                                      : ARENA_BLOCK_SIZE;
+        block             = malloc(sizeof(*block) + block_size);
+        if (!block)
+            return -1;
+        block->size = block_size;
+        block->next = *next;
+        *next       = block;
+        a->reserved += sizeof(*block) + block_size;
+    }
+
+    a->current = block;
+    a->base    = block->data;
+    a->size    = block->size;
+    a->offset  = 0;
+
+    return 0;
+}
+
+static void *arena_alloc_aligned(Arena *a, size_t size, size_t alignment)
+{
+    void *ptr = arena_bump(a, size, alignment);
+    if (ptr)
+        return ptr;
+
+    if (arena_grow(a, size, alignment) < 0)
+        return NULL;
+
+    return arena_bump(a, size, alignment);
+}
+
 void *arena_alloc(size_t size, void *context)
 {
     if (!size)
@@ -53,11 +95,62 @@ void arena_free(size_t size, void *ptr, void *context)
 void arena_free_all(void *context)
 {
     Arena *a     = context;
+    a->base    = a->buffer;
+    a->size    = a->buffer_size;
+    a->current = NULL;
     a->offset    = 0;
     a->committed = 0;
 }
 
 Arena arena_init(void *buffer, size_t size)
 {
-    return (Arena){.base = buffer, .size = size};
+    return (Arena){
+        .base        = buffer,
+        .size        = buffer ? size : 0,
+        .buffer      = buffer,
+        .buffer_size = buffer ? size : 0,
+    };
+}
+
+void arena_destroy(Arena *a)
+{
+    Arena_Block *block = a->blocks, *next = NULL;
+    while (block) {
+        next = block->next;
+        free(block);
+        block = next;
+    }
+    a->blocks   = NULL;
+    a->reserved = 0;
+    arena_free_all(a);
+}
+
+Allocator arena_allocator(Arena *a)
+{
+    return (Allocator){
+        .alloc   = arena_alloc,
+        .free    = arena_free,
+        .context = a,
+    };
+}
+
+static void *heap_alloc(size_t size, void *context)
+{
+    (void)context;
+    return malloc(size);
+}
+
+static void heap_free(size_t size, void *ptr, void *context)
+{
+    (void)size;
+    (void)context;
+    free(ptr);
+}
+
+/*
+ * Plain malloc and free behind the Allocator interface
+ */
+Allocator heap_allocator(void)
+{
+    return (Allocator){.alloc = heap_alloc, .free = heap_free};
 }
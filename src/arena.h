@@ -4,20 +4,57 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+// Minimum size of the blocks an arena grows by
+#define ARENA_BLOCK_SIZE (1 << 14)
+
 typedef struct allocator {
     void *(*alloc)(size_t size, void *context);
     void (*free)(size_t size, void *ptr, void *context);
     void *context;
 } Allocator;
 
-#define alloc(T, n, a)   ((T *)((a).alloc(sizeof(T) * n, (a).context)))
+#define alloc(T, n, a)   ((T *)((a).alloc(sizeof(T) * (n), (a).context)))
 #define release(s, p, a) ((a).free(s, p, (a).context))
 
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    uint8_t data[];
+} Arena_Block;
+
+/*
+ * Bump allocator, it starts from an optional caller provided buffer, e.g. on
+ * the stack, and grows by chaining heap blocks when it runs out of room.
+ *
+ * Nothing is freed on its own, `arena_free_all` rewinds the whole arena at
+ * the end of an operation, keeping the blocks for the next one to reuse,
+ * `arena_destroy` returns them to the heap, `reserved` is the size of the
+ * blocks taken from the heap so far.
+ */
 typedef struct arena {
     void *base;
     size_t size;
     size_t offset;
     size_t committed;
+    size_t reserved;
+    void *buffer;
+    size_t buffer_size;
+    Arena_Block *blocks;
+    Arena_Block *current;
 } Arena;
 
+void *arena_alloc(size_t size, void *context);
+
+void arena_free(size_t size, void *ptr, void *context);
+
+void arena_free_all(void *context);
+
+Arena arena_init(void *buffer, size_t size);
+
+void arena_destroy(Arena *a);
+
+Allocator arena_allocator(Arena *a);
+
+Allocator heap_allocator(void);
+
 #endif
@@ -1,5 +1,6 @@
 #include "binary.h"
 #include <stdint.h>
+#include <string.h>
 
 void write_u8(uint8_t *buf, uint8_t val) { *buf++ = val; }
 
@@ -42,11 +43,22 @@ uint32_t read_u32(const uint8_t *const buf)
            ((uint32_t)buf[2] << 8) | buf[3];
 }
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define to_be64(x) __builtin_bswap64(x)
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define to_be64(x) (x)
+#endif
+
 /*
- * write_i64() -- store a 64-bit int into a char buffer (like htonl())
+ * Shared by the single and the bulk variants, the exported functions can be
+ * interposed in a shared object so they're never inlined in the loops
  */
-void write_i64(uint8_t *buf, uint64_t val)
+static inline void store_be64(uint8_t *buf, uint64_t val)
 {
+#ifdef to_be64
+    val = to_be64(val);
+    memcpy(buf, &val, sizeof(val));
+#else
     *buf++ = val >> 56;
     *buf++ = val >> 48;
     *buf++ = val >> 40;
@@ -55,104 +67,85 @@ void write_i64(uint8_t *buf, uint64_t val)
     *buf++ = val >> 16;
     *buf++ = val >> 8;
     *buf++ = val;
+#endif
 }
 
-/*
- * read_i64() -- unpack a 64-bit unsigned from a char buffer (like ntohl())
- */
-uint64_t read_i64(const uint8_t *const buf)
+static inline uint64_t load_be64(const uint8_t *buf)
 {
+#ifdef to_be64
+    uint64_t val;
+    memcpy(&val, buf, sizeof(val));
+    return to_be64(val);
+#else
     return ((uint64_t)buf[0] << 56) | ((uint64_t)buf[1] << 48) |
            ((uint64_t)buf[2] << 40) | ((uint64_t)buf[3] << 32) |
            ((uint64_t)buf[4] << 24) | ((uint64_t)buf[5] << 16) |
            ((uint64_t)buf[6] << 8) | buf[7];
+#endif
 }
 
-/*
- * write_f64() -- store a 64-bit float into a char buffer, taken from beej.us
- * guide
- */
-void write_f64(uint8_t *buf, double_t val)
+// Binary64 bits, -0.0 is stored as 0.0 like it always was
+static inline uint64_t f64_bits(double_t val)
 {
-    unsigned bits = 64, expbits = 11;
-    long double fnorm;
-    int shift;
-    long long sign, exp, significand;
-    unsigned significandbits = bits - expbits - 1; // -1 for sign bit
-
-    if (val == 0.0) {
-        write_u32(buf, 0);
-    } else {
-        // check sign and begin normalization
-        if (val < 0) {
-            sign  = 1;
-            fnorm = -val;
-        } else {
-            sign  = 0;
-            fnorm = val;
-        }
-
-        // get the normalized form of f and track the exponent
-        shift = 0;
-        while (fnorm >= 2.0) {
-            fnorm /= 2.0;
-            shift++;
-        }
-        while (fnorm < 1.0) {
-            fnorm *= 2.0;
-            shift--;
-        }
-        fnorm       = fnorm - 1.0;
-
-        // calculate the binary form (non-float) of the significand data
-        significand = fnorm * ((1LL << significandbits) + 0.5f);
-
-        // get the biased exponent
-        exp         = shift + ((1 << (expbits - 1)) - 1); // shift + bias
-
-        // return the final answer
-        uint64_t d =
-            (sign << (bits - 1)) | (exp << (bits - expbits - 1)) | significand;
-
-        write_i64(buf, d);
-    }
+    double d = val == 0.0 ? 0.0 : val;
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
 }
 
+static inline double_t bits_f64(uint64_t bits)
+{
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+/*
+ * write_i64() -- store a 64-bit int into a char buffer (like htonl())
+ */
+void write_i64(uint8_t *buf, uint64_t val) { store_be64(buf, val); }
+
 /*
- * read_f64() -- unpack a 64-bit float into a char buffer, taken from beej.us
- * guide
+ * read_i64() -- unpack a 64-bit unsigned from a char buffer (like ntohl())
  */
-double_t read_f64(const uint8_t *const buf)
+uint64_t read_i64(const uint8_t *const buf) { return load_be64(buf); }
+
+/*
+ * write_f64() -- store a 64-bit float into a char buffer, as the big endian
+ * IEEE 754 binary64 bits, matching the normalized form computed by the beej.us
+ * guide routine used before for every finite value
+ */
+void write_f64(uint8_t *buf, double_t val) { store_be64(buf, f64_bits(val)); }
+
+/*
+ * read_f64() -- unpack a 64-bit float from a char buffer
+ */
+double_t read_f64(const uint8_t *const buf) { return bits_f64(load_be64(buf)); }
+
+/*
+ * Bulk variants, the loops carry no calls so they're unrolled and vectorized
+ * into byte shuffles where the target has them
+ */
+void write_i64_array(uint8_t *buf, const uint64_t *vals, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        store_be64(buf + i * sizeof(uint64_t), vals[i]);
+}
+
+void read_i64_array(uint64_t *vals, const uint8_t *const buf, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        vals[i] = load_be64(buf + i * sizeof(uint64_t));
+}
+
+void write_f64_array(uint8_t *buf, const double_t *vals, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        store_be64(buf + i * sizeof(uint64_t), f64_bits(vals[i]));
+}
+
+void read_f64_array(double_t *vals, const uint8_t *const buf, size_t n)
 {
-    uint64_t i    = read_i64(buf);
-    unsigned bits = 64, expbits = 11;
-    long double result;
-    long long shift;
-    unsigned bias;
-    unsigned significandbits = bits - expbits - 1; // -1 for sign bit
-
-    if (i == 0)
-        return 0.0;
-
-    // pull the significand
-    result = (i & ((1LL << significandbits) - 1)); // mask
-    result /= (1LL << significandbits);            // convert back to float
-    result += 1.0f;                                // add the one back on
-
-    // deal with the exponent
-    bias  = (1 << (expbits - 1)) - 1;
-    shift = ((i >> significandbits) & ((1LL << expbits) - 1)) - bias;
-    while (shift > 0) {
-        result *= 2.0;
-        shift--;
-    }
-    while (shift < 0) {
-        result /= 2.0;
-        shift++;
-    }
-
-    // sign it
-    result *= (i >> (bits - 1)) & 1 ? -1.0 : 1.0;
-
-    return result;
+    for (size_t i = 0; i < n; ++i)
+        vals[i] = bits_f64(load_be64(buf + i * sizeof(uint64_t)));
 }
@@ -2,6 +2,7 @@
 #define BINARY_H
 
 #include <math.h>
+#include <stddef.h>
 #include <stdint.h>
 
 void write_u8(uint8_t *, uint8_t);
@@ -24,4 +25,12 @@ void write_f64(uint8_t *, double_t);
 
 double_t read_f64(const uint8_t *const);
 
+void write_i64_array(uint8_t *, const uint64_t *, size_t);
+
+void read_i64_array(uint64_t *, const uint8_t *const, size_t);
+
+void write_f64_array(uint8_t *, const double_t *, size_t);
+
+void read_f64_array(double_t *, const uint8_t *const, size_t);
+
 #endif
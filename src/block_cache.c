@@ -0,0 +1,304 @@
+#include "block_cache.h"
+#include "memory.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/*
+ * Shard of the cache, blocks are chained into the buckets of a fixed hash
+ * table and linked from the most to the least recently used
+ */
+typedef struct cache_shard {
+    pthread_mutex_t lock;
+    size_t size;
+    size_t capacity;
+    Block *head;
+    Block *tail;
+    Block *buckets[BLOCK_CACHE_BUCKETS];
+} Cache_Shard;
+
+static Cache_Shard shards[BLOCK_CACHE_SHARDS];
+static int enabled                    = 0;
+static atomic_uint_fast64_t hits      = 0;
+static atomic_uint_fast64_t misses    = 0;
+static atomic_uint_fast64_t evictions = 0;
+
+static uint64_t block_hash(uint64_t partition, uint64_t offset)
+{
+    // splitmix64 finalizer over the combined key
+    uint64_t hash = partition * 0x9e3779b97f4a7c15ULL ^ offset;
+    hash          = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash          = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+static Cache_Shard *block_shard(uint64_t hash)
+{
+    return &shards[hash % BLOCK_CACHE_SHARDS];
+}
+
+static Block **block_bucket(Cache_Shard *shard, uint64_t hash)
+{
+    return &shard->buckets[(hash / BLOCK_CACHE_SHARDS) % BLOCK_CACHE_BUCKETS];
+}
+
+static void lru_unlink(Cache_Shard *shard, Block *block)
+{
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        shard->head = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+    else
+        shard->tail = block->prev;
+    block->prev = block->next = NULL;
+}
+
+static void lru_push(Cache_Shard *shard, Block *block)
+{
+    block->prev = NULL;
+    block->next = shard->head;
+    if (shard->head)
+        shard->head->prev = block;
+    shard->head = block;
+    if (!shard->tail)
+        shard->tail = block;
+}
+
+static void chain_unlink(Block **bucket, Block *block)
+{
+    while (*bucket && *bucket != block)
+        bucket = &(*bucket)->chain;
+    if (*bucket)
+        *bucket = block->chain;
+    block->chain = NULL;
+}
+
+/*
+ * Drop the least recently used blocks until the shard fits its capacity,
+ * those still referenced are left to their last reader to free
+ */
+static void block_cache_evict(Cache_Shard *shard)
+{
+    while (shard->size > shard->capacity && shard->tail) {
+        Block *victim = shard->tail;
+        uint64_t hash = block_hash(victim->partition, victim->offset);
+
+        lru_unlink(shard, victim);
+        chain_unlink(block_bucket(shard, hash), victim);
+        victim->cached = 0;
+        shard->size -= victim->size;
+        memory_sub(MEM_CACHE, victim->size);
+        atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+
+        if (victim->refs == 0)
+            free(victim);
+    }
+}
+
+/*
+ * To be called before any reader is started, a capacity of 0 leaves the
+ * cache disabled
+ */
+int block_cache_init(size_t capacity)
+{
+    if (capacity == 0)
+        return 0;
+
+    for (size_t i = 0; i < BLOCK_CACHE_SHARDS; ++i) {
+        shards[i] = (Cache_Shard){.capacity = capacity / BLOCK_CACHE_SHARDS};
+        if (pthread_mutex_init(&shards[i].lock, NULL) != 0)
+            return -1;
+    }
+
+    enabled = 1;
+
+    return 0;
+}
+
+/*
+ * Release every block, no reader must hold any reference anymore
+ */
+void block_cache_destroy(void)
+{
+    if (!enabled)
+        return;
+
+    for (size_t i = 0; i < BLOCK_CACHE_SHARDS; ++i) {
+        shards[i].capacity = 0;
+        block_cache_evict(&shards[i]);
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+
+    enabled = 0;
+}
+
+Block *block_alloc(uint64_t partition, uint64_t offset, size_t length)
+{
+    size_t size  = sizeof(Block) + length * sizeof(Record);
+    Block *block = malloc(size);
+    if (!block)
+        return NULL;
+
+    *block = (Block){
+        .partition = partition,
+        .offset    = offset,
+        .size      = size,
+        .length    = length,
+    };
+
+    return block;
+}
+
+/*
+ * Look up a block, on hit it's moved to the front of its shard and returned
+ * referenced, NULL on miss
+ */
+Block *block_cache_get(uint64_t partition, uint64_t offset)
+{
+    Block *block = NULL;
+
+    if (!enabled)
+        goto miss;
+
+    uint64_t hash      = block_hash(partition, offset);
+    Cache_Shard *shard = block_shard(hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    for (block = *block_bucket(shard, hash); block; block = block->chain) {
+        if (block->partition == partition && block->offset == offset)
+            break;
+    }
+
+    if (block) {
+        lru_unlink(shard, block);
+        lru_push(shard, block);
+        block->refs++;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (block) {
+        atomic_fetch_add_explicit(&hits, 1, memory_order_relaxed);
+        return block;
+    }
+
+miss:
+    atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+    return NULL;
+}
+
+/*
+ * Insert a freshly decoded block, returned referenced, if another reader
+ * beat us to it the block already cached is returned instead and the new one
+ * is freed
+ */
+/*
+ * Tell if a block is cached without touching the LRU order nor the stats,
+ * always true while the cache is disabled as there's nowhere to load it into
+ */
+int block_cache_contains(uint64_t partition, uint64_t offset)
+{
+    Block *block = NULL;
+
+    if (!enabled)
+        return 1;
+
+    uint64_t hash      = block_hash(partition, offset);
+    Cache_Shard *shard = block_shard(hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    for (block = *block_bucket(shard, hash); block; block = block->chain) {
+        if (block->partition == partition && block->offset == offset)
+            break;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return block != NULL;
+}
+
+Block *block_cache_put(Block *block)
+{
+    block->refs   = 1;
+    block->cached = 0;
+
+    if (!enabled)
+        return block;
+
+    uint64_t hash      = block_hash(block->partition, block->offset);
+    Cache_Shard *shard = block_shard(hash);
+    Block **bucket     = block_bucket(shard, hash);
+    Block *cached      = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+
+    for (cached = *bucket; cached; cached = cached->chain) {
+        if (cached->partition == block->partition &&
+            cached->offset == block->offset)
+            break;
+    }
+
+    if (cached) {
+        lru_unlink(shard, cached);
+        lru_push(shard, cached);
+        cached->refs++;
+        pthread_mutex_unlock(&shard->lock);
+        free(block);
+        return cached;
+    }
+
+    block->cached = 1;
+    block->chain  = *bucket;
+    *bucket       = block;
+    lru_push(shard, block);
+    shard->size += block->size;
+    memory_add(MEM_CACHE, block->size);
+
+    block_cache_evict(shard);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return block;
+}
+
+void block_cache_release(Block *block)
+{
+    if (!enabled) {
+        free(block);
+        return;
+    }
+
+    uint64_t hash      = block_hash(block->partition, block->offset);
+    Cache_Shard *shard = block_shard(hash);
+    int drop           = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    drop = --block->refs == 0 && !block->cached;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (drop)
+        free(block);
+}
+
+void block_cache_stats(Block_Cache_Stats *stats)
+{
+    *stats = (Block_Cache_Stats){
+        .hits      = atomic_load_explicit(&hits, memory_order_relaxed),
+        .misses    = atomic_load_explicit(&misses, memory_order_relaxed),
+        .evictions = atomic_load_explicit(&evictions, memory_order_relaxed),
+    };
+
+    if (!enabled)
+        return;
+
+    for (size_t i = 0; i < BLOCK_CACHE_SHARDS; ++i) {
+        pthread_mutex_lock(&shards[i].lock);
+        stats->size += shards[i].size;
+        stats->capacity += shards[i].capacity;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include "timeseries.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOCK_CACHE_SHARDS  16
+#define BLOCK_CACHE_BUCKETS 1024
+
+/*
+ * Decoded block of a partition, the records of a batch flushed to the commit
+ * log, keyed by the partition and the offset of the batch in the log.
+ *
+ * Blocks are shared among the readers, each one holds a reference from the
+ * lookup until the release, a block evicted while referenced is freed by the
+ * last reader releasing it.
+ */
+typedef struct block {
+    uint64_t partition;
+    uint64_t offset;
+    size_t size;
+    size_t refs;
+    int cached;
+    struct block *prev;
+    struct block *next;
+    struct block *chain;
+    size_t length;
+    Record records[];
+} Block;
+
+typedef struct block_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t size;
+    size_t capacity;
+} Block_Cache_Stats;
+
+/*
+ * Process wide cache of decoded blocks, split into shards each with its own
+ * lock and LRU list, the capacity is in bytes and evenly divided among the
+ * shards.
+ *
+ * It's disabled until `block_cache_init` is called, lookups always miss and
+ * the blocks inserted are just handed back to be freed on release.
+ */
+int block_cache_init(size_t capacity);
+
+void block_cache_destroy(void);
+
+Block *block_alloc(uint64_t partition, uint64_t offset, size_t length);
+
+Block *block_cache_get(uint64_t partition, uint64_t offset);
+
+int block_cache_contains(uint64_t partition, uint64_t offset);
+
+Block *block_cache_put(Block *block);
+
+void block_cache_release(Block *block);
+
+void block_cache_stats(Block_Cache_Stats *stats);
+
+#endif
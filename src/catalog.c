@@ -0,0 +1,634 @@
+#include "catalog.h"
+#include "binary.h"
+#include "disk_io.h"
+#include "logging.h"
+#include "metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CATALOG_MAGIC        0x524f4132 // ROA2
+#define CATALOG_MAGIC_V1     0x524f4143 // ROAC
+#define CATALOG_BASE_BUCKETS 64
+
+/*
+ * On disk layout, all integers are big endian
+ *
+ * header: magic (4) | series count (4) | next id (8) |
+ *         default chunk size (4) | default flush size (4)
+ * entry:  id (8) | created at (8) | retention (8) | policy (1) |
+ *         partition nr (1) | chunk size (4) | flush size (4) |
+ *         partition base timestamps (8 * nr) |
+ *         name length (2) | name | label nr (1) |
+ *         label length (2) | label (`name=value`), for each label
+ *
+ * The V1 layout has none of the chunk settings, they're loaded as 0.
+ */
+#define CATALOG_HEADER_SIZE        (sizeof(uint32_t) * 4 + sizeof(uint64_t))
+#define CATALOG_HEADER_V1_SIZE     (sizeof(uint32_t) * 2 + sizeof(uint64_t))
+#define CATALOG_ENTRY_BASE_SIZE    34
+#define CATALOG_ENTRY_BASE_V1_SIZE 26
+
+static size_t catalog_entry_size(const Catalog_Entry *e)
+{
+    size_t size = CATALOG_ENTRY_BASE_SIZE + e->partition_nr * sizeof(uint64_t) +
+                  sizeof(uint16_t) + strlen(e->name) + sizeof(uint8_t);
+    for (size_t i = 0; i < e->label_nr; ++i)
+        size += sizeof(uint16_t) + strlen(e->labels[i]);
+    return size;
+}
+
+static void catalog_entry_free(Catalog_Entry *e)
+{
+    if (!e)
+        return;
+    for (size_t i = 0; i < e->label_nr; ++i)
+        free(e->labels[i]);
+    free(e->name);
+    free(e);
+}
+
+static int catalog_id_cmp(const void *key, const void *elem)
+{
+    uint64_t id    = *(const uint64_t *)key;
+    uint64_t other = (*(Catalog_Entry *const *)elem)->id;
+    return id < other ? -1 : id > other;
+}
+
+static uint64_t catalog_hash(const char *name)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *p = name; *p; ++p) {
+        hash ^= (uint8_t)*p;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static Catalog_Entry *catalog_lookup(const Catalog *c, const char *name)
+{
+    Catalog_Entry *e = c->buckets[catalog_hash(name) % c->capacity];
+    while (e && strcmp(e->name, name) != 0)
+        e = e->next;
+    return e;
+}
+
+static int catalog_grow(Catalog *c)
+{
+    size_t capacity         = c->capacity * 2;
+    Catalog_Entry **buckets = calloc(capacity, sizeof(*buckets));
+    Catalog_Entry *e        = NULL, *next = NULL;
+    if (!buckets)
+        return -1;
+
+    for (size_t i = 0; i < c->capacity; ++i) {
+        for (e = c->buckets[i]; e; e = next) {
+            size_t bucket   = catalog_hash(e->name) % capacity;
+            next            = e->next;
+            e->next         = buckets[bucket];
+            buckets[bucket] = e;
+        }
+    }
+
+    free(c->buckets);
+    c->buckets  = buckets;
+    c->capacity = capacity;
+
+    return 0;
+}
+
+static int catalog_insert(Catalog *c, Catalog_Entry *e)
+{
+    if ((c->size + 1) * 4 > c->capacity * 3 && catalog_grow(c) < 0)
+        return -1;
+
+    for (size_t i = 0; i < e->label_nr; ++i)
+        if (label_index_add(&c->labels, e->labels[i], e->id) < 0)
+            return -1;
+
+    // Kept sorted by id, new series always go last
+    size_t pos = vec_size(c->by_id);
+    while (pos > 0 && vec_at(c->by_id, pos - 1)->id > e->id)
+        pos--;
+    vec_push(c->by_id, e);
+    memmove(c->by_id.data + pos + 1, c->by_id.data + pos,
+            (vec_size(c->by_id) - pos - 1) * sizeof(e));
+    vec_at(c->by_id, pos) = e;
+
+    size_t bucket      = catalog_hash(e->name) % c->capacity;
+    e->next            = c->buckets[bucket];
+    c->buckets[bucket] = e;
+    c->size++;
+
+    if (e->id >= c->next_id)
+        c->next_id = e->id + 1;
+
+    return 0;
+}
+
+static int catalog_fsync(int fd)
+{
+    uint64_t start = metrics_now();
+    int err        = fsync(fd);
+
+    metrics_record_since(MET_FSYNC, start);
+
+    return err;
+}
+
+/*
+ * Write the whole catalog into a temporary file, synced and renamed over the
+ * current one, the directory is synced as well to persist the rename
+ */
+static int catalog_persist(const Catalog *c)
+{
+    char pathbuf[MAX_PATH_SIZE];
+    const Catalog_Entry *e = NULL;
+    size_t size            = CATALOG_HEADER_SIZE, n = 0;
+    uint8_t *buf = NULL;
+    FILE *fp     = NULL;
+    int fd       = -1;
+
+    for (size_t i = 0; i < c->capacity; ++i)
+        for (e = c->buckets[i]; e; e = e->next)
+            size += catalog_entry_size(e);
+
+    buf = malloc(size);
+    if (!buf)
+        return -1;
+
+    write_u32(buf, CATALOG_MAGIC);
+    write_u32(buf + sizeof(uint32_t), c->size);
+    write_i64(buf + sizeof(uint32_t) * 2, c->next_id);
+    write_u32(buf + 16, c->defaults.chunk_size);
+    write_u32(buf + 20, c->defaults.flush_size);
+    n = CATALOG_HEADER_SIZE;
+
+    for (size_t i = 0; i < c->capacity; ++i) {
+        for (e = c->buckets[i]; e; e = e->next) {
+            size_t name_len = strlen(e->name);
+            write_i64(buf + n, e->id);
+            write_i64(buf + n + 8, e->created_at);
+            write_i64(buf + n + 16, e->retention);
+            write_u8(buf + n + 24, e->policy);
+            write_u8(buf + n + 25, e->partition_nr);
+            write_u32(buf + n + 26, e->settings.chunk_size);
+            write_u32(buf + n + 30, e->settings.flush_size);
+            n += CATALOG_ENTRY_BASE_SIZE;
+            for (size_t j = 0; j < e->partition_nr; ++j, n += 8)
+                write_i64(buf + n, e->partitions[j]);
+            write_u16(buf + n, name_len);
+            memcpy(buf + n + 2, e->name, name_len);
+            n += 2 + name_len;
+            write_u8(buf + n++, e->label_nr);
+            for (size_t j = 0; j < e->label_nr; ++j) {
+                size_t label_len = strlen(e->labels[j]);
+                write_u16(buf + n, label_len);
+                memcpy(buf + n + 2, e->labels[j], label_len);
+                n += 2 + label_len;
+            }
+        }
+    }
+
+    snprintf(pathbuf, sizeof(pathbuf), "%s.tmp", c->path);
+    fp = fopen(pathbuf, "w");
+    if (!fp)
+        goto err;
+
+    if (fwrite(buf, size, 1, fp) != 1 || fflush(fp) != 0 ||
+        catalog_fsync(fileno(fp)) < 0)
+        goto err;
+
+    metrics_add(MET_BYTES_WRITTEN, size);
+
+    fclose(fp);
+    fp = NULL;
+
+    if (rename(pathbuf, c->path) < 0)
+        goto err;
+
+    // Persist the directory entry
+    snprintf(pathbuf, sizeof(pathbuf), "%s", c->path);
+    char *slash = strrchr(pathbuf, '/');
+    if (slash)
+        *slash = '\0';
+    fd = open(slash ? pathbuf : ".", O_RDONLY);
+    if (fd >= 0) {
+        catalog_fsync(fd);
+        close(fd);
+    }
+
+    free(buf);
+
+    return 0;
+
+err:
+    log_error("Catalog persist %s: %s", c->path, strerror(errno));
+    if (fp)
+        fclose(fp);
+    free(buf);
+    return -1;
+}
+
+static ssize_t catalog_load_entry(Catalog *c, const uint8_t *buf, size_t size,
+                                  int v1)
+{
+    size_t n         = CATALOG_ENTRY_BASE_SIZE, name_len = 0;
+    Catalog_Entry *e = NULL;
+
+    if (v1)
+        n = CATALOG_ENTRY_BASE_V1_SIZE;
+
+    if (n > size)
+        return -1;
+
+    e = calloc(1, sizeof(*e));
+    if (!e)
+        return -1;
+
+    e->id           = read_i64(buf);
+    e->created_at   = read_i64(buf + 8);
+    e->retention    = read_i64(buf + 16);
+    e->policy       = read_u8(buf + 24);
+    e->partition_nr = read_u8(buf + 25);
+
+    if (!v1) {
+        e->settings.chunk_size = read_u32(buf + 26);
+        e->settings.flush_size = read_u32(buf + 30);
+    }
+
+    if (e->partition_nr > CATALOG_MAX_PARTITIONS ||
+        n + e->partition_nr * 8 + 2 > size)
+        goto err;
+
+    for (size_t i = 0; i < e->partition_nr; ++i, n += 8)
+        e->partitions[i] = read_i64(buf + n);
+
+    name_len = read_u16(buf + n);
+    n += 2;
+    if (n + name_len > size)
+        goto err;
+
+    e->name = strndup((const char *)buf + n, name_len);
+    if (!e->name)
+        goto err;
+    n += name_len;
+
+    if (n + 1 > size || read_u8(buf + n) > CATALOG_MAX_LABELS)
+        goto err;
+
+    size_t label_nr = read_u8(buf + n++);
+    for (; e->label_nr < label_nr; ++e->label_nr) {
+        if (n + 2 > size || n + 2 + read_u16(buf + n) > size)
+            goto err;
+        size_t label_len       = read_u16(buf + n);
+        e->labels[e->label_nr] = strndup((const char *)buf + n + 2, label_len);
+        if (!e->labels[e->label_nr])
+            goto err;
+        n += 2 + label_len;
+    }
+
+    if (catalog_insert(c, e) < 0)
+        goto err;
+
+    return n;
+
+err:
+    catalog_entry_free(e);
+    return -1;
+}
+
+static int catalog_load(Catalog *c, const uint8_t *buf, size_t size)
+{
+    size_t n = CATALOG_HEADER_SIZE, count = 0;
+    ssize_t len = 0;
+    int v1      = 0;
+
+    if (size < CATALOG_HEADER_V1_SIZE)
+        return -1;
+
+    if (read_u32(buf) == CATALOG_MAGIC_V1) {
+        v1 = 1;
+        n  = CATALOG_HEADER_V1_SIZE;
+    } else if (read_u32(buf) != CATALOG_MAGIC || size < CATALOG_HEADER_SIZE) {
+        return -1;
+    }
+
+    count      = read_u32(buf + sizeof(uint32_t));
+    c->next_id = read_i64(buf + sizeof(uint32_t) * 2);
+
+    if (!v1) {
+        c->defaults.chunk_size = read_u32(buf + 16);
+        c->defaults.flush_size = read_u32(buf + 20);
+    }
+
+    for (size_t i = 0; i < count; ++i, n += len) {
+        len = catalog_load_entry(c, buf + n, size - n, v1);
+        if (len < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void catalog_free(Catalog *c)
+{
+    Catalog_Entry *e = NULL, *next = NULL;
+    for (size_t i = 0; c->buckets && i < c->capacity; ++i) {
+        for (e = c->buckets[i]; e; e = next) {
+            next = e->next;
+            catalog_entry_free(e);
+        }
+    }
+    label_index_destroy(&c->labels);
+    vec_destroy(c->by_id);
+    c->by_id.data = NULL;
+    free(c->buckets);
+    free(c->path);
+    c->buckets = NULL;
+    c->path    = NULL;
+    c->size    = 0;
+}
+
+/*
+ * Open the catalog stored at `path`, loading it if present.
+ *
+ * Returns 1 if the catalog has been loaded, 0 if there's none yet, -1 on
+ * error
+ */
+int catalog_open(Catalog *c, const char *path)
+{
+    Buffer buffer = {0};
+    FILE *fp      = NULL;
+    int err       = 0;
+
+    *c = (Catalog){0};
+    pthread_mutex_init(&c->lock, NULL);
+
+    c->next_id  = 1;
+    c->size     = 0;
+    c->capacity = CATALOG_BASE_BUCKETS;
+    c->buckets  = calloc(c->capacity, sizeof(*c->buckets));
+    c->path     = strdup(path);
+    vec_new(c->by_id);
+    if (!c->buckets || !c->path || !c->by_id.data ||
+        label_index_init(&c->labels) < 0)
+        goto err;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        if (errno == ENOENT)
+            return 0;
+        goto err;
+    }
+
+    err = buf_read_file(fp, &buffer);
+    fclose(fp);
+    if (err < 0 || !buffer.buf)
+        goto err;
+
+    err = catalog_load(c, buffer.buf, buffer.size);
+    free(buffer.buf);
+    if (err < 0) {
+        log_error("Catalog %s is corrupted", path);
+        goto err;
+    }
+
+    return 1;
+
+err:
+    catalog_close(c);
+    return -1;
+}
+
+void catalog_close(Catalog *c)
+{
+    catalog_free(c);
+    pthread_mutex_destroy(&c->lock);
+}
+
+/*
+ * Copy the metadata of the series `name` into `dst`, the name is shared with
+ * the catalog and valid till it's closed.
+ *
+ * Returns 0 on success, -1 if the series is unknown
+ */
+int catalog_get(Catalog *c, const char *name, Catalog_Entry *dst)
+{
+    int err = -1;
+
+    pthread_mutex_lock(&c->lock);
+    const Catalog_Entry *e = catalog_lookup(c, name);
+    if (e) {
+        *dst      = *e;
+        dst->next = NULL;
+        err       = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return err;
+}
+
+/*
+ * Same as `catalog_get` on the id of the series
+ */
+int catalog_get_by_id(Catalog *c, uint64_t id, Catalog_Entry *dst)
+{
+    int err = -1;
+
+    pthread_mutex_lock(&c->lock);
+    Catalog_Entry **e = bsearch(&id, c->by_id.data, vec_size(c->by_id),
+                                sizeof(*e), catalog_id_cmp);
+    if (e) {
+        *dst      = **e;
+        dst->next = NULL;
+        err       = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return err;
+}
+
+/*
+ * Register a new series with a fresh id, indexing its labels, an already
+ * known series keeps its metadata, which is copied into `dst` in both cases.
+ *
+ * Returns 1 if the series has been added, 0 if it was already present, -1 on
+ * error
+ */
+int catalog_add(Catalog *c, const char *name, int64_t retention,
+                uint8_t policy, const Chunk_Settings *settings,
+                const Label *labels, size_t label_nr, Catalog_Entry *dst)
+{
+    struct timespec tv;
+    Catalog_Entry *e = NULL;
+    int err          = 0;
+
+    pthread_mutex_lock(&c->lock);
+
+    e = catalog_lookup(c, name);
+    if (e)
+        goto exit;
+
+    if (label_nr > CATALOG_MAX_LABELS)
+        goto err;
+
+    e = calloc(1, sizeof(*e));
+    if (!e)
+        goto err;
+
+    e->name = strdup(name);
+    if (!e->name)
+        goto err;
+
+    for (; e->label_nr < label_nr; ++e->label_nr) {
+        const Label *l = &labels[e->label_nr];
+        if (strlen(l->name) > LABEL_MAX_LENGTH ||
+            strlen(l->value) > LABEL_MAX_LENGTH || strchr(l->name, '='))
+            goto err;
+        e->labels[e->label_nr] = malloc(strlen(l->name) + strlen(l->value) + 2);
+        if (!e->labels[e->label_nr])
+            goto err;
+        sprintf(e->labels[e->label_nr], "%s=%s", l->name, l->value);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &tv);
+    e->id         = c->next_id;
+    e->created_at = tv.tv_sec * (uint64_t)1e9 + tv.tv_nsec;
+    e->retention  = retention;
+    e->policy     = policy;
+    if (settings)
+        e->settings = *settings;
+
+    if (catalog_insert(c, e) < 0)
+        goto err;
+
+    // The series is kept in memory even if it can't be persisted, the next
+    // successful write will carry it
+    catalog_persist(c);
+    err = 1;
+
+exit:
+    *dst      = *e;
+    dst->next = NULL;
+    pthread_mutex_unlock(&c->lock);
+    return err;
+
+err:
+    pthread_mutex_unlock(&c->lock);
+    catalog_entry_free(e);
+    return -1;
+}
+
+/*
+ * Copy the chunk settings applied to the series not setting their own
+ */
+void catalog_defaults(Catalog *c, Chunk_Settings *dst)
+{
+    pthread_mutex_lock(&c->lock);
+    *dst = c->defaults;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Update the default chunk settings of the series, persisted only if they
+ * changed
+ */
+int catalog_set_defaults(Catalog *c, const Chunk_Settings *defaults)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&c->lock);
+
+    if (c->defaults.chunk_size != defaults->chunk_size ||
+        c->defaults.flush_size != defaults->flush_size) {
+        c->defaults = *defaults;
+        err         = catalog_persist(c);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    return err;
+}
+
+/*
+ * Update the partition summary of a series, persisted only if it changed
+ */
+int catalog_set_partitions(Catalog *c, const char *name,
+                           const uint64_t *partitions, size_t partition_nr)
+{
+    Catalog_Entry *e = NULL;
+    int err          = 0;
+
+    if (partition_nr > CATALOG_MAX_PARTITIONS)
+        partition_nr = CATALOG_MAX_PARTITIONS;
+
+    pthread_mutex_lock(&c->lock);
+
+    e = catalog_lookup(c, name);
+    if (!e) {
+        err = -1;
+    } else if (e->partition_nr != partition_nr ||
+               memcmp(e->partitions, partitions,
+                      partition_nr * sizeof(*partitions)) != 0) {
+        memcpy(e->partitions, partitions, partition_nr * sizeof(*partitions));
+        e->partition_nr = partition_nr;
+        err             = catalog_persist(c);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    return err;
+}
+
+/*
+ * Call `fn` on every series of the catalog, in no particular order, with the
+ * catalog locked
+ */
+void catalog_foreach(Catalog *c, void (*fn)(const Catalog_Entry *, void *),
+                     void *arg)
+{
+    const Catalog_Entry *e = NULL;
+
+    pthread_mutex_lock(&c->lock);
+    for (size_t i = 0; i < c->capacity; ++i)
+        for (e = c->buckets[i]; e; e = e->next)
+            fn(e, arg);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Call `fn` on every series carrying all the labels matched, in order of id,
+ * with the catalog locked, label values can be glob patterns.
+ *
+ * Returns the number of series selected, -1 on error
+ */
+int catalog_select(Catalog *c, const Label *matchers, size_t matcher_nr,
+                   void (*fn)(const Catalog_Entry *, void *), void *arg)
+{
+    Catalog_Entry **e = NULL;
+    Series_Ids ids;
+    int n = 0;
+
+    vec_new(ids);
+
+    pthread_mutex_lock(&c->lock);
+
+    n = label_index_select(&c->labels, matchers, matcher_nr, &ids);
+    for (int i = 0; i < n; ++i) {
+        e = bsearch(&vec_at(ids, i), c->by_id.data, vec_size(c->by_id),
+                    sizeof(*e), catalog_id_cmp);
+        if (e)
+            fn(*e, arg);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    vec_destroy(ids);
+
+    return n;
+}
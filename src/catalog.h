@@ -0,0 +1,88 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include "label_index.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CATALOG_MAX_PARTITIONS 16
+#define CATALOG_MAX_LABELS     16
+
+/*
+ * Chunk settings of a series, the width in seconds of its in-memory chunks
+ * and the size its WAL grows to before they're flushed, 0 for the default
+ */
+typedef struct {
+    uint32_t chunk_size;
+    uint32_t flush_size;
+} Chunk_Settings;
+
+/*
+ * Metadata of a series, the partition summary is the list of the base
+ * timestamps of the partitions it's been flushed to so far, labels are
+ * stored as `name=value` strings
+ */
+typedef struct catalog_entry {
+    uint64_t id;
+    uint64_t created_at;
+    int64_t retention;
+    uint8_t policy;
+    Chunk_Settings settings;
+    size_t partition_nr;
+    uint64_t partitions[CATALOG_MAX_PARTITIONS];
+    size_t label_nr;
+    char *labels[CATALOG_MAX_LABELS];
+    char *name;
+    struct catalog_entry *next;
+} Catalog_Entry;
+
+/*
+ * Catalog of the series of a DB, persisted as a single file rewritten on
+ * every change, the new version is written aside and renamed over the old one
+ * so a crash leaves either of them in place, never a partial file.
+ *
+ * It's fully loaded in memory into a hash map on the series names, lookups
+ * don't touch the filesystem, the series are indexed by their labels as well
+ * and by id, all the calls are thread safe.
+ *
+ * The defaults apply to the settings left to 0 by the series.
+ */
+typedef struct catalog {
+    pthread_mutex_t lock;
+    char *path;
+    uint64_t next_id;
+    Chunk_Settings defaults;
+    size_t size;
+    size_t capacity;
+    Catalog_Entry **buckets;
+    VEC(Catalog_Entry *) by_id;
+    Label_Index labels;
+} Catalog;
+
+int catalog_open(Catalog *c, const char *path);
+
+void catalog_close(Catalog *c);
+
+int catalog_get(Catalog *c, const char *name, Catalog_Entry *dst);
+
+int catalog_get_by_id(Catalog *c, uint64_t id, Catalog_Entry *dst);
+
+int catalog_add(Catalog *c, const char *name, int64_t retention,
+                uint8_t policy, const Chunk_Settings *settings,
+                const Label *labels, size_t label_nr, Catalog_Entry *dst);
+
+void catalog_defaults(Catalog *c, Chunk_Settings *dst);
+
+int catalog_set_defaults(Catalog *c, const Chunk_Settings *defaults);
+
+int catalog_set_partitions(Catalog *c, const char *name,
+                           const uint64_t *partitions, size_t partition_nr);
+
+void catalog_foreach(Catalog *c, void (*fn)(const Catalog_Entry *, void *),
+                     void *arg);
+
+int catalog_select(Catalog *c, const Label *matchers, size_t matcher_nr,
+                   void (*fn)(const Catalog_Entry *, void *), void *arg);
+
+#endif
@@ -79,7 +79,10 @@ err:
 
 void client_init(Client *c, const struct connect_options *opts)
 {
-    c->opts = opts;
+    c->opts     = opts;
+    c->buf      = NULL;
+    c->size     = 0;
+    c->capacity = 0;
 }
 
 int client_connect(Client *c)
@@ -91,28 +94,86 @@ int client_connect(Client *c)
     return CLIENT_SUCCESS;
 }
 
-void client_disconnect(Client *c) { close(c->fd); }
+void client_disconnect(Client *c)
+{
+    close(c->fd);
+    free(c->buf);
+    c->buf      = NULL;
+    c->size     = 0;
+    c->capacity = 0;
+}
 
 int client_send_command(Client *c, char *buf)
 {
     uint8_t data[BUFSIZE];
     Request rq = {.length = strlen(buf) - 1};
-    snprintf(rq.query, sizeof(rq.query), "%s", buf);
+
+    if (rq.length >= sizeof(rq.query)) {
+        errno = EMSGSIZE;
+        return CLIENT_FAILURE;
+    }
+
+    memcpy(rq.query, buf, rq.length);
     ssize_t n = encode_request(&rq, data);
     if (n < 0)
         return -1;
 
-    return write(c->fd, data, n);
+    // Short writes are possible on a loaded socket
+    for (ssize_t sent = 0, w = 0; sent < n; sent += w) {
+        w = write(c->fd, data + sent, n - sent);
+        if (w < 0 && errno == EINTR)
+            w = 0;
+        else if (w < 0)
+            return -1;
+    }
+
+    return n;
+}
+
+/*
+ * Read until a whole response is buffered, it may come in many segments when
+ * it carries a large range, returns its length
+ */
+static ssize_t client_fill(Client *c)
+{
+    ssize_t length = 0, n = 0;
+
+    while ((length = response_length(c->buf, c->size)) == 0) {
+        if (c->size == c->capacity) {
+            size_t capacity = c->capacity == 0 ? BUFSIZE : c->capacity * 2;
+            uint8_t *buf    = realloc(c->buf, capacity);
+            if (!buf)
+                return -1;
+            c->buf      = buf;
+            c->capacity = capacity;
+        }
+
+        n = read(c->fd, c->buf + c->size, c->capacity - c->size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // Connection closed halfway through
+        if (n <= 0)
+            return -1;
+
+        c->size += n;
+    }
+
+    return length;
 }
 
 int client_recv_response(Client *c, Response *rs)
 {
-    uint8_t data[BUFSIZE];
-    ssize_t n = read(c->fd, data, BUFSIZE);
-    if (n < 0)
+    ssize_t length = client_fill(c);
+    if (length < 0)
         return -1;
 
-    n = decode_response(data, rs);
+    memset(rs, 0x00, sizeof(*rs));
+    ssize_t n = decode_response(c->buf, rs);
+
+    // Keep what's been read past the response for the next one
+    c->size -= length;
+    memmove(c->buf, c->buf + length, c->size);
+
     if (n < 0)
         return -1;
 
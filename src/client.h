@@ -2,6 +2,7 @@
 #define CLIENT_H
 
 #include <netdb.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #define CLIENT_SUCCESS     0
@@ -25,11 +26,15 @@ struct connect_options {
 
 /*
  * Pretty basic connection wrapper, just a FD with a buffer tracking bytes and
- * some options for connection
+ * some options for connection, the buffer grows to fit the largest response
+ * and holds the bytes read past the last one
  */
 struct client {
     int fd;
     const struct connect_options *opts;
+    uint8_t *buf;
+    size_t size;
+    size_t capacity;
 };
 
 void client_init(Client *c, const struct connect_options *opts);
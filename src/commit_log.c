@@ -1,19 +1,147 @@
+// O_DIRECT is Linux specific, not exposed by fcntl.h without _GNU_SOURCE
+#define _GNU_SOURCE
 #include "commit_log.h"
 #include "binary.h"
+#include "crc32c.h"
 #include "disk_io.h"
 #include "logging.h"
+#include "metrics.h"
 #include "timeseries.h"
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+// Records are fixed size for now, size + timestamp + value
+static const size_t RECORD_SIZE = sizeof(uint64_t) * 2 + sizeof(double_t);
+
+static int direct_io = 0;
+
+/*
+ * Switch the logs opened from now on to direct I/O, meant to be set once at
+ * startup, the block cache is then the only cache of the logs read back
+ */
+void c_log_set_direct_io(int enabled) { direct_io = enabled; }
+
+static size_t align_down(size_t n)
+{
+    return n & ~(size_t)(C_LOG_DIRECT_ALIGN - 1);
+}
+
+static size_t align_up(size_t n)
+{
+    return align_down(n + C_LOG_DIRECT_ALIGN - 1);
+}
+
+/*
+ * Open the log a second time with O_DIRECT if the mode is on, filesystems not
+ * supporting it, e.g. tmpfs, are left to buffered I/O
+ */
+static int c_log_direct_open(Commit_Log *cl, const char *path_buf)
+{
+    if (!direct_io)
+        return 0;
+
+#ifdef O_DIRECT
+    char path[MAX_PATH_SIZE];
+    void *tail = NULL;
+
+    snprintf(path, sizeof(path), "%s.log", path_buf);
+    cl->direct_fd = open(path, O_RDWR | O_DIRECT);
+    if (cl->direct_fd < 0) {
+        log_warn("Commit log %s: no direct I/O, %s", path, strerror(errno));
+        return 0;
+    }
+
+    if (posix_memalign(&tail, C_LOG_DIRECT_ALIGN, C_LOG_DIRECT_ALIGN) != 0) {
+        close(cl->direct_fd);
+        cl->direct_fd = -1;
+        return -1;
+    }
+
+    cl->tail = tail;
+#endif
+
+    return 0;
+}
+
+/*
+ * Read back the last partial page of the log, the next write rewrites it
+ * whole
+ */
+static int c_log_tail_load(Commit_Log *cl)
+{
+    size_t start = align_down(cl->size);
+
+    if (cl->direct_fd < 0 || start == cl->size)
+        return 0;
+
+    ssize_t n = pread(cl->direct_fd, cl->tail, C_LOG_DIRECT_ALIGN, start);
+    if (n > 0)
+        metrics_add(MET_BYTES_READ, n);
+    if (n < (ssize_t)(cl->size - start)) {
+        log_error("Commit log tail read: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Append `len` bytes at the end of the log. In direct I/O mode the pages
+ * spanned are written whole from an aligned buffer, starting from the partial
+ * one at the tail, and the padding is cut away so the file keeps its actual
+ * size.
+ */
+static int c_log_write(Commit_Log *cl, const uint8_t *data, size_t len)
+{
+    if (cl->direct_fd < 0)
+        return write_at(cl->fp, data, cl->size, len) < 0 ? -1 : 0;
+
+    size_t start    = align_down(cl->size);
+    size_t tail_len = cl->size - start;
+    size_t end      = align_up(cl->size + len);
+    size_t last     = align_down(cl->size + len);
+    void *buf       = NULL;
+    int err         = -1;
+
+    if (posix_memalign(&buf, C_LOG_DIRECT_ALIGN, end - start) != 0)
+        return -1;
+
+    memcpy(buf, cl->tail, tail_len);
+    memcpy((uint8_t *)buf + tail_len, data, len);
+    memset((uint8_t *)buf + tail_len + len, 0x00, end - cl->size - len);
+
+    if (pwrite(cl->direct_fd, buf, end - start, start) ==
+            (ssize_t)(end - start) &&
+        ftruncate(cl->direct_fd, cl->size + len) == 0) {
+        metrics_add(MET_BYTES_WRITTEN, end - start);
+        memcpy(cl->tail, (uint8_t *)buf + last - start, cl->size + len - last);
+        err = 0;
+    }
+
+    free(buf);
+
+    return err;
+}
 
 int c_log_init(Commit_Log *cl, const char *path, uint64_t base)
 {
     char path_buf[MAX_PATH_SIZE];
     snprintf(path_buf, sizeof(path_buf), "%s/c-%.20" PRIu64, path, base);
 
-    cl->fp = open_file(path_buf, "log", "w+");
+    cl->direct_fd = -1;
+    cl->tail      = NULL;
+
+    cl->fp        = open_file(path_buf, "log", "w+");
     if (!cl->fp)
         return -1;
 
+    if (c_log_direct_open(cl, path_buf) < 0)
+        return -1;
+
     cl->base_timestamp    = base;
     cl->base_ns           = 0;
     cl->current_timestamp = base;
@@ -24,62 +152,108 @@ int c_log_init(Commit_Log *cl, const char *path, uint64_t base)
 
 void c_log_set_base_ns(Commit_Log *cl, uint64_t ns) { cl->base_ns = ns; }
 
+/*
+ * Size of the frame at the head of `buf`, a block of records behind its
+ * header or a bare record, as logs were written before blocks carried a
+ * checksum, 0 if it's torn or corrupted
+ */
+static size_t c_log_frame_size(const uint8_t *buf, size_t len)
+{
+    if (len < sizeof(uint64_t))
+        return 0;
+
+    if (read_i64(buf) == RECORD_SIZE)
+        return len >= RECORD_SIZE ? RECORD_SIZE : 0;
+
+    ssize_t records_len = c_log_block_verify(buf, len);
+
+    return records_len > 0 ? C_LOG_BLOCK_HEADER_SIZE + records_len : 0;
+}
+
+/*
+ * Walk the log frame by frame up to the first torn or corrupted one, what
+ * follows can't be trusted and is truncated away
+ */
 int c_log_load(Commit_Log *cl, const char *path, uint64_t base)
 {
     char path_buf[MAX_PATH_SIZE];
     snprintf(path_buf, sizeof(path_buf), "%s/c-%.20" PRIu64, path, base);
 
-    cl->fp = open_file(path_buf, "log", "r");
+    cl->direct_fd = -1;
+    cl->tail      = NULL;
+
+    cl->fp        = open_file(path_buf, "log", "r+");
     if (!cl->fp)
         return -1;
 
-    cl->base_timestamp   = base;
+    if (c_log_direct_open(cl, path_buf) < 0)
+        return -1;
 
-    uint64_t record_size = 0;
+    cl->base_timestamp = base;
 
     Buffer buffer;
     if (buf_read_file(cl->fp, &buffer) < 0)
         return -1;
 
-    size_t size  = buffer.size;
-    uint8_t *buf = buffer.buf;
+    uint8_t *buf       = buffer.buf;
+    size_t offset      = 0, frame_size = 0;
+    uint64_t first_ts  = 0;
+    uint64_t latest_ts = base;
 
-    while (size > 0) {
-        record_size = read_i64(buf);
-        size -= record_size;
-        buf += record_size;
+    for (;;) {
+        frame_size = c_log_frame_size(buf + offset, buffer.size - offset);
+        if (frame_size == 0)
+            break;
+        size_t records = read_i64(buf + offset) == RECORD_SIZE
+                             ? offset
+                             : offset + C_LOG_BLOCK_HEADER_SIZE;
+        if (offset == 0)
+            first_ts = ts_record_timestamp(buf + records);
+        offset += frame_size;
+        latest_ts = ts_record_timestamp(buf + offset - RECORD_SIZE);
     }
 
-    uint64_t first_ts     = ts_record_timestamp(buffer.buf);
-    uint64_t latest_ts    = ts_record_timestamp(buf - record_size);
-
-    cl->size              = buffer.size;
+    cl->size              = offset;
     cl->current_timestamp = latest_ts;
     cl->base_ns           = first_ts % (uint64_t)1e9;
 
     free(buffer.buf);
 
-    return 0;
+    // Drop the pages read to load the log, the reads from now on bypass them
+    if (cl->direct_fd >= 0)
+        posix_fadvise(fileno(cl->fp), 0, 0, POSIX_FADV_DONTNEED);
+
+    if (offset < buffer.size) {
+        log_warn("Commit log %s: bad block at %zu, truncating", path_buf,
+                 offset);
+        return c_log_truncate(cl, offset);
+    }
+
+    return c_log_tail_load(cl);
 }
 
 int c_log_append_data(Commit_Log *cl, const uint8_t *data, size_t len)
 {
-    int bytes = write_at(cl->fp, data, cl->size, len);
-    if (bytes < 0) {
+    if (c_log_write(cl, data, len) < 0) {
         perror("write_at");
         return -1;
     }
 
-    cl->size += bytes;
+    cl->size += len;
     cl->current_timestamp = ts_record_timestamp(data);
 
     return 0;
 }
 
-int c_log_append_batch(Commit_Log *cl, const uint8_t *batch, size_t len)
+/*
+ * Append a batch of records as a block, the batch header, its size and last
+ * timestamp, is overwritten in place by the block header carrying the
+ * checksum of the records, they're the same size
+ */
+int c_log_append_batch(Commit_Log *cl, uint8_t *batch, size_t len)
 {
     cl->current_timestamp = ts_record_timestamp(batch);
-    size_t start_offset   = sizeof(uint64_t) * 2;
+    size_t start_offset   = C_LOG_BLOCK_HEADER_SIZE;
 
     // If not set before, set the base nanoseconds from the first timestamp of
     // the batch, which is located at the first record of the batch, after the
@@ -89,8 +263,13 @@ int c_log_append_batch(Commit_Log *cl, const uint8_t *batch, size_t len)
         cl->base_ns              = first_timestamp % (uint64_t)1e9;
     }
 
-    int n = write_at(cl->fp, batch + start_offset, cl->size, len);
-    if (n < 0) {
+    write_i64(batch, C_LOG_BLOCK_HEADER_SIZE);
+    write_u32(batch + sizeof(uint64_t), crc32c(0, batch + start_offset, len));
+    write_u32(batch + sizeof(uint64_t) + sizeof(uint32_t), len);
+
+    len += C_LOG_BLOCK_HEADER_SIZE;
+
+    if (c_log_write(cl, batch, len) < 0) {
         perror("write_at");
         return -1;
     }
@@ -100,10 +279,136 @@ int c_log_append_batch(Commit_Log *cl, const uint8_t *batch, size_t len)
     return 0;
 }
 
+/*
+ * Check the block at the head of `buf`, returns the length of its records,
+ * 0 if `buf` doesn't start with a block header, -1 if the block is torn or
+ * its checksum doesn't match
+ */
+ssize_t c_log_block_verify(const uint8_t *buf, size_t len)
+{
+    if (len < sizeof(uint64_t) || read_i64(buf) != C_LOG_BLOCK_HEADER_SIZE)
+        return 0;
+
+    if (len < C_LOG_BLOCK_HEADER_SIZE)
+        return -1;
+
+    uint32_t crc       = read_u32(buf + sizeof(uint64_t));
+    size_t records_len = read_u32(buf + sizeof(uint64_t) + sizeof(uint32_t));
+
+    if (records_len == 0 || records_len % RECORD_SIZE != 0 ||
+        records_len > len - C_LOG_BLOCK_HEADER_SIZE)
+        return -1;
+
+    if (crc32c(0, buf + C_LOG_BLOCK_HEADER_SIZE, records_len) != crc)
+        return -1;
+
+    return records_len;
+}
+
+/*
+ * Cut the log at `size`, the last record left becomes the current one
+ */
+int c_log_truncate(Commit_Log *cl, size_t size)
+{
+    uint8_t record[sizeof(uint64_t) * 2 + sizeof(double_t)];
+
+    if (ftruncate(fileno(cl->fp), size) < 0) {
+        log_error("Commit log truncate: %s", strerror(errno));
+        return -1;
+    }
+
+    cl->size = size;
+
+    if (size >= RECORD_SIZE &&
+        read_at(cl->fp, record, size - RECORD_SIZE, RECORD_SIZE) ==
+            (ssize_t)RECORD_SIZE)
+        cl->current_timestamp = ts_record_timestamp(record);
+
+    return c_log_tail_load(cl);
+}
+
+/*
+ * Read `len` bytes at `offset` in direct I/O mode, the pages spanned are read
+ * whole into an aligned buffer and the range is copied out of it
+ */
+static ssize_t c_log_read_direct(const Commit_Log *cl, uint8_t *buf,
+                                 size_t offset, size_t len)
+{
+    size_t start = align_down(offset);
+    size_t end   = align_up(offset + len);
+    void *pages  = NULL;
+
+    if (posix_memalign(&pages, C_LOG_DIRECT_ALIGN, end - start) != 0)
+        return -1;
+
+    // Short past the end of the file
+    ssize_t n = pread(cl->direct_fd, pages, end - start, start);
+    if (n >= 0) {
+        metrics_add(MET_BYTES_READ, n);
+        metrics_query_add(QS_BYTES_READ, n);
+        n = n > (ssize_t)(offset - start) ? n - (ssize_t)(offset - start) : 0;
+        n = n > (ssize_t)len ? (ssize_t)len : n;
+        memcpy(buf, (uint8_t *)pages + offset - start, n);
+    }
+
+    free(pages);
+
+    return n;
+}
+
 int c_log_read_at(const Commit_Log *cl, uint8_t **buf, size_t offset,
                   size_t len)
 {
-    return read_at(cl->fp, *buf, offset, len);
+    TRACE_BEGIN(t);
+
+    ssize_t n = cl->direct_fd < 0
+                    ? read_at(cl->fp, *buf, offset, len)
+                    : c_log_read_direct(cl, *buf, offset, len);
+
+    TRACE_END(t, TRACE_LOG_READ);
+
+    return n;
+}
+
+/*
+ * Make the blocks appended so far durable, before the WAL frames of their
+ * points can be dropped
+ */
+int c_log_sync(const Commit_Log *cl)
+{
+    uint64_t start = metrics_now();
+    int fd         = cl->direct_fd < 0 ? fileno(cl->fp) : cl->direct_fd;
+    int err        = fdatasync(fd);
+
+    metrics_record_since(MET_FSYNC, start);
+    if (err < 0)
+        log_error("Commit log sync: %s", strerror(errno));
+
+    return err;
+}
+
+/*
+ * Hint the kernel to read ahead the range a scan is about to walk through,
+ * nothing to do in direct I/O mode as the page cache is bypassed
+ */
+void c_log_prefetch(const Commit_Log *cl, size_t offset, size_t len)
+{
+    if (cl->direct_fd >= 0 || len == 0)
+        return;
+
+    posix_fadvise(fileno(cl->fp), offset, len, POSIX_FADV_WILLNEED);
+}
+
+void c_log_close(Commit_Log *cl)
+{
+    if (cl->fp)
+        fclose(cl->fp);
+    if (cl->direct_fd >= 0)
+        close(cl->direct_fd);
+    free(cl->tail);
+    cl->fp        = NULL;
+    cl->direct_fd = -1;
+    cl->tail      = NULL;
 }
 
 void c_log_print(const Commit_Log *cl)
@@ -117,6 +422,11 @@ void c_log_print(const Commit_Log *cl)
     double_t value = 0.0;
     ssize_t len    = read_file(cl->fp, buf);
     while (read < len) {
+        if (read_i64(p) == C_LOG_BLOCK_HEADER_SIZE) {
+            read += C_LOG_BLOCK_HEADER_SIZE;
+            p += C_LOG_BLOCK_HEADER_SIZE;
+            continue;
+        }
         ts    = read_i64(p + sizeof(uint64_t));
         value = read_f64(p + sizeof(uint64_t) * 2);
         read += sizeof(uint64_t) * 2 + sizeof(double_t);
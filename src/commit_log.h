@@ -4,15 +4,32 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
-
+#include <sys/types.h>
+
+// Size of the frame heading each block of records, a marker telling it apart
+// from a record, the CRC32C of the records and their length
+#define C_LOG_BLOCK_HEADER_SIZE (sizeof(uint64_t) + sizeof(uint32_t) * 2)
+// Alignment of the offsets, lengths and buffers of direct I/O
+#define C_LOG_DIRECT_ALIGN      4096
+
+/*
+ * In direct I/O mode the log is also open with O_DIRECT on `direct_fd`, all
+ * the reads and writes go through it, bypassing the page cache, `tail` keeps
+ * the last partial page of the log as writes must span whole pages. It's -1
+ * in the default buffered mode.
+ */
 typedef struct commit_log {
     FILE *fp;
+    int direct_fd;
+    uint8_t *tail;
     size_t size;
     uint64_t base_timestamp;
     uint64_t base_ns;
     uint64_t current_timestamp;
 } Commit_Log;
 
+void c_log_set_direct_io(int enabled);
+
 int c_log_init(Commit_Log *cl, const char *path, uint64_t base);
 
 int c_log_load(Commit_Log *cl, const char *path, uint64_t base);
@@ -21,11 +38,21 @@ void c_log_set_base_ns(Commit_Log *cl, uint64_t ns);
 
 int c_log_append_data(Commit_Log *cl, const uint8_t *data, size_t len);
 
-int c_log_append_batch(Commit_Log *cl, const uint8_t *batch, size_t len);
+int c_log_append_batch(Commit_Log *cl, uint8_t *batch, size_t len);
+
+ssize_t c_log_block_verify(const uint8_t *buf, size_t len);
+
+int c_log_truncate(Commit_Log *cl, size_t size);
 
 int c_log_read_at(const Commit_Log *cl, uint8_t **buf, size_t offset,
                   size_t len);
 
+int c_log_sync(const Commit_Log *cl);
+
+void c_log_prefetch(const Commit_Log *cl, size_t offset, size_t len);
+
+void c_log_close(Commit_Log *cl);
+
 void c_log_print(const Commit_Log *cl);
 
 #endif
@@ -0,0 +1,94 @@
+#include "crc32c.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define CRC32C_HW 1
+#endif
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_fn)(uint32_t, const uint8_t *, size_t);
+
+static uint64_t load_u64(const uint8_t *buf)
+{
+    uint64_t word;
+    memcpy(&word, buf, sizeof(word));
+    return word;
+}
+
+/*
+ * Slicing-by-8, each table folds a byte 8 positions further away from the
+ * end of the word, so 8 bytes are consumed per step. The word is read in
+ * host order, which needs to be little endian.
+ */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    while (len >= sizeof(uint64_t)) {
+        uint64_t word = load_u64(buf) ^ crc;
+        crc           = 0;
+        for (int k = 0; k < 8; ++k)
+            crc ^= crc32c_table[7 - k][(word >> (k * 8)) & 0xff];
+        buf += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+
+    while (len-- > 0)
+        crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#ifdef CRC32C_HW
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t crc64 = crc;
+
+    while (len >= sizeof(uint64_t)) {
+        crc64 = _mm_crc32_u64(crc64, load_u64(buf));
+        buf += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+
+    crc = (uint32_t)crc64;
+    while (len-- > 0)
+        crc = _mm_crc32_u8(crc, *buf++);
+
+    return crc;
+}
+#endif
+
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; ++j)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        for (int k = 1; k < 8; ++k) {
+            uint32_t prev      = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = crc32c_table[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+
+    crc32c_fn = crc32c_sw;
+#ifdef CRC32C_HW
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_fn = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_fn(~crc, buf, len);
+}
@@ -0,0 +1,14 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli) of `len` bytes, chained on a previous `crc`, 0 to
+ * start a new one, SSE4.2 instructions are used where the CPU supports
+ * them, a slicing-by-8 table lookup otherwise
+ */
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t len);
+
+#endif
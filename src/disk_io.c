@@ -1,5 +1,6 @@
 #include "disk_io.h"
 #include "logging.h"
+#include "metrics.h"
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -62,7 +63,7 @@ int buf_read_file(FILE *fp, Buffer *buffer)
     buffer->buf = calloc(size + 1, sizeof(uint8_t));
 
     /* Read the file into the buffer */
-    fread(buffer->buf, 1, size, fp);
+    metrics_add(MET_BYTES_READ, fread(buffer->buf, 1, size, fp));
 
     buffer->size      = size;
 
@@ -85,7 +86,7 @@ ssize_t read_file(FILE *fp, uint8_t *buf)
     rewind(fp);
 
     /* Read the file into the buffer */
-    fread(buf, 1, size, fp);
+    metrics_add(MET_BYTES_READ, fread(buf, 1, size, fp));
 
     /* NULL-terminate the buffer */
     buf[size] = '\0';
@@ -94,12 +95,20 @@ ssize_t read_file(FILE *fp, uint8_t *buf)
 
 ssize_t read_at(FILE *fp, uint8_t *buf, size_t offset, size_t len)
 {
-    int fd = fileno(fp);
-    return pread(fd, buf, len, offset);
+    int fd    = fileno(fp);
+    ssize_t n = pread(fd, buf, len, offset);
+    if (n > 0) {
+        metrics_add(MET_BYTES_READ, n);
+        metrics_query_add(QS_BYTES_READ, n);
+    }
+    return n;
 }
 
 ssize_t write_at(FILE *fp, const uint8_t *buf, size_t offset, size_t len)
 {
-    int fd = fileno(fp);
-    return pwrite(fd, buf, len, offset);
+    int fd    = fileno(fp);
+    ssize_t n = pwrite(fd, buf, len, offset);
+    if (n > 0)
+        metrics_add(MET_BYTES_WRITTEN, n);
+    return n;
 }
@@ -0,0 +1,144 @@
+#include "epoch.h"
+#include "logging.h"
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Retired pointers held by a thread before trying to reclaim them
+#define LIMBO_THRESHOLD 64
+
+/*
+ * Reader slot, each thread gets its own the first time it enters a critical
+ * section, 0 means quiescent, padded to avoid false sharing between readers
+ */
+typedef struct epoch_slot {
+    atomic_uint_fast64_t epoch;
+    char padding[64 - sizeof(atomic_uint_fast64_t)];
+} Epoch_Slot;
+
+typedef struct limbo_entry {
+    void *ptr;
+    Epoch_Release release;
+    uint64_t epoch;
+} Limbo_Entry;
+
+static Epoch_Slot slots[EPOCH_MAX_THREADS];
+static atomic_size_t slots_nr              = 0;
+static atomic_uint_fast64_t global_epoch   = 1;
+
+static _Thread_local Epoch_Slot *local     = NULL;
+static _Thread_local size_t depth          = 0;
+static _Thread_local Limbo_Entry *limbo    = NULL;
+static _Thread_local size_t limbo_size     = 0;
+static _Thread_local size_t limbo_capacity = 0;
+
+void epoch_enter(void)
+{
+    if (depth++ > 0)
+        return;
+
+    if (!local) {
+        size_t index = atomic_fetch_add(&slots_nr, 1);
+        if (index >= EPOCH_MAX_THREADS) {
+            log_error("Too many threads for epoch reclamation");
+            abort();
+        }
+        local = &slots[index];
+    }
+
+    // Sequentially consistent, the announcement must be visible before any
+    // shared pointer is read
+    atomic_store(&local->epoch, atomic_load(&global_epoch));
+}
+
+void epoch_exit(void)
+{
+    if (--depth > 0)
+        return;
+    atomic_store_explicit(&local->epoch, 0, memory_order_release);
+}
+
+/*
+ * Oldest epoch still announced by a reader, UINT64_MAX if they're all
+ * quiescent
+ */
+static uint64_t epoch_min_active(void)
+{
+    uint64_t min = UINT64_MAX, epoch = 0;
+    size_t nr    = atomic_load(&slots_nr);
+    nr           = nr > EPOCH_MAX_THREADS ? EPOCH_MAX_THREADS : nr;
+
+    for (size_t i = 0; i < nr; ++i) {
+        epoch = atomic_load(&slots[i].epoch);
+        if (epoch != 0 && epoch < min)
+            min = epoch;
+    }
+
+    return min;
+}
+
+static void epoch_reclaim(void)
+{
+    uint64_t min = epoch_min_active();
+    size_t kept  = 0;
+
+    for (size_t i = 0; i < limbo_size; ++i) {
+        // Readers that announced an epoch later than the retirement can't
+        // have seen the pointer
+        if (limbo[i].epoch < min)
+            limbo[i].release(limbo[i].ptr);
+        else
+            limbo[kept++] = limbo[i];
+    }
+
+    limbo_size = kept;
+}
+
+void epoch_retire(void *ptr) { epoch_retire_with(ptr, free); }
+
+void epoch_retire_with(void *ptr, Epoch_Release release)
+{
+    if (!ptr)
+        return;
+
+    if (limbo_size == limbo_capacity) {
+        size_t capacity = limbo_capacity == 0 ? LIMBO_THRESHOLD * 2
+                                              : limbo_capacity * 2;
+        Limbo_Entry *entries = realloc(limbo, capacity * sizeof(*entries));
+        if (!entries) {
+            // Can't defer, wait for the readers to leave instead
+            epoch_synchronize();
+            release(ptr);
+            return;
+        }
+        limbo          = entries;
+        limbo_capacity = capacity;
+    }
+
+    // The pointer is already unreachable, bumping the epoch lets readers
+    // coming after this point be told apart from those possibly holding it
+    limbo[limbo_size++] =
+        (Limbo_Entry){.ptr     = ptr,
+                      .release = release,
+                      .epoch   = atomic_fetch_add(&global_epoch, 1)};
+
+    if (limbo_size >= LIMBO_THRESHOLD)
+        epoch_reclaim();
+}
+
+void epoch_synchronize(void)
+{
+    uint64_t target = atomic_fetch_add(&global_epoch, 1) + 1;
+
+    while (epoch_min_active() < target)
+        sched_yield();
+
+    for (size_t i = 0; i < limbo_size; ++i)
+        limbo[i].release(limbo[i].ptr);
+
+    free(limbo);
+    limbo          = NULL;
+    limbo_size     = 0;
+    limbo_capacity = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stddef.h>
+
+#define EPOCH_MAX_THREADS 128
+
+/*
+ * Epoch based reclamation, readers announce the epoch they're reading in,
+ * memory unlinked by writers is retired instead of freed and released only
+ * once every reader active at the time of retirement has left.
+ *
+ * - `epoch_enter` and `epoch_exit` delimit a read side critical section, they
+ *   never block and can be nested
+ * - `epoch_retire` defers the free of a pointer no longer reachable by new
+ *   readers, it's meant to be called by the writer owning the memory
+ * - `epoch_retire_with` does the same releasing it through `release`, e.g.
+ *   to account for the memory when it's actually freed
+ * - `epoch_synchronize` waits for the current readers to leave and frees
+ *   everything the calling thread retired so far
+ */
+void epoch_enter(void);
+
+void epoch_exit(void);
+
+typedef void (*Epoch_Release)(void *ptr);
+
+void epoch_retire(void *ptr);
+
+void epoch_retire_with(void *ptr, Epoch_Release release);
+
+void epoch_synchronize(void);
+
+#endif
@@ -30,17 +30,18 @@
  * handle a very lightweight event-loop based on the most common IO
  * multiplexing implementations available on Unix-based systems:
  *
- * - Linux-based: epoll
+ * - Linux-based: epoll, io_uring (opt-in)
  * - BSD-based (osx): kqueue
  * - All around: poll, select
  *
  * By setting a pre-processor macro definition it's possible to force the use
  * of a wanted implementation.
  *
- * #define EPOLL  1   // set to use epoll
- * #define KQUEUE 1   // set to use kqueue
- * #define POLL   1   // set to use poll
- * #define SELECT 1   // set to use select
+ * #define EPOLL    1   // set to use epoll
+ * #define IO_URING 1   // set to use io_uring, linux >= 5.6, epoll otherwise
+ * #define KQUEUE   1   // set to use kqueue
+ * #define POLL     1   // set to use poll
+ * #define SELECT   1   // set to use select
  *
  * There's another 2 possible tweakable values, the number of events to monitor
  * at once, which is set to 1024 by default
@@ -66,7 +67,15 @@
 
 #ifdef __linux__
 #include <linux/version.h>
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 5, 44)
+// io_uring is opt-in, fallback to epoll if the kernel doesn't support it,
+// at build time or at runtime if the ring can't be set up
+#if defined(IO_URING) && LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+#undef IO_URING
+#endif
+#if defined(IO_URING)
+#define EPOLL             1
+#define EVENTLOOP_BACKEND "io_uring"
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 5, 44)
 #define EPOLL             1
 #define EVENTLOOP_BACKEND "epoll"
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 1, 23)
@@ -79,9 +88,11 @@
 
 #elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) ||    \
     defined(__NetBSD__)
+#undef IO_URING
 #define KQUEUE            1
 #define EVENTLOOP_BACKEND "kqueue"
 #else
+#undef IO_URING
 #define SELECT            1
 #define EVENTLOOP_BACKEND "select"
 #endif // __linux__
@@ -91,6 +102,7 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 #ifdef __linux__
@@ -158,7 +170,8 @@ typedef struct ev_ctx {
     int maxevents;
     unsigned long long fired_events;
     struct ev *events_monitored;
-    void *api; // opaque pointer to platform defined backends
+    void *api;    // opaque pointer to platform defined backends
+    int fallback; // io_uring couldn't be set up, epoll is used instead
 } ev_context;
 
 /*
@@ -174,6 +187,22 @@ struct ev {
     void (*wcallback)(ev_context *, void *); // write callback
 };
 
+/*
+ * Positional read or write on a file descriptor, to be submitted to a context
+ * through `ev_read_at` and `ev_write_at`. Once the operation completes the
+ * callback is called with the number of bytes transferred or a negative errno
+ * value in case of error.
+ * The structure must stay valid until the callback is called.
+ */
+struct ev_io {
+    int fd;
+    void *buf;
+    size_t len;
+    off_t offset;
+    void (*callback)(ev_context *, struct ev_io *, ssize_t);
+    void *data;
+};
+
 /*
  * Initialize the ev_context, accepting the number of events to monitor; that
  * value is indicative as if a FD exceeds the cap set the events array will be
@@ -254,10 +283,483 @@ int ev_register_cron(ev_context *, void (*callback)(ev_context *, void *),
 int ev_fire_event(ev_context *, int, int,
                   void (*callback)(ev_context *, void *), void *);
 
+/*
+ * Submit an asynchronous positional read, with the io_uring backend the read
+ * is carried out by the kernel and the callback is called on a later loop
+ * cycle, without blocking the loop on disk latency. Every other backend falls
+ * back to a plain pread(2), calling the callback straight away.
+ */
+int ev_read_at(ev_context *, struct ev_io *);
+
+/*
+ * Return 1 if `ev_read_at` and `ev_write_at` are carried out without blocking
+ * the loop, i.e. the io_uring backend is in use, 0 otherwise
+ */
+int ev_async_io(const ev_context *);
+
+/*
+ * Submit an asynchronous positional write, same semantic of `ev_read_at`
+ */
+int ev_write_at(ev_context *, struct ev_io *);
+
 #ifdef EV_SOURCE
 #ifndef EV_SOURCE_ONCE
 #define EV_SOURCE_ONCE
 
+/*
+ * The epoll backend is built alongside io_uring as its runtime fallback, under
+ * names of its own
+ */
+#if defined(IO_URING)
+#define EV_EPOLL(name) epoll_##name
+#else
+#define EV_EPOLL(name) name
+#endif
+
+#if defined(IO_URING)
+
+/*
+ * ============================
+ *  io_uring backend functions
+ * ============================
+ *
+ * The uring_api structure contains the ring descriptor and the memory mapped
+ * submission and completion queues, set up through the raw syscalls to avoid
+ * depending on liburing.
+ * Readiness of descriptors is monitored through IORING_OP_POLL_ADD requests,
+ * which are one-shot, so each monitored descriptor tracks its interest mask
+ * and gets re-armed at the beginning of every poll cycle, mimicking the
+ * level-triggered behaviour of epoll. Every poll request is tagged with a
+ * generation counter, completions of cancelled or superseded requests are
+ * discarded.
+ * The ring is also used to submit asynchronous reads and writes, their
+ * completion callbacks are called while reaping the completion queue.
+ *
+ * If the ring can't be set up, e.g. the syscall is filtered out in a
+ * container, the context falls back to epoll and every call is forwarded to
+ * it.
+ */
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// user_data tags, poll requests carry (generation << 32 | fd)
+#define URING_IO_TAG   (1ULL << 63)
+#define URING_NOP_TAG  (1ULL << 62)
+#define URING_GEN_MASK 0x3FFFFFFF
+
+// Linux specific, not exposed by poll.h without _GNU_SOURCE
+#ifndef POLLRDHUP
+#define POLLRDHUP 0x2000
+#endif
+
+static int epoll_ev_api_init(ev_context *, int);
+static void epoll_ev_api_destroy(ev_context *);
+static int epoll_ev_api_get_event_type(ev_context *, int);
+static int epoll_ev_api_poll(ev_context *, time_t);
+static int epoll_ev_api_watch_fd(ev_context *, int);
+static int epoll_ev_api_del_fd(ev_context *, int);
+static int epoll_ev_api_register_event(ev_context *, int, int);
+static int epoll_ev_api_fire_event(ev_context *, int, int);
+static inline struct ev *epoll_ev_api_fetch_event(const ev_context *, int,
+                                                  int);
+
+struct uring_fd {
+    int mask;
+    unsigned gen;
+    int armed;
+    int queued;
+};
+
+struct uring_event {
+    int fd;
+    int revents;
+};
+
+struct uring_api {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned to_submit;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    struct __kernel_timespec timeout;
+    int fds_nr;
+    struct uring_fd *fds;
+    int pending_nr;
+    int *pending;
+    struct uring_event *events;
+};
+
+static int uring_enter(struct uring_api *u, unsigned min_complete,
+                       unsigned flags)
+{
+    int n = 0;
+    do {
+        n = syscall(__NR_io_uring_enter, u->fd, u->to_submit, min_complete,
+                    flags, NULL, 0);
+    } while (n < 0 && errno == EINTR && min_complete == 0);
+    if (n >= 0)
+        u->to_submit -= (unsigned)n < u->to_submit ? (unsigned)n : u->to_submit;
+    return n;
+}
+
+/*
+ * Get the next free submission queue entry, submitting the pending ones to
+ * the kernel if the queue is full
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring_api *u)
+{
+    unsigned tail = *u->sq_tail;
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= u->sq_entries) {
+        if (uring_enter(u, 0, 0) < 0)
+            return NULL;
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= u->sq_entries)
+            return NULL;
+    }
+    unsigned idx             = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0x00, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+    return sqe;
+}
+
+static int uring_fd_reserve(struct uring_api *u, int fd)
+{
+    if (fd < u->fds_nr)
+        return EV_OK;
+    int fds_nr = u->fds_nr;
+    while (fds_nr <= fd)
+        fds_nr *= 2;
+    struct uring_fd *fds = realloc(u->fds, fds_nr * sizeof(*fds));
+    if (!fds)
+        return EV_OOM;
+    int *pending = realloc(u->pending, fds_nr * sizeof(*pending));
+    if (!pending) {
+        u->fds = fds;
+        return EV_OOM;
+    }
+    memset(fds + u->fds_nr, 0x00, (fds_nr - u->fds_nr) * sizeof(*fds));
+    u->fds     = fds;
+    u->pending = pending;
+    u->fds_nr  = fds_nr;
+    return EV_OK;
+}
+
+// Schedule a descriptor to be (re-)armed on the next poll cycle
+static void uring_queue_fd(struct uring_api *u, int fd)
+{
+    if (u->fds[fd].queued)
+        return;
+    u->fds[fd].queued           = 1;
+    u->pending[u->pending_nr++] = fd;
+}
+
+static int uring_poll_add(struct uring_api *u, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (!sqe)
+        return EV_ERR;
+    struct uring_fd *f = &u->fds[fd];
+    f->gen             = (f->gen + 1) & URING_GEN_MASK;
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = fd;
+    sqe->poll_events   = POLLRDHUP;
+    if (f->mask & EV_READ)
+        sqe->poll_events |= POLLIN;
+    if (f->mask & EV_WRITE)
+        sqe->poll_events |= POLLOUT;
+    sqe->user_data = ((unsigned long long)f->gen << 32) | (unsigned)fd;
+    f->armed       = 1;
+    return EV_OK;
+}
+
+static int uring_poll_remove(struct uring_api *u, int fd)
+{
+    struct uring_fd *f = &u->fds[fd];
+    if (!f->armed)
+        return EV_OK;
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (!sqe)
+        return EV_ERR;
+    sqe->opcode    = IORING_OP_POLL_REMOVE;
+    sqe->fd        = -1;
+    sqe->addr      = ((unsigned long long)f->gen << 32) | (unsigned)fd;
+    sqe->user_data = URING_NOP_TAG;
+    f->armed       = 0;
+    return EV_OK;
+}
+
+// Update the interest mask of a descriptor, re-arming it if changed
+static int uring_set_mask(struct uring_api *u, int fd, int mask)
+{
+    if (uring_fd_reserve(u, fd) < 0)
+        return EV_OOM;
+    struct uring_fd *f = &u->fds[fd];
+    if (f->armed && f->mask != mask && uring_poll_remove(u, fd) < 0)
+        return EV_ERR;
+    f->mask = mask;
+    if (!f->armed && mask != EV_NONE)
+        uring_queue_fd(u, fd);
+    return EV_OK;
+}
+
+static int ev_api_init(ev_context *ctx, int events_nr)
+{
+    struct io_uring_params params;
+    struct uring_api *u = calloc(1, sizeof(*u));
+    if (!u)
+        return EV_OOM;
+
+    ctx->fallback = 0;
+
+    memset(&params, 0x00, sizeof(params));
+    u->fd = syscall(__NR_io_uring_setup, events_nr, &params);
+    if (u->fd < 0)
+        goto err;
+
+    u->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = params.cq_off.cqes +
+                      params.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto err;
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED)
+        goto err;
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto err;
+
+    u->sq_head    = (unsigned *)((char *)u->sq_ring + params.sq_off.head);
+    u->sq_tail    = (unsigned *)((char *)u->sq_ring + params.sq_off.tail);
+    u->sq_mask    = (unsigned *)((char *)u->sq_ring + params.sq_off.ring_mask);
+    u->sq_array   = (unsigned *)((char *)u->sq_ring + params.sq_off.array);
+    u->sq_entries = params.sq_entries;
+    u->cq_head    = (unsigned *)((char *)u->cq_ring + params.cq_off.head);
+    u->cq_tail    = (unsigned *)((char *)u->cq_ring + params.cq_off.tail);
+    u->cq_mask    = (unsigned *)((char *)u->cq_ring + params.cq_off.ring_mask);
+    u->cqes =
+        (struct io_uring_cqe *)((char *)u->cq_ring + params.cq_off.cqes);
+
+    u->fds_nr  = events_nr;
+    u->fds     = calloc(events_nr, sizeof(*u->fds));
+    u->pending = calloc(events_nr, sizeof(*u->pending));
+    u->events  = calloc(events_nr, sizeof(*u->events));
+    if (!u->fds || !u->pending || !u->events)
+        goto err;
+
+    ctx->api   = u;
+    ctx->maxfd = events_nr;
+    return EV_OK;
+
+err:
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring && u->cq_ring != MAP_FAILED)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd >= 0)
+        close(u->fd);
+    free(u->fds);
+    free(u->pending);
+    free(u->events);
+    free(u);
+    ctx->fallback = 1;
+    return epoll_ev_api_init(ctx, events_nr);
+}
+
+static void ev_api_destroy(ev_context *ctx)
+{
+    if (ctx->fallback) {
+        epoll_ev_api_destroy(ctx);
+        return;
+    }
+    struct uring_api *u = ctx->api;
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->cq_ring, u->cq_ring_size);
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+    free(u->fds);
+    free(u->pending);
+    free(u->events);
+    free(u);
+}
+
+static int ev_api_get_event_type(ev_context *ctx, int idx)
+{
+    if (ctx->fallback)
+        return epoll_ev_api_get_event_type(ctx, idx);
+    struct uring_api *u = ctx->api;
+    int fd              = u->events[idx].fd;
+    int revents         = u->events[idx].revents;
+    int ev_mask         = ctx->events_monitored[fd].mask;
+    // We want to remember the previous events only if they're not of type
+    // CLOSE or TIMER
+    int mask = ev_mask & (EV_CLOSEFD | EV_TIMERFD) ? ev_mask : EV_NONE;
+    if (revents < 0 || revents & (POLLERR | POLLHUP | POLLRDHUP))
+        mask |= EV_DISCONNECT;
+    if (revents > 0 && revents & POLLIN)
+        mask |= EV_READ;
+    if (revents > 0 && revents & POLLOUT)
+        mask |= EV_WRITE;
+    return mask;
+}
+
+/*
+ * Arm the pending descriptors, submit everything queued and wait for at
+ * least a completion, reaping the completion queue: readiness notifications
+ * are stored in the events array, asynchronous IO completions are dispatched
+ * to their callbacks straight away.
+ */
+static int ev_api_poll(ev_context *ctx, time_t timeout)
+{
+    if (ctx->fallback)
+        return epoll_ev_api_poll(ctx, timeout);
+    struct uring_api *u = ctx->api;
+    int n               = 0;
+
+    for (int i = 0; i < u->pending_nr; ++i) {
+        int fd            = u->pending[i];
+        u->fds[fd].queued = 0;
+        if (!u->fds[fd].armed && u->fds[fd].mask != EV_NONE &&
+            uring_poll_add(u, fd) < 0)
+            return EV_ERR;
+    }
+    u->pending_nr = 0;
+
+    if (timeout > 0) {
+        struct io_uring_sqe *sqe = uring_get_sqe(u);
+        if (!sqe)
+            return EV_ERR;
+        u->timeout.tv_sec  = timeout / 1000;
+        u->timeout.tv_nsec = (timeout % 1000) * 1000000;
+        sqe->opcode        = IORING_OP_TIMEOUT;
+        sqe->fd            = -1;
+        sqe->addr          = (unsigned long)&u->timeout;
+        sqe->len           = 1;
+        sqe->user_data     = URING_NOP_TAG;
+    }
+
+    if (uring_enter(u, timeout == 0 ? 0 : 1, IORING_ENTER_GETEVENTS) < 0)
+        return EV_ERR;
+
+    unsigned head = *u->cq_head;
+    while (n < ctx->events_nr &&
+           head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        unsigned long long data  = cqe->user_data;
+        int res                  = cqe->res;
+        __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+
+        if (data & URING_IO_TAG) {
+            struct ev_io *io =
+                (struct ev_io *)(uintptr_t)(data & ~URING_IO_TAG);
+            io->callback(ctx, io, res);
+        } else if (!(data & URING_NOP_TAG)) {
+            int fd       = data & 0xFFFFFFFF;
+            unsigned gen = (data >> 32) & URING_GEN_MASK;
+            // Stale completion of a removed or superseded poll request
+            if (fd >= u->fds_nr || !u->fds[fd].armed || u->fds[fd].gen != gen)
+                continue;
+            u->fds[fd].armed     = 0;
+            u->events[n].fd      = fd;
+            u->events[n].revents = res;
+            n++;
+            // Level-triggered, re-arm the next cycle unless changed
+            uring_queue_fd(u, fd);
+        }
+        head = *u->cq_head;
+    }
+
+    return n;
+}
+
+static int ev_api_watch_fd(ev_context *ctx, int fd)
+{
+    if (ctx->fallback)
+        return epoll_ev_api_watch_fd(ctx, fd);
+    return uring_set_mask(ctx->api, fd, EV_READ);
+}
+
+static int ev_api_del_fd(ev_context *ctx, int fd)
+{
+    if (ctx->fallback)
+        return epoll_ev_api_del_fd(ctx, fd);
+    struct uring_api *u = ctx->api;
+    if (fd >= u->fds_nr)
+        return EV_OK;
+    u->fds[fd].mask = EV_NONE;
+    return uring_poll_remove(u, fd);
+}
+
+static int ev_api_register_event(ev_context *ctx, int fd, int mask)
+{
+    if (ctx->fallback)
+        return epoll_ev_api_register_event(ctx, fd, mask);
+    return uring_set_mask(ctx->api, fd, mask & (EV_READ | EV_WRITE));
+}
+
+static int ev_api_fire_event(ev_context *ctx, int fd, int mask)
+{
+    if (ctx->fallback)
+        return epoll_ev_api_fire_event(ctx, fd, mask);
+    return uring_set_mask(ctx->api, fd, mask & (EV_READ | EV_WRITE));
+}
+
+static int ev_api_submit_io(ev_context *ctx, struct ev_io *io, int opcode)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ctx->api);
+    if (!sqe)
+        return EV_ERR;
+    sqe->opcode    = opcode;
+    sqe->fd        = io->fd;
+    sqe->addr      = (unsigned long)io->buf;
+    sqe->len       = io->len;
+    sqe->off       = io->offset;
+    sqe->user_data = (unsigned long long)(uintptr_t)io | URING_IO_TAG;
+    return EV_OK;
+}
+
+/*
+ * Get the event on the idx position inside the events map. The event can also
+ * be an unset one (EV_NONE)
+ */
+static inline struct ev *ev_api_fetch_event(const ev_context *ctx, int idx,
+                                            int mask)
+{
+    if (ctx->fallback)
+        return epoll_ev_api_fetch_event(ctx, idx, mask);
+    int fd = ((struct uring_api *)ctx->api)->events[idx].fd;
+    return ctx->events_monitored + fd;
+}
+
+#endif // IO_URING
+
 #if defined(EPOLL)
 
 /*
@@ -321,7 +823,7 @@ static int epoll_del(int efd, int fd)
     return epoll_ctl(efd, EPOLL_CTL_DEL, fd, NULL);
 }
 
-static int ev_api_init(ev_context *ctx, int events_nr)
+static int EV_EPOLL(ev_api_init)(ev_context *ctx, int events_nr)
 {
     struct epoll_api *e_api = malloc(sizeof(*e_api));
     if (!e_api)
@@ -333,14 +835,14 @@ static int ev_api_init(ev_context *ctx, int events_nr)
     return EV_OK;
 }
 
-static void ev_api_destroy(ev_context *ctx)
+static void EV_EPOLL(ev_api_destroy)(ev_context *ctx)
 {
     close(((struct epoll_api *)ctx->api)->fd);
     free(((struct epoll_api *)ctx->api)->events);
     free(ctx->api);
 }
 
-static int ev_api_get_event_type(ev_context *ctx, int idx)
+static int EV_EPOLL(ev_api_get_event_type)(ev_context *ctx, int idx)
 {
     struct epoll_api *e_api = ctx->api;
     int events              = e_api->events[idx].events;
@@ -357,25 +859,26 @@ static int ev_api_get_event_type(ev_context *ctx, int idx)
     return mask;
 }
 
-static int ev_api_poll(ev_context *ctx, time_t timeout)
+static int EV_EPOLL(ev_api_poll)(ev_context *ctx, time_t timeout)
 {
     struct epoll_api *e_api = ctx->api;
     return epoll_wait(e_api->fd, e_api->events, ctx->events_nr, timeout);
 }
 
-static int ev_api_watch_fd(ev_context *ctx, int fd)
+static int EV_EPOLL(ev_api_watch_fd)(ev_context *ctx, int fd)
 {
     struct epoll_api *e_api = ctx->api;
     return epoll_add(e_api->fd, fd, EPOLLIN, NULL);
 }
 
-static int ev_api_del_fd(ev_context *ctx, int fd)
+static int EV_EPOLL(ev_api_del_fd)(ev_context *ctx, int fd)
 {
     struct epoll_api *e_api = ctx->api;
     return epoll_del(e_api->fd, fd);
 }
 
-static int ev_api_register_event(ev_context *ctx, int fd, int mask)
+static int EV_EPOLL(ev_api_register_event)(ev_context *ctx, int fd,
+                                           int mask)
 {
     struct epoll_api *e_api = ctx->api;
     int op                  = 0;
@@ -386,7 +889,7 @@ static int ev_api_register_event(ev_context *ctx, int fd, int mask)
     return epoll_add(e_api->fd, fd, op, NULL);
 }
 
-static int ev_api_fire_event(ev_context *ctx, int fd, int mask)
+static int EV_EPOLL(ev_api_fire_event)(ev_context *ctx, int fd, int mask)
 {
     struct epoll_api *e_api = ctx->api;
     int op                  = 0;
@@ -403,8 +906,8 @@ static int ev_api_fire_event(ev_context *ctx, int fd, int mask)
  * Get the event on the idx position inside the events map. The event can also
  * be an unset one (EV_NONE)
  */
-static inline struct ev *ev_api_fetch_event(const ev_context *ctx, int idx,
-                                            int mask)
+static inline struct ev *EV_EPOLL(ev_api_fetch_event)(const ev_context *ctx,
+                                                      int idx, int mask)
 {
     (void)mask; // silence the compiler warning
     int fd = ((struct epoll_api *)ctx->api)->events[idx].data.fd;
@@ -1199,6 +1702,47 @@ int ev_fire_event(ev_context *ctx, int fd, int mask,
     return EV_OK;
 }
 
+/*
+ * Submit an asynchronous positional read, with the io_uring backend the read
+ * is carried out by the kernel and the callback is called on a later loop
+ * cycle, every other backend, or io_uring fallen back to epoll, does a
+ * blocking pread(2) instead.
+ */
+int ev_read_at(ev_context *ctx, struct ev_io *io)
+{
+#if defined(IO_URING)
+    if (!ctx->fallback)
+        return ev_api_submit_io(ctx, io, IORING_OP_READ);
+#endif
+    ssize_t n = pread(io->fd, io->buf, io->len, io->offset);
+    io->callback(ctx, io, n < 0 ? -errno : n);
+    return EV_OK;
+}
+
+int ev_async_io(const ev_context *ctx)
+{
+#if defined(IO_URING)
+    return !ctx->fallback;
+#else
+    (void)ctx;
+    return 0;
+#endif
+}
+
+/*
+ * Submit an asynchronous positional write, same semantic of `ev_read_at`
+ */
+int ev_write_at(ev_context *ctx, struct ev_io *io)
+{
+#if defined(IO_URING)
+    if (!ctx->fallback)
+        return ev_api_submit_io(ctx, io, IORING_OP_WRITE);
+#endif
+    ssize_t n = pwrite(io->fd, io->buf, io->len, io->offset);
+    io->callback(ctx, io, n < 0 ? -errno : n);
+    return EV_OK;
+}
+
 #endif // EV_SOURCE_ONCE
 #endif // EV_SOURCE
 
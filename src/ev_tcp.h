@@ -30,7 +30,9 @@
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #ifdef HAVE_OPENSSL
 #include <openssl/err.h>
@@ -77,6 +79,14 @@
  */
 #define EV_TCP_BUFSIZE          2048
 
+/*
+ * Maximum number of buffers handed to a single writev call, IOV_MAX is not
+ * exposed by every libc without _XOPEN_SOURCE, POSIX grants at least 16
+ */
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
 typedef struct ev_buf ev_buf;
 typedef struct ev_connection ev_connection;
 typedef struct ev_tcp_server ev_tcp_server;
@@ -121,6 +131,21 @@ struct ev_buf {
     char *buf;
 };
 
+/*
+ * Scatter/gather list of buffers to be written out with a single writev call,
+ * the buffers are not copied, they're owned by the caller which is notified
+ * through the `release` callback once the write has completed (or the
+ * connection has been closed), with `release_data` as argument.
+ * `index` tracks the first iovec not yet completely written.
+ */
+struct ev_iov {
+    struct iovec *iov;
+    int iovcnt;
+    int index;
+    void (*release)(void *);
+    void *release_data;
+};
+
 /*
  * Connection abstraction, as of now it's pretty self-explanatory, it is
  * composed of the file descriptor for socket and 3 main callbacks:
@@ -194,6 +219,7 @@ struct ev_tcp_handle {
 #endif
     ev_connection *c;
     ev_buf buffer;
+    struct ev_iov iov;
     ev_context *ctx;
 };
 
@@ -284,6 +310,16 @@ int ev_tcp_queue_read(ev_tcp_handle *);
  */
 int ev_tcp_queue_write(ev_tcp_handle *);
 
+/*
+ * Fires a EV_WRITE event to write out a list of buffers referenced by an
+ * array of iovec, avoiding to copy them into the handle buffer. The buffers
+ * must stay valid until the release callback is called, at the completion of
+ * the write or at the close of the connection, see `struct ev_iov`. If the
+ * event can't be fired the buffers are left to the caller
+ */
+int ev_tcp_queue_writev(ev_tcp_handle *, struct iovec *, int,
+                        void (*)(void *), void *);
+
 /*
  * Fires an EV_WRITE event using a service private function to schedule the
  * closing of a connection
@@ -430,8 +466,10 @@ static void ev_on_send(ev_context *ctx, void *data)
      * for a write on the next loop cycle, hopefully the kernel will be
      * available to send the remaining data
      */
-    if (handle->buffer.size > 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-        ev_tcp_queue_write(handle);
+    if ((handle->buffer.size > 0 || handle->iov.iovcnt > 0) &&
+        (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        ev_fire_event(handle->ctx, handle->c->fd, EV_WRITE, ev_on_send,
+                      handle);
     } else {
         if (handle->c->on_send)
             handle->c->on_send(handle);
@@ -553,6 +591,17 @@ static void ev_buf_zero(ev_buf *dst)
     dst->size = 0;
 }
 
+/*
+ * Notify the owner of the buffers referenced by the iovec list that they're
+ * not used anymore and reset the list
+ */
+static void ev_iov_release(struct ev_iov *iov)
+{
+    if (iov->release)
+        iov->release(iov->release_data);
+    memset(iov, 0x00, sizeof(*iov));
+}
+
 /*
  * init a fresh new tcp_handle which can be used as a server or a client
  */
@@ -562,6 +611,7 @@ static int ev_tcp_handle_init(ev_tcp_handle *handle, int fd)
     if (!handle->c)
         return EV_TCP_OUT_OF_MEMORY;
     ev_buf_init(&handle->buffer, EV_TCP_BUFSIZE);
+    memset(&handle->iov, 0x00, sizeof(handle->iov));
     handle->to_read = handle->to_write = 0;
     return EV_TCP_SUCCESS;
 }
@@ -699,6 +749,7 @@ static int ev_tls_tcp_handle_init(ev_tcp_handle *handle, int fd, SSL *ssl)
     if (!handle->c)
         return EV_TCP_OUT_OF_MEMORY;
     ev_buf_init(&handle->buffer, EV_TCP_BUFSIZE);
+    memset(&handle->iov, 0x00, sizeof(handle->iov));
     handle->ssl     = 1;
     handle->to_read = handle->to_write = 0;
     return EV_TCP_SUCCESS;
@@ -875,11 +926,16 @@ int ev_tcp_server_accept(ev_tcp_handle *server, ev_tcp_handle *client,
 {
     if (!on_data)
         return EV_TCP_MISSING_CALLBACK;
+    /*
+     * A single connection per call as there's a single handle to init, the
+     * listening socket is level-triggered so the loop wakes up again for the
+     * connections still pending
+     */
     while (1) {
         struct sockaddr_in addr;
         int fd = ev_accept(server->c->fd, &addr);
         if (fd < 0)
-            break;
+            return EV_TCP_FAILURE;
         if (fd == 0)
             continue;
 
@@ -908,6 +964,7 @@ int ev_tcp_server_accept(ev_tcp_handle *server, ev_tcp_handle *client,
 
         client->c->on_recv = on_data;
         client->c->on_send = on_send;
+        break;
     }
     return EV_TCP_SUCCESS;
 }
@@ -949,6 +1006,29 @@ int ev_tcp_queue_write(ev_tcp_handle *client)
     return EV_TCP_SUCCESS;
 }
 
+int ev_tcp_queue_writev(ev_tcp_handle *client, struct iovec *iov, int iovcnt,
+                        void (*release)(void *), void *release_data)
+{
+    if (!client->c->on_send)
+        return EV_TCP_MISSING_CALLBACK;
+    client->iov = (struct ev_iov){.iov          = iov,
+                                  .iovcnt       = iovcnt,
+                                  .index        = 0,
+                                  .release      = release,
+                                  .release_data = release_data};
+    client->to_write = client->buffer.size;
+    for (int i = 0; i < iovcnt; ++i)
+        client->to_write += iov[i].iov_len;
+    int err =
+        ev_fire_event(client->ctx, client->c->fd, EV_WRITE, ev_on_send, client);
+    if (err < 0) {
+        memset(&client->iov, 0x00, sizeof(client->iov));
+        return EV_TCP_FAILURE;
+    }
+
+    return EV_TCP_SUCCESS;
+}
+
 int ev_tcp_queue_read(ev_tcp_handle *client)
 {
     if (!client->c->on_recv)
@@ -1054,6 +1134,47 @@ ssize_t ev_tcp_read(ev_tcp_handle *client)
 #endif
 }
 
+/*
+ * Write out the iovec list set on the handle, advancing the list on partial
+ * writes, buffers are released as soon as the last byte has been sent out
+ */
+static ssize_t ev_tcp_writev(ev_tcp_handle *client)
+{
+    struct ev_iov *iov = &client->iov;
+    ssize_t n = 0, wrote = 0;
+
+    while (iov->index < iov->iovcnt) {
+        int count = iov->iovcnt - iov->index;
+        n = writev(client->c->fd, iov->iov + iov->index,
+                   count > IOV_MAX ? IOV_MAX : count);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            else
+                return n;
+        }
+        wrote += n;
+        // Skip the fully written (or empty) iovecs and move forward the
+        // partial one
+        while (iov->index < iov->iovcnt) {
+            struct iovec *v = &iov->iov[iov->index];
+            if ((size_t)n >= v->iov_len) {
+                n -= v->iov_len;
+                iov->index++;
+            } else {
+                v->iov_base = (char *)v->iov_base + n;
+                v->iov_len -= n;
+                break;
+            }
+        }
+    }
+
+    if (iov->index == iov->iovcnt)
+        ev_iov_release(iov);
+
+    return wrote;
+}
+
 ssize_t ev_tcp_write(ev_tcp_handle *client)
 {
 #ifdef HAVE_OPENSSL
@@ -1068,8 +1189,14 @@ ssize_t ev_tcp_write(ev_tcp_handle *client)
             if ((n = SSL_write(ssl, client->buffer.buf + n,
                                client->buffer.size)) <= 0) {
                 int err = SSL_get_error(ssl, n);
-                if (err == SSL_ERROR_WANT_WRITE || SSL_ERROR_NONE)
-                    continue;
+                /*
+                 * Socket buffer full, the caller re-arms for a write on the
+                 * next loop cycle as for EAGAIN on the plain path
+                 */
+                if (err == SSL_ERROR_WANT_WRITE) {
+                    errno = EAGAIN;
+                    break;
+                }
                 if (err == SSL_ERROR_ZERO_RETURN ||
                     (err == SSL_ERROR_SYSCALL && !errno))
                     return EV_TCP_SUCCESS; // Connection closed
@@ -1081,6 +1208,29 @@ ssize_t ev_tcp_write(ev_tcp_handle *client)
             client->buffer.size -= n;
         }
 
+        /* Referenced buffers are encrypted and sent out one by one */
+        struct ev_iov *iov = &client->iov;
+        while (client->buffer.size == 0 && iov->index < iov->iovcnt) {
+            struct iovec *v = &iov->iov[iov->index];
+            if ((n = SSL_write(ssl, v->iov_base, v->iov_len)) <= 0) {
+                int err = SSL_get_error(ssl, n);
+                if (err == SSL_ERROR_WANT_WRITE) {
+                    errno = EAGAIN;
+                    break;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                goto err;
+            }
+            total += n;
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+            if (v->iov_len == 0)
+                iov->index++;
+        }
+        if (iov->iovcnt > 0 && iov->index == iov->iovcnt)
+            ev_iov_release(iov);
+
         return total - client->buffer.size;
 
     err:
@@ -1107,6 +1257,14 @@ ssize_t ev_tcp_write(ev_tcp_handle *client)
             wrote += n;
         }
 
+        /* Then the list of referenced buffers, if any */
+        if (client->buffer.size == 0 && client->iov.iovcnt > 0) {
+            n = ev_tcp_writev(client);
+            if (n < 0)
+                return n;
+            wrote += n;
+        }
+
         return wrote;
 #ifdef HAVE_OPENSSL
     }
@@ -1126,6 +1284,8 @@ void ev_tcp_close_handle(ev_tcp_handle *handle)
         ssl = ((ev_tls_connection *)handle->c)->ssl;
 #endif
     handle->err = handle->err > 0 ? EV_TCP_SUCCESS : handle->err;
+    if (handle->iov.iovcnt > 0)
+        ev_iov_release(&handle->iov);
     if (handle->c->on_close)
         handle->c->on_close(handle, handle->err);
 #ifdef HAVE_OPENSSL
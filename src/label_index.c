@@ -0,0 +1,373 @@
+#include "label_index.h"
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LABEL_INDEX_BASE_BUCKETS 64
+#define POSTINGS_BASE_CAPACITY   16
+// Max bytes of a varint encoded 64 bit integer
+#define VARINT_MAX_SIZE          10
+
+static uint64_t label_hash(const char *label)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *p = label; *p; ++p) {
+        hash ^= (uint8_t)*p;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static size_t varint_write(uint8_t *buf, uint64_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (uint8_t)value;
+    return n;
+}
+
+static size_t varint_read(const uint8_t *buf, uint64_t *value)
+{
+    size_t n   = 0;
+    int shift  = 0;
+    uint64_t v = 0;
+    do {
+        v |= (uint64_t)(buf[n] & 0x7f) << shift;
+        shift += 7;
+    } while (buf[n++] & 0x80);
+    *value = v;
+    return n;
+}
+
+static int postings_append(Postings *p, uint64_t id)
+{
+    if (p->size + VARINT_MAX_SIZE > p->capacity) {
+        size_t capacity =
+            p->capacity == 0 ? POSTINGS_BASE_CAPACITY : p->capacity * 2;
+        uint8_t *data = realloc(p->data, capacity);
+        if (!data)
+            return -1;
+        p->data     = data;
+        p->capacity = capacity;
+    }
+
+    p->size += varint_write(p->data + p->size, id - p->last);
+    p->last = id;
+    p->count++;
+
+    return 0;
+}
+
+static int postings_decode(const Postings *p, Series_Ids *ids)
+{
+    uint64_t id = 0, delta = 0;
+    for (size_t n = 0; n < p->size;) {
+        n += varint_read(p->data + n, &delta);
+        id += delta;
+        vec_push(*ids, id);
+    }
+    return 0;
+}
+
+/*
+ * Ids are expected in increasing order, an older id, e.g. while rebuilding
+ * the index from an unordered source, re-encodes the whole list
+ */
+static int postings_add(Postings *p, uint64_t id)
+{
+    if (p->count == 0 || id > p->last)
+        return postings_append(p, id);
+
+    Series_Ids ids;
+    size_t i = 0;
+    int err  = 0;
+
+    vec_new(ids);
+    postings_decode(p, &ids);
+
+    free(p->data);
+    *p = (Postings){0};
+
+    for (; i < vec_size(ids) && vec_at(ids, i) < id; ++i)
+        err |= postings_append(p, vec_at(ids, i));
+    if (i == vec_size(ids) || vec_at(ids, i) != id)
+        err |= postings_append(p, id);
+    for (; i < vec_size(ids); ++i)
+        err |= postings_append(p, vec_at(ids, i));
+
+    vec_destroy(ids);
+
+    return err;
+}
+
+static Label_Postings *label_index_lookup(const Label_Index *li,
+                                          const char *label)
+{
+    Label_Postings *lp = li->buckets[label_hash(label) % li->capacity];
+    while (lp && strcmp(lp->label, label) != 0)
+        lp = lp->next;
+    return lp;
+}
+
+static int label_index_grow(Label_Index *li)
+{
+    size_t capacity          = li->capacity * 2;
+    Label_Postings **buckets = calloc(capacity, sizeof(*buckets));
+    Label_Postings *lp       = NULL, *next = NULL;
+    if (!buckets)
+        return -1;
+
+    for (size_t i = 0; i < li->capacity; ++i) {
+        for (lp = li->buckets[i]; lp; lp = next) {
+            size_t bucket   = label_hash(lp->label) % capacity;
+            next            = lp->next;
+            lp->next        = buckets[bucket];
+            buckets[bucket] = lp;
+        }
+    }
+
+    free(li->buckets);
+    li->buckets  = buckets;
+    li->capacity = capacity;
+
+    return 0;
+}
+
+int label_index_init(Label_Index *li)
+{
+    li->size     = 0;
+    li->capacity = LABEL_INDEX_BASE_BUCKETS;
+    li->buckets  = calloc(li->capacity, sizeof(*li->buckets));
+    return li->buckets ? 0 : -1;
+}
+
+void label_index_destroy(Label_Index *li)
+{
+    Label_Postings *lp = NULL, *next = NULL;
+    for (size_t i = 0; li->buckets && i < li->capacity; ++i) {
+        for (lp = li->buckets[i]; lp; lp = next) {
+            next = lp->next;
+            free(lp->postings.data);
+            free(lp->label);
+            free(lp);
+        }
+    }
+    free(li->buckets);
+    li->buckets = NULL;
+    li->size    = 0;
+}
+
+/*
+ * Add the series `id` to the postings of `label`, formatted as `name=value`
+ */
+int label_index_add(Label_Index *li, const char *label, uint64_t id)
+{
+    const char *eq     = strchr(label, '=');
+    Label_Postings *lp = NULL;
+
+    if (!eq)
+        return -1;
+
+    lp = label_index_lookup(li, label);
+    if (lp)
+        return postings_add(&lp->postings, id);
+
+    if ((li->size + 1) * 4 > li->capacity * 3 && label_index_grow(li) < 0)
+        return -1;
+
+    lp = calloc(1, sizeof(*lp));
+    if (!lp)
+        return -1;
+
+    lp->label = strdup(label);
+    if (!lp->label || postings_append(&lp->postings, id) < 0) {
+        free(lp->label);
+        free(lp);
+        return -1;
+    }
+
+    lp->name_len        = eq - label;
+    size_t bucket       = label_hash(label) % li->capacity;
+    lp->next            = li->buckets[bucket];
+    li->buckets[bucket] = lp;
+    li->size++;
+
+    return 0;
+}
+
+/*
+ * Exponential search of the first position in [lo, size) holding an id not
+ * lower than `target`
+ */
+static size_t gallop(const uint64_t *ids, size_t lo, size_t size,
+                     uint64_t target)
+{
+    size_t step = 1, hi = lo;
+
+    while (hi < size && ids[hi] < target) {
+        lo = hi + 1;
+        hi += step;
+        step <<= 1;
+    }
+
+    if (hi > size)
+        hi = size;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ids[mid] < target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/*
+ * Intersect two sorted lists into `a`, the shorter one drives the search
+ * galloping over the longer, cheap when their sizes are far apart, as it's
+ * common for a selective label against a broad one
+ */
+static void ids_intersect(Series_Ids *a, const Series_Ids *b)
+{
+    const Series_Ids *small = vec_size(*a) <= vec_size(*b) ? a : b;
+    const Series_Ids *large = small == a ? b : a;
+    size_t pos = 0, n = 0;
+
+    for (size_t i = 0; i < vec_size(*small); ++i) {
+        uint64_t id = vec_at(*small, i);
+        pos         = gallop(large->data, pos, vec_size(*large), id);
+        if (pos == vec_size(*large))
+            break;
+        if (vec_at(*large, pos) == id)
+            a->data[n++] = id;
+    }
+
+    vec_size(*a) = n;
+}
+
+/*
+ * Merge a sorted list into the sorted `dst`, without duplicates
+ */
+static int ids_union(Series_Ids *dst, const Series_Ids *src)
+{
+    Series_Ids merged;
+    size_t i = 0, j = 0;
+
+    vec_init(merged, vec_size(*dst) + vec_size(*src) + 1);
+    if (!merged.data)
+        return -1;
+
+    while (i < vec_size(*dst) || j < vec_size(*src)) {
+        if (j == vec_size(*src) ||
+            (i < vec_size(*dst) && vec_at(*dst, i) < vec_at(*src, j))) {
+            vec_push(merged, vec_at(*dst, i++));
+        } else if (i == vec_size(*dst) || vec_at(*src, j) < vec_at(*dst, i)) {
+            vec_push(merged, vec_at(*src, j++));
+        } else {
+            vec_push(merged, vec_at(*dst, i++));
+            j++;
+        }
+    }
+
+    vec_destroy(*dst);
+    *dst = merged;
+
+    return 0;
+}
+
+/*
+ * Collect the ids of the series carrying `name` with a value matching the
+ * glob `pattern`, the union of the postings of every matching label
+ */
+static int label_index_match(const Label_Index *li, const Label *matcher,
+                             Series_Ids *ids)
+{
+    const Label_Postings *lp = NULL;
+    size_t name_len          = strlen(matcher->name);
+    Series_Ids postings;
+    int err = 0;
+
+    vec_new(postings);
+
+    for (size_t i = 0; i < li->capacity && err == 0; ++i) {
+        for (lp = li->buckets[i]; lp && err == 0; lp = lp->next) {
+            if (lp->name_len != name_len ||
+                strncmp(lp->label, matcher->name, name_len) != 0 ||
+                fnmatch(matcher->value, lp->label + name_len + 1, 0) != 0)
+                continue;
+            vec_size(postings) = 0;
+            postings_decode(&lp->postings, &postings);
+            err = ids_union(ids, &postings);
+        }
+    }
+
+    vec_destroy(postings);
+
+    return err;
+}
+
+static int label_is_pattern(const Label *matcher)
+{
+    return strpbrk(matcher->value, "*?[") != NULL;
+}
+
+/*
+ * Collect the sorted ids of the series carrying all the labels matched,
+ * exact labels are resolved first, they're the cheapest to look up and
+ * narrow down the result before the patterns are expanded.
+ *
+ * Returns the number of series selected, -1 on error
+ */
+int label_index_select(const Label_Index *li, const Label *matchers,
+                       size_t matcher_nr, Series_Ids *ids)
+{
+    char label[LABEL_MAX_LENGTH * 2];
+    const Label_Postings *lp = NULL;
+    Series_Ids postings;
+    int first = 1, err = 0;
+
+    vec_new(postings);
+
+    for (int pass = 0; pass < 2 && err == 0; ++pass) {
+        for (size_t i = 0; i < matcher_nr; ++i) {
+            if (label_is_pattern(&matchers[i]) != pass)
+                continue;
+
+            vec_size(postings) = 0;
+            if (pass == 0) {
+                snprintf(label, sizeof(label), "%s=%s", matchers[i].name,
+                         matchers[i].value);
+                lp = label_index_lookup(li, label);
+                if (lp)
+                    postings_decode(&lp->postings, &postings);
+            } else if (label_index_match(li, &matchers[i], &postings) < 0) {
+                err = -1;
+                break;
+            }
+
+            if (first) {
+                for (size_t j = 0; j < vec_size(postings); ++j)
+                    vec_push(*ids, vec_at(postings, j));
+                first = 0;
+            } else {
+                ids_intersect(ids, &postings);
+            }
+
+            // Nothing left to intersect with
+            if (vec_size(*ids) == 0)
+                goto exit;
+        }
+    }
+
+exit:
+    vec_destroy(postings);
+
+    return err < 0 ? -1 : (int)vec_size(*ids);
+}
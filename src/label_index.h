@@ -0,0 +1,60 @@
+#ifndef LABEL_INDEX_H
+#define LABEL_INDEX_H
+
+#include "vec.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define LABEL_MAX_LENGTH 128
+
+/*
+ * A key=value couple attached to a series, when used to select series the
+ * value can be a glob pattern
+ */
+typedef struct label {
+    const char *name;
+    const char *value;
+} Label;
+
+typedef VEC(uint64_t) Series_Ids;
+
+/*
+ * Sorted list of series ids, stored as the varint encoded deltas between
+ * consecutive ids, ids are assigned increasingly so appends are always at
+ * the tail
+ */
+typedef struct postings {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    size_t count;
+    uint64_t last;
+} Postings;
+
+typedef struct label_postings {
+    char *label;
+    size_t name_len;
+    Postings postings;
+    struct label_postings *next;
+} Label_Postings;
+
+/*
+ * Inverted index from each `name=value` label to the postings of the series
+ * carrying it, not thread safe, it's up to the owner to serialize the access
+ */
+typedef struct label_index {
+    size_t size;
+    size_t capacity;
+    Label_Postings **buckets;
+} Label_Index;
+
+int label_index_init(Label_Index *li);
+
+void label_index_destroy(Label_Index *li);
+
+int label_index_add(Label_Index *li, const char *label, uint64_t id);
+
+int label_index_select(const Label_Index *li, const Label *matchers,
+                       size_t matcher_nr, Series_Ids *ids);
+
+#endif
@@ -1,19 +1,251 @@
 #include "logging.h"
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 
-static const char *llevels = "+#!";
+#define LOG_MAX_THREADS  128
+// Room of each thread for the lines not written out yet, a power of 2
+#define LOG_BUFFER_SIZE  (1 << 16)
+// Longest line, the longer ones are truncated
+#define LOG_LINE_MAX     1024
+// Level and length of a line, ahead of its text in the buffers
+#define LOG_ENTRY_HEADER 3
+#define LOG_RATE         1000
+#define LOG_DRAIN_NS     (50 * 1000 * 1000)
 
-void rr_log(rr_log_level level, const char *fmt, ...)
+static const char *llevels = ".+#!";
+
+static const char *level_names[] = {"debug", "info", "warn", "error"};
+
+/*
+ * Lines of a thread, a ring written by the owner alone and drained by the
+ * writer, `head` and `tail` only ever grow, the rate window is private to
+ * the owner
+ */
+typedef struct {
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_size_t dropped;
+    time_t window;
+    size_t lines;
+    char data[LOG_BUFFER_SIZE];
+} Log_Buffer;
+
+static _Atomic(Log_Buffer *) buffers[LOG_MAX_THREADS];
+static atomic_size_t buffers_nr = 0;
+
+static atomic_int min_level = R_INFO;
+static atomic_size_t rate   = LOG_RATE;
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+// Serializes the drains and the lines of the threads without a buffer
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set at exit, the output is not to be touched anymore
+static int stopped                = 0;
+
+static _Thread_local Log_Buffer *local = NULL;
+static _Thread_local int unbuffered    = 0;
+
+static void log_write(rr_log_level level, const char *line, size_t len)
 {
     FILE *fp = level > R_INFO ? stderr : stdout;
-    fprintf(fp, "%lu %c ", time(NULL), llevels[level]);
+    fwrite(line, 1, len, fp);
+    fputc('\n', fp);
+}
+
+static void log_buffer_drain(Log_Buffer *b)
+{
+    size_t tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&b->head, memory_order_acquire);
+    char line[LOG_LINE_MAX];
+
+    while (tail < head) {
+        uint8_t header[LOG_ENTRY_HEADER];
+        for (size_t i = 0; i < LOG_ENTRY_HEADER; ++i)
+            header[i] = b->data[(tail + i) & (LOG_BUFFER_SIZE - 1)];
+        size_t len = header[1] | (size_t)header[2] << 8;
+        tail += LOG_ENTRY_HEADER;
+        for (size_t i = 0; i < len; ++i)
+            line[i] = b->data[(tail + i) & (LOG_BUFFER_SIZE - 1)];
+        tail += len;
+        log_write(header[0], line, len);
+    }
+
+    atomic_store_explicit(&b->tail, tail, memory_order_release);
+
+    size_t dropped = atomic_exchange(&b->dropped, 0);
+    if (dropped > 0)
+        fprintf(stderr, "%lu ! Dropped %zu log lines\n", time(NULL), dropped);
+}
+
+static void log_drain(void)
+{
+    size_t nr = atomic_load(&buffers_nr);
+    nr        = nr > LOG_MAX_THREADS ? LOG_MAX_THREADS : nr;
+
+    pthread_mutex_lock(&drain_lock);
+    for (size_t i = 0; i < nr && !stopped; ++i) {
+        Log_Buffer *b = atomic_load(&buffers[i]);
+        if (b)
+            log_buffer_drain(b);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void *log_writer(void *arg)
+{
+    (void)arg;
+    const struct timespec interval = {.tv_sec = 0, .tv_nsec = LOG_DRAIN_NS};
+
+    while (1) {
+        log_drain();
+        nanosleep(&interval, NULL);
+    }
+
+    return NULL;
+}
+
+static void log_shutdown(void)
+{
+    log_drain();
+    pthread_mutex_lock(&drain_lock);
+    stopped = 1;
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void log_init(void)
+{
+    const char *level = getenv("ROACH_LOG_LEVEL");
+    const char *lines = getenv("ROACH_LOG_RATE");
+    pthread_t writer;
+
+    if (level && log_level_parse(level) >= 0)
+        atomic_store(&min_level, log_level_parse(level));
+    if (lines)
+        atomic_store(&rate, strtoull(lines, NULL, 10));
+
+    // Without a writer every line goes out synchronously
+    if (pthread_create(&writer, NULL, log_writer, NULL) == 0)
+        pthread_detach(writer);
+    else
+        unbuffered = 1;
+
+    atexit(log_shutdown);
+}
+
+// The threads past LOG_MAX_THREADS write their lines synchronously
+static Log_Buffer *log_buffer(void)
+{
+    if (local || unbuffered)
+        return local;
+
+    size_t index = atomic_fetch_add(&buffers_nr, 1);
+    if (index >= LOG_MAX_THREADS || !(local = calloc(1, sizeof(*local)))) {
+        unbuffered = 1;
+        return NULL;
+    }
+
+    atomic_store(&buffers[index], local);
+
+    return local;
+}
+
+static int log_rate_exceeded(Log_Buffer *b)
+{
+    size_t limit = atomic_load_explicit(&rate, memory_order_relaxed);
+    time_t now   = time(NULL);
+
+    if (now != b->window) {
+        b->window = now;
+        b->lines  = 0;
+    }
+
+    return limit > 0 && ++b->lines > limit;
+}
+
+void rr_log(rr_log_level level, const char *fmt, ...)
+{
+    char line[LOG_LINE_MAX];
     va_list args;
+
+    pthread_once(&log_once, log_init);
+
+    if ((int)level < atomic_load_explicit(&min_level, memory_order_relaxed))
+        return;
+
+    Log_Buffer *b = log_buffer();
+    if (b && log_rate_exceeded(b)) {
+        atomic_fetch_add_explicit(&b->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    int n = snprintf(line, sizeof(line), "%lu %c ", time(NULL), llevels[level]);
     va_start(args, fmt);
-    vfprintf(fp, fmt, args);
+    int m = vsnprintf(line + n, sizeof(line) - n, fmt, args);
     va_end(args);
-    fprintf(fp, "\n");
+
+    size_t len = m < 0 ? (size_t)n : (size_t)n + m;
+    len        = len > sizeof(line) - 1 ? sizeof(line) - 1 : len;
+
+    if (!b) {
+        pthread_mutex_lock(&drain_lock);
+        if (!stopped)
+            log_write(level, line, len);
+        pthread_mutex_unlock(&drain_lock);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&b->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&b->tail, memory_order_acquire);
+    if (LOG_BUFFER_SIZE - (head - tail) < len + LOG_ENTRY_HEADER) {
+        atomic_fetch_add_explicit(&b->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    const uint8_t header[LOG_ENTRY_HEADER] = {level, len & 0xFF, len >> 8};
+    for (size_t i = 0; i < LOG_ENTRY_HEADER; ++i)
+        b->data[(head + i) & (LOG_BUFFER_SIZE - 1)] = header[i];
+    head += LOG_ENTRY_HEADER;
+    for (size_t i = 0; i < len; ++i)
+        b->data[(head + i) & (LOG_BUFFER_SIZE - 1)] = line[i];
+
+    atomic_store_explicit(&b->head, head + len, memory_order_release);
+}
+
+void log_set_level(rr_log_level level)
+{
+    pthread_once(&log_once, log_init);
+    atomic_store(&min_level, level);
+}
+
+rr_log_level log_level(void)
+{
+    pthread_once(&log_once, log_init);
+    return atomic_load(&min_level);
 }
+
+int log_level_parse(const char *name)
+{
+    for (size_t i = 0; i < sizeof(level_names) / sizeof(*level_names); ++i)
+        if (strcasecmp(name, level_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+const char *log_level_name(rr_log_level level) { return level_names[level]; }
+
+void log_set_rate(size_t lines_per_sec)
+{
+    pthread_once(&log_once, log_init);
+    atomic_store(&rate, lines_per_sec);
+}
+
+void log_flush(void) { log_drain(); }
@@ -1,19 +1,47 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <stddef.h>
+
 // Basic log utility function
 
 typedef enum {
+    R_DEBUG,
     R_INFO,
     R_WARNING,
     R_ERROR,
 } rr_log_level;
 
 #define r_log(...)     rr_log(__VA_ARGS__)
+#define log_debug(...) r_log(R_DEBUG, __VA_ARGS__)
 #define log_info(...)  r_log(R_INFO, __VA_ARGS__)
 #define log_warn(...)  r_log(R_WARNING, __VA_ARGS__)
 #define log_error(...) r_log(R_ERROR, __VA_ARGS__)
 
+/*
+ * Lines are formatted by the calling thread into a buffer of its own and
+ * written out by a background thread, so logging never blocks on the output,
+ * lines that don't fit the buffer or past the rate limit of the thread are
+ * dropped and counted instead.
+ *
+ * The minimum level is INFO, ROACH_LOG_LEVEL sets it to one of debug, info,
+ * warn or error, the rate limit is 1000 lines per second per thread,
+ * ROACH_LOG_RATE sets it, 0 for no limit.
+ */
 void rr_log(rr_log_level level, const char *fmt, ...);
 
+void log_set_level(rr_log_level level);
+
+rr_log_level log_level(void);
+
+// Parse a level name, returns -1 if it's not one
+int log_level_parse(const char *name);
+
+const char *log_level_name(rr_log_level level);
+
+void log_set_rate(size_t lines_per_sec);
+
+// Write out all the lines buffered so far, it's called at exit too
+void log_flush(void);
+
 #endif
@@ -0,0 +1,44 @@
+#include "memory.h"
+#include <stdatomic.h>
+
+static atomic_size_t usage[MEM_CLASS_NR];
+static atomic_size_t budget;
+
+void memory_add(Memory_Class class, size_t size)
+{
+    atomic_fetch_add_explicit(&usage[class], size, memory_order_relaxed);
+}
+
+void memory_sub(Memory_Class class, size_t size)
+{
+    atomic_fetch_sub_explicit(&usage[class], size, memory_order_relaxed);
+}
+
+size_t memory_usage(void)
+{
+    size_t total = 0;
+    for (int i = 0; i < MEM_CLASS_NR; ++i)
+        total += atomic_load_explicit(&usage[i], memory_order_relaxed);
+    return total;
+}
+
+size_t memory_class_usage(Memory_Class class)
+{
+    return atomic_load_explicit(&usage[class], memory_order_relaxed);
+}
+
+void memory_set_budget(size_t size)
+{
+    atomic_store_explicit(&budget, size, memory_order_relaxed);
+}
+
+size_t memory_budget(void)
+{
+    return atomic_load_explicit(&budget, memory_order_relaxed);
+}
+
+int memory_over_budget(void)
+{
+    size_t limit = memory_budget();
+    return limit > 0 && memory_usage() > limit;
+}
@@ -0,0 +1,43 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+
+/*
+ * Classes of memory tracked by the accountant
+ *
+ * - MEM_CHUNKS the points held by the in-memory chunks of the open series
+ * - MEM_BUFFERS the response buffers waiting to be written out and the
+ *   temporaries of the request being served
+ * - MEM_CACHE the blocks read back from disk and kept around
+ */
+typedef enum {
+    MEM_CHUNKS,
+    MEM_BUFFERS,
+    MEM_CACHE,
+    MEM_CLASS_NR
+} Memory_Class;
+
+/*
+ * Process wide accountant of the memory held by the main consumers, it only
+ * keeps counters, the owners report every allocation and release, and a
+ * budget to compare the total against, a budget of 0 means unbounded.
+ *
+ * It doesn't enforce anything by itself, it's up to the writers to check
+ * `memory_over_budget` and spill their chunks to disk when it's set.
+ */
+void memory_add(Memory_Class class, size_t size);
+
+void memory_sub(Memory_Class class, size_t size);
+
+size_t memory_usage(void);
+
+size_t memory_class_usage(Memory_Class class);
+
+void memory_set_budget(size_t budget);
+
+size_t memory_budget(void);
+
+int memory_over_budget(void);
+
+#endif
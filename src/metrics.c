@@ -0,0 +1,215 @@
+#include "metrics.h"
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Metrics of a thread, written by the owner alone with plain loads and
+ * stores, read by anyone, the slots past METRICS_MAX_THREADS share the last
+ * one and go through atomic adds instead
+ */
+typedef struct metrics_slot {
+    atomic_uint_fast64_t counts[MET_LATENCY_NR][METRICS_BUCKETS];
+    atomic_uint_fast64_t sums[MET_LATENCY_NR];
+    atomic_uint_fast64_t maxs[MET_LATENCY_NR];
+    atomic_int_fast64_t counters[MET_COUNTER_NR];
+} Metrics_Slot;
+
+static const char *latency_names[MET_LATENCY_NR] = {
+    "insert", "find", "range", "flush", "wal_append", "fsync"};
+
+static const char *counter_names[MET_COUNTER_NR] = {
+    "points", "bytes_read", "bytes_written", "partitions_open"};
+
+static const char *query_names[QS_NR] = {"partitions", "index_entries",
+                                         "bytes_read", "blocks_decoded",
+                                         "points_scanned"};
+
+static Metrics_Slot slots[METRICS_MAX_THREADS];
+static atomic_size_t slots_nr = 0;
+
+static _Thread_local Metrics_Slot *local = NULL;
+static _Thread_local int shared          = 0;
+static _Thread_local Query_Stats *query  = NULL;
+
+static Metrics_Slot *metrics_slot(void)
+{
+    if (!local) {
+        size_t index = atomic_fetch_add(&slots_nr, 1);
+        shared       = index >= METRICS_MAX_THREADS - 1;
+        local        = &slots[shared ? METRICS_MAX_THREADS - 1 : index];
+    }
+    return local;
+}
+
+static void slot_add(atomic_uint_fast64_t *value, uint64_t n)
+{
+    if (shared)
+        atomic_fetch_add_explicit(value, n, memory_order_relaxed);
+    else
+        atomic_store_explicit(
+            value, atomic_load_explicit(value, memory_order_relaxed) + n,
+            memory_order_relaxed);
+}
+
+static size_t metrics_bucket(uint64_t value)
+{
+    if (value < (1 << METRICS_SUB_BITS))
+        return value;
+
+    if (value >= (uint64_t)1 << METRICS_MAX_BITS)
+        return METRICS_BUCKETS - 1;
+
+    int shift  = 63 - __builtin_clzll(value) - METRICS_SUB_BITS;
+    size_t sub = (value >> shift) & ((1 << METRICS_SUB_BITS) - 1);
+
+    return ((size_t)(shift + 1) << METRICS_SUB_BITS) + sub;
+}
+
+// Highest value falling in the bucket
+uint64_t metrics_bucket_max(size_t bucket)
+{
+    if (bucket < (1 << METRICS_SUB_BITS))
+        return bucket;
+
+    int shift    = (bucket >> METRICS_SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1 << METRICS_SUB_BITS) - 1);
+    uint64_t low = (((uint64_t)1 << METRICS_SUB_BITS) + sub) << shift;
+
+    return low + (((uint64_t)1 << shift) - 1);
+}
+
+uint64_t metrics_now(void)
+{
+    struct timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec * (uint64_t)1e9 + tv.tv_nsec;
+}
+
+void metrics_record(Metrics_Latency latency, uint64_t ns)
+{
+    Metrics_Slot *s = metrics_slot();
+
+    slot_add(&s->counts[latency][metrics_bucket(ns)], 1);
+    slot_add(&s->sums[latency], ns);
+
+    // Racy for the shared slot, a lost max is fine there
+    if (ns > atomic_load_explicit(&s->maxs[latency], memory_order_relaxed))
+        atomic_store_explicit(&s->maxs[latency], ns, memory_order_relaxed);
+}
+
+void metrics_record_since(Metrics_Latency latency, uint64_t start)
+{
+    metrics_record(latency, metrics_now() - start);
+}
+
+void metrics_add(Metrics_Counter counter, int64_t value)
+{
+    Metrics_Slot *s = metrics_slot();
+
+    if (shared)
+        atomic_fetch_add_explicit(&s->counters[counter], value,
+                                  memory_order_relaxed);
+    else
+        atomic_store_explicit(
+            &s->counters[counter],
+            atomic_load_explicit(&s->counters[counter], memory_order_relaxed) +
+                value,
+            memory_order_relaxed);
+}
+
+static size_t metrics_slots(void)
+{
+    size_t nr = atomic_load(&slots_nr);
+    return nr > METRICS_MAX_THREADS ? METRICS_MAX_THREADS : nr;
+}
+
+void metrics_histogram(Metrics_Latency latency, Metrics_Histogram *h)
+{
+    size_t nr = metrics_slots();
+    uint64_t max;
+
+    memset(h, 0x00, sizeof(*h));
+
+    for (size_t i = 0; i < nr; ++i) {
+        const Metrics_Slot *s = &slots[i];
+        for (size_t j = 0; j < METRICS_BUCKETS; ++j) {
+            uint64_t n = atomic_load_explicit(&s->counts[latency][j],
+                                              memory_order_relaxed);
+            h->buckets[j] += n;
+            h->count += n;
+        }
+        h->sum += atomic_load_explicit(&s->sums[latency], memory_order_relaxed);
+        max    = atomic_load_explicit(&s->maxs[latency], memory_order_relaxed);
+        h->max = max > h->max ? max : h->max;
+    }
+}
+
+/*
+ * Nearest rank percentile, `p` in [0, 100], as the highest value of the
+ * bucket holding the rank, never past the largest value recorded
+ */
+uint64_t metrics_percentile(const Metrics_Histogram *h, double p)
+{
+    uint64_t seen = 0;
+
+    if (h->count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+    rank          = rank == 0 ? 1 : rank > h->count ? h->count : rank;
+
+    for (size_t i = 0; i < METRICS_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = metrics_bucket_max(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+int64_t metrics_counter(Metrics_Counter counter)
+{
+    size_t nr     = metrics_slots();
+    int64_t total = 0;
+
+    for (size_t i = 0; i < nr; ++i)
+        total += atomic_load_explicit(&slots[i].counters[counter],
+                                      memory_order_relaxed);
+
+    return total;
+}
+
+const char *metrics_latency_name(Metrics_Latency latency)
+{
+    return latency_names[latency];
+}
+
+const char *metrics_counter_name(Metrics_Counter counter)
+{
+    return counter_names[counter];
+}
+
+void metrics_query_reset(Query_Stats *stats)
+{
+    for (size_t i = 0; i < QS_NR; ++i)
+        atomic_store_explicit(&stats->values[i], 0, memory_order_relaxed);
+}
+
+void metrics_query_attach(Query_Stats *stats) { query = stats; }
+
+void metrics_query_add(Query_Stat stat, uint64_t value)
+{
+    if (query)
+        atomic_fetch_add_explicit(&query->values[stat], value,
+                                  memory_order_relaxed);
+}
+
+uint64_t metrics_query_get(const Query_Stats *stats, Query_Stat stat)
+{
+    return atomic_load_explicit(&stats->values[stat], memory_order_relaxed);
+}
+
+const char *metrics_query_name(Query_Stat stat) { return query_names[stat]; }
@@ -0,0 +1,123 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_MAX_THREADS 128
+// Sub-buckets per power of two, latencies are off by 1/16 at most
+#define METRICS_SUB_BITS    4
+// Latencies up to 2^40 ns, about 18 minutes, the longer ones are clamped
+#define METRICS_MAX_BITS    40
+#define METRICS_BUCKETS                                                        \
+    ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+
+/*
+ * Latencies tracked, in nanoseconds
+ *
+ * - MET_INSERT a point inserted into a series
+ * - MET_FIND a point looked up
+ * - MET_RANGE a range of points read
+ * - MET_FLUSH an in-memory chunk written to its partition
+ * - MET_WAL_APPEND a point logged into the WAL
+ * - MET_FSYNC a file synced to disk
+ */
+typedef enum {
+    MET_INSERT,
+    MET_FIND,
+    MET_RANGE,
+    MET_FLUSH,
+    MET_WAL_APPEND,
+    MET_FSYNC,
+    MET_LATENCY_NR
+} Metrics_Latency;
+
+/*
+ * Counters tracked, the partitions open go up and down, the others only
+ * ever grow
+ */
+typedef enum {
+    MET_POINTS,
+    MET_BYTES_READ,
+    MET_BYTES_WRITTEN,
+    MET_PARTITIONS_OPEN,
+    MET_COUNTER_NR
+} Metrics_Counter;
+
+/*
+ * Work done on behalf of a single query, accounted only while a set of stats
+ * is attached to the thread doing it
+ *
+ * - QS_PARTITIONS partitions searched
+ * - QS_INDEX_ENTRIES index entries read, the binary searches included
+ * - QS_BYTES_READ bytes read from disk, the block cache hits read nothing
+ * - QS_BLOCKS_DECODED blocks read from disk and decoded
+ * - QS_POINTS_SCANNED points held by the blocks and the in-memory buckets
+ *   gone through
+ */
+typedef enum {
+    QS_PARTITIONS,
+    QS_INDEX_ENTRIES,
+    QS_BYTES_READ,
+    QS_BLOCKS_DECODED,
+    QS_POINTS_SCANNED,
+    QS_NR
+} Query_Stat;
+
+// Shared by the threads a query is split on, hence atomic
+typedef struct query_stats {
+    atomic_uint_fast64_t values[QS_NR];
+} Query_Stats;
+
+/*
+ * Log-linear histogram, values below 2^METRICS_SUB_BITS have a bucket each,
+ * the others one of the 2^METRICS_SUB_BITS buckets of their power of two
+ */
+typedef struct metrics_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[METRICS_BUCKETS];
+} Metrics_Histogram;
+
+/*
+ * Process wide metrics, each thread records into a set of histograms and
+ * counters of its own, registered the first time it records anything, so
+ * the hot paths never contend nor take locks. Readers merge the sets of all
+ * the threads, the result is not an atomic snapshot but every sample is
+ * eventually accounted.
+ */
+uint64_t metrics_now(void);
+
+void metrics_record(Metrics_Latency latency, uint64_t ns);
+
+// Latency since `start`, taken with `metrics_now`
+void metrics_record_since(Metrics_Latency latency, uint64_t start);
+
+void metrics_add(Metrics_Counter counter, int64_t value);
+
+void metrics_histogram(Metrics_Latency latency, Metrics_Histogram *h);
+
+uint64_t metrics_percentile(const Metrics_Histogram *h, double p);
+
+uint64_t metrics_bucket_max(size_t bucket);
+
+int64_t metrics_counter(Metrics_Counter counter);
+
+const char *metrics_latency_name(Metrics_Latency latency);
+
+const char *metrics_counter_name(Metrics_Counter counter);
+
+void metrics_query_reset(Query_Stats *stats);
+
+// Account the work of the calling thread into `stats` from now on, NULL stops
+void metrics_query_attach(Query_Stats *stats);
+
+void metrics_query_add(Query_Stat stat, uint64_t value);
+
+uint64_t metrics_query_get(const Query_Stats *stats, Query_Stat stat);
+
+const char *metrics_query_name(Query_Stat stat);
+
+#endif
@@ -1,4 +1,5 @@
 #include "parser.h"
+#include "trace.h"
 #include <inttypes.h>
 #include <string.h>
 
@@ -89,9 +90,16 @@ typedef enum {
     TOKEN_OPERATOR_GT,
     TOKEN_AGGREGATE,
     TOKEN_AGGREGATE_FN,
-    TOKEN_BY
+    TOKEN_BY,
+    TOKEN_LABEL,
+    TOKEN_STATS,
+    TOKEN_CHUNK,
+    TOKEN_FLUSH
 } Token_Type;
 
+// Enough to fit a SELECT on SERIES_LENGTH series and all its clauses
+#define TOKENS_CAPACITY (SERIES_LENGTH + LABELS_LENGTH + 20)
+
 // Define token structure
 typedef struct token {
     Token_Type type;
@@ -114,12 +122,50 @@ static ssize_t tokenize_create(Lexer *l, Token *tokens, size_t capacity)
             token          = lexer_next(l);
             strncpy(tokens[i].value, token.p, token.length);
             // TODO retention and duplication policy
+        } else if (strncmp(token.p, "CHUNK", token.length) == 0) {
+            tokens[i].type = TOKEN_CHUNK;
+            token          = lexer_next(l);
+            if (sscanf(token.p, "%" PRIu64, &(uint64_t){0}) == 1)
+                strncpy(tokens[i].value, token.p, token.length);
+        } else if (strncmp(token.p, "FLUSH", token.length) == 0) {
+            tokens[i].type = TOKEN_FLUSH;
+            token          = lexer_next(l);
+            if (sscanf(token.p, "%" PRIu64, &(uint64_t){0}) == 1)
+                strncpy(tokens[i].value, token.p, token.length);
+        } else if (strncmp(token.p, "LABELS", token.length) == 0) {
+            // One token for each of the labels, separated by ','
+            token = lexer_next(l);
+            for (;;) {
+                String_View label = string_view_chop_by_delim(&token, ',');
+                tokens[i].type    = TOKEN_LABEL;
+                snprintf(tokens[i].value, sizeof(tokens[i].value), "%.*s",
+                         (int)label.length, label.p);
+                if (token.length == 0 || i + 1 == capacity)
+                    break;
+                ++i;
+            }
         }
     }
 
     return i;
 }
 
+/*
+ * Split a `key=value` token into a label, returns -1 if there's no '='
+ */
+static int parse_label(const char *value, Statement_Label *label)
+{
+    const char *eq = strchr(value, '=');
+    if (!eq || eq == value)
+        return -1;
+
+    snprintf(label->name, sizeof(label->name), "%.*s", (int)(eq - value),
+             value);
+    snprintf(label->value, sizeof(label->value), "%s", eq + 1);
+
+    return 0;
+}
+
 // Function to tokenize input string into an array of tokens
 static ssize_t tokenize_insert(Lexer *l, Token *tokens, size_t capacity)
 {
@@ -159,10 +205,19 @@ static ssize_t tokenize_insert(Lexer *l, Token *tokens, size_t capacity)
 static ssize_t tokenize_select(Lexer *l, Token *tokens, size_t capacity)
 {
     String_View token = lexer_next(l);
+    String_View name  = {0};
     size_t i          = 0;
 
-    tokens[i].type    = TOKEN_SELECT;
-    strncpy(tokens[i].value, token.p, token.length);
+    // One token for each of the series selected, separated by ','
+    for (;;) {
+        name           = string_view_chop_by_delim(&token, ',');
+        tokens[i].type = TOKEN_SELECT;
+        snprintf(tokens[i].value, sizeof(tokens[i].value), "%.*s",
+                 (int)name.length, name.p);
+        if (token.length == 0 || i + 1 == capacity)
+            break;
+        ++i;
+    }
 
     while (l->length > 0 && ++i < capacity) {
         token = lexer_next(l);
@@ -238,6 +293,9 @@ static ssize_t tokenize(const char *query, Token *tokens, size_t capacity)
         token_count = tokenize_insert(&l, tokens, capacity);
     else if (strncmp(first_token.p, "SELECT", first_token.length) == 0)
         token_count = tokenize_select(&l, tokens, capacity);
+    else if (strncmp(first_token.p, "STATS", first_token.length) == 0 ||
+             strncmp(first_token.p, "INFO", first_token.length) == 0)
+        tokens[0].type = TOKEN_STATS;
 
     token_count++;
 
@@ -260,9 +318,22 @@ static Statement_Create parse_create(Token *tokens, size_t token_count)
                 snprintf(create.db_name, sizeof(create.db_name), "%s",
                          tokens[i].value);
                 create.mask = 1;
+            } else if (tokens[i].type == TOKEN_CHUNK) {
+                create.chunk_size = strtoull(tokens[i].value, NULL, 10);
+            } else if (tokens[i].type == TOKEN_FLUSH) {
+                create.flush_size = strtoull(tokens[i].value, NULL, 10);
+            } else if (tokens[i].type == TOKEN_LABEL &&
+                       create.label_len < LABELS_LENGTH &&
+                       parse_label(tokens[i].value,
+                                   &create.labels[create.label_len]) == 0) {
+                create.label_len++;
             }
             // TODO error here
         }
+        // Without INTO it's the database being created
+        if (create.mask == 0)
+            snprintf(create.db_name, sizeof(create.db_name), "%s",
+                     create.ts_name);
     }
 
     return create;
@@ -308,8 +379,24 @@ static Statement_Select parse_select(Token *tokens, size_t token_count)
     for (size_t i = 0; i < token_count; ++i) {
         switch (tokens[i].type) {
         case TOKEN_SELECT:
-            snprintf(select.ts_name, sizeof(select.ts_name), "%s",
-                     tokens[i].value);
+            // A label to match
+            if (strchr(tokens[i].value, '=')) {
+                if (select.label_len < LABELS_LENGTH &&
+                    parse_label(tokens[i].value,
+                                &select.labels[select.label_len]) == 0)
+                    select.label_len++;
+                select.mask |= SM_MULTI;
+                break;
+            }
+            if (select.ts_len == 0)
+                snprintf(select.ts_name, sizeof(select.ts_name), "%s",
+                         tokens[i].value);
+            if (select.ts_len < SERIES_LENGTH)
+                snprintf(select.ts_names[select.ts_len++],
+                         sizeof(select.ts_names[0]), "%s", tokens[i].value);
+            // More than a series or a glob pattern
+            if (select.ts_len > 1 || strpbrk(tokens[i].value, "*?["))
+                select.mask |= SM_MULTI;
             break;
         case TOKEN_FROM:
             snprintf(select.db_name, sizeof(select.db_name), "%s",
@@ -379,13 +466,18 @@ static Statement_Select parse_select(Token *tokens, size_t token_count)
     return select;
 }
 
-Statement parse(const char *input)
+Statement parse(const char *input, Allocator allocator)
 {
-    Token *tokens      = calloc(20, sizeof(Token));
-    size_t token_count = tokenize(input, tokens, 20);
+    TRACE_BEGIN(t);
+    Token *tokens = alloc(Token, TOKENS_CAPACITY, allocator);
+    if (!tokens)
+        return (Statement){.type = STATEMENT_EMPTY};
+
+    memset(tokens, 0x00, TOKENS_CAPACITY * sizeof(Token));
 
+    size_t token_count = tokenize(input, tokens, TOKENS_CAPACITY);
     if (token_count < 1) {
-        free(tokens);
+        release(TOKENS_CAPACITY * sizeof(Token), tokens, allocator);
         return (Statement){.type = STATEMENT_EMPTY};
     }
 
@@ -404,11 +496,16 @@ Statement parse(const char *input)
         statement.type   = STATEMENT_SELECT;
         statement.select = parse_select(tokens, token_count);
         break;
+    case TOKEN_STATS:
+        statement.type = STATEMENT_STATS;
+        break;
     default:
         break;
     }
 
-    free(tokens);
+    release(TOKENS_CAPACITY * sizeof(Token), tokens, allocator);
+
+    TRACE_END(t, TRACE_PARSE);
 
     return statement;
 }
@@ -420,7 +517,16 @@ static void print_create(const Statement_Create *create)
     } else {
         printf("CREATE\n\t%s\n", create->ts_name);
         printf("INTO\n\t%s\n", create->db_name);
+        if (create->label_len > 0)
+            printf("LABELS\n\t");
+        for (size_t i = 0; i < create->label_len; ++i)
+            printf("%s=%s%s", create->labels[i].name, create->labels[i].value,
+                   i + 1 < create->label_len ? "," : "\n");
     }
+    if (create->chunk_size > 0)
+        printf("CHUNK\n\t%" PRIu64 "\n", create->chunk_size);
+    if (create->flush_size > 0)
+        printf("FLUSH\n\t%" PRIu64 "\n", create->flush_size);
 }
 
 static void print_insert(const Statement_Insert *insert)
@@ -436,7 +542,13 @@ static void print_insert(const Statement_Insert *insert)
 
 static void print_select(const Statement_Select *select)
 {
-    printf("SELECT\n\t%s\nFROM\n\t%s\n", select->ts_name, select->db_name);
+    printf("SELECT\n\t");
+    for (size_t i = 0; i < select->ts_len; ++i)
+        printf("%s%s", select->ts_names[i], i + 1 < select->ts_len ? "," : "");
+    for (size_t i = 0; i < select->label_len; ++i)
+        printf("%s%s=%s", i + select->ts_len > 0 ? "," : "",
+               select->labels[i].name, select->labels[i].value);
+    printf("\nFROM\n\t%s\n", select->db_name);
     if (select->mask & SM_SINGLE)
         printf("AT\n\t%" PRId64 "\n", select->start_time);
     else if (select->mask & SM_RANGE)
@@ -463,6 +575,9 @@ void print_statement(const Statement *statement)
     case STATEMENT_SELECT:
         print_select(&statement->select);
         break;
+    case STATEMENT_STATS:
+        printf("STATS\n");
+        break;
     default:
         printf("Unrecognized statement\n");
         break;
@@ -1,6 +1,7 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include "arena.h"
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,6 +10,8 @@
 
 #define IDENTIFIER_LENGTH 64
 #define RECORDS_LENGTH    32
+#define SERIES_LENGTH     32
+#define LABELS_LENGTH     16
 
 /*
  * String view APIs definition
@@ -45,20 +48,44 @@ typedef enum { OP_EQ, OP_NE, OP_GE, OP_GT, OP_LE, OP_LT } Operator;
  * - With a WHERE clause
  * - With an aggregation function
  * - With an interval to aggregate on
+ * - On multiple series, listed or matching a glob pattern
  */
 typedef enum Select_Mask {
     SM_SINGLE    = 0x01,
     SM_RANGE     = 0x02,
     SM_WHERE     = 0x04,
     SM_AGGREGATE = 0x08,
-    SM_BY        = 0x10
+    SM_BY        = 0x10,
+    SM_MULTI     = 0x20
 } Select_Mask;
 
-// Define structure for CREATE statement
+// A key=value label, the value can be a glob pattern when selecting series
+typedef struct {
+    char name[IDENTIFIER_LENGTH];
+    char value[IDENTIFIER_LENGTH];
+} Statement_Label;
+
+/*
+ * Define structure for CREATE statement, series can carry a list of labels,
+ * e.g.
+ *
+ * CREATE cpu INTO metrics LABELS host=web1,region=eu
+ *
+ * CHUNK sets the width in seconds of the in-memory chunks and FLUSH the bytes
+ * of WAL they're flushed at, 0 if not set, on a database they're the defaults
+ * of its series, e.g.
+ *
+ * CREATE cpu INTO metrics CHUNK 60 FLUSH 65536
+ * CREATE metrics CHUNK 3600
+ */
 typedef struct {
     char db_name[IDENTIFIER_LENGTH];
     char ts_name[IDENTIFIER_LENGTH];
     uint8_t mask;
+    uint64_t chunk_size;
+    uint64_t flush_size;
+    size_t label_len;
+    Statement_Label labels[LABELS_LENGTH];
 } Statement_Create;
 
 // Define a pair (timestamp, value) for INSERT statements
@@ -82,10 +109,25 @@ typedef struct {
     double_t value;
 } Statement_Where;
 
-// Define structure for SELECT statement
+/*
+ * Define structure for SELECT statement, `ts_name` is the first series
+ * selected, a comma separated list of series or glob patterns on their names
+ * is collected into `ts_names`, e.g.
+ *
+ * SELECT cpu.*,mem FROM metrics RANGE 1710033421000000000 TO 1710033521000000000
+ *
+ * key=value items of the list are collected into `labels` instead, they
+ * restrict the selection to the series carrying all of them, e.g.
+ *
+ * SELECT host=web*,region=eu FROM metrics AT 1710033421000000000
+ */
 typedef struct {
     char db_name[IDENTIFIER_LENGTH];
     char ts_name[IDENTIFIER_LENGTH];
+    size_t ts_len;
+    char ts_names[SERIES_LENGTH][IDENTIFIER_LENGTH];
+    size_t label_len;
+    Statement_Label labels[LABELS_LENGTH];
     int64_t start_time;
     int64_t end_time;
     Aggregate_Function af;
@@ -100,6 +142,7 @@ typedef enum {
     STATEMENT_CREATE,
     STATEMENT_INSERT,
     STATEMENT_SELECT,
+    STATEMENT_STATS,
     STATEMENT_UNKNOWN
 } Statement_Type;
 
@@ -113,8 +156,8 @@ typedef struct {
     };
 } Statement;
 
-// Parse a statement
-Statement parse(const char *input);
+// Parse a statement, the temporaries are taken from the allocator
+Statement parse(const char *input, Allocator allocator);
 
 // Debug helpers
 
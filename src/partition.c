@@ -1,15 +1,29 @@
 #include "partition.h"
+#include "arena.h"
 #include "binary.h"
+#include "block_cache.h"
 #include "commit_log.h"
 #include "logging.h"
+#include "metrics.h"
 #include "persistent_index.h"
 #include "timeseries.h"
+#include "trace.h"
 #include "vec.h"
 #include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <string.h>
 
+// Stack room for the temporaries of a flush before the arena hits the heap
+#define FLUSH_SCRATCH_SIZE 4096
+
 static const size_t BATCH_SIZE = 1 << 6;
-static const size_t BLOCK_SIZE = 1 << 12;
+// Records are fixed size for now, size + timestamp + value
+static const size_t RECORD_SIZE = sizeof(uint64_t) * 2 + sizeof(double_t);
+// Batch size and last timestamp
+static const size_t BATCH_HEADER_SIZE = sizeof(uint64_t) * 2;
+
+static atomic_uint_fast64_t partition_ids = 1;
 
 int partition_init(Partition *p, const char *path, uint64_t base)
 {
@@ -21,9 +35,43 @@ int partition_init(Partition *p, const char *path, uint64_t base)
     if (err < 0)
         return -1;
 
+    p->id       = atomic_fetch_add(&partition_ids, 1);
     p->start_ts = 0;
     p->end_ts   = 0;
 
+    metrics_add(MET_PARTITIONS_OPEN, 1);
+
+    return 0;
+}
+
+/*
+ * A crash between the append of a block and the one of its index entry, or
+ * a truncated log, leave the two out of step, both are cut back to the last
+ * block they agree on
+ */
+static int partition_reconcile(Partition *p)
+{
+    size_t entries = index_entries(&p->index);
+    uint64_t ts = 0, end = 0;
+
+    for (; entries > 0; --entries) {
+        if (index_entry_at(&p->index, entries - 1, &ts, &end) < 0)
+            return -1;
+        end += RECORD_SIZE;
+        if (end <= p->clog.size)
+            break;
+    }
+
+    if (entries == 0)
+        end = 0;
+
+    if (entries < index_entries(&p->index) &&
+        index_truncate(&p->index, entries) < 0)
+        return -1;
+
+    if (end < p->clog.size && c_log_truncate(&p->clog, end) < 0)
+        return -1;
+
     return 0;
 }
 
@@ -37,20 +85,42 @@ int partition_load(Partition *p, const char *path, uint64_t base)
     if (err < 0)
         return -1;
 
+    err = partition_reconcile(p);
+    if (err < 0)
+        return -1;
+
+    p->id       = atomic_fetch_add(&partition_ids, 1);
     p->start_ts = p->clog.base_timestamp * (uint64_t)1e9 + p->clog.base_ns;
     p->end_ts   = p->clog.current_timestamp;
 
+    metrics_add(MET_PARTITIONS_OPEN, 1);
+
     return 0;
 }
 
-static int commit_records_to_log(Partition *p, const uint8_t *buf, size_t len)
+void partition_close(Partition *p)
 {
+    // The id is assigned once the partition is open
+    if (p->id != 0)
+        metrics_add(MET_PARTITIONS_OPEN, -1);
+    p->id = 0;
+    c_log_close(&p->clog);
+    if (p->index.fp)
+        index_close(&p->index);
+    p->index.fp = NULL;
+}
+
+static int commit_records_to_log(Partition *p, uint8_t *buf, size_t len)
+{
+    // The batch header is rewritten by the append
+    uint64_t last_ts = ts_record_timestamp(buf);
+
     int err = c_log_append_batch(&p->clog, buf, len);
     if (err < 0)
         return -1;
 
     size_t commit_log_size = p->clog.size;
-    err = index_append_offset(&p->index, ts_record_timestamp(buf),
+    err = index_append_offset(&p->index, last_ts,
                               commit_log_size - TS_BATCH_OFFSET);
     if (err < 0)
         return -1;
@@ -58,157 +128,379 @@ static int commit_records_to_log(Partition *p, const uint8_t *buf, size_t len)
     return 0;
 }
 
+/*
+ * Write the records of a chunk to the log in batches, each one indexed by its
+ * last timestamp, the temporaries live in an arena rewound at the end of the
+ * flush, small chunks fit the stack. Readers don't look for them on disk
+ * until `partition_publish_chunk` is called
+ */
 int partition_flush_chunk(Partition *p, const Timeseries_Chunk *tc)
 {
+    uint8_t scratch[FLUSH_SCRATCH_SIZE];
+    Arena arena            = arena_init(scratch, sizeof(scratch));
+    Allocator allocator    = arena_allocator(&arena);
+    TRACE_BEGIN(t);
+    uint64_t start         = metrics_now();
+    size_t total_records   = 0, batch_size = 0, n = 0;
+    const Record **records = NULL;
+    uint8_t *buf           = NULL;
+    int err                = 0;
+
+    for (size_t i = 0; i < tc->width; ++i)
+        total_records +=
+            atomic_load_explicit(&tc->points[i].size, memory_order_acquire);
+
+    if (total_records == 0)
+        goto exit;
+
+    // A batch at a time is encoded, after its size and last timestamp header
+    records = alloc(const Record *, total_records, allocator);
+    buf     = alloc(uint8_t, BATCH_HEADER_SIZE + BATCH_SIZE * RECORD_SIZE,
+                    allocator);
+    if (!records || !buf) {
+        err = -1;
+        goto exit;
+    }
 
-    VEC(const Record *) records;
-    vec_new(records);
-
-    size_t total_records = 0;
-    size_t batch_size    = 0;
-    uint8_t *buf         = malloc(TS_FLUSH_SIZE * 2);
-    if (!buf) {
-        vec_destroy(records);
-        return -1;
+    for (size_t i = 0; i < tc->width; ++i) {
+        size_t size  = atomic_load_explicit(&tc->points[i].size,
+                                            memory_order_acquire);
+        Record *data = atomic_load_explicit(&tc->points[i].data,
+                                            memory_order_acquire);
+        for (size_t j = 0; j < size; ++j)
+            records[n++] = &data[j];
     }
 
-    uint8_t *bufptr = buf;
-    int err         = 0;
-
-    for (size_t i = 0; i < TS_CHUNK_SIZE; ++i) {
-        if (tc->points[i].size == 0)
-            continue;
-
-        for (size_t j = 0; j < vec_size(tc->points[i]); ++j) {
-            vec_push(records, &tc->points[i].data[j]);
-            total_records++;
-
-            if (++batch_size == BATCH_SIZE) {
-                // Poor man slice
-                size_t len = ts_record_batch_write(
-                    (records.data + (total_records - BATCH_SIZE)), bufptr,
-                    BATCH_SIZE);
-                err = commit_records_to_log(p, bufptr, len);
-                if (err < 0)
-                    log_error("batch write failed: %s", strerror(errno));
-                bufptr += len;
-                batch_size = 0;
-            }
+    for (size_t i = 0; i < total_records; i += batch_size) {
+        batch_size = total_records - i < BATCH_SIZE ? total_records - i
+                                                     : BATCH_SIZE;
+        size_t len = ts_record_batch_write(records + i, buf, batch_size);
+        if (commit_records_to_log(p, buf, len) < 0) {
+            log_error("Batch write failed: %s", strerror(errno));
+            err = -1;
         }
     }
 
-    // Finish up any remaining record
-    size_t remaining_records = total_records % BATCH_SIZE;
-    if (remaining_records != 0) {
-        size_t len = ts_record_batch_write(
-            (records.data + (total_records - remaining_records)), bufptr,
-            remaining_records);
-        err = commit_records_to_log(p, bufptr, len);
-        if (err < 0)
-            log_error("Error writing remaining records to commit log: %s",
-                      strerror(errno));
-    }
+    // The WAL frames of the chunk are dropped once it's flushed, its blocks
+    // and their index entries have to be on disk by then
+    if (err == 0 && (c_log_sync(&p->clog) < 0 || index_sync(&p->index) < 0))
+        err = -1;
+
+exit:
+    arena_destroy(&arena);
+
+    metrics_record_since(MET_FLUSH, start);
+    TRACE_END(t, TRACE_FLUSH);
+
+    return err;
+}
+
+/*
+ * Extend the bounds of the partition over a chunk flushed into it, readers
+ * only look for records within them, so its records become visible on disk
+ * from here on
+ */
+void partition_publish_chunk(Partition *p, const Timeseries_Chunk *tc)
+{
+    if (tc->end_ts == 0)
+        return;
 
     // Set base nanoseconds for the commit log
-    if (p->start_ts == 0) {
-        uint64_t base_ns = tc->start_ts % (uint64_t)1e9;
-        c_log_set_base_ns(&p->clog, base_ns);
-    }
+    if (p->start_ts == 0)
+        c_log_set_base_ns(&p->clog, tc->start_ts % (uint64_t)1e9);
 
-    // Update timestamps
     p->start_ts = p->start_ts != 0 ? p->start_ts : tc->base_offset;
-    p->end_ts   = vec_size(records) == 0 ? 0 : vec_last(records)->timestamp;
+    p->end_ts   = tc->end_ts;
+}
+
+/*
+ * Decode the `len` bytes of a block read from the log at `start`
+ */
+static Block *block_decode(uint64_t partition, uint64_t start,
+                           const uint8_t *buf, size_t len)
+{
+    const uint8_t *ptr = buf;
+    Block *block       = NULL;
+
+    // Blocks written before they carried a checksum have no header
+    ssize_t records_len = c_log_block_verify(buf, len);
+    if (records_len < 0 ||
+        (records_len > 0 &&
+         (size_t)records_len + C_LOG_BLOCK_HEADER_SIZE != len)) {
+        log_error("Partition block at %" PRIu64 " corrupted", start);
+        return NULL;
+    }
+
+    if (records_len > 0) {
+        ptr += C_LOG_BLOCK_HEADER_SIZE;
+        len = records_len;
+    }
+
+    block = block_alloc(partition, start, len / RECORD_SIZE);
+    if (!block)
+        return NULL;
+
+    // A record length read from the log is trusted only if it's the expected
+    // one, a torn read of a partition being flushed stops the decoding short
+    if (ts_record_read_batch(block->records, ptr, block->length) !=
+        block->length) {
+        free(block);
+        return NULL;
+    }
+
+    metrics_query_add(QS_BLOCKS_DECODED, 1);
+
+    return block;
+}
+
+/*
+ * Read the n-th block of the partition, a block spans from the end of the
+ * previous batch to the last record of its own, which is the offset its
+ * index entry points to
+ */
+static Block *partition_block_read(const Partition *p, size_t n, uint64_t start)
+{
+    uint64_t ts = 0, end = 0;
+    uint8_t *buf = NULL;
+    Block *block = NULL;
+
+    if (index_entry_at(&p->index, n, &ts, &end) < 0)
+        return NULL;
+
+    end += RECORD_SIZE;
+    if (end <= start || end > p->clog.size)
+        return NULL;
+
+    ssize_t len = end - start;
+    buf         = malloc(len);
+    if (!buf)
+        return NULL;
+
+    if (c_log_read_at(&p->clog, &buf, start, len) == len)
+        block = block_decode(p->id, start, buf, len);
 
     free(buf);
-    vec_destroy(records);
 
-    return 0;
+    return block;
 }
 
-static uint64_t end_offset(const Partition *p, const Range *r)
+/*
+ * Return the n-th block of the partition, from the block cache if it's been
+ * read recently, referenced until `block_cache_release` is called on it
+ */
+static Block *partition_block(const Partition *p, size_t n)
 {
-    uint64_t end = 0;
-    if (r->end == -1)
-        end = p->clog.size;
-    else if (r->end == r->start)
-        end = sizeof(uint64_t) * 3;
-    else
-        end = r->end;
+    uint64_t ts = 0, start = 0;
+    Block *block = NULL;
 
-    return end;
+    if (n > 0) {
+        if (index_entry_at(&p->index, n - 1, &ts, &start) < 0)
+            return NULL;
+        start += RECORD_SIZE;
+    }
+
+    block = block_cache_get(p->id, start);
+    if (block)
+        return block;
+
+    block = partition_block_read(p, n, start);
+    if (!block)
+        return NULL;
+
+    return block_cache_put(block);
 }
 
-int partition_find(const Partition *p, uint8_t *dst, uint64_t timestamp)
+/*
+ * Position of the first record of a block with a timestamp not lower than
+ * `timestamp`, records of a batch are sorted
+ */
+static size_t block_search(const Block *block, uint64_t timestamp)
 {
-    Range range;
-    int err = index_find_offset(&p->index, timestamp, &range);
-    if (err < 0)
-        return -1;
+    size_t lo = 0, hi = block->length;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (block->records[mid].timestamp < timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
 
-    // TODO dynamic alloc this buffer
-    uint8_t buf[BLOCK_SIZE];
-    uint8_t *ptr = &buf[0];
+    return lo;
+}
 
-    uint64_t end = end_offset(p, &range);
+int partition_find(const Partition *p, Record *dst, uint64_t timestamp)
+{
+    metrics_query_add(QS_PARTITIONS, 1);
 
-    ssize_t n    = c_log_read_at(&p->clog, &ptr, range.start, end);
-    if (n < 0)
+    ssize_t n = index_find_entry(&p->index, timestamp);
+    if (n < 0 || (size_t)n == index_entries(&p->index))
         return -1;
 
-    size_t record_len = 0;
-    uint64_t ts       = 0;
-    while (n > 0) {
-        record_len = read_i64(ptr);
-        ts         = read_i64(ptr + sizeof(uint64_t));
-        if (ts == timestamp)
-            break;
-        ptr += record_len;
-        n -= record_len;
+    Block *block = partition_block(p, n);
+    if (!block)
+        return -1;
+
+    metrics_query_add(QS_POINTS_SCANNED, block->length);
+
+    size_t i = block_search(block, timestamp);
+    int err  = -1;
+    if (i < block->length && block->records[i].timestamp == timestamp) {
+        *dst = block->records[i];
+        err  = 0;
     }
 
-    record_len = read_i64(ptr);
-    memcpy(dst, ptr, record_len);
+    block_cache_release(block);
 
-    return 0;
+    return err;
 }
 
-int partition_range(const Partition *p, uint8_t *dst, uint64_t t0, uint64_t t1)
+/*
+ * Let the blocks from the n-th to the one holding `t1` be read ahead, a scan
+ * is going to walk through them in order
+ */
+static void partition_prefetch(const Partition *p, size_t n, uint64_t t1)
 {
-    Range r0, r1;
-    int err = index_find_offset(&p->index, t0, &r0);
-    if (err < 0)
+    uint64_t ts = 0, start = 0, end = 0;
+    size_t entries = index_entries(&p->index);
+    ssize_t last   = index_find_entry(&p->index, t1);
+
+    if (last < 0 || (size_t)last >= entries)
+        last = entries - 1;
+
+    // A single block is read at once anyway
+    if ((size_t)last <= n)
+        return;
+
+    if (n > 0 && index_entry_at(&p->index, n - 1, &ts, &start) == 0)
+        start += RECORD_SIZE;
+
+    if (index_entry_at(&p->index, last, &ts, &end) < 0)
+        return;
+
+    c_log_prefetch(&p->clog, start, end + RECORD_SIZE - start);
+}
+
+/*
+ * Collect into `reads` the reads of the blocks holding [t0, t1] that are
+ * missing from the block cache, up to `max` reads in total, returns their
+ * number or -1 on error
+ */
+int partition_block_reads(const Partition *p, uint64_t t0, uint64_t t1,
+                          Block_Reads *reads, size_t max, Allocator allocator)
+{
+    uint64_t ts = 0, start = 0, end = 0;
+    size_t entries = index_entries(&p->index);
+    ssize_t n      = index_find_entry(&p->index, t0);
+    ssize_t last   = index_find_entry(&p->index, t1);
+
+    if (n < 0 || (size_t)n >= entries)
+        return vec_size(*reads);
+
+    if (last < 0 || (size_t)last >= entries)
+        last = entries - 1;
+
+    if (n > 0) {
+        if (index_entry_at(&p->index, n - 1, &ts, &start) < 0)
+            return -1;
+        start += RECORD_SIZE;
+    }
+
+    for (ssize_t i = n; i <= last && vec_size(*reads) < max; ++i) {
+        if (index_entry_at(&p->index, i, &ts, &end) < 0)
+            return -1;
+
+        end += RECORD_SIZE;
+        if (end <= start || end > p->clog.size)
+            return -1;
+
+        if (!block_cache_contains(p->id, start)) {
+            Block_Read read = {.fd        = fileno(p->clog.fp),
+                               .partition = p->id,
+                               .start     = start,
+                               .size      = end - start,
+                               .offset    = start,
+                               .length    = end - start};
+            // Whole pages, the buffer has to be aligned as well
+            if (p->clog.direct_fd >= 0) {
+                read.fd     = p->clog.direct_fd;
+                read.offset = start & ~(uint64_t)(C_LOG_DIRECT_ALIGN - 1);
+                read.length = ((end + C_LOG_DIRECT_ALIGN - 1) &
+                               ~(uint64_t)(C_LOG_DIRECT_ALIGN - 1)) -
+                              read.offset;
+            }
+            vec_push_alloc(*reads, read, allocator);
+        }
+
+        start = end;
+    }
+
+    return vec_size(*reads);
+}
+
+/*
+ * Decode a block read through `partition_block_reads` into the block cache,
+ * `len` being the number of bytes read into `buf`
+ */
+int partition_block_load(const Block_Read *read, const uint8_t *buf,
+                         size_t len)
+{
+    size_t skip = read->start - read->offset;
+
+    metrics_add(MET_BYTES_READ, len);
+    metrics_query_add(QS_BYTES_READ, len);
+
+    if (len < skip + read->size)
         return -1;
 
-    err = index_find_offset(&p->index, t1, &r1);
-    if (err < 0)
+    Block *block =
+        block_decode(read->partition, read->start, buf + skip, read->size);
+    if (!block)
         return -1;
 
-    uint64_t end1 = end_offset(p, &r1);
+    block_cache_release(block_cache_put(block));
 
-    // TODO dynamic alloc this buffer
-    uint8_t buf[BLOCK_SIZE];
-    uint8_t *ptr = &buf[0];
+    return 0;
+}
+
+/*
+ * Collect the records in [t0, t1] into `dst`, grown through `allocator`,
+ * block by block from the one holding `t0`, returns the number of records
+ * collected, -1 on error
+ */
+int partition_range(const Partition *p, uint64_t t0, uint64_t t1, Points *dst,
+                    Allocator allocator)
+{
+    ssize_t n      = index_find_entry(&p->index, t0);
+    size_t entries = index_entries(&p->index);
+    int count      = 0, done = 0;
+
+    metrics_query_add(QS_PARTITIONS, 1);
 
-    ssize_t n    = c_log_read_at(&p->clog, &ptr, r0.start, end1);
     if (n < 0)
         return -1;
 
-    size_t record_len = 0, base_size = n;
-    size_t start = n;
-    uint64_t ts  = 0;
-
-    while (n > 0) {
-        record_len = read_i64(ptr);
-        ts         = read_i64(ptr + sizeof(uint64_t));
-        if (ts == t0)
-            start = n;
-        ptr += record_len;
-        n -= record_len;
-        if (ts == t1)
-            break;
-    }
+    if ((size_t)n < entries)
+        partition_prefetch(p, n, t1);
 
-    memcpy(dst, buf + (base_size - start), start - n);
+    for (size_t i = n; i < entries && !done; ++i) {
+        Block *block = partition_block(p, i);
+        if (!block)
+            return -1;
+
+        metrics_query_add(QS_POINTS_SCANNED, block->length);
+
+        size_t j = block_search(block, t0);
+        for (; j < block->length && block->records[j].timestamp <= t1; ++j) {
+            vec_push_alloc(*dst, block->records[j], allocator);
+            count++;
+        }
+
+        // Stopped short of the end of the block, past t1
+        done = j < block->length;
+
+        block_cache_release(block);
+    }
 
-    return start - n;
+    return count;
 }
@@ -1,26 +1,63 @@
 #ifndef PARTITION_H
 #define PARTITION_H
 
+#include "arena.h"
 #include "commit_log.h"
 #include "persistent_index.h"
+#include "vec.h"
 
 typedef struct timeseries_chunk Timeseries_Chunk;
+typedef struct record Record;
+typedef struct points Points;
 
+/*
+ * A commit log and its index, `id` is unique across the process, it keys the
+ * blocks of the partition in the block cache
+ */
 typedef struct partition {
+    uint64_t id;
     Commit_Log clog;
     Persistent_Index index;
     uint64_t start_ts;
     uint64_t end_ts;
 } Partition;
 
+/*
+ * Read of a block missing from the block cache, carried out by the caller,
+ * e.g. asynchronously through the event loop, and handed back to
+ * `partition_block_load`. `offset` and `length` span the whole pages to read
+ * in direct I/O mode, the block is `size` bytes at `start` within them
+ */
+typedef struct block_read {
+    int fd;
+    uint64_t partition;
+    uint64_t start;
+    size_t size;
+    uint64_t offset;
+    size_t length;
+} Block_Read;
+
+typedef VEC(Block_Read) Block_Reads;
+
 int partition_init(Partition *p, const char *path, uint64_t base);
 
 int partition_load(Partition *p, const char *path, uint64_t base);
 
+void partition_close(Partition *p);
+
 int partition_flush_chunk(Partition *p, const Timeseries_Chunk *tc);
 
-int partition_find(const Partition *p, uint8_t *dst, uint64_t timestamp);
+void partition_publish_chunk(Partition *p, const Timeseries_Chunk *tc);
+
+int partition_find(const Partition *p, Record *dst, uint64_t timestamp);
+
+int partition_range(const Partition *p, uint64_t t0, uint64_t t1, Points *dst,
+                    Allocator allocator);
+
+int partition_block_reads(const Partition *p, uint64_t t0, uint64_t t1,
+                          Block_Reads *reads, size_t max, Allocator allocator);
 
-int partition_range(const Partition *p, uint8_t *dst, uint64_t t0, uint64_t t1);
+int partition_block_load(const Block_Read *read, const uint8_t *buf,
+                         size_t len);
 
 #endif
@@ -2,7 +2,12 @@
 #include "binary.h"
 #include "disk_io.h"
 #include "logging.h"
+#include "metrics.h"
+#include "trace.h"
+#include <errno.h>
 #include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
 
 // relative timestamp -> main segment offset position in the file
 static const size_t ENTRY_SIZE = sizeof(uint64_t) * 2;
@@ -30,11 +35,13 @@ int index_load(Persistent_Index *pi, const char *path, uint64_t base)
     char path_buf[MAX_PATH_SIZE];
     snprintf(path_buf, sizeof(path_buf), "%s/i-%.20" PRIu64, path, base);
 
-    pi->fp = open_file(path_buf, "index", "r");
+    pi->fp = open_file(path_buf, "index", "r+");
     if (!pi->fp)
         return -1;
 
+    // A torn trailing entry is ignored and overwritten by the next append
     pi->size           = get_file_size(pi->fp, 0);
+    pi->size           = pi->size - pi->size % ENTRY_SIZE;
     pi->base_timestamp = base;
 
     return 0;
@@ -42,7 +49,7 @@ int index_load(Persistent_Index *pi, const char *path, uint64_t base)
 
 int index_append_offset(Persistent_Index *pi, uint64_t ts, uint64_t offset)
 {
-    uint64_t relative_ts = ts - (pi->base_timestamp * 1e9);
+    uint64_t relative_ts = ts - pi->base_timestamp * (uint64_t)1e9;
 
     // Serialize the position into integer 64bits
     uint8_t buf[ENTRY_SIZE];
@@ -59,52 +66,84 @@ int index_append_offset(Persistent_Index *pi, uint64_t ts, uint64_t offset)
     return 0;
 }
 
-int index_find_offset(const Persistent_Index *pi, uint64_t ts, Range *r)
+int index_truncate(Persistent_Index *pi, size_t n)
 {
-    if (pi->size == 0) {
-        *r = (Range){0, 0};
-        return 0;
+    if (ftruncate(fileno(pi->fp), n * ENTRY_SIZE) < 0) {
+        log_error("Index truncate: %s", strerror(errno));
+        return -1;
     }
 
-    uint64_t base_ts = pi->base_timestamp * (uint64_t)1e9;
+    pi->size = n * ENTRY_SIZE;
 
-    // 1st simple approach, read the entire file and look for the offset
-    // linearly
-    uint8_t buf[INDEX_SIZE];
-    ssize_t len = read_file(pi->fp, buf);
-    if (len < 0)
+    return 0;
+}
+
+int index_sync(const Persistent_Index *pi)
+{
+    uint64_t start = metrics_now();
+    int err        = fdatasync(fileno(pi->fp));
+
+    metrics_record_since(MET_FSYNC, start);
+    if (err < 0)
+        log_error("Index sync: %s", strerror(errno));
+
+    return err;
+}
+
+size_t index_entries(const Persistent_Index *pi)
+{
+    return pi->size / ENTRY_SIZE;
+}
+
+int index_entry_at(const Persistent_Index *pi, size_t n, uint64_t *ts,
+                   uint64_t *offset)
+{
+    uint8_t buf[ENTRY_SIZE];
+
+    // Positional read as lookups can come from multiple threads
+    if (read_at(pi->fp, buf, n * ENTRY_SIZE, ENTRY_SIZE) < (ssize_t)ENTRY_SIZE)
         return -1;
 
-    uint8_t *ptr        = &buf[0];
-    int64_t prev_offset = 0, offset = 0;
-    uint64_t timestamp = 0, entry_ts = 0;
-    while (len > 0) {
-        // Decode from binary
-        timestamp = read_i64(ptr);
-        offset    = read_i64(ptr + sizeof(uint64_t));
-        entry_ts  = timestamp + base_ts;
-        // We went too forward
-        if (entry_ts > ts)
-            break;
-        // Remember the just read offset
-        prev_offset = offset;
-        // Forward the pointer and subtract the total length
-        ptr += ENTRY_SIZE;
-        len -= ENTRY_SIZE;
-        // Found exact match
-        if (entry_ts == ts)
-            break;
-    }
+    *ts     = read_i64(buf) + pi->base_timestamp * (uint64_t)1e9;
+    *offset = read_i64(buf + sizeof(uint64_t));
 
-    // -1 as end only in the case where we read the entire index and we didn't
-    // find anything close to the request timestamp, which means it must be
-    // at the end of the log
-    r->start = prev_offset;
-    r->end   = len == 0 ? -1 : offset;
+    metrics_query_add(QS_INDEX_ENTRIES, 1);
 
     return 0;
 }
 
+/*
+ * Binary search over the entries, each one carries the last timestamp of a
+ * batch, so the entry found is the one of the batch that would hold `ts`.
+ *
+ * Returns the number of entries if `ts` is past the last batch, -1 on error
+ */
+ssize_t index_find_entry(const Persistent_Index *pi, uint64_t ts)
+{
+    size_t lo = 0, hi = index_entries(pi);
+    uint64_t entry_ts = 0, offset = 0;
+    ssize_t found     = -1;
+
+    TRACE_BEGIN(t);
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index_entry_at(pi, mid, &entry_ts, &offset) < 0)
+            goto exit;
+        if (entry_ts < ts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    found = lo;
+
+exit:
+    TRACE_END(t, TRACE_INDEX_FIND);
+
+    return found;
+}
+
 void index_print(const Persistent_Index *pi)
 {
     uint8_t buf[INDEX_SIZE];
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 /*
  * Keeps the state for an index file on disk, updated every interval values
@@ -15,15 +16,6 @@ typedef struct persistent_index {
     uint64_t base_timestamp;
 } Persistent_Index;
 
-/*
- * Represents an offset range containing the requested point(s), with a
- * start and end bounds.
- */
-typedef struct range {
-    int64_t start;
-    int64_t end;
-} Range;
-
 // Initializes a Persistent_Index structure
 int index_init(Persistent_Index *pi, const char *path, uint64_t base);
 
@@ -37,8 +29,21 @@ int index_load(Persistent_Index *pi, const char *path, uint64_t base);
 // structure
 int index_append_offset(Persistent_Index *pi, uint64_t ts, uint64_t offset);
 
-// Finds the offset range for a given timestamp in the index file
-int index_find_offset(const Persistent_Index *pi, uint64_t ts, Range *r);
+// Drops the entries past the first n
+int index_truncate(Persistent_Index *pi, size_t n);
+
+// Syncs the entries appended so far to disk
+int index_sync(const Persistent_Index *pi);
+
+// Returns the number of entries in the index, one per batch in the log
+size_t index_entries(const Persistent_Index *pi);
+
+// Reads the timestamp and offset stored in the n-th entry of the index
+int index_entry_at(const Persistent_Index *pi, size_t n, uint64_t *ts,
+                   uint64_t *offset);
+
+// Finds the first entry with a timestamp not lower than the given one
+ssize_t index_find_entry(const Persistent_Index *pi, uint64_t ts);
 
 // Prints information about a PersistentIndex structure
 void index_print(const Persistent_Index *pi);
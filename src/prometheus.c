@@ -0,0 +1,143 @@
+#include "prometheus.h"
+#include "block_cache.h"
+#include "memory.h"
+#include "metrics.h"
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t length;
+    int overflow;
+} Text;
+
+typedef struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} Family;
+
+static const Family counter_families[MET_COUNTER_NR] = {
+    {"roach_points_total", "counter", "Points inserted"},
+    {"roach_disk_read_bytes_total", "counter", "Bytes read from disk"},
+    {"roach_disk_written_bytes_total", "counter", "Bytes written to disk"},
+    {"roach_partitions_open", "gauge", "Partitions open"}};
+
+static const char *latency_help[MET_LATENCY_NR] = {
+    "Latency of the inserts of a point",
+    "Latency of the lookups of a point",
+    "Latency of the range reads",
+    "Latency of the flushes of a chunk to its partition",
+    "Latency of the appends to the WAL",
+    "Latency of the fsyncs"};
+
+static const char *memory_classes[MEM_CLASS_NR] = {"chunks", "buffers",
+                                                   "cache"};
+
+/*
+ * Upper bounds of the buckets exposed, the histograms are finer grained, each
+ * of their buckets is accounted under the first bound its highest value fits
+ */
+static const struct {
+    uint64_t ns;
+    const char *le;
+} bounds[] = {
+    {1000, "0.000001"},       {2500, "0.0000025"},     {5000, "0.000005"},
+    {10000, "0.00001"},       {25000, "0.000025"},     {50000, "0.00005"},
+    {100000, "0.0001"},       {250000, "0.00025"},     {500000, "0.0005"},
+    {1000000, "0.001"},       {2500000, "0.0025"},     {5000000, "0.005"},
+    {10000000, "0.01"},       {25000000, "0.025"},     {50000000, "0.05"},
+    {100000000, "0.1"},       {250000000, "0.25"},     {500000000, "0.5"},
+    {1000000000, "1"},        {2500000000, "2.5"},     {5000000000, "5"},
+    {10000000000, "10"}};
+
+static void text_append(Text *t, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (t->overflow)
+        return;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(t->buf + t->length, t->size - t->length, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t)n >= t->size - t->length)
+        t->overflow = 1;
+    else
+        t->length += n;
+}
+
+static void text_family(Text *t, const char *name, const char *type,
+                        const char *help)
+{
+    text_append(t, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void encode_histogram(Text *t, Metrics_Latency latency)
+{
+    Metrics_Histogram h;
+    char name[64];
+    uint64_t count = 0;
+    size_t bucket  = 0;
+
+    metrics_histogram(latency, &h);
+
+    snprintf(name, sizeof(name), "roach_%s_duration_seconds",
+             metrics_latency_name(latency));
+    text_family(t, name, "histogram", latency_help[latency]);
+
+    for (size_t i = 0; i < sizeof(bounds) / sizeof(bounds[0]); ++i) {
+        for (; bucket < METRICS_BUCKETS &&
+               metrics_bucket_max(bucket) <= bounds[i].ns;
+             ++bucket)
+            count += h.buckets[bucket];
+        text_append(t, "%s_bucket{le=\"%s\"} %" PRIu64 "\n", name,
+                    bounds[i].le, count);
+    }
+
+    text_append(t, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, h.count);
+    text_append(t, "%s_sum %.9f\n", name, (double)h.sum / 1e9);
+    text_append(t, "%s_count %" PRIu64 "\n", name, h.count);
+}
+
+ssize_t prometheus_encode(char *dst, size_t size)
+{
+    Text t                  = {.buf = dst, .size = size};
+    Block_Cache_Stats cache = {0};
+
+    for (Metrics_Counter c = 0; c < MET_COUNTER_NR; ++c) {
+        const Family *f = &counter_families[c];
+        text_family(&t, f->name, f->type, f->help);
+        text_append(&t, "%s %" PRId64 "\n", f->name, metrics_counter(c));
+    }
+
+    block_cache_stats(&cache);
+    text_family(&t, "roach_cache_hits_total", "counter", "Block cache hits");
+    text_append(&t, "roach_cache_hits_total %" PRIu64 "\n", cache.hits);
+    text_family(&t, "roach_cache_misses_total", "counter",
+                "Block cache misses");
+    text_append(&t, "roach_cache_misses_total %" PRIu64 "\n", cache.misses);
+    text_family(&t, "roach_cache_evictions_total", "counter",
+                "Block cache evictions");
+    text_append(&t, "roach_cache_evictions_total %" PRIu64 "\n",
+                cache.evictions);
+    text_family(&t, "roach_cache_bytes", "gauge", "Block cache size");
+    text_append(&t, "roach_cache_bytes %zu\n", cache.size);
+
+    text_family(&t, "roach_memory_bytes", "gauge",
+                "Memory held by the main consumers");
+    for (Memory_Class c = 0; c < MEM_CLASS_NR; ++c)
+        text_append(&t, "roach_memory_bytes{class=\"%s\"} %zu\n",
+                    memory_classes[c], memory_class_usage(c));
+    text_family(&t, "roach_memory_budget_bytes", "gauge",
+                "Memory budget, 0 if unbounded");
+    text_append(&t, "roach_memory_budget_bytes %zu\n", memory_budget());
+
+    for (Metrics_Latency l = 0; l < MET_LATENCY_NR; ++l)
+        encode_histogram(&t, l);
+
+    return t.overflow ? -1 : (ssize_t)t.length;
+}
@@ -0,0 +1,20 @@
+#ifndef PROMETHEUS_H
+#define PROMETHEUS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Room for the whole exposition, the set of metrics is fixed
+#define PROMETHEUS_TEXT_SIZE (1 << 15)
+
+/*
+ * Render the process metrics in the Prometheus text exposition format, the
+ * counters as roach_*_total, the gauges as they are and the latencies as
+ * histograms in seconds, named roach_*_duration_seconds.
+ *
+ * Returns the length of the text written into `dst`, -1 if it doesn't fit
+ * into `size` bytes.
+ */
+ssize_t prometheus_encode(char *dst, size_t size);
+
+#endif
@@ -1,4 +1,5 @@
 #include "protocol.h"
+#include <float.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
@@ -57,44 +58,130 @@ ssize_t decode_request(const uint8_t *data, Request *dst)
     return dst->length;
 }
 
-ssize_t encode_response(const Response *r, uint8_t *dst)
+ssize_t encode_array_header(size_t length, uint8_t *dst)
 {
-    if (r->type == STRING_RSP) {
-        // String response
-        dst[0] = r->string_response.rc == 0 ? '$' : '!';
-        return 1 + encode_string(dst + 1, r->string_response.message,
-                                 r->string_response.length);
-    }
-    // Array response
     dst[0]    = '#';
     ssize_t i = 1;
-    size_t j  = 0;
 
     // Array length
-    size_t n  = snprintf((char *)dst + i, 20, "%lu", r->array_response.length);
-    i += n;
+    i += snprintf((char *)dst + i, 21, "%lu", length);
 
     // CRLF
     dst[i++] = '\r';
     dst[i++] = '\n';
 
+    return i;
+}
+
+// Decimal digits of `n`, at least `width` of them zero padded
+static size_t encode_u64(uint64_t n, size_t width, uint8_t *dst)
+{
+    uint8_t digits[20];
+    size_t length = 0, i = 0;
+
+    do {
+        digits[length++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0 || length < width);
+
+    while (length > 0)
+        dst[i++] = digits[--length];
+
+    return i;
+}
+
+/*
+ * Same output as "%lf", a value is rounded to its 6th decimal as a fixed point
+ * number when it's far enough from a tie for the product by 1e6 not to flip
+ * the rounding, the rare ones that aren't go through snprintf
+ */
+static size_t encode_f64(double_t value, uint8_t *dst)
+{
+    double x    = (value < 0 ? -value : value) * 1e6;
+    double diff = 0.0;
+    uint64_t r  = 0;
+    size_t i    = 0;
+    int n       = 0;
+
+    // Below 2^50, so x + 0.5 is exact, not a NaN nor an infinity
+    if (x < 1e15) {
+        r    = (uint64_t)(x + 0.5);
+        diff = x < r ? r - x : x - r;
+        if (diff < 0.5 - x * DBL_EPSILON) {
+            if (signbit(value))
+                dst[i++] = '-';
+            i += encode_u64(r / 1000000, 1, dst + i);
+            dst[i++] = '.';
+            i += encode_u64(r % 1000000, 6, dst + i);
+            return i;
+        }
+    }
+
+    // Clamp it on truncation to keep within ARRAY_RECORD_MAX_SIZE
+    n = snprintf((char *)dst, 32, "%lf", value);
+    return n < 32 ? n : 31;
+}
+
+ssize_t encode_array_record(uint64_t timestamp, double_t value, uint8_t *dst)
+{
+    ssize_t i = 0;
+
+    // Timestamp
+    dst[i++] = ':';
+    i += encode_u64(timestamp, 1, dst + i);
+    dst[i++] = '\r';
+    dst[i++] = '\n';
+
+    // Value
+    dst[i++] = ';';
+    i += encode_f64(value, dst + i);
+    dst[i++] = '\r';
+    dst[i++] = '\n';
+
+    return i;
+}
+
+ssize_t encode_series_header(size_t length, uint8_t *dst)
+{
+    ssize_t i = encode_array_header(length, dst);
+    dst[0]    = '%';
+    return i;
+}
+
+ssize_t encode_series_name(const char *name, uint8_t *dst)
+{
+    dst[0] = '$';
+    return 1 + encode_string(dst + 1, name, strlen(name));
+}
+
+static ssize_t encode_array(const Array_Response *r, uint8_t *dst)
+{
+    ssize_t i = encode_array_header(r->length, dst);
+
     // Records
-    while (j < r->array_response.length) {
-        // Timestamp
-        dst[i++] = ':';
-        n        = snprintf((char *)dst + i, 21, "%" PRIu64,
-                            r->array_response.records[j].timestamp);
-        i += n;
-        dst[i++] = '\r';
-        dst[i++] = '\n';
-        // Value
-        dst[i++] = ';';
-        n        = snprintf((char *)dst + i, 21, "%lf",
-                            r->array_response.records[j].value);
-        i += n;
-        dst[i++] = '\r';
-        dst[i++] = '\n';
-        j++;
+    for (size_t j = 0; j < r->length; ++j)
+        i += encode_array_record(r->records[j].timestamp, r->records[j].value,
+                                 dst + i);
+
+    return i;
+}
+
+ssize_t encode_response(const Response *r, uint8_t *dst)
+{
+    if (r->type == STRING_RSP) {
+        // String response
+        dst[0] = r->string_response.rc == 0 ? '$' : '!';
+        return 1 + encode_string(dst + 1, r->string_response.message,
+                                 r->string_response.length);
+    }
+    if (r->type == ARRAY_RSP)
+        return encode_array(&r->array_response, dst);
+
+    // Series response, one named array for each series
+    ssize_t i = encode_series_header(r->series_response.length, dst);
+    for (size_t j = 0; j < r->series_response.length; ++j) {
+        i += encode_series_name(r->series_response.series[j].name, dst + i);
+        i += encode_array(&r->series_response.series[j].array, dst + i);
     }
 
     return i;
@@ -125,85 +212,238 @@ static ssize_t decode_string(const uint8_t *ptr, Response *dst)
     return i + n;
 }
 
+static ssize_t decode_length(const uint8_t *data, size_t *length)
+{
+    const uint8_t *ptr = data;
+
+    *length = 0;
+    while (*ptr != '\r' && *(ptr + 1) != '\n') {
+        *length *= 10;
+        *length += *ptr - '0';
+        ptr++;
+    }
+
+    // Jump over \r\n
+    return ptr - data + 2;
+}
+
+static ssize_t decode_array(const uint8_t *data, Array_Response *dst)
+{
+    const uint8_t *ptr = data;
+    char *end          = NULL;
+
+    if (*ptr++ != '#')
+        return -1;
+
+    ptr += decode_length(ptr, &dst->length);
+
+    // TODO arena malloc here
+    dst->records = malloc(dst->length * sizeof(*dst->records));
+    if (!dst->records)
+        return -1;
+
+    for (size_t j = 0; j < dst->length; ++j) {
+        // Timestamp
+        if (*ptr++ != ':')
+            goto cleanup;
+
+        dst->records[j].timestamp = 0;
+        while (*ptr >= '0' && *ptr <= '9')
+            dst->records[j].timestamp =
+                dst->records[j].timestamp * 10 + (*ptr++ - '0');
+
+        // Skip CRLF + ;
+        ptr += 3;
+
+        // Value, up to the CRLF closing the record
+        dst->records[j].value = strtod((const char *)ptr, &end);
+        if (end == (const char *)ptr)
+            goto cleanup;
+
+        // Skip CRLF
+        ptr = (const uint8_t *)end + 2;
+    }
+
+    return ptr - data;
+
+cleanup:
+    free(dst->records);
+    dst->records = NULL;
+    return -1;
+}
+
+static ssize_t decode_series(const uint8_t *data, Series_Response *dst)
+{
+    const uint8_t *ptr = data + 1;
+    size_t name_length = 0;
+    ssize_t n          = 0;
+
+    ptr += decode_length(ptr, &dst->length);
+
+    dst->series = calloc(dst->length, sizeof(*dst->series));
+    if (!dst->series)
+        return -1;
+
+    for (size_t j = 0; j < dst->length; ++j) {
+        // Series name
+        if (*ptr++ != '$')
+            goto cleanup;
+
+        ptr += decode_length(ptr, &name_length);
+        snprintf(dst->series[j].name, SERIES_NAME_LENGTH, "%.*s",
+                 (int)name_length, ptr);
+
+        // Skip name + CRLF
+        ptr += name_length + 2;
+
+        n = decode_array(ptr, &dst->series[j].array);
+        if (n < 0)
+            goto cleanup;
+
+        ptr += n;
+    }
+
+    return ptr - data;
+
+cleanup:
+    for (size_t j = 0; j < dst->length; ++j)
+        free(dst->series[j].array.records);
+    free(dst->series);
+    dst->series = NULL;
+    return -1;
+}
+
 ssize_t decode_response(const uint8_t *data, Response *dst)
 {
     uint8_t byte   = *data;
     ssize_t length = 0;
 
-    dst->type      = byte == '#' ? ARRAY_RSP : STRING_RSP;
-
     switch (byte) {
     case '$':
     case '!':
         // Treat error and common strings the same for now
-        length = decode_string(data, dst);
+        dst->type = STRING_RSP;
+        length    = decode_string(data, dst);
         break;
     case '#':
-        data++;
-        length++;
-        // Read length
-        dst->array_response.length = 0;
-        while (*data != '\r' && *(data + 1) != '\n' && length++) {
-            dst->array_response.length *= 10;
-            dst->array_response.length += *data - '0';
-            data++;
-        }
-
-        // Jump over \r\n
-        data += 2;
-        length += 2;
-
-        // Read records
-        size_t j             = 0;
-        size_t total_records = dst->array_response.length;
-        uint8_t buf[32];
-        size_t k = 0;
-        // TODO arena malloc here
-        dst->array_response.records =
-            malloc(total_records * sizeof(*dst->array_response.records));
-        while (total_records-- > 0) {
-            // Timestamp
-            if (*data++ != ':')
-                goto cleanup;
-
-            while (*data != '\r' && *(data + 1) != '\n' && length++)
-                buf[k++] = *data++;
-
-            dst->array_response.records[j].timestamp = atoll((const char *)buf);
-            memset(buf, 0x00, sizeof(buf));
-            k = 0;
-
-            // Skip CRLF + ;
-            data += 3;
-            length += 3;
-
-            // Value
-            while (*data != '\r' && *(data + 1) != '\n' && length++)
-                buf[k++] = *data++;
-
-            buf[k]                               = '\0';
-
-            dst->array_response.records[j].value = strtold((char *)buf, NULL);
-
-            // Skip CRLF
-            data += 2;
-            length += 2;
-            j++;
-        }
+        dst->type = ARRAY_RSP;
+        length    = decode_array(data, &dst->array_response);
+        break;
+    case '%':
+        dst->type = SERIES_RSP;
+        length    = decode_series(data, &dst->series_response);
         break;
     default:
+        dst->type = STRING_RSP;
         break;
     }
 
     return length;
+}
 
-cleanup:
-    free(dst->array_response.records);
-    return -1;
+// Length of the line at the head of `data` up to CRLF included, 0 if partial
+static size_t line_length(const uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i + 1 < size; ++i)
+        if (data[i] == '\r' && data[i + 1] == '\n')
+            return i + 2;
+
+    return 0;
+}
+
+static ssize_t string_length(const uint8_t *data, size_t size)
+{
+    size_t length = 0;
+    size_t n      = line_length(data, size);
+
+    if (n == 0)
+        return 0;
+
+    decode_length(data + 1, &length);
+
+    // Payload + CRLF
+    return size - n < length + 2 ? 0 : (ssize_t)(n + length + 2);
+}
+
+static ssize_t array_length(const uint8_t *data, size_t size)
+{
+    size_t length = 0;
+    size_t i      = line_length(data, size);
+    size_t n      = 0;
+
+    if (i == 0)
+        return 0;
+
+    if (data[0] != '#')
+        return -1;
+
+    decode_length(data + 1, &length);
+
+    // A timestamp and a value line for each record
+    for (size_t j = 0; j < length * 2; ++j) {
+        n = line_length(data + i, size - i);
+        if (n == 0)
+            return 0;
+        i += n;
+    }
+
+    return i;
+}
+
+ssize_t response_length(const uint8_t *data, size_t size)
+{
+    size_t length = 0;
+    size_t i      = 0;
+    ssize_t n     = 0;
+
+    if (size == 0)
+        return 0;
+
+    switch (data[0]) {
+    case '$':
+    case '!':
+        return string_length(data, size);
+    case '#':
+        return array_length(data, size);
+    case '%':
+        i = line_length(data, size);
+        if (i == 0)
+            return 0;
+
+        decode_length(data + 1, &length);
+
+        // A name and an array for each series
+        for (size_t j = 0; j < length; ++j) {
+            if (i == size)
+                return 0;
+
+            if (data[i] != '$')
+                return -1;
+
+            n = string_length(data + i, size - i);
+            if (n <= 0)
+                return n;
+            i += n;
+
+            n = array_length(data + i, size - i);
+            if (n <= 0)
+                return n;
+            i += n;
+        }
+
+        return i;
+    default:
+        return -1;
+    }
 }
 
 void free_response(Response *rs)
 {
-    if (rs->type == ARRAY_RSP)
+    if (rs->type == ARRAY_RSP) {
         free(rs->array_response.records);
+    } else if (rs->type == SERIES_RSP && rs->series_response.series) {
+        for (size_t i = 0; i < rs->series_response.length; ++i)
+            free(rs->series_response.series[i].array.records);
+        free(rs->series_response.series);
+    }
 }
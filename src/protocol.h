@@ -36,7 +36,21 @@ typedef struct {
     } *records;
 } Array_Response;
 
-typedef enum { STRING_RSP, ARRAY_RSP } Response_Type;
+#define SERIES_NAME_LENGTH 64
+
+/*
+ * Define a response carrying multiple array responses, one per series, used
+ * as SELECT response when the query targets more than one series.
+ */
+typedef struct {
+    size_t length;
+    struct {
+        char name[SERIES_NAME_LENGTH];
+        Array_Response array;
+    } *series;
+} Series_Response;
+
+typedef enum { STRING_RSP, ARRAY_RSP, SERIES_RSP } Response_Type;
 
 /*
  * Define a generic response which can either be a string response or an array
@@ -47,6 +61,7 @@ typedef struct response {
     union {
         String_Response string_response;
         Array_Response array_response;
+        Series_Response series_response;
     };
 } Response;
 
@@ -56,13 +71,41 @@ ssize_t encode_request(const Request *r, uint8_t *dst);
 // Decode a request from an array of bytes into a Request struct
 ssize_t decode_request(const uint8_t *data, Request *dst);
 
+/*
+ * Upper bound of the encoded size of a single array record, used to size the
+ * output buffer when encoding records directly from a result set:
+ * ':' + 20 digits timestamp + CRLF + ';' + 31 chars value + CRLF
+ */
+#define ARRAY_RECORD_MAX_SIZE 58
+
+// Encode the header of an array response carrying `length` records
+ssize_t encode_array_header(size_t length, uint8_t *dst);
+
+// Encode a single record of an array response
+ssize_t encode_array_record(uint64_t timestamp, double_t value, uint8_t *dst);
+
+/*
+ * Encode the header of a series response carrying `length` series, each
+ * series follows as its name encoded with `encode_series_name` and an array
+ */
+ssize_t encode_series_header(size_t length, uint8_t *dst);
+
+// Encode the name of a series, dst must fit the name plus 25 bytes
+ssize_t encode_series_name(const char *name, uint8_t *dst);
+
 // Encode a response into an array of bytes
 ssize_t encode_response(const Response *r, uint8_t *dst);
 
 // Decode a response from an array of bytes into a Response struct
 ssize_t decode_response(const uint8_t *data, Response *dst);
 
-// Free an array response
+/*
+ * Length of the response at the head of `data`, once it's all there, 0 while
+ * some bytes are still missing, -1 if it's not a response
+ */
+ssize_t response_length(const uint8_t *data, size_t size);
+
+// Free an array or a series response
 void free_response(Response *rs);
 
 #endif // PROTOCOL_H
@@ -20,7 +20,8 @@ static const char *cmd_usage(const char *cmd)
         return "INSERT <timeseries-name> INTO <database-name> timestamp|* "
                "value, ..";
     if (strncasecmp(cmd, "select", 5) == 0)
-        return "SELECT <timeseries-name> FROM <database-name> [RANGE|AT] "
+        return "SELECT <timeseries-name|pattern>[,..] FROM <database-name> "
+               "[RANGE|AT] "
                "start_timestamp [end_timestamp] [WHERE] <identifier> "
                "[<|>|<=|>=|=|!=] [AGGREGATE] [MIN|MAX|AVG] [BY literal]";
     return NULL;
@@ -43,6 +44,14 @@ static void print_response(const Response *rs)
 {
     if (rs->type == STRING_RSP) {
         printf("%s\n", rs->string_response.message);
+    } else if (rs->type == SERIES_RSP) {
+        for (size_t i = 0; i < rs->series_response.length; ++i) {
+            const Array_Response *ar = &rs->series_response.series[i].array;
+            for (size_t j = 0; j < ar->length; ++j)
+                printf("%s %" PRIu64 " %.6f\n",
+                       rs->series_response.series[i].name,
+                       ar->records[j].timestamp, ar->records[j].value);
+        }
     } else {
         for (size_t i = 0; i < rs->array_response.length; ++i)
             printf("%" PRIu64 " %.6f\n",
@@ -97,7 +106,12 @@ int main(void)
             delta = timespec_seconds(&end_time) - timespec_seconds(&end_time);
             printf("%lu results in %lf seconds.\n", rs.array_response.length,
                    delta);
+        } else if (rs.type == SERIES_RSP) {
+            delta = timespec_seconds(&end_time) - timespec_seconds(&end_time);
+            printf("%lu series in %lf seconds.\n", rs.series_response.length,
+                   delta);
         }
+        free_response(&rs);
     }
     client_disconnect(&c);
     free(line);
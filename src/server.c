@@ -2,41 +2,334 @@
 #define EV_SOURCE
 #define EV_TCP_SOURCE
 #include "ev_tcp.h"
+#include "arena.h"
+#include "block_cache.h"
+#include "commit_log.h"
 #include "logging.h"
+#include "memory.h"
+#include "metrics.h"
 #include "parser.h"
+#include "prometheus.h"
 #include "protocol.h"
 #include "server.h"
+#include "shard.h"
 #include "timeseries.h"
+#include "trace.h"
+#include "worker.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #define BACKLOG 128
 
+// Default memory budget, overridden by ROACH_MEMORY_BUDGET, e.g. 256M
+#define MEMORY_BUDGET      ((size_t)512 << 20)
+// Default size of the block cache, overridden by ROACH_CACHE_SIZE
+#define BLOCK_CACHE_SIZE   ((size_t)64 << 20)
+// Room of the per-request arena before it grows on the heap
+#define REQUEST_ARENA_SIZE (1 << 14)
+// Heap blocks kept by the per-request arena between requests, past it they
+// are given back once the request is served
+#define REQUEST_ARENA_HIGH (1 << 22)
+// Default port of the Prometheus endpoint, overridden by ROACH_METRICS_PORT,
+// 0 disables it
+#define METRICS_PORT       17679
+// Default threshold of the slow query log, overridden by ROACH_SLOW_QUERY_MS,
+// fractions allowed, 0 logs every query and a negative one none
+#define SLOW_QUERY_MS      100
+// Longest HTTP request header accepted by the metrics endpoint
+#define HTTP_HEADER_MAX    8192
+// Most blocks read ahead of a SELECT, the scan reads the rest by itself
+#define PREFETCH_BLOCKS    64
+// Counters, cache and memory stats, plus 7 figures per latency histogram
+#define STATS_MAX          (MET_COUNTER_NR + 5 + MET_LATENCY_NR * 7)
+
 #define add_string_response(resp, str, rc)                                     \
     do {                                                                       \
         (resp).type   = STRING_RSP;                                            \
         size_t length = strlen((str));                                         \
         memset((resp).string_response.message, 0x00,                           \
                sizeof((resp).string_response.message));                        \
-        strncpy((resp).string_response.message, (str), length);                \
+        memcpy((resp).string_response.message, (str), length);                 \
         (resp).string_response.length = length;                                \
     } while (0)
 
 // testing dummy
 static Timeseries_DB *db = NULL;
 
-static Response execute_statement(const Statement *statement)
+// Writer threads, each series is owned by exactly one of them
+static Shard_Pool shards = {0};
+
+// Reader threads, multi-series SELECT scan each series on one of them
+static Worker_Pool workers = {0};
+
+// Temporaries of the request being served, rewound after each one, requests
+// are served one at a time by the event loop thread
+static uint8_t request_buffer[REQUEST_ARENA_SIZE];
+static Arena request_arena          = {0};
+// Heap blocks of the request arena reported to the memory accountant
+static size_t request_arena_reserved = 0;
+
+// Work done by the request being served, the scans of the workers included
+static Query_Stats request_stats;
+
+/*
+ * Rewind the request arena once a request is served, the heap blocks it grew
+ * by count as buffers and are kept for the next requests, unless a large one
+ * took them past REQUEST_ARENA_HIGH
+ */
+static void request_arena_reset(void)
+{
+    if (request_arena.reserved > REQUEST_ARENA_HIGH)
+        arena_destroy(&request_arena);
+    else
+        arena_free_all(&request_arena);
+
+    if (request_arena.reserved > request_arena_reserved)
+        memory_add(MEM_BUFFERS,
+                   request_arena.reserved - request_arena_reserved);
+    else
+        memory_sub(MEM_BUFFERS,
+                   request_arena_reserved - request_arena.reserved);
+    request_arena_reserved = request_arena.reserved;
+}
+
+static int64_t slow_query_ns = SLOW_QUERY_MS * (int64_t)1e6;
+
+/*
+ * INSERT handed to the shard owning its series, the client is replied to by
+ * the loop once the shard applied it, `next` links it into the completions,
+ * or into the parked ones of its shard while the ring of the shard is full
+ */
+typedef struct pending_insert {
+    ev_tcp_handle *client;
+    int rc;
+    size_t shard;
+    Shard_Command command;
+    struct pending_insert *next;
+    Record records[];
+} Pending_Insert;
+
+// INSERTs applied by the shards waiting for their reply, pushed by the shard
+// threads, drained by the loop once `inserts_fd` is signaled
+static _Atomic(Pending_Insert *) inserts_applied = NULL;
+static int inserts_fd                           = -1;
+
+// INSERTs waiting for room in the ring of their shard, in arrival order, only
+// touched by the loop, resubmitted as the shards apply the ones before them
+static struct {
+    Pending_Insert *head;
+    Pending_Insert *tail;
+} inserts_parked[SHARD_MAX_NR];
+
+/*
+ * Scan of a single series of a multi-series SELECT, the results are collected
+ * into `points` by one of the workers, out of an arena of its own as the
+ * scans run concurrently
+ */
+typedef struct {
+    const Statement_Select *select;
+    Timeseries *ts;
+    Query_Stats *stats;
+    Arena arena;
+    Points points;
+    int err;
+} Series_Scan;
+
+typedef VEC(Series_Scan) Series_Scans;
+
+static void series_scan(void *arg)
+{
+    Series_Scan *scan   = arg;
+    Allocator allocator = arena_allocator(&scan->arena);
+    Record r            = {0};
+
+    metrics_query_attach(scan->stats);
+
+    if (scan->select->mask & SM_SINGLE) {
+        scan->err = ts_find(scan->ts, scan->select->start_time, &r);
+        if (scan->err == 0)
+            vec_push_alloc(scan->points, r, allocator);
+    } else if (scan->select->mask & SM_RANGE) {
+        scan->err = ts_range_with_allocator(
+            scan->ts, scan->select->start_time, scan->select->end_time,
+            &scan->points, allocator);
+    }
+
+    metrics_query_attach(NULL);
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Add a scan on the series `name`, skipping it if it doesn't carry the labels
+ * selected, `matched` being the sorted names of the series carrying them, or
+ * NULL if there's no label to match
+ */
+static int series_scans_add(Series_Scans *scans, const Statement_Select *select,
+                            const char *name, const Series_Names *matched)
+{
+    Series_Scan scan = {.select = select, .stats = &request_stats};
+
+    if (matched && !bsearch(&name, matched->data, vec_size(*matched),
+                            sizeof(char *), name_cmp))
+        return 0;
+
+    scan.ts = shard_series_get(&shards, db, name, 0);
+    if (!scan.ts)
+        return -1;
+
+    // The same series can be listed more than once or match more patterns
+    for (size_t i = 0; select->ts_len > 1 && i < vec_size(*scans); ++i)
+        if (vec_at(*scans, i).ts == scan.ts)
+            return 0;
+
+    scan.arena = arena_init(NULL, 0);
+    vec_new_alloc(scan.points, arena_allocator(&scan.arena));
+    vec_push_alloc(*scans, scan, arena_allocator(&request_arena));
+
+    return 1;
+}
+
+/*
+ * Resolve the series listed by a multi-series SELECT, expanding the glob
+ * patterns on the names in the DB and narrowing them down to those carrying
+ * the labels selected, if any, then scan them in parallel on the worker pool,
+ * the calling thread waits for all of them to be done.
+ *
+ * Returns the number of series scanned or -1 if a listed series is missing
+ */
+static int execute_multi_select(const Statement_Select *select,
+                                 Series_Scans *scans)
+{
+    Series_Names names, matched;
+    Label matchers[LABELS_LENGTH];
+    Work_Group group;
+    int err = 0;
+
+    vec_new(names);
+    vec_new(matched);
+
+    for (size_t i = 0; i < select->label_len; ++i)
+        matchers[i] = (Label){.name  = select->labels[i].name,
+                              .value = select->labels[i].value};
+
+    if (select->label_len > 0 &&
+        tsdb_series_by_labels(db, matchers, select->label_len, &matched) < 0)
+        err = -1;
+
+    // Only labels, all the series carrying them are selected
+    if (select->ts_len == 0) {
+        for (size_t i = 0; i < vec_size(matched) && err == 0; ++i)
+            if (series_scans_add(scans, select, vec_at(matched, i), NULL) < 0)
+                err = -1;
+    }
+
+    for (size_t i = 0; i < select->ts_len && err == 0; ++i) {
+        const char *name = select->ts_names[i];
+        if (!strpbrk(name, "*?[")) {
+            if (series_scans_add(scans, select, name,
+                                 select->label_len > 0 ? &matched : NULL) < 0)
+                err = -1;
+            continue;
+        }
+
+        // Series may vanish between the listing and the lookup, skip them
+        if (tsdb_series(db, name, &names) < 0)
+            log_error("Can't list series matching %s", name);
+        for (size_t j = 0; j < vec_size(names); ++j) {
+            series_scans_add(scans, select, vec_at(names, j),
+                             select->label_len > 0 ? &matched : NULL);
+            free(vec_at(names, j));
+        }
+        vec_size(names) = 0;
+    }
+
+    for (size_t i = 0; i < vec_size(matched); ++i)
+        free(vec_at(matched, i));
+    vec_destroy(matched);
+    vec_destroy(names);
+
+    if (err < 0)
+        return -1;
+
+    work_group_init(&group);
+
+    for (size_t i = 0; i < vec_size(*scans); ++i) {
+        // Fallback to scan it on the calling thread
+        if (worker_pool_submit(&workers, &group, series_scan,
+                               &vec_at(*scans, i)) < 0)
+            series_scan(&vec_at(*scans, i));
+    }
+
+    work_group_wait(&group);
+    sem_destroy(&group.done);
+
+    return vec_size(*scans);
+}
+
+/*
+ * Update the default chunk settings of `tsdb` with the ones given by a
+ * CREATE of the DB, those not given are left as they are, a CREATE naming
+ * another DB is refused rather than changing the settings of this one
+ */
+static int create_defaults(Timeseries_DB *tsdb, const Statement_Create *create)
+{
+    Chunk_Settings defaults;
+
+    if (strcmp(tsdb->data_path, create->db_name) != 0)
+        return -1;
+
+    if (create->chunk_size == 0 && create->flush_size == 0)
+        return 0;
+
+    catalog_defaults(tsdb->catalog, &defaults);
+    if (create->chunk_size > 0)
+        defaults.chunk_size = create->chunk_size;
+    if (create->flush_size > 0)
+        defaults.flush_size = create->flush_size;
+
+    return tsdb_set_defaults(tsdb, &defaults);
+}
+
+/*
+ * Execute a statement, SELECT results are collected into `coll`, or into
+ * `scans` for multi-series SELECT, which are encoded straight into the output
+ * buffers by the caller, the response only carries the number of records or
+ * series found. `series` is the series of a single series SELECT if already
+ * resolved, NULL otherwise
+ */
+static Response execute_statement(const Statement *statement,
+                                  Timeseries *series, Points *coll,
+                                  Series_Scans *scans)
 {
     Response rs    = {0};
     Record r       = {0};
     Timeseries *ts = NULL;
     int err        = 0;
-    struct timespec tv;
+    Chunk_Settings settings;
+    Label labels[LABELS_LENGTH];
 
     switch (statement->type) {
     case STATEMENT_CREATE:
+        if (statement->create.chunk_size > UINT32_MAX ||
+            statement->create.flush_size > UINT32_MAX)
+            goto err;
         if (statement->create.mask == 0) {
-            db = tsdb_init(statement->create.db_name);
+            // Opening the DB twice would replay its WAL under the live one,
+            // a single DB is served, no other can be opened alongside it
             if (!db)
+                db = tsdb_init(statement->create.db_name);
+            else if (strcmp(db->data_path, statement->create.db_name) != 0)
                 goto err;
+            if (!db || create_defaults(db, &statement->create) < 0)
+                goto err;
+            add_string_response(rs, "Ok", 0);
+            break;
         } else {
             if (!db)
                 db = tsdb_init(statement->create.db_name);
@@ -44,40 +337,28 @@ static Response execute_statement(const Statement *statement)
             if (!db)
                 goto err;
 
-            ts = ts_create(db, statement->create.ts_name, 0, DP_IGNORE);
+            for (size_t i = 0; i < statement->create.label_len; ++i)
+                labels[i] =
+                    (Label){.name  = statement->create.labels[i].name,
+                            .value = statement->create.labels[i].value};
+
+            settings = (Chunk_Settings){
+                .chunk_size = statement->create.chunk_size,
+                .flush_size = statement->create.flush_size};
+            ts = shard_series_create(&shards, db, statement->create.ts_name,
+                                     &settings, labels,
+                                     statement->create.label_len);
         }
         if (!ts)
             goto err;
         else
             add_string_response(rs, "Ok", 0);
         break;
-    case STATEMENT_INSERT:
-        if (!db)
-            db = tsdb_init(statement->insert.db_name);
-
-        if (!db)
-            goto err;
-
-        ts = ts_get(db, statement->insert.ts_name);
-        if (!ts)
-            goto err_not_found;
-
-        uint64_t timestamp = 0;
-        for (size_t i = 0; i < statement->insert.record_len; ++i) {
-            if (statement->insert.records[i].timestamp == -1) {
-                clock_gettime(CLOCK_REALTIME, &tv);
-                timestamp = tv.tv_sec * 1e9 + tv.tv_nsec;
-            } else {
-                timestamp = statement->insert.records[i].timestamp;
-            }
-
-            err = ts_insert(ts, timestamp, statement->insert.records[i].value);
-            if (err < 0)
-                goto err;
-            else
-                add_string_response(rs, "Ok", 0);
-        }
-
+    case STATEMENT_STATS:
+        // Encoded by the caller, one series per figure
+        rs.type                   = SERIES_RSP;
+        rs.series_response.length = STATS_MAX;
+        rs.series_response.series = NULL;
         break;
     case STATEMENT_SELECT:
         if (!db)
@@ -86,14 +367,25 @@ static Response execute_statement(const Statement *statement)
         if (!db)
             goto err;
 
-        ts = ts_get(db, statement->select.ts_name);
+        if (statement->select.mask & SM_MULTI) {
+            err = execute_multi_select(&statement->select, scans);
+            if (err < 0)
+                goto err_not_found;
+
+            rs.type                   = SERIES_RSP;
+            rs.series_response.length = vec_size(*scans);
+            rs.series_response.series = NULL;
+            break;
+        }
+
+        ts = series;
+        if (!ts)
+            ts = shard_series_get(&shards, db, statement->select.ts_name, 0);
         if (!ts)
             goto err_not_found;
 
-        int err = 0;
-        Points coll;
-        vec_new(coll);
-
+        // Reads don't go through the owner shard, they run on a snapshot of
+        // the live series
         if (statement->select.mask & SM_SINGLE) {
             err = ts_find(ts, statement->select.start_time, &r);
             if (err < 0) {
@@ -101,42 +393,26 @@ static Response execute_statement(const Statement *statement)
                           statement->select.start_time);
                 goto err_not_found;
             } else {
-                log_info("Record found: %lu %.2lf", r.timestamp, r.value);
-                rs.type                  = ARRAY_RSP;
-                rs.array_response.length = 1;
-                rs.array_response.records =
-                    calloc(1, sizeof(*rs.array_response.records));
-                rs.array_response.records[0].timestamp = r.timestamp;
-                rs.array_response.records[0].value     = r.value;
+                log_debug("Record found: %lu %.2lf", r.timestamp, r.value);
+                vec_push_alloc(*coll, r, arena_allocator(&request_arena));
             }
         } else if (statement->select.mask & SM_RANGE) {
-            err = ts_range(ts, statement->select.start_time,
-                           statement->select.end_time, &coll);
-            if (err < 0) {
+            err = ts_range_with_allocator(
+                ts, statement->select.start_time, statement->select.end_time,
+                coll, arena_allocator(&request_arena));
+            if (err < 0)
                 log_error("Couldn't find the record %lu",
                           statement->select.start_time);
-            } else {
-                for (size_t i = 0; i < vec_size(coll); i++) {
-                    Record r = vec_at(coll, i);
-                    log_info(" %lu {.sec: %lu, .nsec: %lu .value: %.02f }",
-                             r.timestamp, r.tv.tv_sec, r.tv.tv_nsec, r.value);
-                }
-            }
-            rs.array_response.length = vec_size(coll);
-            for (size_t i = 0; i < vec_size(coll); ++i) {
-                rs.array_response.records[i].timestamp = r.timestamp;
-                rs.array_response.records[i].value     = r.value;
-            }
         }
+        rs.type                   = ARRAY_RSP;
+        rs.array_response.length  = vec_size(*coll);
+        rs.array_response.records = NULL;
         break;
     default:
         log_error("Unknown command");
         break;
     }
 
-    if (ts)
-        ts_close(ts);
-
     return rs;
 
 err:
@@ -149,50 +425,644 @@ err_not_found:
     return rs;
 }
 
+/*
+ * Called by the owner shard once it applied an INSERT, the reply is left to
+ * the loop
+ */
+static void on_insert_applied(void *data, int rc)
+{
+    Pending_Insert *insert = data;
+
+    insert->rc             = rc;
+    insert->next =
+        atomic_load_explicit(&inserts_applied, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(
+        &inserts_applied, &insert->next, insert, memory_order_release,
+        memory_order_relaxed))
+        ;
+
+    (void)eventfd_write(inserts_fd, 1);
+}
+
+/*
+ * Submit the parked INSERTs of a shard until its ring fills up again
+ */
+static void submit_parked(size_t shard)
+{
+    Pending_Insert *insert = inserts_parked[shard].head, *next = NULL;
+
+    // `next` is reused by the shard once the INSERT is submitted
+    for (; insert; insert = next) {
+        next = insert->next;
+        if (shard_submit(&shards, &insert->command) < 0)
+            break;
+    }
+
+    inserts_parked[shard].head = insert;
+    if (!insert)
+        inserts_parked[shard].tail = NULL;
+}
+
+/*
+ * Hand an INSERT to the shard owning the series without waiting for it, the
+ * series is written only by its owner, the client is replied to once the
+ * whole batch is applied, see `on_inserts_applied`. If the ring of the shard
+ * is full the INSERT is parked until there's room. Returns 0 if submitted,
+ * -1 with the reply to send right away in `rs` otherwise
+ */
+static int submit_insert(ev_tcp_handle *client, const Statement_Insert *insert,
+                         Response *rs)
+{
+    Shard_Command *command = NULL;
+    Timeseries *ts         = NULL;
+    Pending_Insert *queued = NULL;
+    struct timespec tv;
+
+    if (!db)
+        db = tsdb_init(insert->db_name);
+
+    if (!db)
+        goto err;
+
+    ts = shard_series_get(&shards, db, insert->ts_name, 0);
+    if (!ts) {
+        add_string_response(*rs, "Not found", 0);
+        return -1;
+    }
+
+    queued = malloc(sizeof(*queued) + insert->record_len * sizeof(Record));
+    if (!queued)
+        goto err;
+
+    queued->client = client;
+    queued->rc     = 0;
+    queued->shard  = shard_index(&shards, ts->db_data_path, ts->name);
+    queued->next   = NULL;
+
+    for (size_t i = 0; i < insert->record_len; ++i) {
+        if (insert->records[i].timestamp == -1) {
+            clock_gettime(CLOCK_REALTIME, &tv);
+            queued->records[i].timestamp =
+                tv.tv_sec * (uint64_t)1e9 + tv.tv_nsec;
+        } else {
+            queued->records[i].timestamp = insert->records[i].timestamp;
+        }
+        queued->records[i].value = insert->records[i].value;
+    }
+
+    command                 = &queued->command;
+    command->type           = SC_INSERT;
+    command->ts             = ts;
+    command->insert.records = queued->records;
+    command->insert.length  = insert->record_len;
+    command->done           = on_insert_applied;
+    command->data           = queued;
+
+    // Queue behind the INSERTs already parked on the shard, if any, not to
+    // overtake them
+    if (inserts_parked[queued->shard].head ||
+        shard_submit(&shards, command) < 0) {
+        if (inserts_parked[queued->shard].tail)
+            inserts_parked[queued->shard].tail->next = queued;
+        else
+            inserts_parked[queued->shard].head = queued;
+        inserts_parked[queued->shard].tail = queued;
+    }
+
+    // No more requests from the client until this one is replied to
+    ev_fire_event(client->ctx, client->c->fd, EV_NONE, NULL, NULL);
+
+    // Let the shards flush some chunks in the background, the writes go on
+    // meanwhile
+    if (memory_over_budget())
+        shard_pool_spill(&shards);
+
+    return 0;
+
+err:
+    add_string_response(*rs, "Err", 0);
+    return -1;
+}
+
+/*
+ * Reply to the INSERTs applied by the shards since the last time
+ */
+static void on_inserts_applied(ev_context *ctx, void *arg)
+{
+    (void)ctx;
+    (void)arg;
+    Pending_Insert *insert = NULL, *next = NULL;
+    eventfd_t count        = 0;
+
+    (void)eventfd_read(inserts_fd, &count);
+
+    insert = atomic_exchange_explicit(&inserts_applied, NULL,
+                                      memory_order_acquire);
+    for (; insert; insert = next) {
+        Response rs           = {0};
+        ev_tcp_handle *client = insert->client;
+
+        next                  = insert->next;
+        if (insert->rc < 0)
+            add_string_response(rs, "Err", insert->rc);
+        else
+            add_string_response(rs, "Ok", 0);
+
+        client->buffer.size =
+            encode_response(&rs, (uint8_t *)client->buffer.buf);
+        ev_tcp_queue_write(client);
+
+        free(insert);
+    }
+
+    // The shards made some room in their rings
+    for (size_t i = 0; i < shards.size; ++i)
+        if (inserts_parked[i].head)
+            submit_parked(i);
+}
+
 static void on_close(ev_tcp_handle *client, int err)
 {
     (void)client;
     if (err == EV_TCP_SUCCESS)
-        log_info("Closed connection with %s:%i", client->addr, client->port);
+        log_debug("Closed connection with %s:%i", client->addr, client->port);
     else
-        log_info("Connection closed: %s", ev_tcp_err(err));
+        log_debug("Connection closed: %s", ev_tcp_err(err));
     free(client);
 }
 
 static void on_write(ev_tcp_handle *client)
 {
-    log_info("Written %lu bytes to %s:%i", client->to_write, client->addr,
-             client->port);
+    log_debug("Written %lu bytes to %s:%i", client->to_write, client->addr,
+              client->port);
 }
 
-static void on_data(ev_tcp_handle *client)
+/*
+ * Output of an array response, the iovec list references the header encoded
+ * into the client buffer and the records encoded directly from the result set
+ * into the trailing data, the whole block is released once written out
+ */
+typedef struct {
+    size_t size;
+    struct iovec iov[2];
+    uint8_t data[];
+} Array_Output;
+
+static Array_Output *array_output_alloc(size_t size)
+{
+    Array_Output *out = malloc(sizeof(*out) + size);
+    if (!out)
+        return NULL;
+    out->size = sizeof(*out) + size;
+    memory_add(MEM_BUFFERS, out->size);
+    return out;
+}
+
+static void array_output_release(void *ptr)
+{
+    Array_Output *out = ptr;
+    memory_sub(MEM_BUFFERS, out->size);
+    free(out);
+}
+
+/*
+ * Queue the iovec list of an output block, the block is released straight
+ * away if it can't be queued
+ */
+static int queue_output(ev_tcp_handle *client, Array_Output *out)
+{
+    if (ev_tcp_queue_writev(client, out->iov, 2, array_output_release, out) ==
+        EV_TCP_SUCCESS)
+        return 0;
+
+    array_output_release(out);
+
+    return -1;
+}
+
+static int queue_array_response(ev_tcp_handle *client, const Points *coll)
+{
+    size_t length      = vec_size(*coll);
+    Array_Output *out  = array_output_alloc(length * ARRAY_RECORD_MAX_SIZE);
+    uint8_t *header    = (uint8_t *)client->buffer.buf;
+    ssize_t header_len = 0, n = 0;
+
+    if (!out)
+        return -1;
+
+    header_len = encode_array_header(length, header);
+
+    for (size_t i = 0; i < length; ++i) {
+        const Record *r = &vec_at(*coll, i);
+        n += encode_array_record(r->timestamp, r->value, out->data + n);
+    }
+
+    out->iov[0] = (struct iovec){.iov_base = header, .iov_len = header_len};
+    out->iov[1] = (struct iovec){.iov_base = out->data, .iov_len = n};
+
+    // The header is referenced by the iovec list, nothing left to write from
+    // the buffer itself
+    client->buffer.size = 0;
+
+    return queue_output(client, out);
+}
+
+/*
+ * Output of a series response, each series is encoded as its name followed by
+ * an array of its records, all into the trailing data of the output block
+ */
+static int queue_series_response(ev_tcp_handle *client,
+                                 const Series_Scans *scans)
+{
+    size_t size        = 0;
+    uint8_t *header    = (uint8_t *)client->buffer.buf;
+    ssize_t header_len = 0, n = 0;
+    Array_Output *out  = NULL;
+
+    // Name and array header, 2 lengths up to 20 digits, markers and CRLFs
+    for (size_t i = 0; i < vec_size(*scans); ++i)
+        size += strlen(vec_at(*scans, i).ts->name) + 50 +
+                vec_size(vec_at(*scans, i).points) * ARRAY_RECORD_MAX_SIZE;
+
+    out = array_output_alloc(size);
+    if (!out)
+        return -1;
+
+    header_len = encode_series_header(vec_size(*scans), header);
+
+    for (size_t i = 0; i < vec_size(*scans); ++i) {
+        const Series_Scan *scan = &vec_at(*scans, i);
+        n += encode_series_name(scan->ts->name, out->data + n);
+        n += encode_array_header(vec_size(scan->points), out->data + n);
+        for (size_t j = 0; j < vec_size(scan->points); ++j) {
+            const Record *r = &vec_at(scan->points, j);
+            n += encode_array_record(r->timestamp, r->value, out->data + n);
+        }
+    }
+
+    out->iov[0] = (struct iovec){.iov_base = header, .iov_len = header_len};
+    out->iov[1] = (struct iovec){.iov_base = out->data, .iov_len = n};
+
+    client->buffer.size = 0;
+
+    return queue_output(client, out);
+}
+
+typedef struct {
+    char name[IDENTIFIER_LENGTH];
+    double_t value;
+} Stat;
+
+/*
+ * Snapshot of the process metrics, the latencies are in nanoseconds, as
+ * count, mean, a few percentiles and max of each histogram
+ */
+static size_t stats_collect(Stat *stats)
+{
+    static const double percentiles[]   = {50.0, 90.0, 99.0, 99.9};
+    static const char *percentile_names[] = {"p50", "p90", "p99", "p999"};
+    Block_Cache_Stats cache               = {0};
+    Metrics_Histogram h;
+    size_t n = 0;
+
+    for (Metrics_Counter c = 0; c < MET_COUNTER_NR; ++c, ++n) {
+        snprintf(stats[n].name, IDENTIFIER_LENGTH, "%s",
+                 metrics_counter_name(c));
+        stats[n].value = metrics_counter(c);
+    }
+
+    block_cache_stats(&cache);
+    stats[n++] = (Stat){"cache_hits", cache.hits};
+    stats[n++] = (Stat){"cache_misses", cache.misses};
+    stats[n++] = (Stat){"cache_evictions", cache.evictions};
+    stats[n++] = (Stat){"cache_bytes", cache.size};
+    stats[n++] = (Stat){"memory_bytes", memory_usage()};
+
+    for (Metrics_Latency l = 0; l < MET_LATENCY_NR; ++l) {
+        const char *name = metrics_latency_name(l);
+        metrics_histogram(l, &h);
+        snprintf(stats[n].name, IDENTIFIER_LENGTH, "%s_count", name);
+        stats[n++].value = h.count;
+        snprintf(stats[n].name, IDENTIFIER_LENGTH, "%s_mean_ns", name);
+        stats[n++].value = h.count ? (double)h.sum / h.count : 0.0;
+        for (size_t i = 0; i < sizeof(percentiles) / sizeof(*percentiles);
+             ++i, ++n) {
+            snprintf(stats[n].name, IDENTIFIER_LENGTH, "%s_%s_ns", name,
+                     percentile_names[i]);
+            stats[n].value = metrics_percentile(&h, percentiles[i]);
+        }
+        snprintf(stats[n].name, IDENTIFIER_LENGTH, "%s_max_ns", name);
+        stats[n++].value = h.max;
+    }
+
+    return n;
+}
+
+/*
+ * Output of a STATS response, a series response where each figure is a series
+ * named after it with a single record, stamped with the current time
+ */
+static int queue_stats_response(ev_tcp_handle *client)
+{
+    Stat stats[STATS_MAX];
+    uint8_t *header    = (uint8_t *)client->buffer.buf;
+    ssize_t header_len = 0, n = 0;
+    Array_Output *out  = NULL;
+    size_t length      = stats_collect(stats);
+    struct timespec tv;
+
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t now = tv.tv_sec * (uint64_t)1e9 + tv.tv_nsec;
+
+    // Name and array header, markers and CRLFs, as for the series response
+    out = array_output_alloc(length *
+                             (IDENTIFIER_LENGTH + 50 + ARRAY_RECORD_MAX_SIZE));
+    if (!out)
+        return -1;
+
+    header_len = encode_series_header(length, header);
+
+    for (size_t i = 0; i < length; ++i) {
+        n += encode_series_name(stats[i].name, out->data + n);
+        n += encode_array_header(1, out->data + n);
+        n += encode_array_record(now, stats[i].value, out->data + n);
+    }
+
+    out->iov[0] = (struct iovec){.iov_base = header, .iov_len = header_len};
+    out->iov[1] = (struct iovec){.iov_base = out->data, .iov_len = n};
+
+    client->buffer.size = 0;
+
+    return queue_output(client, out);
+}
+
+/*
+ * Reply with a bare error when the response can't be queued, so the client
+ * isn't left waiting for it
+ */
+static void queue_error_response(ev_tcp_handle *client)
 {
-    if (client->buffer.size == 0)
-        return;
-    Request rq  = {0};
     Response rs = {0};
-    ssize_t n   = decode_request((const uint8_t *)client->buffer.buf, &rq);
-    if (n < 0) {
+
+    add_string_response(rs, "Err", 1);
+    rs.string_response.rc = 1;
+    client->buffer.size   = encode_response(&rs, (uint8_t *)client->buffer.buf);
+    ev_tcp_queue_write(client);
+}
+
+/*
+ * Log a query slower than the threshold along with the work it took, times
+ * in milliseconds
+ */
+static void log_slow_query(const Request *rq, size_t returned, uint64_t start,
+                           uint64_t parsed, uint64_t executed,
+                           uint64_t encoded)
+{
+    log_warn("Slow query %.3f ms, parse %.3f execute %.3f encode %.3f, "
+             "partitions %" PRIu64 " index_entries %" PRIu64
+             " bytes_read %" PRIu64 " blocks_decoded %" PRIu64
+             " points_scanned %" PRIu64 " returned %zu: %.*s",
+             (encoded - start) / 1e6, (parsed - start) / 1e6,
+             (executed - parsed) / 1e6, (encoded - executed) / 1e6,
+             metrics_query_get(&request_stats, QS_PARTITIONS),
+             metrics_query_get(&request_stats, QS_INDEX_ENTRIES),
+             metrics_query_get(&request_stats, QS_BYTES_READ),
+             metrics_query_get(&request_stats, QS_BLOCKS_DECODED),
+             metrics_query_get(&request_stats, QS_POINTS_SCANNED), returned,
+             (int)(rq->length < sizeof(rq->query) ? rq->length
+                                                   : sizeof(rq->query)),
+             rq->query);
+}
+
+/*
+ * Request decoded and parsed once it's read, `statement` is left empty if it
+ * can't be decoded, `ts` is the series of a single series SELECT once
+ * resolved by its prefetch
+ */
+typedef struct {
+    Request rq;
+    Statement statement;
+    Timeseries *ts;
+    int decoded;
+    uint64_t start;
+    uint64_t parsed;
+} Client_Request;
+
+/*
+ * Serve a request read from the client
+ */
+static void serve_request(ev_tcp_handle *client, const Client_Request *cr)
+{
+    TRACE_BEGIN(request);
+    Response rs                = {0};
+    Allocator allocator        = arena_allocator(&request_arena);
+    const Statement *statement = &cr->statement;
+    Statement_Type type        = statement->type;
+    uint64_t start             = cr->start;
+    uint64_t parsed            = cr->parsed, executed = parsed;
+    size_t returned            = 0;
+    int err                    = 0, deferred = 0;
+    ssize_t n                  = 0;
+    Points coll;
+    Series_Scans scans;
+    vec_new_alloc(coll, allocator);
+    vec_new_alloc(scans, allocator);
+    metrics_query_reset(&request_stats);
+    metrics_query_attach(&request_stats);
+    if (!cr->decoded) {
         log_error("Can't decode a request from data");
         rs.type               = STRING_RSP;
         rs.string_response.rc = 1;
         strncpy(rs.string_response.message, "Err", 4);
         rs.string_response.length = 4;
     } else {
-        // Parse into Statement
-        Statement statement = parse(rq.query);
-        // Execute it
-        rs                  = execute_statement(&statement);
+        // Execute it, INSERTs are replied to once applied by their shard
+        if (type == STATEMENT_INSERT)
+            deferred = submit_insert(client, &statement->insert, &rs) == 0;
+        else
+            rs = execute_statement(statement, cr->ts, &coll, &scans);
+        executed = metrics_now();
     }
 
     ev_tcp_zero_buffer(client);
 
-    n                   = encode_response(&rs, (uint8_t *)client->buffer.buf);
-    client->buffer.size = n;
-    log_info("Data: %s", client->buffer.buf);
+    TRACE_BEGIN(encode);
+    if (type == STATEMENT_STATS) {
+        err = queue_stats_response(client);
+    } else if (rs.type == ARRAY_RSP) {
+        err = queue_array_response(client, &coll);
+    } else if (rs.type == SERIES_RSP) {
+        err = queue_series_response(client, &scans);
+    } else if (!deferred) {
+        n = encode_response(&rs, (uint8_t *)client->buffer.buf);
+        client->buffer.size = n;
+        ev_tcp_queue_write(client);
+    }
+    if (err < 0) {
+        log_error("Can't queue the response");
+        queue_error_response(client);
+    }
+    TRACE_END(encode, TRACE_ENCODE);
+
+    metrics_query_attach(NULL);
+
+    uint64_t encoded = metrics_now();
+    if (slow_query_ns >= 0 && encoded - start >= (uint64_t)slow_query_ns) {
+        if (type == STATEMENT_SELECT && rs.type == ARRAY_RSP)
+            returned = vec_size(coll);
+        for (size_t i = 0; type == STATEMENT_SELECT && i < vec_size(scans);
+             ++i)
+            returned += vec_size(vec_at(scans, i).points);
+        log_slow_query(&cr->rq, returned, start, parsed, executed, encoded);
+    }
+
     free_response(&rs);
+    for (size_t i = 0; i < vec_size(scans); ++i)
+        arena_destroy(&vec_at(scans, i).arena);
+    // The results and the scans go away with the request arena
+    request_arena_reset();
 
-    ev_tcp_queue_write(client);
+    TRACE_END(request, TRACE_REQUEST);
+}
+
+/*
+ * A block read ahead of a SELECT, `io` comes first as the completion only
+ * carries a pointer to it
+ */
+typedef struct {
+    struct ev_io io;
+    Block_Read read;
+} Block_Fetch;
+
+/*
+ * Blocks read ahead of a SELECT through the loop, the request is served once
+ * the last read completes, out of the block cache, `request` is a copy of it
+ * as the request arena is reused meanwhile
+ */
+typedef struct {
+    ev_tcp_handle *client;
+    size_t pending;
+    int deferred;
+    Client_Request request;
+    Block_Fetch fetches[];
+} Select_Prefetch;
+
+static void select_prefetch_done(Select_Prefetch *prefetch)
+{
+    if (--prefetch->pending > 0)
+        return;
+
+    if (prefetch->deferred)
+        serve_request(prefetch->client, &prefetch->request);
+
+    free(prefetch);
+}
+
+static void on_block_read(ev_context *ctx, struct ev_io *io, ssize_t n)
+{
+    (void)ctx;
+    Block_Fetch *fetch = (Block_Fetch *)io;
+
+    // The scan reads it again by itself
+    if (n < 0 || partition_block_load(&fetch->read, io->buf, n) < 0)
+        log_debug("Can't read ahead the block at %" PRIu64, fetch->read.start);
+
+    free(io->buf);
+    select_prefetch_done(io->data);
+}
+
+/*
+ * Submit the reads of the blocks on disk a single series SELECT is about to
+ * scan to the loop, only with io_uring, which carries them out without
+ * blocking it, every other backend would read them twice. The series is
+ * resolved into the request for the scan. Returns 1 if some are still in
+ * flight, the request is then served by the last completion, 0 if it can be
+ * served right away
+ */
+static int select_prefetch(ev_tcp_handle *client, Client_Request *cr)
+{
+    Allocator allocator            = arena_allocator(&request_arena);
+    const Statement_Select *select = &cr->statement.select;
+    Select_Prefetch *prefetch      = NULL;
+    Block_Reads reads;
+
+    if (!db || !ev_async_io(client->ctx) ||
+        cr->statement.type != STATEMENT_SELECT || select->mask & SM_MULTI)
+        return 0;
+
+    cr->ts = shard_series_get(&shards, db, select->ts_name, 0);
+    if (!cr->ts)
+        return 0;
+
+    vec_new_alloc(reads, allocator);
+    if (ts_block_reads(cr->ts, select->start_time,
+                       select->mask & SM_RANGE ? select->end_time
+                                               : select->start_time,
+                       &reads, PREFETCH_BLOCKS, allocator) <= 0)
+        return 0;
+
+    prefetch =
+        malloc(sizeof(*prefetch) + vec_size(reads) * sizeof(Block_Fetch));
+    if (!prefetch)
+        return 0;
+
+    // Held until all the reads are submitted
+    prefetch->client   = client;
+    prefetch->pending  = vec_size(reads) + 1;
+    prefetch->deferred = 0;
+    prefetch->request  = *cr;
+
+    for (size_t i = 0; i < vec_size(reads); ++i) {
+        Block_Fetch *fetch = &prefetch->fetches[i];
+        fetch->read        = vec_at(reads, i);
+        fetch->io          = (struct ev_io){.fd       = fetch->read.fd,
+                                            .len      = fetch->read.length,
+                                            .offset   = fetch->read.offset,
+                                            .callback = on_block_read,
+                                            .data     = prefetch};
+        // Aligned for direct I/O
+        if (posix_memalign(&fetch->io.buf, C_LOG_DIRECT_ALIGN,
+                           fetch->io.len) != 0) {
+            prefetch->pending--;
+            continue;
+        }
+        if (ev_read_at(client->ctx, &fetch->io) < 0) {
+            free(fetch->io.buf);
+            prefetch->pending--;
+        }
+    }
+
+    // No more requests from the client until this one is served
+    int deferred = prefetch->pending > 1;
+    if (deferred) {
+        prefetch->deferred = 1;
+        ev_fire_event(client->ctx, client->c->fd, EV_NONE, NULL, NULL);
+    }
+
+    select_prefetch_done(prefetch);
+
+    return deferred;
+}
+
+static void on_data(ev_tcp_handle *client)
+{
+    Client_Request cr = {.statement.type = STATEMENT_EMPTY};
+
+    if (client->buffer.size == 0)
+        return;
+
+    // Decoded and parsed once, for both the prefetch and the execution
+    cr.start   = metrics_now();
+    cr.decoded =
+        decode_request((const uint8_t *)client->buffer.buf, &cr.rq) >= 0;
+    if (cr.decoded)
+        cr.statement = parse(cr.rq.query, arena_allocator(&request_arena));
+    cr.parsed = metrics_now();
+
+    if (select_prefetch(client, &cr) == 0)
+        serve_request(client, &cr);
+    else
+        request_arena_reset();
 }
 
 static void on_connection(ev_tcp_handle *server)
@@ -204,14 +1074,285 @@ static void on_connection(ev_tcp_handle *server)
                   err == -1 ? strerror(errno) : ev_tcp_err(err));
         free(client);
     } else {
-        log_info("New connection from %s:%i", client->addr, client->port);
+        log_debug("New connection from %s:%i", client->addr, client->port);
         ev_tcp_handle_set_on_close(client, on_close);
     }
 }
 
+static int http_header_complete(const char *data, size_t size)
+{
+    for (size_t i = 3; i < size; ++i)
+        if (data[i] == '\n' && data[i - 1] == '\r' && data[i - 2] == '\n' &&
+            data[i - 3] == '\r')
+            return 1;
+    return 0;
+}
+
+static int http_path_is(const char *path, const char *expected)
+{
+    size_t len = strlen(expected);
+    return strncmp(path, expected, len) == 0 &&
+           (path[len] == ' ' || path[len] == '?');
+}
+
+static Array_Output *render_metrics(ssize_t *len)
+{
+    Array_Output *out = array_output_alloc(PROMETHEUS_TEXT_SIZE);
+    if (!out)
+        return NULL;
+
+    *len = prometheus_encode((char *)out->data, PROMETHEUS_TEXT_SIZE);
+    if (*len < 0) {
+        array_output_release(out);
+        return NULL;
+    }
+
+    return out;
+}
+
+// The size of the trace is only known once written out, it's copied over
+static Array_Output *render_trace(ssize_t *len)
+{
+    Array_Output *out = NULL;
+    char *text        = NULL;
+    size_t size       = 0;
+    FILE *fp          = open_memstream(&text, &size);
+    if (!fp)
+        return NULL;
+
+    int err = trace_dump(fp);
+    fclose(fp);
+
+    if (err == 0 && (out = array_output_alloc(size))) {
+        memcpy(out->data, text, size);
+        *len = size;
+    }
+
+    free(text);
+
+    return out;
+}
+
+/*
+ * Current log level, switched first to the one of the `level` parameter if
+ * any, e.g. /log?level=debug
+ */
+static Array_Output *render_log(const char *path, ssize_t *len)
+{
+    const char *query = strchr(path, '?');
+    const char *end   = strchr(path, ' ');
+    char name[16]     = {0};
+
+    if (query && (!end || query < end) && strncmp(query, "?level=", 7) == 0) {
+        query += 7;
+        size_t n = strcspn(query, " &");
+        if (n >= sizeof(name))
+            return NULL;
+        memcpy(name, query, n);
+        int level = log_level_parse(name);
+        if (level < 0)
+            return NULL;
+        log_set_level(level);
+        log_info("Log level set to %s", name);
+    }
+
+    Array_Output *out = array_output_alloc(sizeof(name));
+    if (!out)
+        return NULL;
+
+    *len = snprintf((char *)out->data, sizeof(name), "%s\n",
+                    log_level_name(log_level()));
+
+    return out;
+}
+
+/*
+ * Minimal HTTP/1.1 endpoint, GET or HEAD of /metrics for the Prometheus
+ * scrapers, of /trace for the Chrome trace of the spans recorded and of /log
+ * to read or switch the log level at runtime, the connection is kept alive
+ * as every response carries its length. The header goes out of the client
+ * buffer, the body follows from an output block like the array responses.
+ */
+static void on_metrics_data(ev_tcp_handle *client)
+{
+    const char *req    = (const char *)client->buffer.buf;
+    const char *status = "200 OK";
+    const char *type   = "text/plain; version=0.0.4";
+    const char *path   = NULL;
+    Array_Output *out  = NULL;
+    ssize_t body_len   = 0;
+    size_t header_len  = 0;
+    int head           = strncmp(req, "HEAD ", 5) == 0;
+    int get            = strncmp(req, "GET ", 4) == 0;
+
+    // Wait for the whole header, the requests served carry no body
+    if (!http_header_complete(req, client->buffer.size)) {
+        if (client->buffer.size >= HTTP_HEADER_MAX)
+            ev_tcp_queue_close(client);
+        return;
+    }
+
+    path = req + (head ? 5 : 4);
+    if (!get && !head) {
+        status = "405 Method Not Allowed";
+    } else if (http_path_is(path, "/metrics")) {
+        out = render_metrics(&body_len);
+    } else if (http_path_is(path, "/trace")) {
+        out  = render_trace(&body_len);
+        type = "application/json";
+    } else if (http_path_is(path, "/log")) {
+        out = render_log(path, &body_len);
+        if (!out)
+            status = "400 Bad Request";
+    } else {
+        status = "404 Not Found";
+    }
+
+    if (!out && (get || head) && status[0] == '2') {
+        log_error("Can't render %s", path);
+        status = "500 Internal Server Error";
+    }
+
+    ev_tcp_zero_buffer(client);
+
+    char *header = client->buffer.buf;
+    if (out) {
+        header_len = snprintf(header, client->buffer.capacity,
+                              "HTTP/1.1 %s\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Length: %zd\r\n\r\n",
+                              status, type, body_len);
+        out->iov[0] = (struct iovec){.iov_base = header, .iov_len = header_len};
+        out->iov[1] = (struct iovec){.iov_base = out->data,
+                                     .iov_len  = head ? 0 : body_len};
+        client->buffer.size = 0;
+        if (queue_output(client, out) < 0)
+            ev_tcp_queue_close(client);
+    } else {
+        // The status doubles as the body of the errors
+        header_len = snprintf(header, client->buffer.capacity,
+                              "HTTP/1.1 %s\r\n"
+                              "Content-Type: text/plain\r\n"
+                              "Content-Length: %zu\r\n\r\n%s\n",
+                              status, strlen(status) + 1, head ? "" : status);
+        client->buffer.size = head ? header_len - 1 : header_len;
+        ev_tcp_queue_write(client);
+    }
+}
+
+static void on_metrics_connection(ev_tcp_handle *server)
+{
+    int err               = 0;
+    ev_tcp_handle *client = malloc(sizeof(*client));
+    if ((err = ev_tcp_server_accept(server, client, on_metrics_data,
+                                    on_write)) < 0) {
+        log_error("Error occured: %s",
+                  err == -1 ? strerror(errno) : ev_tcp_err(err));
+        free(client);
+    } else {
+        ev_tcp_handle_set_on_close(client, on_close);
+    }
+}
+
+/*
+ * Parse the size in bytes set by the environment variable `name`, with an
+ * optional K, M or G suffix, `fallback` is kept if it's unset or invalid
+ */
+static size_t parse_size(const char *name, size_t fallback)
+{
+    const char *str = getenv(name);
+    char *end       = NULL;
+    unsigned shift  = 0;
+
+    if (!str)
+        return fallback;
+
+    // strtoull takes leading blanks and a minus sign, a size doesn't
+    if (*str < '0' || *str > '9')
+        goto err;
+
+    errno                   = 0;
+    unsigned long long size = strtoull(str, &end, 10);
+    if (errno == ERANGE)
+        goto err;
+
+    switch (*end) {
+    case 'G':
+    case 'g':
+        shift = 30;
+        break;
+    case 'M':
+    case 'm':
+        shift = 20;
+        break;
+    case 'K':
+    case 'k':
+        shift = 10;
+        break;
+    case '\0':
+        return size;
+    default:
+        goto err;
+    }
+
+    if (end[1] != '\0' || size > (SIZE_MAX >> shift))
+        goto err;
+
+    return size << shift;
+
+err:
+    log_warn("Invalid %s \"%s\", using %zu bytes", name, str, fallback);
+    return fallback;
+}
+
 int roachdb_server_run(const char *host, int port)
 {
+    const char *direct_io  = getenv("ROACH_DIRECT_IO");
+    const char *slow_query = getenv("ROACH_SLOW_QUERY_MS");
+    const char *metrics    = getenv("ROACH_METRICS_PORT");
+    int metrics_port       = metrics ? atoi(metrics) : METRICS_PORT;
+    Block_Cache_Stats stats;
+
+    memory_set_budget(parse_size("ROACH_MEMORY_BUDGET", MEMORY_BUDGET));
+    if (slow_query)
+        slow_query_ns = (int64_t)(atof(slow_query) * 1e6);
+    c_log_set_direct_io(direct_io && strcmp(direct_io, "0") != 0);
+    request_arena = arena_init(request_buffer, sizeof(request_buffer));
+
+    if (block_cache_init(parse_size("ROACH_CACHE_SIZE", BLOCK_CACHE_SIZE)) <
+        0) {
+        log_error("Can't init the block cache");
+        return -1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        cpus = 1;
+    else if (cpus > SHARD_MAX_NR)
+        cpus = SHARD_MAX_NR;
+
+    if (shard_pool_init(&shards, cpus) < 0) {
+        log_error("Can't start the writer shards");
+        return -1;
+    }
+
+    if (worker_pool_init(&workers, cpus) < 0) {
+        log_error("Can't start the reader workers");
+        shard_pool_stop(&shards);
+        return -1;
+    }
+
     ev_context *ctx = ev_get_context();
+
+    inserts_fd      = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inserts_fd < 0 || ev_register_event(ctx, inserts_fd, EV_READ,
+                                            on_inserts_applied, NULL) < 0) {
+        log_error("Can't watch the inserts applied: %s", strerror(errno));
+        worker_pool_stop(&workers);
+        shard_pool_stop(&shards);
+        return -1;
+    }
+
     ev_tcp_server server;
     ev_tcp_server_init(&server, ctx, BACKLOG);
     int err = ev_tcp_server_listen(&server, host, port, on_connection);
@@ -224,14 +1365,62 @@ int roachdb_server_run(const char *host, int port)
 
     log_info("Listening on %s:%i", host, port);
 
+    // The scrapers are served by the same loop, on a port of their own
+    ev_tcp_server metrics_server;
+    if (metrics_port > 0) {
+        ev_tcp_server_init(&metrics_server, ctx, BACKLOG);
+        err = ev_tcp_server_listen(&metrics_server, host, metrics_port,
+                                   on_metrics_connection);
+        if (err < 0)
+            log_error("Can't serve the metrics on %s:%i: %s", host,
+                      metrics_port,
+                      err == -1 ? strerror(errno) : ev_tcp_err(err));
+        else
+            log_info("Metrics on http://%s:%i/metrics", host, metrics_port);
+    }
+
     // Blocking call
     ev_tcp_server_run(&server);
 
     // This could be registered to a SIGINT|SIGTERM signal notification
     // to stop the server with Ctrl+C
     ev_tcp_server_stop(&server);
+    if (metrics_port > 0)
+        ev_tcp_server_stop(&metrics_server);
+
+    worker_pool_stop(&workers);
+
+    // Drain and stop the writers, closing every series they own
+    shard_pool_stop(&shards);
+
+    // The loop is gone, the INSERTs applied meanwhile get no reply, nor do
+    // the ones still parked
+    Pending_Insert *insert = atomic_exchange(&inserts_applied, NULL);
+    while (insert) {
+        Pending_Insert *next = insert->next;
+        free(insert);
+        insert = next;
+    }
+    for (size_t i = 0; i < SHARD_MAX_NR; ++i) {
+        insert = inserts_parked[i].head;
+        while (insert) {
+            Pending_Insert *next = insert->next;
+            free(insert);
+            insert = next;
+        }
+    }
+    close(inserts_fd);
+
+    block_cache_stats(&stats);
+    log_info("Block cache hits %lu misses %lu evictions %lu", stats.hits,
+             stats.misses, stats.evictions);
+    block_cache_destroy();
+    arena_destroy(&request_arena);
+    memory_sub(MEM_BUFFERS, request_arena_reserved);
 
     tsdb_close(db);
 
+    log_flush();
+
     return 0;
 }
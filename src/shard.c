@@ -0,0 +1,351 @@
+#include "shard.h"
+#include "epoch.h"
+#include "logging.h"
+#include "memory.h"
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
+/*
+ * FNV-1a over the database and series names, used to pin each series to a
+ * single owner shard
+ */
+static uint64_t series_hash(const char *db, const char *name)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *p = db; *p; ++p)
+        hash = (hash ^ (uint8_t)*p) * 0x100000001b3ULL;
+    hash = (hash ^ '/') * 0x100000001b3ULL;
+    for (const char *p = name; *p; ++p)
+        hash = (hash ^ (uint8_t)*p) * 0x100000001b3ULL;
+    return hash;
+}
+
+size_t shard_index(const Shard_Pool *pool, const char *db, const char *name)
+{
+    return series_hash(db, name) % pool->size;
+}
+
+/*
+ * Return the open series `name`, loading it from disk or creating it with
+ * `settings` and `labels` if `create` is set the first time it's requested,
+ * the series stays resident and is owned by its shard until the pool is
+ * stopped
+ */
+static Timeseries *shard_series_open(Shard_Pool *pool,
+                                     const Timeseries_DB *tsdb,
+                                     const char *name, int create,
+                                     const Chunk_Settings *settings,
+                                     const Label *labels, size_t label_nr)
+{
+    uint64_t hash       = series_hash(tsdb->data_path, name);
+    Shard *shard        = &pool->shards[hash % pool->size];
+    Series_Entry **head = &shard->series[(hash / pool->size) % SHARD_BUCKETS];
+    Series_Entry *entry = NULL;
+    Timeseries *ts      = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+
+    for (entry = *head; entry; entry = entry->next) {
+        if (strcmp(entry->ts->name, name) == 0 &&
+            strcmp(entry->ts->db_data_path, tsdb->data_path) == 0) {
+            ts = entry->ts;
+            goto unlock;
+        }
+    }
+
+    entry = malloc(sizeof(*entry));
+    if (!entry)
+        goto unlock;
+
+    ts = create ? ts_create_with_settings(tsdb, name, 0, DP_IGNORE, settings,
+                                          labels, label_nr)
+                : ts_get(tsdb, name);
+    if (!ts) {
+        free(entry);
+        goto unlock;
+    }
+
+    entry->ts   = ts;
+    entry->next = *head;
+    *head       = entry;
+
+unlock:
+    pthread_mutex_unlock(&shard->lock);
+    return ts;
+}
+
+Timeseries *shard_series_get(Shard_Pool *pool, const Timeseries_DB *tsdb,
+                             const char *name, int create)
+{
+    return shard_series_open(pool, tsdb, name, create, NULL, NULL, 0);
+}
+
+Timeseries *shard_series_create(Shard_Pool *pool, const Timeseries_DB *tsdb,
+                                const char *name,
+                                const Chunk_Settings *settings,
+                                const Label *labels, size_t label_nr)
+{
+    return shard_series_open(pool, tsdb, name, 1, settings, labels, label_nr);
+}
+
+static void shard_series_close(Shard *shard)
+{
+    Series_Entry *entry = NULL, *next = NULL;
+    for (size_t i = 0; i < SHARD_BUCKETS; ++i) {
+        for (entry = shard->series[i]; entry; entry = next) {
+            next = entry->next;
+            ts_close(entry->ts);
+            free(entry);
+        }
+        shard->series[i] = NULL;
+    }
+}
+
+static int shard_ring_push(Shard *shard, const Shard_Command *command)
+{
+    Shard_Slot *slot = NULL;
+    size_t tail      = atomic_load_explicit(&shard->tail, memory_order_relaxed);
+
+    for (;;) {
+        slot = &shard->slots[tail & (SHARD_RING_SIZE - 1)];
+        size_t seq =
+            atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)tail;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &shard->tail, &tail, tail + 1, memory_order_relaxed,
+                    memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // Ring full, the owner is lagging behind
+            return -1;
+        } else {
+            tail = atomic_load_explicit(&shard->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->command = *command;
+    atomic_store_explicit(&slot->sequence, tail + 1, memory_order_release);
+
+    return 0;
+}
+
+static int shard_ring_pop(Shard *shard, Shard_Command *command)
+{
+    Shard_Slot *slot = &shard->slots[shard->head & (SHARD_RING_SIZE - 1)];
+    size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+
+    // A producer claimed the slot but it's still copying the command in
+    if (seq != shard->head + 1)
+        return -1;
+
+    *command = slot->command;
+    atomic_store_explicit(&slot->sequence, shard->head + SHARD_RING_SIZE,
+                          memory_order_release);
+    shard->head++;
+
+    return 0;
+}
+
+/*
+ * The series of the shard holding the most memory in its chunks, NULL if
+ * none has anything left to flush
+ */
+static Timeseries *shard_series_largest(Shard *shard)
+{
+    Timeseries *largest = NULL;
+    size_t max_memory   = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    for (size_t i = 0; i < SHARD_BUCKETS; ++i) {
+        for (Series_Entry *e = shard->series[i]; e; e = e->next) {
+            size_t memory = ts_memory(e->ts);
+            if (memory > max_memory) {
+                max_memory = memory;
+                largest    = e->ts;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return largest;
+}
+
+/*
+ * Flush the largest series of the shard, one at a time, as long as the
+ * process is over its memory budget, every shard spills its own series
+ * concurrently so the biggest writers are hit first
+ */
+static int shard_spill(Shard *shard)
+{
+    Timeseries *ts = NULL;
+    int err        = 0;
+
+    while (err == 0 && memory_over_budget()) {
+        ts = shard_series_largest(shard);
+        if (!ts)
+            break;
+        err = ts_flush_chunks(ts);
+        if (err < 0)
+            log_error("Spill of %s failed", ts->name);
+    }
+
+    atomic_store(&shard->spilling, 0);
+
+    return err;
+}
+
+static int shard_command_run(Shard *shard, const Shard_Command *command)
+{
+    int err = 0;
+
+    switch (command->type) {
+    case SC_INSERT:
+        err = ts_insert_batch(command->ts, command->insert.records,
+                              command->insert.length);
+        break;
+    case SC_SPILL:
+        err = shard_spill(shard);
+        break;
+    default:
+        break;
+    }
+
+    return err;
+}
+
+static void *shard_run(void *arg)
+{
+    Shard *shard = arg;
+    Shard_Command command;
+
+    for (;;) {
+        while (sem_wait(&shard->items) < 0 && errno == EINTR)
+            ;
+
+        // The semaphore is posted after the slot is published, this can only
+        // spin for the short window of a concurrent push
+        while (shard_ring_pop(shard, &command) < 0)
+            sched_yield();
+
+        if (command.type == SC_STOP)
+            break;
+
+        int rc = shard_command_run(shard, &command);
+        if (command.done)
+            command.done(command.data, rc);
+    }
+
+    // Release what's left of the memory retired by the writes
+    epoch_synchronize();
+
+    return NULL;
+}
+
+int shard_pool_init(Shard_Pool *pool, size_t size)
+{
+    if (size == 0 || size > SHARD_MAX_NR)
+        return -1;
+
+    pool->shards = calloc(size, sizeof(*pool->shards));
+    if (!pool->shards)
+        return -1;
+
+    pool->size = 0;
+
+    for (size_t i = 0; i < size; ++i) {
+        Shard *shard = &pool->shards[i];
+        shard->id    = i;
+        shard->head  = 0;
+        atomic_init(&shard->tail, 0);
+        atomic_init(&shard->spilling, 0);
+        for (size_t j = 0; j < SHARD_RING_SIZE; ++j)
+            atomic_init(&shard->slots[j].sequence, j);
+
+        if (sem_init(&shard->items, 0, 0) < 0)
+            goto err;
+
+        pthread_mutex_init(&shard->lock, NULL);
+
+        if (pthread_create(&shard->thread, NULL, shard_run, shard) != 0) {
+            pthread_mutex_destroy(&shard->lock);
+            sem_destroy(&shard->items);
+            goto err;
+        }
+
+        pool->size++;
+    }
+
+    return 0;
+
+err:
+    log_error("Shard pool init: %s", strerror(errno));
+    shard_pool_stop(pool);
+    return -1;
+}
+
+void shard_pool_stop(Shard_Pool *pool)
+{
+    Shard_Command stop = {.type = SC_STOP};
+
+    for (size_t i = 0; i < pool->size; ++i) {
+        while (shard_ring_push(&pool->shards[i], &stop) < 0)
+            sched_yield();
+        sem_post(&pool->shards[i].items);
+    }
+
+    for (size_t i = 0; i < pool->size; ++i) {
+        pthread_join(pool->shards[i].thread, NULL);
+        shard_series_close(&pool->shards[i]);
+        pthread_mutex_destroy(&pool->shards[i].lock);
+        sem_destroy(&pool->shards[i].items);
+    }
+
+    free(pool->shards);
+    pool->shards = NULL;
+    pool->size   = 0;
+}
+
+/*
+ * Enqueue a command on the shard owning the series without blocking, the
+ * outcome is delivered to the `done` callback of the command, if any.
+ * Returns -1 if the ring of the owner is full, it's up to the caller to
+ * retry once some of its commands are done
+ */
+int shard_submit(Shard_Pool *pool, Shard_Command *command)
+{
+    if (!command->ts)
+        return -1;
+
+    size_t index =
+        shard_index(pool, command->ts->db_data_path, command->ts->name);
+    Shard *shard = &pool->shards[index];
+
+    if (shard_ring_push(shard, command) < 0)
+        return -1;
+
+    return sem_post(&shard->items);
+}
+
+/*
+ * Ask every shard to spill its series to disk, without waiting for it, a
+ * shard already spilling isn't asked again, neither is one with a full ring,
+ * it's asked by the next call
+ */
+void shard_pool_spill(Shard_Pool *pool)
+{
+    Shard_Command spill = {.type = SC_SPILL};
+
+    for (size_t i = 0; i < pool->size; ++i) {
+        Shard *shard = &pool->shards[i];
+        if (atomic_exchange(&shard->spilling, 1))
+            continue;
+        if (shard_ring_push(shard, &spill) < 0)
+            atomic_store(&shard->spilling, 0);
+        else
+            sem_post(&shard->items);
+    }
+}
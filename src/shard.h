@@ -0,0 +1,99 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "timeseries.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+// Slots of each shard ring, must be a power of 2
+#define SHARD_RING_SIZE 1024
+#define SHARD_MAX_NR    64
+#define SHARD_BUCKETS   64
+
+/*
+ * Commands a shard can execute on behalf of other threads, every write to a
+ * series is routed to the shard owning it, that way the head chunk and its
+ * WAL are only ever touched by a single thread, reads run on the caller
+ * thread, concurrently with the owner.
+ *
+ * SC_SPILL asks the shard to flush its largest series to disk until the
+ * process is back within the memory budget
+ */
+typedef enum { SC_INSERT, SC_SPILL, SC_STOP } Shard_Command_Type;
+
+/*
+ * Completion of a command, called by the owner thread once it's executed it
+ * with `data` and its outcome, the submitter doesn't wait for it, it's up to
+ * the callback to hand the outcome back, e.g. to the event loop. The records
+ * of an insert must stay valid until then
+ */
+typedef void (*Shard_Done)(void *data, int rc);
+
+typedef struct shard_command {
+    Shard_Command_Type type;
+    Timeseries *ts;
+    struct {
+        const Record *records;
+        size_t length;
+    } insert;
+    Shard_Done done;
+    void *data;
+} Shard_Command;
+
+/*
+ * Bounded MPSC ring, each slot carries a sequence number telling producers
+ * and the consumer whether it's free or filled for the current lap, producers
+ * claim a slot with a CAS on the tail, the single consumer owns the head
+ */
+typedef struct shard_slot {
+    atomic_size_t sequence;
+    Shard_Command command;
+} Shard_Slot;
+
+/*
+ * Open series owned by a shard, kept resident across requests, lookups can
+ * come from any thread and go through the shard lock, the write path itself
+ * never takes it
+ */
+typedef struct series_entry {
+    Timeseries *ts;
+    struct series_entry *next;
+} Series_Entry;
+
+typedef struct shard {
+    size_t id;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    Series_Entry *series[SHARD_BUCKETS];
+    atomic_int spilling;
+    sem_t items;
+    atomic_size_t tail;
+    size_t head;
+    Shard_Slot slots[SHARD_RING_SIZE];
+} Shard;
+
+typedef struct shard_pool {
+    size_t size;
+    Shard *shards;
+} Shard_Pool;
+
+int shard_pool_init(Shard_Pool *pool, size_t size);
+
+void shard_pool_stop(Shard_Pool *pool);
+
+size_t shard_index(const Shard_Pool *pool, const char *db, const char *name);
+
+Timeseries *shard_series_get(Shard_Pool *pool, const Timeseries_DB *tsdb,
+                             const char *name, int create);
+
+Timeseries *shard_series_create(Shard_Pool *pool, const Timeseries_DB *tsdb,
+                                const char *name,
+                                const Chunk_Settings *settings,
+                                const Label *labels, size_t label_nr);
+
+int shard_submit(Shard_Pool *pool, Shard_Command *command);
+
+void shard_pool_spill(Shard_Pool *pool);
+
+#endif
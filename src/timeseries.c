@@ -1,19 +1,291 @@
 #include "timeseries.h"
+#include "arena.h"
 #include "binary.h"
 #include "disk_io.h"
+#include "epoch.h"
 #include "logging.h"
+#include "memory.h"
+#include "metrics.h"
+#include "trace.h"
 #include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
 
 static const char *BASE_PATH         = "logdata";
+static const char *CATALOG_NAME      = "catalog";
 static const size_t LINEAR_THRESHOLD = 192;
 static const size_t RECORD_BINARY_SIZE =
     (sizeof(uint64_t) * 2) + sizeof(double_t);
-const size_t TS_FLUSH_SIZE   = 512; // 512b
+// Records decoded at once by ts_record_read_batch
+#define RECORD_DECODE_RUN 64
+const size_t TS_FLUSH_SIZE   = 32 * WAL_FRAME_SIZE; // 32 points
 const size_t TS_BATCH_OFFSET = sizeof(uint64_t) * 3;
 /* const size_t TS_FLUSH_SIZE = 4294967296; // 4Mb */
 
+_Static_assert(TS_MAX_PARTITIONS <= CATALOG_MAX_PARTITIONS,
+               "The catalog must fit the partitions of a series");
+
+/*
+ * Register the series found in the DB directory into a brand new catalog,
+ * to pick up the data written before the catalog was introduced, their
+ * metadata was never persisted so they get the defaults
+ */
+static int tsdb_catalog_import(Timeseries_DB *tsdb, const char *path)
+{
+    Catalog_Entry entry;
+    struct dirent **namelist;
+    int n = scandir(path, &namelist, NULL, alphasort);
+    if (n == -1)
+        return -1;
+
+    for (int i = 0; i < n; ++i) {
+        if (namelist[i]->d_type == DT_DIR && namelist[i]->d_name[0] != '.' &&
+            catalog_add(tsdb->catalog, namelist[i]->d_name, 0, DP_IGNORE,
+                        NULL, NULL, 0, &entry) < 0)
+            log_error("Can't import series %s", namelist[i]->d_name);
+        free(namelist[i]);
+    }
+
+    free(namelist);
+
+    return 0;
+}
+
+typedef struct wal_recovery {
+    VEC(Wal_Frame) frames;
+    VEC(uint64_t) flushed;
+} Wal_Recovery;
+
+static int tsdb_recover_frame(void *arg, const Wal_Frame *frame)
+{
+    Wal_Recovery *recovery = arg;
+
+    if (frame->flushed)
+        vec_push(recovery->flushed, frame->chunk);
+    else
+        vec_push(recovery->frames, *frame);
+
+    return 0;
+}
+
+static int tsdb_chunk_cmp(const void *a, const void *b)
+{
+    uint64_t ca = *(const uint64_t *)a, cb = *(const uint64_t *)b;
+    return ca < cb ? -1 : ca > cb;
+}
+
+static int tsdb_frame_cmp(const void *a, const void *b)
+{
+    const Wal_Frame *fa = a, *fb = b;
+    if (fa->series != fb->series)
+        return fa->series < fb->series ? -1 : 1;
+    return fa->lsn < fb->lsn ? -1 : fa->lsn > fb->lsn;
+}
+
+/*
+ * Replay the points of the frames `[start, end)`, all belonging to the same
+ * series, into the series, flushing them to its partitions straight away
+ */
+static int tsdb_recover_series(Timeseries_DB *tsdb, const Wal_Frame *start,
+                               const Wal_Frame *end)
+{
+    Catalog_Entry entry;
+
+    if (catalog_get_by_id(tsdb->catalog, start->series, &entry) < 0) {
+        log_warn("Dropping %zu WAL points of unknown series %" PRIu64,
+                 (size_t)(end - start), start->series);
+        return 0;
+    }
+
+    Timeseries *ts = ts_get(tsdb, entry.name);
+    if (!ts)
+        return -1;
+
+    for (const Wal_Frame *f = start; f < end; ++f)
+        if (ts_insert(ts, f->timestamp, f->value) < 0)
+            log_error("Can't recover point %" PRIu64 " of %s", f->timestamp,
+                      ts->name);
+
+    int err = ts_flush_chunks(ts);
+
+    log_info("Recovered %zu WAL points of %s", (size_t)(end - start),
+             ts->name);
+
+    ts_close(ts);
+
+    return err;
+}
+
+static int tsdb_legacy_cmp(const void *a, const void *b)
+{
+    const Wal_Frame *fa = a, *fb = b;
+    return fa->timestamp < fb->timestamp ? -1
+                                         : fa->timestamp > fb->timestamp;
+}
+
+static int tsdb_legacy_name(const struct dirent *entry)
+{
+    const char *dot = strrchr(entry->d_name, '.');
+    return strncmp(entry->d_name, "wal-", 4) == 0 && dot &&
+           strcmp(dot, ".log") == 0;
+}
+
+/*
+ * Move the points left in the WAL files of the series `name`, written before
+ * the WAL was shared by the DB, into its partitions, in timestamp order. The
+ * files are removed once the points are flushed.
+ */
+static int tsdb_recover_legacy_series(Timeseries_DB *tsdb, const char *path,
+                                      const char *name)
+{
+    char pathbuf[MAX_PATH_SIZE];
+    char filebuf[MAX_PATH_SIZE];
+    struct dirent **namelist;
+    Wal_Recovery recovery;
+    Timeseries *ts = NULL;
+    int err        = 0;
+
+    snprintf(pathbuf, sizeof(pathbuf), "%s/%s", path, name);
+    int n = scandir(pathbuf, &namelist, tsdb_legacy_name, alphasort);
+    if (n <= 0)
+        return n;
+
+    vec_new(recovery.frames);
+    vec_new(recovery.flushed);
+
+    for (int i = 0; i < n && err == 0; ++i) {
+        snprintf(filebuf, sizeof(filebuf), "%s/%s", pathbuf,
+                 namelist[i]->d_name);
+        err = wal_legacy_replay(filebuf, tsdb_recover_frame, &recovery);
+    }
+
+    if (err == 0 && vec_size(recovery.frames) > 0) {
+        ts = ts_get(tsdb, name);
+        if (!ts) {
+            log_error("Can't open %s to recover its WAL", name);
+            err = -1;
+            goto exit;
+        }
+
+        qsort(recovery.frames.data, vec_size(recovery.frames),
+              sizeof(Wal_Frame), tsdb_legacy_cmp);
+
+        for (size_t i = 0; i < vec_size(recovery.frames); ++i)
+            if (ts_insert(ts, vec_at(recovery.frames, i).timestamp,
+                          vec_at(recovery.frames, i).value) < 0)
+                log_error("Can't recover point %" PRIu64 " of %s",
+                          vec_at(recovery.frames, i).timestamp, name);
+
+        err = ts_flush_chunks(ts);
+        ts_close(ts);
+
+        log_info("Recovered %zu legacy WAL points of %s",
+                 vec_size(recovery.frames), name);
+    }
+
+    // Only once the points are safe in the partitions
+    for (int i = 0; i < n && err == 0; ++i) {
+        snprintf(filebuf, sizeof(filebuf), "%s/%s", pathbuf,
+                 namelist[i]->d_name);
+        if (remove(filebuf) < 0)
+            log_error("Can't remove WAL %s: %s", filebuf, strerror(errno));
+    }
+
+exit:
+    for (int i = 0; i < n; ++i)
+        free(namelist[i]);
+    free(namelist);
+    vec_destroy(recovery.frames);
+    vec_destroy(recovery.flushed);
+
+    return err;
+}
+
+/*
+ * Bring back the points left in the WAL files of each series by the versions
+ * keeping a WAL per series, to be done before the DB one is replayed, as its
+ * points can only be more recent
+ */
+static int tsdb_recover_legacy(Timeseries_DB *tsdb, const char *path)
+{
+    struct dirent **namelist;
+    int err = 0;
+    int n   = scandir(path, &namelist, NULL, alphasort);
+    if (n == -1)
+        return -1;
+
+    for (int i = 0; i < n; ++i) {
+        if (err == 0 && namelist[i]->d_type == DT_DIR &&
+            namelist[i]->d_name[0] != '.')
+            err = tsdb_recover_legacy_series(tsdb, path,
+                                             namelist[i]->d_name);
+        free(namelist[i]);
+    }
+
+    free(namelist);
+
+    return err;
+}
+
+/*
+ * Bring back the points left in the WAL of the DB, the frames of the chunks
+ * flushed are skipped, the others are flushed series by series in their log
+ * order. Points are replayed with no WAL set on the DB, so they're not logged
+ * again, the WAL is checkpointed once they're all on disk.
+ */
+static int tsdb_recover(Timeseries_DB *tsdb, Wal *wal)
+{
+    Wal_Recovery recovery;
+    Wal_Frame *frames = NULL;
+    size_t n          = 0;
+    size_t live       = 0;
+    int err           = 0;
+
+    vec_new(recovery.frames);
+    vec_new(recovery.flushed);
+
+    err = wal_replay(wal, tsdb_recover_frame, &recovery);
+    if (err < 0)
+        goto exit;
+
+    frames = recovery.frames.data;
+    n      = vec_size(recovery.frames);
+
+    qsort(recovery.flushed.data, vec_size(recovery.flushed), sizeof(uint64_t),
+          tsdb_chunk_cmp);
+
+    for (size_t i = 0; i < n; ++i)
+        if (!bsearch(&frames[i].chunk, recovery.flushed.data,
+                     vec_size(recovery.flushed), sizeof(uint64_t),
+                     tsdb_chunk_cmp))
+            frames[live++] = frames[i];
+
+    qsort(frames, live, sizeof(Wal_Frame), tsdb_frame_cmp);
+
+    for (size_t i = 0, j = 0; i < live && err == 0; i = j) {
+        while (j < live && frames[j].series == frames[i].series)
+            ++j;
+        err = tsdb_recover_series(tsdb, frames + i, frames + j);
+    }
+
+    if (err == 0)
+        wal_checkpoint(wal);
+
+    // Free the chunks retired by the replay, rather than leaving them in the
+    // limbo of a thread that may not retire anything else
+    epoch_synchronize();
+
+exit:
+    vec_destroy(recovery.frames);
+    vec_destroy(recovery.flushed);
+
+    return err;
+}
+
 Timeseries_DB *tsdb_init(const char *data_path)
 {
     if (!data_path)
@@ -25,43 +297,119 @@ Timeseries_DB *tsdb_init(const char *data_path)
     if (make_dir(BASE_PATH) < 0)
         return NULL;
 
-    Timeseries_DB *tsdb = malloc(sizeof(*tsdb));
+    char pathbuf[MAX_PATH_SIZE];
+    char catalog_path[MAX_PATH_SIZE];
+    int err             = 0;
+    Wal *wal            = NULL;
+    Timeseries_DB *tsdb = calloc(1, sizeof(*tsdb));
     if (!tsdb)
         return NULL;
 
-    strncpy(tsdb->data_path, data_path, strlen(data_path) + 1);
+    snprintf(tsdb->data_path, sizeof(tsdb->data_path), "%s", data_path);
 
     // Create the DB path if it doesn't exist
-    char pathbuf[MAX_PATH_SIZE];
     snprintf(pathbuf, sizeof(pathbuf), "%s/%s", BASE_PATH, tsdb->data_path);
     if (make_dir(pathbuf) < 0)
-        return NULL;
+        goto err;
+
+    tsdb->catalog = malloc(sizeof(*tsdb->catalog));
+    if (!tsdb->catalog)
+        goto err;
+
+    snprintf(catalog_path, sizeof(catalog_path), "%s/%s", pathbuf,
+             CATALOG_NAME);
+
+    // Series are all known upfront, no more filesystem lookups from here on
+    err = catalog_open(tsdb->catalog, catalog_path);
+    if (err < 0)
+        goto err;
+
+    if (err == 0 && tsdb_catalog_import(tsdb, pathbuf) < 0)
+        goto err_catalog;
+
+    // Series are opened without a WAL till the recovery is done
+    if (tsdb_recover_legacy(tsdb, pathbuf) < 0)
+        goto err_catalog;
+
+    wal = malloc(sizeof(*wal));
+    if (!wal || wal_open(wal, pathbuf) < 0)
+        goto err_catalog;
+
+    if (tsdb_recover(tsdb, wal) < 0) {
+        wal_close(wal);
+        goto err_catalog;
+    }
+
+    tsdb->wal = wal;
 
     return tsdb;
+
+err_catalog:
+    catalog_close(tsdb->catalog);
+err:
+    free(wal);
+    free(tsdb->catalog);
+    free(tsdb);
+    return NULL;
 }
 
-void tsdb_close(Timeseries_DB *tsdb) { free(tsdb); }
+void tsdb_close(Timeseries_DB *tsdb)
+{
+    if (!tsdb)
+        return;
 
-Timeseries *ts_create(const Timeseries_DB *tsdb, const char *name,
-                      int64_t retention, Duplication_Policy policy)
+    wal_close(tsdb->wal);
+    free(tsdb->wal);
+    catalog_close(tsdb->catalog);
+    free(tsdb->catalog);
+    free(tsdb);
+}
+
+/*
+ * Align the partition summary in the catalog to the partitions of the series
+ */
+static void ts_catalog_sync(Timeseries *ts)
 {
-    if (!tsdb || !name)
-        return NULL;
+    uint64_t partitions[TS_MAX_PARTITIONS];
 
-    if (strlen(name) > TS_NAME_MAX_LENGTH)
-        return NULL;
+    if (!ts->catalog)
+        return;
+
+    for (size_t i = 0; i < ts->partition_nr; ++i)
+        partitions[i] = ts->partitions[i].clog.base_timestamp;
+
+    if (catalog_set_partitions(ts->catalog, ts->name, partitions,
+                               ts->partition_nr) < 0)
+        log_error("Can't update the catalog of %s", ts->name);
+}
+
+// The setting of the series if set, the default of the DB or `fallback`
+static size_t ts_setting(uint32_t series, uint32_t db, size_t fallback)
+{
+    return series > 0 ? series : db > 0 ? db : fallback;
+}
 
-    Timeseries *ts = malloc(sizeof(*ts));
+static Timeseries *ts_open(const Timeseries_DB *tsdb,
+                           const Catalog_Entry *entry)
+{
+    Chunk_Settings defaults;
+    Timeseries *ts = calloc(1, sizeof(*ts));
     if (!ts)
         return NULL;
 
-    ts->retention    = retention;
-    ts->partition_nr = 0;
-    ts->policy       = policy;
-    for (int i = 0; i < TS_MAX_PARTITIONS; ++i)
-        memset(&ts->partitions[i], 0x00, sizeof(ts->partitions[i]));
+    catalog_defaults(tsdb->catalog, &defaults);
+
+    ts->id         = entry->id;
+    ts->catalog    = tsdb->catalog;
+    ts->retention  = entry->retention;
+    ts->policy     = entry->policy;
+    ts->wal        = tsdb->wal;
+    ts->chunk_size = ts_setting(entry->settings.chunk_size,
+                                defaults.chunk_size, TS_CHUNK_SIZE);
+    ts->flush_size = ts_setting(entry->settings.flush_size,
+                                defaults.flush_size, TS_FLUSH_SIZE);
 
-    snprintf(ts->name, TS_NAME_MAX_LENGTH, "%s", name);
+    snprintf(ts->name, TS_NAME_MAX_LENGTH, "%s", entry->name);
     snprintf(ts->db_data_path, DATA_PATH_SIZE, "%s", tsdb->data_path);
 
     // Create the timeseries path if it doesn't exist
@@ -74,39 +422,258 @@ Timeseries *ts_create(const Timeseries_DB *tsdb, const char *name,
 
     if (ts_init(ts) < 0) {
         ts_close(ts);
-        free(ts);
         return NULL;
     }
 
+    // Partitions may have been created right before a crash
+    if (entry->partition_nr != ts->partition_nr)
+        ts_catalog_sync(ts);
+
     return ts;
 }
 
-Timeseries *ts_get(const Timeseries_DB *tsdb, const char *name)
+// Settings left to 0 follow the defaults, the others must be in bounds
+static int ts_settings_valid(const Chunk_Settings *settings)
+{
+    return !settings || (settings->chunk_size <= TS_CHUNK_MAX_SIZE &&
+                         (settings->flush_size == 0 ||
+                          (settings->flush_size >= TS_FLUSH_MIN_SIZE &&
+                           settings->flush_size <= TS_FLUSH_MAX_SIZE)));
+}
+
+/*
+ * Create a new series, registering it into the catalog of the DB along with
+ * its chunk settings and labels, NULL settings or settings left to 0 follow
+ * the defaults of the DB. If the series already exists it's opened with its
+ * own policy, retention, settings and labels
+ */
+Timeseries *ts_create_with_settings(const Timeseries_DB *tsdb,
+                                    const char *name, int64_t retention,
+                                    Duplication_Policy policy,
+                                    const Chunk_Settings *settings,
+                                    const Label *labels, size_t label_nr)
 {
+    Catalog_Entry entry;
+
     if (!tsdb || !name)
         return NULL;
 
-    if (strlen(name) > TS_NAME_MAX_LENGTH)
+    if (strlen(name) > TS_NAME_MAX_LENGTH || !ts_settings_valid(settings))
         return NULL;
 
-    Timeseries *ts = malloc(sizeof(*ts));
-    if (!ts)
+    if (catalog_add(tsdb->catalog, name, retention, policy, settings, labels,
+                    label_nr, &entry) < 0)
         return NULL;
 
-    for (int i = 0; i < TS_MAX_PARTITIONS; ++i)
-        memset(&ts->partitions[i], 0x00, sizeof(ts->partitions[i]));
+    return ts_open(tsdb, &entry);
+}
 
-    snprintf(ts->db_data_path, DATA_PATH_SIZE, "%s", tsdb->data_path);
-    snprintf(ts->name, TS_NAME_MAX_LENGTH, "%s", name);
+Timeseries *ts_create_with_labels(const Timeseries_DB *tsdb, const char *name,
+                                  int64_t retention, Duplication_Policy policy,
+                                  const Label *labels, size_t label_nr)
+{
+    return ts_create_with_settings(tsdb, name, retention, policy, NULL, labels,
+                                   label_nr);
+}
 
-    // TODO consider adding some metadata file which saves TS info such as the
-    // duplication policy
-    if (ts_init(ts) < 0) {
-        ts_close(ts);
+Timeseries *ts_create(const Timeseries_DB *tsdb, const char *name,
+                      int64_t retention, Duplication_Policy policy)
+{
+    return ts_create_with_labels(tsdb, name, retention, policy, NULL, 0);
+}
+
+/*
+ * Open an existing series, NULL if it's not in the catalog of the DB
+ */
+Timeseries *ts_get(const Timeseries_DB *tsdb, const char *name)
+{
+    Catalog_Entry entry;
+
+    if (!tsdb || !name)
         return NULL;
+
+    if (catalog_get(tsdb->catalog, name, &entry) < 0)
+        return NULL;
+
+    return ts_open(tsdb, &entry);
+}
+
+/*
+ * Set the chunk settings of the series not setting their own, persisted in
+ * the catalog, they apply to the series opened from here on, 0 restores the
+ * built-in defaults
+ *
+ * Returns 0 on success, -1 on error or if the settings are out of bounds
+ */
+int tsdb_set_defaults(Timeseries_DB *tsdb, const Chunk_Settings *defaults)
+{
+    if (!tsdb || !defaults || !ts_settings_valid(defaults))
+        return -1;
+
+    return catalog_set_defaults(tsdb->catalog, defaults);
+}
+
+/*
+ * Structural changes to the in-memory chunks, such as starting, rotating or
+ * flushing them and out of order inserts, are wrapped in a write section
+ * bumping the series version, odd while the change is in progress.
+ *
+ * Readers take a snapshot of the version, scan the chunks and retry if it
+ * changed in the meanwhile, plain appends to a bucket don't touch the version
+ * as they're published by the bucket size alone. Memory unlinked by the
+ * writer is retired through the epoch reclamation, so that a reader racing
+ * with a change can still safely dereference what it loaded.
+ */
+static void ts_write_begin(Timeseries *ts)
+{
+    uint64_t version = atomic_load_explicit(&ts->version, memory_order_relaxed);
+    atomic_store_explicit(&ts->version, version + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void ts_write_end(Timeseries *ts)
+{
+    uint64_t version = atomic_load_explicit(&ts->version, memory_order_relaxed);
+    atomic_store_explicit(&ts->version, version + 1, memory_order_release);
+}
+
+static uint64_t ts_read_begin(const Timeseries *ts)
+{
+    uint64_t version = 0;
+    while ((version = atomic_load_explicit(&ts->version,
+                                           memory_order_acquire)) &
+           1)
+        sched_yield();
+    return version;
+}
+
+static int ts_read_retry(const Timeseries *ts, uint64_t version)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&ts->version, memory_order_relaxed) != version;
+}
+
+/*
+ * Load a consistent view of a bucket, the size is read before the data, the
+ * writer publishes them in the opposite order, so every point within the size
+ * is in the array loaded
+ */
+static Points ts_bucket_load(const Chunk_Bucket *bucket)
+{
+    size_t size  = atomic_load_explicit(&bucket->size, memory_order_acquire);
+    Record *data = atomic_load_explicit(&bucket->data, memory_order_acquire);
+
+    // Read only, as large as the points it holds
+    return (Points){.size = size, .capacity = size, .data = data};
+}
+
+/*
+ * Report the growth of the chunk arena to the memory accountant
+ */
+static void ts_chunk_account(Timeseries_Chunk *tc)
+{
+    if (tc->arena.reserved > tc->memory)
+        memory_add(MEM_CHUNKS, tc->arena.reserved - tc->memory);
+    tc->memory = tc->arena.reserved;
+}
+
+/*
+ * Make room for one more point in a bucket, the array is grown by copying it
+ * into the chunk arena and publishing the copy, the old one stays valid for
+ * the readers still scanning it until the whole chunk is released. Buckets
+ * start with no array, it's allocated on the first point set
+ */
+static int ts_bucket_reserve(Timeseries_Chunk *tc, Chunk_Bucket *bucket)
+{
+    size_t size = atomic_load_explicit(&bucket->size, memory_order_relaxed);
+
+    if (size < bucket->capacity)
+        return 0;
+
+    size_t capacity =
+        bucket->capacity > 0 ? bucket->capacity * 2 : VEC_BASE_CAPACITY;
+    Record *data    = arena_alloc(capacity * sizeof(*data), &tc->arena);
+    if (!data)
+        return -1;
+
+    if (size > 0)
+        memcpy(data,
+               atomic_load_explicit(&bucket->data, memory_order_relaxed),
+               size * sizeof(*data));
+
+    // The copy is published before any point past the old array
+    atomic_store_explicit(&bucket->data, data, memory_order_release);
+    bucket->capacity = capacity;
+
+    ts_chunk_account(tc);
+
+    return 0;
+}
+
+typedef struct {
+    const char *pattern;
+    Series_Names *names;
+    int matched;
+} Series_Match;
+
+static void ts_series_match(const Catalog_Entry *entry, void *arg)
+{
+    Series_Match *match = arg;
+    if (match->pattern && fnmatch(match->pattern, entry->name, 0) != 0)
+        return;
+
+    char *copy = strdup(entry->name);
+    if (copy) {
+        vec_push(*match->names, copy);
+        match->matched++;
     }
+}
 
-    return ts;
+static int ts_name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Collect the names of the series in the DB matching a glob `pattern`, all of
+ * them if NULL, sorted by name, names are allocated and appended to `names`,
+ * it's up to the caller to free them.
+ *
+ * Returns the number of series matched
+ */
+int tsdb_series(const Timeseries_DB *tsdb, const char *pattern,
+                Series_Names *names)
+{
+    size_t start       = vec_size(*names);
+    Series_Match match = {.pattern = pattern, .names = names, .matched = 0};
+
+    catalog_foreach(tsdb->catalog, ts_series_match, &match);
+
+    qsort(names->data + start, match.matched, sizeof(char *), ts_name_cmp);
+
+    return match.matched;
+}
+
+/*
+ * Collect the names of the series in the DB carrying all the labels matched,
+ * label values can be glob patterns, e.g. `host=web*` and `region=eu`, names
+ * are sorted and allocated as per `tsdb_series`.
+ *
+ * Returns the number of series matched or -1 on error
+ */
+int tsdb_series_by_labels(const Timeseries_DB *tsdb, const Label *matchers,
+                          size_t matcher_nr, Series_Names *names)
+{
+    size_t start       = vec_size(*names);
+    Series_Match match = {.pattern = NULL, .names = names, .matched = 0};
+
+    if (catalog_select(tsdb->catalog, matchers, matcher_nr, ts_series_match,
+                       &match) < 0)
+        return -1;
+
+    qsort(names->data + start, match.matched, sizeof(char *), ts_name_cmp);
+
+    return match.matched;
 }
 
 static void ts_chunk_zero(Timeseries_Chunk *tc)
@@ -115,50 +682,128 @@ static void ts_chunk_zero(Timeseries_Chunk *tc)
     tc->start_ts    = 0;
     tc->end_ts      = 0;
     tc->max_index   = 0;
-    tc->wal.size    = 0;
+    tc->memory      = 0;
+    tc->width       = 0;
+    tc->span        = 1;
+    tc->points      = NULL;
+    tc->arena       = arena_init(NULL, 0);
+    tc->wal         = (Wal_Chunk){0};
 }
 
-static int ts_chunk_init(Timeseries_Chunk *tc, const char *path,
-                         uint64_t base_ts, int main)
+/*
+ * Allocate the empty buckets of a chunk `size` seconds wide from a brand new
+ * arena, no more than TS_CHUNK_BUCKETS of them
+ */
+static int ts_chunk_alloc(Timeseries_Chunk *tc, size_t size)
+{
+    size_t span  = (size + TS_CHUNK_BUCKETS - 1) / TS_CHUNK_BUCKETS;
+    size_t width = (size + span - 1) / span;
+
+    tc->arena    = arena_init(NULL, 0);
+    tc->memory   = 0;
+
+    Chunk_Bucket *points = arena_alloc(width * sizeof(*points), &tc->arena);
+    if (!points)
+        return -1;
+
+    memset(points, 0, width * sizeof(*points));
+    tc->points = points;
+    tc->width  = width;
+    tc->span   = span;
+
+    ts_chunk_account(tc);
+
+    return 0;
+}
+
+/*
+ * Start a chunk based at `base_ts`, its share of the WAL is kept, it's only
+ * set if the marker of the chunk flushed before couldn't be written, the new
+ * points are then logged under that chunk to be marked along with them
+ */
+static int ts_chunk_init(Timeseries_Chunk *tc, uint64_t base_ts, size_t size)
 {
     tc->base_offset = base_ts;
     tc->start_ts    = 0;
     tc->end_ts      = 0;
     tc->max_index   = 0;
 
-    for (int i = 0; i < TS_CHUNK_SIZE; ++i)
-        vec_new(tc->points[i]);
-
-    if (wal_init(&tc->wal, path, tc->base_offset, main) < 0)
-        return -1;
+    return ts_chunk_alloc(tc, size);
+}
 
-    return 0;
+// Bucket of the chunk covering the second `sec`, past the width if it's out
+static size_t ts_chunk_index(const Timeseries_Chunk *tc, uint64_t sec)
+{
+    return (sec - tc->base_offset) / tc->span;
 }
 
+/*
+ * Release the points of a chunk no reader can reach anymore, on close
+ */
 static void ts_chunk_destroy(Timeseries_Chunk *tc)
 {
-    if (tc->base_offset != 0) {
-        for (int i = 0; i < TS_CHUNK_SIZE; ++i) {
-            vec_destroy(tc->points[i]);
-            tc->points[i].size = 0;
-        }
+    for (size_t i = 0; i < tc->width; ++i)
+        atomic_store_explicit(&tc->points[i].size, 0, memory_order_relaxed);
+    arena_destroy(&tc->arena);
+    memory_sub(MEM_CHUNKS, tc->memory);
+    tc->memory      = 0;
+    tc->base_offset = 0;
+    tc->start_ts    = 0;
+    tc->end_ts      = 0;
+    tc->max_index   = 0;
+    tc->width       = 0;
+}
+
+/*
+ * Free a block of a retired chunk, its points stop counting toward the
+ * memory budget only now that no reader can hold them
+ */
+static void ts_chunk_block_release(void *ptr)
+{
+    Arena_Block *block = ptr;
+    memory_sub(MEM_CHUNKS, sizeof(*block) + block->size);
+    free(block);
+}
+
+/*
+ * Reset a chunk still reachable by readers, the blocks of its arena are
+ * retired instead of being freed straight away, the buckets included, so
+ * the pointer to them is left for the readers racing with the reset
+ */
+static void ts_chunk_retire(Timeseries_Chunk *tc)
+{
+    Arena_Block *block = tc->arena.blocks, *next = NULL;
+
+    for (size_t i = 0; i < tc->width; ++i)
+        atomic_store_explicit(&tc->points[i].size, 0, memory_order_relaxed);
+
+    // Every block has to be accounted before being released one by one
+    ts_chunk_account(tc);
+
+    for (; block; block = next) {
+        next = block->next;
+        epoch_retire_with(block, ts_chunk_block_release);
     }
+
+    tc->arena       = arena_init(NULL, 0);
+    tc->memory      = 0;
     tc->base_offset = 0;
     tc->start_ts    = 0;
     tc->end_ts      = 0;
     tc->max_index   = 0;
+    tc->width       = 0;
 }
 
 static int ts_chunk_record_fit(const Timeseries_Chunk *tc, uint64_t sec)
 {
     // Relative offset inside the 2 arrays
-    size_t index = sec - tc->base_offset;
+    size_t index = ts_chunk_index(tc, sec);
 
     // Index outside of the head chunk range
     // 1. Flush the tail chunk to persistence
-    // 2. Create a new head chunk set on the next 15 min
+    // 2. Create a new head chunk set on the next chunk width
     // 3. Make the current head chunk the new tail chunk
-    if (index > TS_CHUNK_SIZE - 1)
+    if (index >= tc->width)
         return -1;
 
     return 0;
@@ -182,6 +827,25 @@ static int record_cmp(const Record *r1, const Record *r2)
     return -1;
 }
 
+/*
+ * Position past the last point of a bucket not newer than `timestamp`, points
+ * with the same timestamp keep their arrival order
+ */
+static size_t bucket_upper_bound(const Points *bucket, uint64_t timestamp)
+{
+    size_t lo = 0, hi = vec_size(*bucket);
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (vec_at(*bucket, mid).timestamp <= timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
 /*
  * Set a record in the chunk at a relative index based on the first timestamp
  * stored e.g.
@@ -197,82 +861,65 @@ static int record_cmp(const Record *r1, const Record *r2)
  *
  * - This function assumes the record will fit in the chunk, by previously
  *   checking it with `ts_chunk_record_fit(2)`
+ * - In order points are appended without bumping the series version, they
+ *   become visible to readers as the bucket size is updated
  *
  */
-static int ts_chunk_set_record(Timeseries_Chunk *tc, uint64_t sec,
-                               uint64_t nsec, double_t value)
+static int ts_chunk_set_record(Timeseries *ts, Timeseries_Chunk *tc,
+                               uint64_t sec, uint64_t nsec, double_t value)
 {
     // Relative offset inside the 2 arrays
-    size_t index = sec - tc->base_offset;
+    size_t index = ts_chunk_index(tc, sec);
 
     // Append to the last record in this timestamp bucket
     Record point = {
         .value     = value,
-        .timestamp = sec * 1e9 + nsec,
+        .timestamp = sec * (uint64_t)1e9 + nsec,
         .tv        = (struct timespec){.tv_sec = sec, .tv_nsec = nsec},
         .is_set    = 1,
     };
 
+    // Grow the bucket beforehand, no push or insert must realloc it under
+    // the readers feet
+    Chunk_Bucket *bucket = &tc->points[index];
+    if (ts_bucket_reserve(tc, bucket) < 0)
+        return -1;
+
+    // Only the owner writes the bucket, its own view of it is current
+    Points points = {
+        .size     = atomic_load_explicit(&bucket->size, memory_order_relaxed),
+        .capacity = bucket->capacity,
+        .data     = atomic_load_explicit(&bucket->data, memory_order_relaxed),
+    };
+
     // Check if the timestamp is ordered
     if (tc->end_ts != 0 && tc->end_ts > point.timestamp) {
-        ssize_t i = 0;
-        vec_bsearch_cmp(tc->points[index], &point, record_cmp, &i);
-        if (i < 0)
-            return -1;
+        size_t i = bucket_upper_bound(&points, point.timestamp);
         // Simple shift of existing elements, maybe worth adding a support
         // vector for out of order (in chunk range) records and merge them
         // when flushing, must profile
         // NB WAL doesn't need any change as it will act as an event
         // log, replayable to obtain the up-to-date state
-        vec_insert_at(tc->points[index], (size_t)i, point);
+        ts_write_begin(ts);
+        memmove(points.data + i + 1, points.data + i,
+                (points.size - i) * sizeof(Record));
+        points.data[i] = point;
+        atomic_store_explicit(&bucket->size, points.size + 1,
+                              memory_order_release);
+        tc->max_index = index > tc->max_index ? index : tc->max_index;
+        ts_write_end(ts);
     } else {
-        vec_push(tc->points[index], point);
+        points.data[points.size] = point;
+        // Publish the point, readers load the size before the data
+        atomic_store_explicit(&bucket->size, points.size + 1,
+                              memory_order_release);
         tc->max_index = index > tc->max_index ? index : tc->max_index;
     }
 
-    tc->start_ts = tc->start_ts == 0 ? point.timestamp : tc->start_ts;
-    tc->end_ts   = point.timestamp;
-
-    return 0;
-}
-
-static int ts_chunk_load(Timeseries_Chunk *tc, const char *pathbuf,
-                         uint64_t base_timestamp, int main)
-{
-
-    int err = wal_load(&tc->wal, pathbuf, base_timestamp, main);
-    if (err < 0)
-        return -1;
-
-    uint8_t *buf = malloc(tc->wal.size + 1);
-    if (!buf)
-        return -1;
-    ssize_t n = read_file(tc->wal.fp, buf);
-    if (n < 0)
-        return -1;
-
-    tc->base_offset = base_timestamp;
-    for (int i = 0; i < TS_CHUNK_SIZE; ++i)
-        vec_new(tc->points[i]);
-
-    uint8_t *ptr = buf;
-    uint64_t timestamp;
-    double_t value;
-
-    while (n > 0) {
-        timestamp     = read_i64(ptr);
-        value         = read_f64(ptr + sizeof(uint64_t));
-
-        uint64_t sec  = timestamp / (uint64_t)1e9;
-        uint64_t nsec = timestamp % (uint64_t)1e9;
-
-        ts_chunk_set_record(tc, sec, nsec, value);
-
-        ptr += sizeof(uint64_t) + sizeof(double_t);
-        n -= (sizeof(uint64_t) + sizeof(double_t));
-    }
-
-    free(buf);
+    if (tc->start_ts == 0 || tc->start_ts > point.timestamp)
+        tc->start_ts = point.timestamp;
+    if (tc->end_ts < point.timestamp)
+        tc->end_ts = point.timestamp;
 
     return 0;
 }
@@ -284,26 +931,16 @@ int ts_init(Timeseries *ts)
              ts->name);
 
     ts_chunk_zero(&ts->head);
-    ts_chunk_zero(&ts->head);
+    ts_chunk_zero(&ts->prev);
 
     struct dirent **namelist;
-    int err = 0, ok = 0;
-    int n = scandir(pathbuf, &namelist, NULL, alphasort);
+    int err = 0;
+    int n   = scandir(pathbuf, &namelist, NULL, alphasort);
     if (n == -1)
-        goto exit;
+        return -1;
 
     for (int i = 0; i < n; ++i) {
-        const char *dot = strrchr(namelist[i]->d_name, '.');
-        if (strncmp(namelist[i]->d_name, "wal-", 4) == 0 &&
-            strncmp(dot, ".log", 4) == 0) {
-            uint64_t base_timestamp = atoll(namelist[i]->d_name + 6);
-            if (namelist[i]->d_name[4] == 'h') {
-                err = ts_chunk_load(&ts->head, pathbuf, base_timestamp, 1);
-            } else if (namelist[i]->d_name[4] == 't') {
-                err = ts_chunk_load(&ts->prev, pathbuf, base_timestamp, 0);
-            }
-            ok = err == 0;
-        } else if (namelist[i]->d_name[0] == 'c') {
+        if (namelist[i]->d_name[0] == 'c') {
             // There is a log partition
             uint64_t base_timestamp = atoll(namelist[i]->d_name + 3);
             err = partition_load(&ts->partitions[ts->partition_nr++], pathbuf,
@@ -318,7 +955,7 @@ int ts_init(Timeseries *ts)
 
     free(namelist);
 
-    return ok;
+    return 0;
 
 exit:
     free(namelist);
@@ -329,15 +966,146 @@ void ts_close(Timeseries *ts)
 {
     ts_chunk_destroy(&ts->head);
     ts_chunk_destroy(&ts->prev);
+    for (size_t i = 0; i < ts->partition_nr; ++i)
+        partition_close(&ts->partitions[i]);
     free(ts);
 }
 
-static void ts_deinit(Timeseries *ts)
+/*
+ * Log a point of the chunk `tc`, nothing to do for series without a WAL
+ */
+static int ts_wal_append(Timeseries *ts, Timeseries_Chunk *tc,
+                         uint64_t timestamp, double_t value)
 {
-    ts_chunk_destroy(&ts->head);
-    ts_chunk_destroy(&ts->prev);
-    wal_delete(&ts->head.wal);
-    wal_delete(&ts->prev.wal);
+    if (!ts->wal)
+        return 0;
+
+    return wal_append(ts->wal, &tc->wal, ts->id, timestamp, value);
+}
+
+/*
+ * Mark the frames of a chunk as flushed in the WAL, they aren't needed
+ * anymore. If the marker can't be written the chunk keeps its pin on the WAL
+ * and it's marked again on the next flush, only its size is reset.
+ */
+static int ts_wal_flushed(Timeseries *ts, Wal_Chunk *wal)
+{
+    if (ts->wal && wal_flushed(ts->wal, wal, ts->id) < 0) {
+        log_error("Can't checkpoint the WAL of %s", ts->name);
+        wal->size = 0;
+        return -1;
+    }
+
+    *wal = (Wal_Chunk){0};
+
+    return 0;
+}
+
+/*
+ * Return the partition a chunk starting at `base` has to be flushed into, a
+ * new one is started if the chunk is past the latest partition, as long as
+ * there's room left, the latest is extended otherwise
+ */
+static ssize_t ts_partition_for(Timeseries *ts, const char *pathbuf,
+                                uint64_t base)
+{
+    size_t partition_nr = ts->partition_nr == 0 ? 0 : ts->partition_nr - 1;
+
+    if (ts->partition_nr == 0 ||
+        (ts->partitions[partition_nr].clog.base_timestamp < base &&
+         ts->partition_nr < TS_MAX_PARTITIONS)) {
+        if (partition_init(&ts->partitions[ts->partition_nr], pathbuf, base) <
+            0)
+            return -1;
+        partition_nr = ts->partition_nr;
+        // The partition must be complete before readers can see it
+        atomic_thread_fence(memory_order_release);
+        ts->partition_nr++;
+        ts_catalog_sync(ts);
+    }
+
+    return partition_nr;
+}
+
+/*
+ * Move the head chunk to the prev one, after flushing the current prev to
+ * persistence, and start a new head chunk based at `sec`.
+ *
+ * The new head is set up and the prev written to disk out of the write
+ * section, readers keep finding its points in memory meanwhile, the section
+ * only covers publishing them on disk and swapping the chunks
+ */
+static int ts_chunk_rotate(Timeseries *ts, const char *pathbuf, uint64_t sec)
+{
+    Timeseries_Chunk head = {0};
+    ssize_t partition_nr  = -1;
+    Wal_Chunk flushed     = ts->prev.wal;
+
+    if (ts_chunk_init(&head, sec, ts->chunk_size) < 0)
+        return -1;
+
+    if (ts->prev.base_offset != 0) {
+        partition_nr = ts_partition_for(ts, pathbuf, ts->prev.base_offset);
+        if (partition_nr < 0 ||
+            partition_flush_chunk(&ts->partitions[partition_nr], &ts->prev) <
+                0) {
+            ts_chunk_destroy(&head);
+            return -1;
+        }
+    }
+
+    ts_write_begin(ts);
+    if (partition_nr >= 0) {
+        partition_publish_chunk(&ts->partitions[partition_nr], &ts->prev);
+        ts_chunk_retire(&ts->prev);
+    }
+    // Set the current head as new prev, its frames in the WAL follow it
+    ts->prev = ts->head;
+    ts->head = head;
+    ts_write_end(ts);
+
+    // The frames of the prev chunk flushed can be recycled, a prev left
+    // empty can still hold the pin of a chunk flushed before, if the marker
+    // can't be written the new head takes it over
+    if (ts_wal_flushed(ts, &flushed) < 0)
+        ts->head.wal = flushed;
+
+    return 0;
+}
+
+/*
+ * Dump both the in-memory chunks into the latest partition and reset them,
+ * as for the rotation only publishing the records on disk and resetting the
+ * chunks is done in a write section
+ */
+static int ts_flush(Timeseries *ts, const char *pathbuf)
+{
+    uint64_t base        = ts->prev.base_offset > 0 ? ts->prev.base_offset
+                                                    : ts->head.base_offset;
+    ssize_t partition_nr = ts_partition_for(ts, pathbuf, base);
+    if (partition_nr < 0)
+        return -1;
+
+    Partition *p = &ts->partitions[partition_nr];
+
+    // Dump chunks into disk and create new ones
+    if (ts->prev.base_offset > 0 && partition_flush_chunk(p, &ts->prev) < 0)
+        return -1;
+    if (partition_flush_chunk(p, &ts->head) < 0)
+        return -1;
+
+    ts_write_begin(ts);
+    partition_publish_chunk(p, &ts->prev);
+    partition_publish_chunk(p, &ts->head);
+    ts_chunk_retire(&ts->head);
+    ts_chunk_retire(&ts->prev);
+    ts_write_end(ts);
+
+    // Their frames in the WAL can be recycled
+    ts_wal_flushed(ts, &ts->head.wal);
+    ts_wal_flushed(ts, &ts->prev.wal);
+
+    return 0;
 }
 
 /*
@@ -352,7 +1120,8 @@ static void ts_deinit(Timeseries *ts)
  * @param value The value of the record to be set.
  * @return 0 on success, -1 on failure.
  */
-int ts_insert(Timeseries *ts, uint64_t timestamp, double_t value)
+static int ts_insert_record(Timeseries *ts, uint64_t timestamp,
+                            double_t value)
 {
     // Extract seconds and nanoseconds from timestamp
     uint64_t sec  = timestamp / (uint64_t)1e9;
@@ -362,69 +1131,128 @@ int ts_insert(Timeseries *ts, uint64_t timestamp, double_t value)
     snprintf(pathbuf, sizeof(pathbuf), "%s/%s/%s", BASE_PATH, ts->db_data_path,
              ts->name);
 
+    int err = 0;
+
     // if the limit is reached we dump the chunks into disk and create 2 new
     // ones
-    if (wal_size(&ts->head.wal) >= TS_FLUSH_SIZE) {
-        uint64_t base       = ts->prev.base_offset > 0 ? ts->prev.base_offset
-                                                       : ts->head.base_offset;
-        size_t partition_nr = ts->partition_nr == 0 ? 0 : ts->partition_nr - 1;
-
-        if (ts->partitions[partition_nr].clog.base_timestamp < base) {
-            if (partition_init(&ts->partitions[ts->partition_nr], pathbuf,
-                               base) < 0) {
-                return -1;
-            }
-            partition_nr = ts->partition_nr;
-            ts->partition_nr++;
-        }
-
-        // Dump chunks into disk and create new ones
-        if (partition_flush_chunk(&ts->partitions[partition_nr], &ts->prev) < 0)
-            return -1;
-        if (partition_flush_chunk(&ts->partitions[partition_nr], &ts->head) < 0)
-            return -1;
-
-        // Reset clean both head and prev in-memory chunks
-        ts_deinit(ts);
-    }
+    if (wal_size(&ts->head.wal) >= ts->flush_size &&
+        ts_flush(ts, pathbuf) < 0)
+        return -1;
     // Let it crash for now if the timestamp is out of bounds in the ooo
     if (sec < ts->head.base_offset) {
         // If the chunk is empty, it also means the base offset is 0, we set
         // it here with the first record inserted
-        if (ts->prev.base_offset == 0)
-            ts_chunk_init(&ts->prev, pathbuf, sec, 0);
+        if (ts->prev.base_offset == 0) {
+            ts_write_begin(ts);
+            err = ts_chunk_init(&ts->prev, sec, ts->chunk_size);
+            ts_write_end(ts);
+            if (err < 0)
+                return -1;
+        }
 
         // Persist to disk for disaster recovery
-        wal_append(&ts->prev.wal, timestamp, value);
+        ts_wal_append(ts, &ts->prev, timestamp, value);
 
         // If we successfully insert the record, we can return
         if (ts_chunk_record_fit(&ts->prev, sec) == 0)
-            return ts_chunk_set_record(&ts->prev, sec, nsec, value);
+            return ts_chunk_set_record(ts, &ts->prev, sec, nsec, value);
     }
 
-    if (ts->head.base_offset == 0)
-        ts_chunk_init(&ts->head, pathbuf, sec, 1);
+    if (ts->head.base_offset == 0) {
+        ts_write_begin(ts);
+        err = ts_chunk_init(&ts->head, sec, ts->chunk_size);
+        ts_write_end(ts);
+        if (err < 0)
+            return -1;
+    }
 
-    // Persist to disk for disaster recovery
-    wal_append(&ts->head.wal, timestamp, value);
     // Check if the timestamp is in range of the current chunk, otherwise
     // create a new in-memory segment
-    if (ts_chunk_record_fit(&ts->head, sec) < 0) {
-        // Flush the prev chunk to persistence
-        if (partition_flush_chunk(&ts->partitions[ts->partition_nr],
-                                  &ts->prev) < 0)
-            return -1;
-        // Clean up the prev chunk and delete it's WAL
-        ts_chunk_destroy(&ts->prev);
-        wal_delete(&ts->prev.wal);
-        // Set the current head as new prev
-        ts->prev = ts->head;
-        // Reset the current head as new head
-        ts_chunk_destroy(&ts->head);
-        wal_delete(&ts->head.wal);
-    }
+    if (ts_chunk_record_fit(&ts->head, sec) < 0 &&
+        ts_chunk_rotate(ts, pathbuf, sec) < 0)
+        return -1;
+
+    // Persist to disk for disaster recovery
+    if (ts_wal_append(ts, &ts->head, timestamp, value) < 0)
+        return -1;
+
     // Insert it into the head chunk
-    return ts_chunk_set_record(&ts->head, sec, nsec, value);
+    return ts_chunk_set_record(ts, &ts->head, sec, nsec, value);
+}
+
+static int ts_insert_point(Timeseries *ts, uint64_t timestamp,
+                           double_t value)
+{
+    TRACE_BEGIN(t);
+    uint64_t start = metrics_now();
+    int err        = ts_insert_record(ts, timestamp, value);
+
+    metrics_record_since(MET_INSERT, start);
+    TRACE_END(t, TRACE_TS_INSERT);
+    if (err == 0)
+        metrics_add(MET_POINTS, 1);
+
+    return err;
+}
+
+/*
+ * Write out the frames logged by the inserts so far, the points are durable
+ * from here on
+ */
+static int ts_wal_commit(Timeseries *ts)
+{
+    if (!ts->wal || wal_commit(ts->wal) == 0)
+        return 0;
+
+    log_error("Can't write the WAL of %s: %s", ts->name, strerror(errno));
+
+    return -1;
+}
+
+int ts_insert(Timeseries *ts, uint64_t timestamp, double_t value)
+{
+    int err = ts_insert_point(ts, timestamp, value);
+
+    return ts_wal_commit(ts) < 0 ? -1 : err;
+}
+
+/*
+ * Insert `length` records, stopping at the first failing, their frames are
+ * written out to the WAL in a single commit at the end
+ */
+int ts_insert_batch(Timeseries *ts, const Record *records, size_t length)
+{
+    int err = 0;
+
+    for (size_t i = 0; i < length && err == 0; ++i)
+        err = ts_insert_point(ts, records[i].timestamp, records[i].value);
+
+    return ts_wal_commit(ts) < 0 ? -1 : err;
+}
+
+/*
+ * Bytes held by the in-memory chunks of the series, only meaningful from the
+ * writer thread
+ */
+size_t ts_memory(const Timeseries *ts)
+{
+    return ts->head.memory + ts->prev.memory;
+}
+
+/*
+ * Flush the in-memory chunks to disk ahead of the WAL size threshold, e.g. to
+ * release memory under pressure, must be called by the writer of the series
+ */
+int ts_flush_chunks(Timeseries *ts)
+{
+    if (ts->head.base_offset == 0)
+        return 0;
+
+    char pathbuf[MAX_PATH_SIZE];
+    snprintf(pathbuf, sizeof(pathbuf), "%s/%s/%s", BASE_PATH, ts->db_data_path,
+             ts->name);
+
+    return ts_flush(ts, pathbuf);
 }
 
 static int ts_search_index(const Timeseries_Chunk *tc, uint64_t sec,
@@ -436,42 +1264,28 @@ static int ts_search_index(const Timeseries_Chunk *tc, uint64_t sec,
     size_t index = 0;
     ssize_t idx  = 0;
 
-    if ((index = sec - tc->base_offset) > TS_CHUNK_SIZE)
+    if ((index = ts_chunk_index(tc, sec)) >= tc->width)
         return -1;
 
-    if (vec_size(tc->points[index]) < LINEAR_THRESHOLD)
-        vec_search_cmp(tc->points[index], target, record_cmp, &idx);
+    Points bucket = ts_bucket_load(&tc->points[index]);
+    if (vec_size(bucket) == 0)
+        return 1;
+
+    if (vec_size(bucket) < LINEAR_THRESHOLD)
+        vec_search_cmp(bucket, target, record_cmp, &idx);
     else
-        vec_bsearch_cmp(tc->points[index], target, record_cmp, &idx);
+        vec_bsearch_cmp(bucket, target, record_cmp, &idx);
 
     if (idx < 0)
         return 1;
 
-    *dst = vec_at(tc->points[index], idx);
+    *dst = vec_at(bucket, idx);
 
     return 0;
 }
 
-/*
- * Finds a record in a timeseries data structure.
- *
- * This function searches for a record with the specified timestamp in the
- * given timeseries data structure. It first checks the in-memory chunks
- * (head and previous) and then looks for the record on disk if not found
- * in memory.
- *
- * @param ts A pointer to the Timeseries structure representing the timeseries.
- * @param timestamp The timestamp of the record to be found, specified in
- * nanoseconds since the Unix epoch.
- * @param r A pointer to a Record structure where the found record will be
- * stored.
- * @return 0 if the record is found and successfully stored in 'r', -1 if an
- * error occurs, or a negative value indicating the result of the search:
- *         - 1 if the record is found in memory.
- *         - 0 if the record is not found in memory but found on disk.
- *         - Negative value if an error occurs during the search.
- */
-int ts_find(const Timeseries *ts, uint64_t timestamp, Record *r)
+static int ts_find_snapshot(const Timeseries *ts, uint64_t timestamp,
+                            Record *r)
 {
     uint64_t sec  = timestamp / (uint64_t)1e9;
     Record target = {.timestamp = timestamp};
@@ -484,7 +1298,7 @@ int ts_find(const Timeseries *ts, uint64_t timestamp, Record *r)
             return err;
     }
     // Then check the OOO chunk
-    if (err != 1 && ts->prev.base_offset > 0) {
+    if (ts->prev.base_offset > 0) {
         err = ts_search_index(&ts->prev, sec, &target, r);
         if (err <= 0)
             return err;
@@ -495,9 +1309,10 @@ int ts_find(const Timeseries *ts, uint64_t timestamp, Record *r)
         return -1;
 
     // Look for the record on disk
-    uint8_t buf[RECORD_BINARY_SIZE];
     ssize_t partition_i = 0;
-    for (size_t n = 0; n <= ts->partition_nr; ++n) {
+    size_t partition_nr = ts->partition_nr;
+    atomic_thread_fence(memory_order_acquire);
+    for (size_t n = 0; n < partition_nr; ++n) {
         if (ts->partitions[n].clog.base_timestamp > 0 &&
             ts->partitions[n].clog.base_timestamp <= sec) {
             uint64_t curr_ts =
@@ -514,120 +1329,135 @@ int ts_find(const Timeseries *ts, uint64_t timestamp, Record *r)
         return -1;
 
     // Fetch single record from the partition
-    err = partition_find(&ts->partitions[partition_i], buf, timestamp);
-    if (err < 0)
-        return -1;
+    return partition_find(&ts->partitions[partition_i], r, timestamp);
+}
+
+/*
+ * Finds a record in a timeseries data structure.
+ *
+ * This function searches for a record with the specified timestamp in the
+ * given timeseries data structure. It first checks the in-memory chunks
+ * (head and previous) and then looks for the record on disk if not found
+ * in memory.
+ *
+ * @param ts A pointer to the Timeseries structure representing the timeseries.
+ * @param timestamp The timestamp of the record to be found, specified in
+ * nanoseconds since the Unix epoch.
+ * @param r A pointer to a Record structure where the found record will be
+ * stored.
+ * @return 0 if the record is found and successfully stored in 'r', -1 if an
+ * error occurs, or a negative value indicating the result of the search:
+ *         - 1 if the record is found in memory.
+ *         - 0 if the record is not found in memory but found on disk.
+ *         - Negative value if an error occurs during the search.
+ */
+int ts_find(const Timeseries *ts, uint64_t timestamp, Record *r)
+{
+    uint64_t start   = metrics_now();
+    uint64_t version = 0;
+    int err          = 0;
 
-    // We got a match
-    ts_record_read(r, buf);
+    epoch_enter();
 
-    return 0;
+    do {
+        version = ts_read_begin(ts);
+        err     = ts_find_snapshot(ts, timestamp, r);
+    } while (ts_read_retry(ts, version));
+
+    epoch_exit();
+
+    metrics_record_since(MET_FIND, start);
+
+    return err;
 }
 
+/*
+ * Collect the records of a chunk falling in [t0, t1], the boundaries are
+ * clamped to the chunk buckets so that ranges spanning multiple chunks or
+ * partitions can be stitched together by the caller
+ */
 static void ts_chunk_range(const Timeseries_Chunk *tc, uint64_t t0, uint64_t t1,
-                           Points *p)
+                           Points *p, Allocator allocator)
 {
     uint64_t sec0 = t0 / (uint64_t)1e9;
     uint64_t sec1 = t1 / (uint64_t)1e9;
-    size_t low, high, idx_low = 0, idx_high = 0;
-    // Find the low
-    low           = sec0 - tc->base_offset;
-    Record target = {.timestamp = t0};
-
-    if (vec_size(tc->points[low]) < LINEAR_THRESHOLD)
-        vec_search_cmp(tc->points[low], &target, record_cmp, &idx_low);
-    else
-        vec_bsearch_cmp(tc->points[low], &target, record_cmp, &idx_low);
+    size_t low = 0, high = 0;
 
-    // Find the high
-    // TODO let it crash on edge cases for now (can this happen now?)
-    high             = sec1 - tc->base_offset;
-    target.timestamp = t1;
+    if (tc->base_offset == 0 || sec1 < tc->base_offset)
+        return;
 
-    if (vec_size(tc->points[high]) < LINEAR_THRESHOLD)
-        vec_search_cmp(tc->points[high], &target, record_cmp, &idx_high);
-    else
-        vec_bsearch_cmp(tc->points[high], &target, record_cmp, &idx_high);
+    low  = sec0 > tc->base_offset ? ts_chunk_index(tc, sec0) : 0;
+    high = ts_chunk_index(tc, sec1);
+    high = high > tc->max_index ? tc->max_index : high;
 
-    // Collect the records
+    // Collect the records, only the boundary buckets can hold points out of
+    // the range
     for (size_t i = low; i < high + 1; ++i) {
-
-        size_t end = i == high ? idx_high : vec_size(tc->points[i]);
-
-        for (size_t j = idx_low; j < end + 1; ++j) {
-            Record r = vec_at(tc->points[i], j);
-            if (r.is_set == 1)
-                vec_push(*p, r);
+        Points bucket = ts_bucket_load(&tc->points[i]);
+        metrics_query_add(QS_POINTS_SCANNED, vec_size(bucket));
+        for (size_t j = 0; j < vec_size(bucket); ++j) {
+            const Record *r = &vec_at(bucket, j);
+            if (r->is_set == 1 && r->timestamp >= t0 && r->timestamp <= t1)
+                vec_push_alloc(*p, *r, allocator);
         }
-        idx_low = 0;
     }
 }
 
 // Helper function to fetch records from a partition within a given time range
 static int fetch_records_from_partition(const Partition *partition,
                                         uint64_t start, uint64_t end,
-                                        Points *points)
-{
-    // TODO malloc
-    uint8_t buf[4096];
-    uint8_t *ptr      = &buf[0];
-    size_t record_len = 0;
-    int n             = partition_range(partition, ptr, start, end);
-    if (n < 0)
+                                        Points *points, Allocator allocator)
+{
+    if (partition_range(partition, start, end, points, allocator) < 0)
         return -1;
-
-    while (n > 0) {
-        Record record;
-        record_len = ts_record_read(&record, ptr);
-        vec_push(*points, record);
-        ptr += record_len;
-        n -= record_len;
-        start = record.timestamp;
-    }
     return 0;
 }
 
-int ts_range(const Timeseries *ts, uint64_t start, uint64_t end, Points *p)
+static int ts_range_snapshot(const Timeseries *ts, uint64_t start,
+                             uint64_t end, Points *p, Allocator allocator)
 {
-    uint64_t sec0 = start / (uint64_t)1e9;
+    uint64_t sec0       = start / (uint64_t)1e9;
+    size_t partition_nr = ts->partition_nr;
+    atomic_thread_fence(memory_order_acquire);
     // Check if the range falls in the current chunk
     if (ts->head.base_offset > 0 && ts->head.base_offset <= sec0 &&
         ts->head.start_ts <= start) {
         // The starting timestamp is in the future, return not found
-        if (sec0 - ts->head.base_offset > TS_CHUNK_SIZE)
+        if (ts_chunk_index(&ts->head, sec0) > ts->head.width)
             return -1;
-        ts_chunk_range(&ts->head, start, end, p);
+        ts_chunk_range(&ts->head, start, end, p, allocator);
     } else if (ts->prev.base_offset > 0 && ts->prev.base_offset <= sec0 &&
                ts->prev.start_ts <= end) {
         // TODO remove
         // The starting timestamp is in the future for the prev chunk, this
         // shouldn't happen
-        if (sec0 - ts->prev.base_offset > TS_CHUNK_SIZE)
+        if (ts_chunk_index(&ts->prev, sec0) > ts->prev.width)
             return -1;
-        ts_chunk_range(&ts->prev, start, end, p);
+        ts_chunk_range(&ts->prev, start, end, p, allocator);
     } else {
         // Search in the persistence
         size_t partition_i      = 0;
         const Partition *curr_p = NULL;
 
         // Find the starting partition
-        while (partition_i < ts->partition_nr &&
+        while (partition_i < partition_nr &&
                ts->partitions[partition_i].end_ts < start)
             partition_i++;
 
         // Fetch records from partitions within the time range
-        while (partition_i < ts->partition_nr &&
+        while (partition_i < partition_nr &&
                ts->partitions[partition_i].start_ts <= end) {
             curr_p = &ts->partitions[partition_i];
 
             // Fetch records from the current partition
             if (curr_p->end_ts >= end) {
-                if (fetch_records_from_partition(curr_p, start, end, p) < 0)
+                if (fetch_records_from_partition(curr_p, start, end, p,
+                                                 allocator) < 0)
                     return -1;
                 return 0;
             } else {
                 if (fetch_records_from_partition(curr_p, start, curr_p->end_ts,
-                                                 p) < 0)
+                                                 p, allocator) < 0)
                     return -1;
                 start = curr_p->end_ts;
                 partition_i++;
@@ -635,24 +1465,90 @@ int ts_range(const Timeseries *ts, uint64_t start, uint64_t end, Points *p)
         }
 
         // Fetch records from the previous chunk if it exists
-        if (ts->prev.base_offset != 0) {
-            ts_chunk_range(&ts->prev, start, end, p);
-            start = vec_last(ts->prev.points[ts->prev.max_index]).timestamp;
-        }
+        if (ts->prev.base_offset != 0)
+            ts_chunk_range(&ts->prev, start, end, p, allocator);
 
         // Fetch records from the current chunk if it exists
         if (ts->head.base_offset != 0) {
-            ts_chunk_range(&ts->head, ts->head.start_ts, end, p);
+            ts_chunk_range(&ts->head, ts->head.start_ts, end, p, allocator);
         }
     }
 
     return 0;
 }
 
+/*
+ * Collect the records in the range [start, end] into `p`, the in-memory
+ * chunks are scanned concurrently with the writer, the scan is restarted from
+ * scratch if the series changed shape in the meanwhile.
+ *
+ * `p` is grown through `allocator`, it must be the one it was created with
+ */
+int ts_range_with_allocator(const Timeseries *ts, uint64_t start,
+                            uint64_t end, Points *p, Allocator allocator)
+{
+    uint64_t t0      = metrics_now();
+    uint64_t version = 0;
+    size_t size      = vec_size(*p);
+    int err          = 0;
+
+    epoch_enter();
+
+    do {
+        p->size = size;
+        version = ts_read_begin(ts);
+        err     = ts_range_snapshot(ts, start, end, p, allocator);
+    } while (ts_read_retry(ts, version));
+
+    epoch_exit();
+
+    metrics_record_since(MET_RANGE, t0);
+
+    return err;
+}
+
+int ts_range(const Timeseries *ts, uint64_t start, uint64_t end, Points *p)
+{
+    return ts_range_with_allocator(ts, start, end, p, heap_allocator());
+}
+
+/*
+ * Collect into `reads`, grown through `allocator`, the reads of the blocks
+ * on disk holding [start, end] that are missing from the block cache, at most
+ * `max`, once they're carried out a range or a find on the same span is
+ * served from memory. Returns the number of reads or -1 on error
+ */
+int ts_block_reads(const Timeseries *ts, uint64_t start, uint64_t end,
+                   Block_Reads *reads, size_t max, Allocator allocator)
+{
+    uint64_t version = 0;
+    int err          = 0;
+
+    epoch_enter();
+
+    do {
+        reads->size         = 0;
+        err                 = 0;
+        version             = ts_read_begin(ts);
+        size_t partition_nr = ts->partition_nr;
+        atomic_thread_fence(memory_order_acquire);
+        for (size_t i = 0; i < partition_nr && err >= 0; ++i) {
+            const Partition *p = &ts->partitions[i];
+            if (p->end_ts >= start && p->start_ts <= end)
+                err = partition_block_reads(p, start, end, reads, max,
+                                            allocator);
+        }
+    } while (ts_read_retry(ts, version));
+
+    epoch_exit();
+
+    return err < 0 ? -1 : (int)vec_size(*reads);
+}
+
 void ts_print(const Timeseries *ts)
 {
-    for (int i = 0; i < TS_CHUNK_SIZE; ++i) {
-        Points p = ts->head.points[i];
+    for (size_t i = 0; i < ts->head.width; ++i) {
+        Points p = ts_bucket_load(&ts->head.points[i]);
         for (size_t j = 0; j < vec_size(p); ++j) {
             Record r = vec_at(p, j);
             if (!r.is_set)
@@ -698,6 +1594,41 @@ size_t ts_record_read(Record *r, const uint8_t *buf)
     return record_size;
 }
 
+/*
+ * Decode `count` records laid out back to back, as they're flushed to the
+ * partitions, byte swapping runs of them in bulk. Returns the number of
+ * records decoded, short of `count` at the first one carrying a wrong size.
+ */
+size_t ts_record_read_batch(Record *r, const uint8_t *buf, size_t count)
+{
+    // Size, timestamp and value of each record of a run
+    uint64_t words[RECORD_DECODE_RUN * 3];
+    size_t n = 0;
+    double value;
+
+    for (size_t i = 0; i < count; i += n) {
+        n = count - i < RECORD_DECODE_RUN ? count - i : RECORD_DECODE_RUN;
+        read_i64_array(words, buf + i * RECORD_BINARY_SIZE, n * 3);
+
+        for (size_t j = 0; j < n; ++j) {
+            Record *record = &r[i + j];
+
+            if (words[j * 3] != RECORD_BINARY_SIZE)
+                return i + j;
+
+            record->timestamp  = words[j * 3 + 1];
+            record->tv.tv_sec  = record->timestamp / (uint64_t)1e9;
+            record->tv.tv_nsec = record->timestamp % (uint64_t)1e9;
+            // The binary64 bits, as stored by write_f64
+            memcpy(&value, &words[j * 3 + 2], sizeof(value));
+            record->value  = value;
+            record->is_set = 1;
+        }
+    }
+
+    return count;
+}
+
 size_t ts_record_batch_write(const Record *r[], uint8_t *buf, size_t count)
 {
     uint64_t last_timestamp = r[count - 1]->timestamp;
@@ -0,0 +1,171 @@
+#include "trace.h"
+
+#ifdef ROACH_TRACE
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * An event is valid once its sequence, the position it was written at plus
+ * one, is set, the writer clears it before touching the event so a reader
+ * racing with the overwrite sees a sequence change and skips it
+ */
+typedef struct {
+    atomic_uint_fast64_t seq;
+    atomic_uint_fast64_t start;
+    atomic_uint_fast64_t end;
+    atomic_uint_fast32_t span;
+} Trace_Event;
+
+typedef struct {
+    atomic_size_t head;
+    Trace_Event events[TRACE_RING_SIZE];
+} Trace_Ring;
+
+static const char *span_names[TRACE_SPAN_NR] = {
+    "request",    "parse", "encode",     "ts_insert",
+    "wal_append", "flush", "index_find", "log_read"};
+
+static _Atomic(Trace_Ring *) rings[TRACE_MAX_THREADS];
+static atomic_size_t rings_nr = 0;
+
+// Clock reference to turn the ticks into time
+static atomic_int calibrated  = 0;
+static uint64_t base_ticks    = 0;
+static uint64_t base_ns       = 0;
+
+static _Thread_local Trace_Ring *local = NULL;
+static _Thread_local int dropped       = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec * (uint64_t)1e9 + tv.tv_nsec;
+}
+
+static void trace_calibrate(void)
+{
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&calibrated, &expected, 1)) {
+        base_ns    = now_ns();
+        base_ticks = trace_now();
+        atomic_store(&calibrated, 2);
+    }
+}
+
+// The threads past TRACE_MAX_THREADS are not traced
+static Trace_Ring *trace_ring(void)
+{
+    if (local || dropped)
+        return local;
+
+    trace_calibrate();
+
+    size_t index = atomic_fetch_add(&rings_nr, 1);
+    if (index >= TRACE_MAX_THREADS) {
+        dropped = 1;
+        return NULL;
+    }
+
+    local = calloc(1, sizeof(*local));
+    if (!local) {
+        dropped = 1;
+        return NULL;
+    }
+
+    atomic_store_explicit(&rings[index], local, memory_order_release);
+
+    return local;
+}
+
+void trace_record(Trace_Span span, uint64_t start, uint64_t end)
+{
+    Trace_Ring *r = trace_ring();
+    if (!r)
+        return;
+
+    size_t head    = atomic_load_explicit(&r->head, memory_order_relaxed);
+    Trace_Event *e = &r->events[head & (TRACE_RING_SIZE - 1)];
+
+    atomic_store_explicit(&e->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&e->start, start, memory_order_relaxed);
+    atomic_store_explicit(&e->end, end, memory_order_relaxed);
+    atomic_store_explicit(&e->span, span, memory_order_relaxed);
+    atomic_store_explicit(&e->seq, head + 1, memory_order_release);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+static int trace_dump_ring(FILE *fp, Trace_Ring *r, size_t tid,
+                           double ns_per_tick, int *first)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t i    = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+    for (; i < head; ++i) {
+        Trace_Event *e = &r->events[i & (TRACE_RING_SIZE - 1)];
+        uint64_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        uint64_t start = atomic_load_explicit(&e->start, memory_order_relaxed);
+        uint64_t end   = atomic_load_explicit(&e->end, memory_order_relaxed);
+        uint32_t span  = atomic_load_explicit(&e->span, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+
+        if (seq != i + 1 ||
+            atomic_load_explicit(&e->seq, memory_order_relaxed) != seq ||
+            span >= TRACE_SPAN_NR || end < start || start < base_ticks)
+            continue;
+
+        // Timestamps and durations in microseconds
+        double ts  = (start - base_ticks) * ns_per_tick / 1e3;
+        double dur = (end - start) * ns_per_tick / 1e3;
+
+        if (fprintf(fp,
+                    "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                    "\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+                    *first ? "" : ",", span_names[span], tid, ts, dur) < 0)
+            return -1;
+        *first = 0;
+    }
+
+    return 0;
+}
+
+int trace_dump(FILE *fp)
+{
+    double ns_per_tick = 1.0;
+    int first          = 1;
+
+    if (fputs("{\"traceEvents\":[", fp) < 0)
+        return -1;
+
+    if (atomic_load(&calibrated) == 2) {
+        uint64_t ticks = trace_now() - base_ticks;
+        uint64_t ns    = now_ns() - base_ns;
+        ns_per_tick    = ticks > 0 ? (double)ns / ticks : 1.0;
+
+        size_t nr = atomic_load(&rings_nr);
+        nr        = nr > TRACE_MAX_THREADS ? TRACE_MAX_THREADS : nr;
+        for (size_t i = 0; i < nr; ++i) {
+            Trace_Ring *r =
+                atomic_load_explicit(&rings[i], memory_order_acquire);
+            if (r && trace_dump_ring(fp, r, i + 1, ns_per_tick, &first) < 0)
+                return -1;
+        }
+    }
+
+    if (fputs("\n],\"displayTimeUnit\":\"ns\"}\n", fp) < 0)
+        return -1;
+
+    return 0;
+}
+
+#else
+
+int trace_dump(FILE *fp)
+{
+    return fputs("{\"traceEvents\":[]}\n", fp) < 0 ? -1 : 0;
+}
+
+#endif
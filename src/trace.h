@@ -0,0 +1,77 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAX_THREADS 128
+// Events kept per thread, the oldest are overwritten, must be a power of 2
+#define TRACE_RING_SIZE   (1 << 14)
+
+/*
+ * Spans traced, the request one wraps the whole handling of a query on the
+ * server, parse and encode included, the others the main steps of the
+ * storage engine it goes through
+ */
+typedef enum {
+    TRACE_REQUEST,
+    TRACE_PARSE,
+    TRACE_ENCODE,
+    TRACE_TS_INSERT,
+    TRACE_WAL_APPEND,
+    TRACE_FLUSH,
+    TRACE_INDEX_FIND,
+    TRACE_LOG_READ,
+    TRACE_SPAN_NR
+} Trace_Span;
+
+/*
+ * Spans are compiled in only with ROACH_TRACE defined, `make TRACE=1`,
+ * otherwise the macros expand to nothing and cost nothing.
+ *
+ * Each thread records into a ring of its own, registered the first time it
+ * records anything, with TSC timestamps where available, the rings are
+ * converted to the Chrome trace event format on demand by `trace_dump`.
+ *
+ * TRACE_BEGIN(t);
+ * ...
+ * TRACE_END(t, TRACE_TS_INSERT);
+ */
+#ifdef ROACH_TRACE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t trace_now(void) { return __rdtsc(); }
+#else
+#include <time.h>
+static inline uint64_t trace_now(void)
+{
+    struct timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec * (uint64_t)1e9 + tv.tv_nsec;
+}
+#endif
+
+void trace_record(Trace_Span span, uint64_t start, uint64_t end);
+
+#define TRACE_BEGIN(var)      uint64_t var = trace_now()
+#define TRACE_END(var, span)  trace_record((span), (var), trace_now())
+
+#else
+
+#define TRACE_BEGIN(var)      (void)0
+#define TRACE_END(var, span)  (void)0
+
+#endif
+
+/*
+ * Write the events recorded so far as a Chrome trace JSON, loadable by
+ * chrome://tracing or Perfetto, the rings are read while the threads keep
+ * recording so the oldest events of a busy thread can be overwritten midway,
+ * those are skipped. Without ROACH_TRACE the list of events is empty.
+ *
+ * Returns 0 on success, -1 on write error
+ */
+int trace_dump(FILE *fp);
+
+#endif
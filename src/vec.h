@@ -70,6 +70,39 @@
         (vec).size++;                                                          \
     } while (0);
 
+/*
+ * Allocator aware variants, `a` is an Allocator as defined in arena.h, every
+ * array of a vector must go through the same one. Growing allocates a new
+ * array and hands the old one back to the allocator, there's no realloc,
+ * an arena can ignore the release and free everything at once later
+ */
+#define vec_init_alloc(vec, cap, a)                                            \
+    do {                                                                       \
+        assert((cap) > 0);                                                     \
+        (vec).size     = 0;                                                    \
+        (vec).capacity = (cap);                                                \
+        (vec).data =                                                           \
+            ((a).alloc)((cap) * sizeof((vec).data[0]), (a).context);           \
+    } while (0)
+
+#define vec_new_alloc(vec, a) vec_init_alloc((vec), VEC_BASE_CAPACITY, (a))
+
+#define vec_destroy_alloc(vec, a)                                              \
+    (a).free((vec).capacity * sizeof((vec).data[0]), (vec).data, (a).context)
+
+#define vec_push_alloc(vec, item, a)                                           \
+    do {                                                                       \
+        if (vec_size((vec)) + 1 == vec_capacity((vec))) {                      \
+            size_t size_ = (vec).capacity * 2 * sizeof((vec).data[0]);         \
+            void *data_  = ((a).alloc)(size_, (a).context);                    \
+            memcpy(data_, (vec).data, (vec).size * sizeof((vec).data[0]));     \
+            vec_destroy_alloc((vec), (a));                                     \
+            (vec).data = data_;                                                \
+            (vec).capacity *= 2;                                               \
+        }                                                                      \
+        (vec).data[(vec).size++] = (item);                                     \
+    } while (0)
+
 #define vec_at(vec, index) (vec).data[(index)]
 
 #define vec_first(vec)     vec_at((vec), 0)
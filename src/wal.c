@@ -1,7 +1,12 @@
 #include "wal.h"
 #include "binary.h"
+#include "crc32c.h"
 #include "disk_io.h"
 #include "logging.h"
+#include "metrics.h"
+#include "trace.h"
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -10,70 +15,706 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-static const char t[2] = {'t', 'h'};
+// Bytes of a frame covered by its checksum, all but the checksum itself
+static const size_t FRAME_DATA_SIZE = sizeof(uint64_t) * 4;
+// Set on the chunk id of the frames marking a chunk as flushed
+static const uint64_t FRAME_FLUSHED = 1ULL << 63;
 
-int wal_init(Wal *w, const char *path, uint64_t base_timestamp, int main)
+static void wal_segment_path(const Wal_Pool *pool, uint64_t id, char *buf,
+                             size_t len)
 {
-    snprintf(w->path, sizeof(w->path), "%s/wal-%c-%.20" PRIu64, path, t[main],
-             base_timestamp);
-    w->fp = open_file(w->path, "log", "w+");
-    if (!w->fp)
-        goto errdefer;
+    snprintf(buf, len, "%s/wal-%.20" PRIu64, pool->path, id);
+}
+
+/*
+ * Reserve the blocks of the whole segment upfront, appends then never grow
+ * the file, where fallocate isn't available the file is just extended
+ */
+static int wal_segment_preallocate(FILE *fp)
+{
+#if defined(__linux__)
+    int err = posix_fallocate(fileno(fp), 0, WAL_SEGMENT_SIZE);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+#else
+    return ftruncate(fileno(fp), WAL_SEGMENT_SIZE);
+#endif
+}
+
+/*
+ * Write the header of the segment under the sequence number `seq`, a `seq`
+ * of 0 marks the segment as free
+ */
+static int wal_segment_start(Wal_Segment *s, uint64_t seq)
+{
+    uint8_t header[WAL_SEGMENT_HEADER_SIZE] = {0};
+
+    s->seq  = seq;
+    s->pins = 0;
+
+    write_i64(header, seq);
+    s->seed = crc32c(0, header, sizeof(uint64_t));
+    write_u32(header + sizeof(uint64_t), s->seed);
+
+    if (write_at(s->fp, header, 0, sizeof(header)) < 0) {
+        log_error("WAL segment %" PRIu64 " header: %s", s->id,
+                  strerror(errno));
+        return -1;
+    }
 
-    w->size = 0;
+    s->offset = WAL_SEGMENT_HEADER_SIZE;
 
     return 0;
+}
 
-errdefer:
-    log_error("WAL init %s: %s", path, strerror(errno));
-    return -1;
+/*
+ * Sync the directory of the segments, so a segment just created is still
+ * there after a crash along with the frames synced to it
+ */
+static int wal_pool_sync(const Wal_Pool *pool)
+{
+    uint64_t start = metrics_now();
+    int fd         = open(pool->path, O_RDONLY | O_DIRECTORY);
+    int err        = fd < 0 || fsync(fd) < 0 ? -1 : 0;
+
+    metrics_record_since(MET_FSYNC, start);
+    if (err < 0)
+        log_error("WAL sync %s: %s", pool->path, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+
+    return err;
 }
 
-int wal_delete(Wal *w)
+static int wal_segment_create(Wal_Pool *pool, Wal_Segment *s)
 {
-    if (!w->fp)
+    char path[MAX_PATH_SIZE];
+
+    s->id = pool->next_id++;
+    wal_segment_path(pool, s->id, path, sizeof(path));
+
+    s->fp = open_file(path, "log", "w+");
+    if (!s->fp)
         return -1;
-    int err = fclose(w->fp);
-    if (err < 0)
+
+    if (wal_segment_preallocate(s->fp) < 0) {
+        log_error("WAL segment %s preallocate: %s", path, strerror(errno));
+        fclose(s->fp);
+        return -1;
+    }
+
+    if (wal_pool_sync(pool) < 0) {
+        fclose(s->fp);
         return -1;
-    w->size = 0;
-    char tmp[WAL_PATH_SIZE + 5];
-    snprintf(tmp, sizeof(tmp), "%s.log", w->path);
+    }
 
-    return remove(tmp);
+    return 0;
+}
+
+static void wal_segment_remove(Wal_Pool *pool, Wal_Segment *s)
+{
+    char path[MAX_PATH_SIZE];
+
+    fclose(s->fp);
+    s->fp = NULL;
+
+    snprintf(path, sizeof(path), "%s/wal-%.20" PRIu64 ".log", pool->path,
+             s->id);
+    if (remove(path) < 0)
+        log_error("WAL segment %s remove: %s", path, strerror(errno));
 }
 
-int wal_load(Wal *w, const char *path, uint64_t base_timestamp, int main)
+/*
+ * Hand out the next tail segment, a free one if there's any, a new one is
+ * created and preallocated otherwise
+ */
+static int wal_pool_acquire(Wal_Pool *pool, Wal_Segment *s)
 {
-    char path_buf[MAX_PATH_SIZE];
-    snprintf(path_buf, sizeof(path_buf), "%s/wal-%c-%.20" PRIu64, path, t[main],
-             base_timestamp);
-    w->fp = open_file(path_buf, "log", "r");
-    if (!w->fp)
-        goto errdefer;
+    if (vec_size(pool->free) > 0)
+        *s = pool->free.data[--vec_size(pool->free)];
+    else if (wal_segment_create(pool, s) < 0)
+        return -1;
 
-    w->size = get_file_size(w->fp, 0);
+    if (wal_segment_start(s, pool->next_seq++) < 0) {
+        wal_segment_remove(pool, s);
+        return -1;
+    }
 
     return 0;
+}
+
+/*
+ * Mark a segment as free so it's not replayed on open, keeping it for reuse
+ * if the pool has room left
+ */
+static void wal_pool_release(Wal_Pool *pool, Wal_Segment *s)
+{
+    if (vec_size(pool->free) < WAL_POOL_SIZE && wal_segment_start(s, 0) == 0) {
+        vec_push(pool->free, *s);
+        return;
+    }
+
+    wal_segment_remove(pool, s);
+}
+
+/*
+ * Take in the segment file `id` found on disk, segments in use are kept to
+ * be replayed, the others are free
+ */
+static int wal_adopt(Wal *w, uint64_t id)
+{
+    char path[MAX_PATH_SIZE];
+    uint8_t header[WAL_SEGMENT_HEADER_SIZE] = {0};
+    Wal_Pool *pool                          = &w->pool;
+    Wal_Segment s                           = {.id = id};
+
+    wal_segment_path(pool, id, path, sizeof(path));
+    s.fp = open_file(path, "log", "r+");
+    if (!s.fp)
+        return -1;
+
+    pool->next_id = id >= pool->next_id ? id + 1 : pool->next_id;
 
-errdefer:
-    log_error("WAL from disk %s: %s", path, strerror(errno));
+    ssize_t n     = read_at(s.fp, header, 0, sizeof(header));
+    uint32_t crc  = crc32c(0, header, sizeof(uint64_t));
+    if (n == (ssize_t)sizeof(header) &&
+        read_u32(header + sizeof(uint64_t)) == crc) {
+        s.seq          = read_i64(header);
+        s.seed         = crc;
+        s.offset       = WAL_SEGMENT_HEADER_SIZE;
+        pool->next_seq = s.seq >= pool->next_seq ? s.seq + 1 : pool->next_seq;
+    }
+
+    if (s.seq != 0) {
+        vec_push(w->segments, s);
+        return 0;
+    }
+
+    // Possibly created right before a crash, make sure it's fully allocated
+    if (vec_size(pool->free) < WAL_POOL_SIZE &&
+        wal_segment_preallocate(s.fp) == 0) {
+        vec_push(pool->free, s);
+        return 0;
+    }
+
+    wal_segment_remove(pool, &s);
+
+    return 0;
+}
+
+static int wal_segment_cmp(const void *a, const void *b)
+{
+    const Wal_Segment *sa = a, *sb = b;
+    return sa->seq < sb->seq ? -1 : sa->seq > sb->seq;
+}
+
+static int wal_segment_name(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    return strncmp(name, "wal-", 4) == 0 && isdigit((unsigned char)name[4]) &&
+           dot && strcmp(dot, ".log") == 0;
+}
+
+/*
+ * Open the WAL in the directory `path`, the segments found are left to be
+ * replayed in their sequence order, appends go to a brand new tail segment so
+ * the old ones can all be recycled once replayed
+ */
+int wal_open(Wal *w, const char *path)
+{
+    struct dirent **namelist = NULL;
+    Wal_Segment tail;
+    int err = 0;
+
+    snprintf(w->pool.path, sizeof(w->pool.path), "%s", path);
+    w->pool.next_id  = 0;
+    w->pool.next_seq = 1;
+    w->next_chunk    = 1;
+    w->pending_size  = 0;
+    w->appended      = 0;
+    w->written       = 0;
+    w->writing       = 0;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->done, NULL);
+
+    // Never more than the room left in the tail
+    w->pending = malloc(WAL_SEGMENT_SIZE);
+    vec_new(w->pool.free);
+    vec_new(w->segments);
+    if (!w->pending || !w->pool.free.data || !w->segments.data)
+        goto err;
+
+    int n = scandir(path, &namelist, NULL, alphasort);
+    if (n < 0)
+        goto err;
+
+    for (int i = 0; i < n; ++i) {
+        if (err == 0 && wal_segment_name(namelist[i]->d_name))
+            err = wal_adopt(w, strtoull(namelist[i]->d_name + 4, NULL, 10));
+        free(namelist[i]);
+    }
+
+    free(namelist);
+
+    if (err < 0)
+        goto err;
+
+    qsort(w->segments.data, vec_size(w->segments), sizeof(Wal_Segment),
+          wal_segment_cmp);
+
+    if (wal_pool_acquire(&w->pool, &tail) < 0)
+        goto err;
+
+    vec_push(w->segments, tail);
+
+    return 0;
+
+err:
+    log_error("WAL open %s: %s", path, strerror(errno));
+    wal_close(w);
     return -1;
 }
 
-int wal_append(Wal *wal, uint64_t ts, double_t value)
+/*
+ * Close the segment files, after writing out the frames still buffered,
+ * they're left on disk, free ones are recognized as such on open
+ */
+void wal_close(Wal *w)
 {
-    size_t len = sizeof(uint64_t) + sizeof(double_t);
-    uint8_t buf[len];
+    if (wal_commit(w) < 0)
+        log_error("WAL close %s: %s", w->pool.path, strerror(errno));
 
-    write_i64(buf, ts);
-    write_f64(buf + sizeof(uint64_t), value);
+    for (size_t i = 0; i < vec_size(w->pool.free); ++i)
+        fclose(vec_at(w->pool.free, i).fp);
+    for (size_t i = 0; i < vec_size(w->segments); ++i)
+        fclose(vec_at(w->segments, i).fp);
+    vec_destroy(w->pool.free);
+    vec_destroy(w->segments);
+    w->pool.free.data = NULL;
+    w->segments.data  = NULL;
+    free(w->pending);
+    w->pending = NULL;
+    pthread_cond_destroy(&w->done);
+    pthread_mutex_destroy(&w->lock);
+}
 
-    // TODO Fix to handle multiple points in the same timestamp
-    if (write_at(wal->fp, buf, wal->size, len) < 0)
+/*
+ * Recycle the oldest segments as long as no chunk still in memory pins them,
+ * never the tail. A chunk pins the segment holding its first frame, the ones
+ * following it are kept as well. To be called with the lock held.
+ */
+static void wal_recycle(Wal *w)
+{
+    size_t n = 0;
+
+    while (n + 1 < vec_size(w->segments) && vec_at(w->segments, n).pins == 0)
+        wal_pool_release(&w->pool, &w->segments.data[n++]);
+
+    if (n == 0)
+        return;
+
+    memmove(w->segments.data, w->segments.data + n,
+            (vec_size(w->segments) - n) * sizeof(Wal_Segment));
+    vec_size(w->segments) -= n;
+}
+
+void wal_checkpoint(Wal *w)
+{
+    pthread_mutex_lock(&w->lock);
+    wal_recycle(w);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static Wal_Segment *wal_segment_find(Wal *w, uint64_t seq)
+{
+    for (size_t i = 0; i < vec_size(w->segments); ++i)
+        if (vec_at(w->segments, i).seq == seq)
+            return &w->segments.data[i];
+    return NULL;
+}
+
+/*
+ * Write `len` bytes of frames at `offset` of a segment and sync them, the
+ * points they hold are durable once it returns
+ */
+static int wal_segment_write(FILE *fp, const uint8_t *buf, size_t offset,
+                             size_t len)
+{
+    if (write_at(fp, buf, offset, len) < 0)
         return -1;
-    wal->size += len;
+
+    uint64_t start = metrics_now();
+    int err        = fdatasync(fileno(fp));
+
+    metrics_record_since(MET_FSYNC, start);
+
+    return err;
+}
+
+/*
+ * Write the frames buffered to the tail, waiting for the writer in flight
+ * if any, before a new tail is chained. To be called with the lock held.
+ */
+static int wal_drain(Wal *w)
+{
+    Wal_Segment *s = NULL;
+
+    while (w->writing)
+        pthread_cond_wait(&w->done, &w->lock);
+
+    if (w->pending_size == 0)
+        return 0;
+
+    s = &w->segments.data[vec_size(w->segments) - 1];
+    if (wal_segment_write(s->fp, w->pending, s->offset, w->pending_size) < 0)
+        return -1;
+
+    s->offset += w->pending_size;
+    w->written += w->pending_size;
+    w->pending_size = 0;
+    pthread_cond_broadcast(&w->done);
+
+    return 0;
+}
+
+/*
+ * Each frame carries its own checksum, a torn write at crash time only costs
+ * the frames it spans, it's buffered till the next commit, a new segment is
+ * chained once the tail is full. To be called with the lock held.
+ */
+static Wal_Segment *wal_write(Wal *w, uint64_t chunk, uint64_t series,
+                              uint64_t ts, double_t value)
+{
+    Wal_Segment *s = &w->segments.data[vec_size(w->segments) - 1];
+
+    if (s->offset + w->pending_size + WAL_FRAME_SIZE > WAL_SEGMENT_SIZE) {
+        Wal_Segment next;
+        if (wal_drain(w) < 0 || wal_pool_acquire(&w->pool, &next) < 0)
+            return NULL;
+        vec_push(w->segments, next);
+        s = &w->segments.data[vec_size(w->segments) - 1];
+    }
+
+    uint8_t *buf = w->pending + w->pending_size;
+
+    write_i64(buf, chunk);
+    write_i64(buf + sizeof(uint64_t), ts);
+    write_f64(buf + sizeof(uint64_t) * 2, value);
+    write_i64(buf + sizeof(uint64_t) * 3, series);
+    write_u32(buf + FRAME_DATA_SIZE, crc32c(s->seed, buf, FRAME_DATA_SIZE));
+
+    w->pending_size += WAL_FRAME_SIZE;
+    w->appended += WAL_FRAME_SIZE;
+
+    return s;
+}
+
+/*
+ * Log a point of the in-memory chunk `c` of a series, the first one assigns
+ * the chunk its id and pins the segment it lands in
+ */
+int wal_append(Wal *w, Wal_Chunk *c, uint64_t series, uint64_t ts,
+               double_t value)
+{
+    TRACE_BEGIN(t);
+    uint64_t start = metrics_now();
+
+    pthread_mutex_lock(&w->lock);
+
+    if (c->id == 0)
+        c->id = w->next_chunk++;
+
+    Wal_Segment *s = wal_write(w, c->id, series, ts, value);
+    if (s && c->pin == 0) {
+        c->pin = s->seq;
+        s->pins++;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    metrics_record_since(MET_WAL_APPEND, start);
+    TRACE_END(t, TRACE_WAL_APPEND);
+
+    if (!s)
+        return -1;
+
+    c->size += WAL_FRAME_SIZE;
+
+    return 0;
+}
+
+/*
+ * Mark the chunk `c` as flushed, its frames are skipped on replay from now on,
+ * and drop its pin, recycling the segments no other chunk needs anymore. On
+ * error `c` is left as it is, to be marked again later.
+ */
+int wal_flushed(Wal *w, Wal_Chunk *c, uint64_t series)
+{
+    if (c->id == 0)
+        return 0;
+
+    pthread_mutex_lock(&w->lock);
+
+    // Without the marker the frames are still needed, the pin is kept
+    Wal_Segment *s = wal_write(w, c->id | FRAME_FLUSHED, series, 0, 0.0);
+    if (!s) {
+        pthread_mutex_unlock(&w->lock);
+        return -1;
+    }
+
+    if ((s = wal_segment_find(w, c->pin))) {
+        s->pins--;
+        wal_recycle(w);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    *c = (Wal_Chunk){0};
+
+    return 0;
+}
+
+/*
+ * Write out the frames appended so far, the ones of the other writers
+ * included, in a single write and sync. One writer at a time does it with
+ * the lock released, the others wait for it to cover their frames or take
+ * over once it's done. Frames failing to be written stay buffered for the
+ * next commit.
+ */
+int wal_commit(Wal *w)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&w->lock);
+
+    uint64_t target = w->appended;
+    while (err == 0 && w->written < target) {
+        if (w->writing) {
+            pthread_cond_wait(&w->done, &w->lock);
+            continue;
+        }
+
+        // The tail can't change nor move while writing, it's drained first
+        Wal_Segment *s = &w->segments.data[vec_size(w->segments) - 1];
+        FILE *fp       = s->fp;
+        size_t offset  = s->offset;
+        size_t len     = w->pending_size;
+
+        // Frames keep being appended past `len` meanwhile
+        w->writing     = 1;
+        pthread_mutex_unlock(&w->lock);
+        err = wal_segment_write(fp, w->pending, offset, len);
+        pthread_mutex_lock(&w->lock);
+        w->writing = 0;
+
+        if (err == 0) {
+            s = &w->segments.data[vec_size(w->segments) - 1];
+            s->offset += len;
+            w->written += len;
+            w->pending_size -= len;
+            memmove(w->pending, w->pending + len, w->pending_size);
+        }
+
+        pthread_cond_broadcast(&w->done);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return err;
+}
+
+size_t wal_size(const Wal_Chunk *c) { return c->size; }
+
+/*
+ * Feed the frames of a segment to `fn` up to the first torn or corrupted one,
+ * where the segment was cut by a crash. Recovered segments are all recycled
+ * once replayed and reused under a new seed, so valid frames past it can't
+ * resurface.
+ */
+static int wal_segment_replay(Wal *w, Wal_Segment *s, uint8_t *buf,
+                              int (*fn)(void *, const Wal_Frame *), void *arg)
+{
+    ssize_t n = read_at(s->fp, buf, 0, WAL_SEGMENT_SIZE);
+    if (n < 0)
+        return -1;
+
+    size_t offset = WAL_SEGMENT_HEADER_SIZE;
+    for (; offset + WAL_FRAME_SIZE <= (size_t)n; offset += WAL_FRAME_SIZE) {
+        const uint8_t *ptr = buf + offset;
+        if (read_u32(ptr + FRAME_DATA_SIZE) !=
+            crc32c(s->seed, ptr, FRAME_DATA_SIZE))
+            break;
+
+        uint64_t chunk  = read_i64(ptr);
+        Wal_Frame frame = {
+            .chunk     = chunk & ~FRAME_FLUSHED,
+            .timestamp = read_i64(ptr + sizeof(uint64_t)),
+            .value     = read_f64(ptr + sizeof(uint64_t) * 2),
+            .series    = read_i64(ptr + sizeof(uint64_t) * 3),
+            .lsn       = s->seq << 32 | offset,
+            .flushed   = (chunk & FRAME_FLUSHED) != 0,
+        };
+
+        if (frame.chunk >= w->next_chunk)
+            w->next_chunk = frame.chunk + 1;
+
+        if (fn(arg, &frame) < 0)
+            return -1;
+    }
+
+    // Valid frames past the bad one mean corruption rather than a torn tail
+    for (size_t i = offset + WAL_FRAME_SIZE; i + WAL_FRAME_SIZE <= (size_t)n;
+         i += WAL_FRAME_SIZE) {
+        if (read_u32(buf + i + FRAME_DATA_SIZE) !=
+            crc32c(s->seed, buf + i, FRAME_DATA_SIZE))
+            continue;
+        log_warn("WAL segment %" PRIu64 ": bad frame at %zu, dropping the rest",
+                 s->id, offset);
+        break;
+    }
+
     return 0;
 }
 
-size_t wal_size(const Wal *wal) { return wal->size; }
+/*
+ * Feed every valid frame found on open to `fn`, in log order, to be called
+ * before any append as it sets the chunk id to start from
+ */
+int wal_replay(Wal *w, int (*fn)(void *, const Wal_Frame *), void *arg)
+{
+    uint8_t *buf = malloc(WAL_SEGMENT_SIZE);
+    int err      = 0;
+
+    if (!buf)
+        return -1;
+
+    // The last one is the tail started on open
+    for (size_t i = 0; i + 1 < vec_size(w->segments) && err == 0; ++i)
+        err = wal_segment_replay(w, &w->segments.data[i], buf, fn, arg);
+
+    free(buf);
+
+    return err;
+}
+
+// Header of the segments of the WALs kept per series before the DB one, the
+// chunk base timestamp, a sequence number, the CRC32C of both and padding
+static const size_t LEGACY_HEADER_SIZE = sizeof(uint64_t) * 3;
+// Timestamp and value of a legacy frame, followed by their CRC32C
+static const size_t LEGACY_DATA_SIZE   = sizeof(uint64_t) + sizeof(double_t);
+
+/*
+ * Feed the legacy frames of `b` from `offset`, checksummed with `seed`, to
+ * `fn` up to the first torn or corrupted one
+ */
+static int wal_legacy_frames(const Buffer *b, size_t offset, uint32_t seed,
+                             int (*fn)(void *, const Wal_Frame *), void *arg)
+{
+    size_t frame_size = LEGACY_DATA_SIZE + sizeof(uint32_t);
+
+    for (; offset + frame_size <= b->size; offset += frame_size) {
+        const uint8_t *ptr = b->buf + offset;
+        if (read_u32(ptr + LEGACY_DATA_SIZE) !=
+            crc32c(seed, ptr, LEGACY_DATA_SIZE))
+            break;
+
+        Wal_Frame frame = {
+            .timestamp = read_i64(ptr),
+            .value     = read_f64(ptr + sizeof(uint64_t)),
+        };
+
+        if (fn(arg, &frame) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Segment of a series WAL, its frames are seeded with the checksum of the
+ * header, free segments or ones with a bad header hold no point
+ */
+static int wal_legacy_segment(const Buffer *b,
+                              int (*fn)(void *, const Wal_Frame *), void *arg)
+{
+    if (b->size < LEGACY_HEADER_SIZE)
+        return 0;
+
+    uint32_t seed = crc32c(0, b->buf, sizeof(uint64_t) * 2);
+    if (read_u32(b->buf + sizeof(uint64_t) * 2) != seed ||
+        read_i64(b->buf) == 0)
+        return 0;
+
+    return wal_legacy_frames(b, LEGACY_HEADER_SIZE, seed, fn, arg);
+}
+
+/*
+ * WAL file of a single chunk, head or prev, made of frames only, checksummed
+ * with no seed. Files older than the checksums hold bare timestamp and value
+ * pairs, told apart by their first frame failing the check, they're read up
+ * to the last whole pair.
+ */
+static int wal_legacy_chunk(const Buffer *b,
+                            int (*fn)(void *, const Wal_Frame *), void *arg)
+{
+    size_t frame_size = LEGACY_DATA_SIZE + sizeof(uint32_t);
+
+    if (b->size >= frame_size &&
+        read_u32(b->buf + LEGACY_DATA_SIZE) ==
+            crc32c(0, b->buf, LEGACY_DATA_SIZE))
+        return wal_legacy_frames(b, 0, 0, fn, arg);
+
+    for (size_t offset = 0; offset + LEGACY_DATA_SIZE <= b->size;
+         offset += LEGACY_DATA_SIZE) {
+        Wal_Frame frame = {
+            .timestamp = read_i64(b->buf + offset),
+            .value     = read_f64(b->buf + offset + sizeof(uint64_t)),
+        };
+
+        if (fn(arg, &frame) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Read back the points of a WAL file written by a single series, before the
+ * WAL was shared by the DB, to move them into the partitions on upgrade. The
+ * frames are fed to `fn` in file order up to the first bad one, only their
+ * timestamp and value are set.
+ */
+int wal_legacy_replay(const char *path, int (*fn)(void *, const Wal_Frame *),
+                      void *arg)
+{
+    const char *name = strrchr(path, '/');
+    Buffer b         = {0};
+    int err          = 0;
+
+    FILE *fp         = fopen(path, "r");
+    if (!fp || buf_read_file(fp, &b) < 0 || !b.buf) {
+        log_error("WAL %s: %s", path, strerror(errno));
+        if (fp)
+            fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+
+    // Either wal-<segment id>.log or wal-<h|t>-<chunk base>.log
+    name = name ? name + 1 : path;
+    if (isdigit((unsigned char)name[4]))
+        err = wal_legacy_segment(&b, fn, arg);
+    else if ((name[4] == 'h' || name[4] == 't') && name[5] == '-')
+        err = wal_legacy_chunk(&b, fn, arg);
+    else
+        log_warn("WAL %s: unknown format, dropped", path);
+
+    free(b.buf);
+
+    return err;
+}
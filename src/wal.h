@@ -1,27 +1,117 @@
 #ifndef WAL_H
 #define WAL_H
 
+#include "vec.h"
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-#define WAL_PATH_SIZE 512
+#define WAL_PATH_SIZE           512
+#define WAL_SEGMENT_SIZE        (1 << 20)
+// Segments released and kept around for reuse
+#define WAL_POOL_SIZE           4
+// Sequence number, its CRC32C and padding
+#define WAL_SEGMENT_HEADER_SIZE (sizeof(uint64_t) * 2)
+// Chunk id, timestamp, value, series id and the CRC32C of them all
+#define WAL_FRAME_SIZE          (sizeof(uint64_t) * 4 + sizeof(uint32_t))
 
-typedef struct wal {
+/*
+ * Fixed size, preallocated file holding a run of frames of the WAL, ordered
+ * by their sequence number, 0 for free segments.
+ *
+ * Frame checksums are seeded with the one of the header, so the frames left
+ * by a previous use of the file never pass as valid ones. `pins` counts the
+ * chunks not flushed yet whose first frame is in the segment.
+ */
+typedef struct wal_segment {
     FILE *fp;
+    uint64_t id;
+    uint64_t seq;
+    uint32_t seed;
+    size_t offset;
+    size_t pins;
+} Wal_Segment;
+
+typedef VEC(Wal_Segment) Wal_Segments;
+
+/*
+ * Segment files released, kept open to be reused as the next tail, up to
+ * WAL_POOL_SIZE, so the WAL moving on doesn't create nor unlink files
+ */
+typedef struct wal_pool {
     char path[WAL_PATH_SIZE];
+    uint64_t next_id;
+    uint64_t next_seq;
+    Wal_Segments free;
+} Wal_Pool;
+
+/*
+ * Share of the WAL of an in-memory chunk, its frames are tagged with `id`,
+ * unique in the DB, `pin` is the sequence number of the segment holding its
+ * first frame, `size` the amount of bytes logged so far
+ */
+typedef struct wal_chunk {
+    uint64_t id;
+    uint64_t pin;
     size_t size;
+} Wal_Chunk;
+
+/*
+ * Frame as read back on replay, either a point of a chunk of a series or the
+ * marker of the chunk having been flushed
+ */
+typedef struct wal_frame {
+    uint64_t series;
+    uint64_t chunk;
+    uint64_t timestamp;
+    double_t value;
+    uint64_t lsn;
+    int flushed;
+} Wal_Frame;
+
+/*
+ * WAL shared by all the series of a DB, appends from any writer go to the
+ * tail segment one after the other, the segments are recycled from the
+ * oldest as soon as no chunk still in memory has frames in them.
+ *
+ * Frames are buffered in `pending` and written to the tail and synced in
+ * groups by `wal_commit`, one writer at a time with the lock released,
+ * `appended` and `written` count the bytes of frames buffered and synced so
+ * far.
+ */
+typedef struct wal {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    Wal_Pool pool;
+    Wal_Segments segments;
+    uint64_t next_chunk;
+    uint8_t *pending;
+    size_t pending_size;
+    uint64_t appended;
+    uint64_t written;
+    int writing;
 } Wal;
 
-int wal_init(Wal *w, const char *path, uint64_t base_timestamp, int main);
+int wal_open(Wal *w, const char *path);
+
+void wal_close(Wal *w);
+
+int wal_append(Wal *w, Wal_Chunk *c, uint64_t series, uint64_t ts,
+               double_t value);
+
+int wal_flushed(Wal *w, Wal_Chunk *c, uint64_t series);
+
+int wal_commit(Wal *w);
 
-int wal_load(Wal *w, const char *path, uint64_t base_timestamp, int main);
+int wal_replay(Wal *w, int (*fn)(void *, const Wal_Frame *), void *arg);
 
-int wal_delete(Wal *w);
+void wal_checkpoint(Wal *w);
 
-int wal_append(Wal *wal, uint64_t ts, double_t value);
+size_t wal_size(const Wal_Chunk *c);
 
-size_t wal_size(const Wal *wal);
+int wal_legacy_replay(const char *path, int (*fn)(void *, const Wal_Frame *),
+                      void *arg);
 
 #endif
@@ -0,0 +1,154 @@
+#include "worker.h"
+#include "logging.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JOBS_BASE_CAPACITY 64
+
+static void *worker_run(void *arg)
+{
+    Worker_Pool *pool = arg;
+    Work work;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head == pool->tail && !pool->stop)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+
+        if (pool->head == pool->tail && pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        work = pool->jobs[pool->head++ % pool->capacity];
+        pthread_mutex_unlock(&pool->lock);
+
+        work.fn(work.arg);
+
+        // The last job of the group wakes up the submitter
+        if (work.group && atomic_fetch_sub(&work.group->pending, 1) == 1)
+            sem_post(&work.group->done);
+    }
+
+    return NULL;
+}
+
+int worker_pool_init(Worker_Pool *pool, size_t size)
+{
+    if (size == 0 || size > WORKER_MAX_NR)
+        return -1;
+
+    pool->threads = calloc(size, sizeof(*pool->threads));
+    if (!pool->threads)
+        return -1;
+
+    pool->jobs = calloc(JOBS_BASE_CAPACITY, sizeof(*pool->jobs));
+    if (!pool->jobs) {
+        free(pool->threads);
+        return -1;
+    }
+
+    pool->size     = 0;
+    pool->head     = 0;
+    pool->tail     = 0;
+    pool->capacity = JOBS_BASE_CAPACITY;
+    pool->stop     = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (size_t i = 0; i < size; ++i) {
+        if (pthread_create(&pool->threads[i], NULL, worker_run, pool) != 0) {
+            log_error("Worker pool init: %s", strerror(errno));
+            worker_pool_stop(pool);
+            return -1;
+        }
+        pool->size++;
+    }
+
+    return 0;
+}
+
+/*
+ * Stop the workers once the queued jobs are drained
+ */
+void worker_pool_stop(Worker_Pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->size; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->jobs);
+    pool->threads = NULL;
+    pool->jobs    = NULL;
+    pool->size    = 0;
+}
+
+/*
+ * The submitter holds a reference on the group until it waits on it, so the
+ * group can't be signaled while jobs are still being submitted
+ */
+int work_group_init(Work_Group *group)
+{
+    atomic_init(&group->pending, 1);
+    return sem_init(&group->done, 0, 0);
+}
+
+/*
+ * Queue a job on the pool, the queue grows as needed, jobs are never dropped
+ */
+int worker_pool_submit(Worker_Pool *pool, Work_Group *group,
+                       void (*fn)(void *), void *arg)
+{
+    if (group)
+        atomic_fetch_add(&group->pending, 1);
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->tail - pool->head == pool->capacity) {
+        size_t capacity = pool->capacity * 2;
+        Work *jobs      = malloc(capacity * sizeof(*jobs));
+        if (!jobs) {
+            pthread_mutex_unlock(&pool->lock);
+            if (group)
+                atomic_fetch_sub(&group->pending, 1);
+            return -1;
+        }
+        // Unroll the ring into the new array
+        for (size_t i = 0; i < pool->capacity; ++i)
+            jobs[i] = pool->jobs[(pool->head + i) % pool->capacity];
+        free(pool->jobs);
+        pool->jobs     = jobs;
+        pool->tail     = pool->capacity;
+        pool->head     = 0;
+        pool->capacity = capacity;
+    }
+
+    pool->jobs[pool->tail++ % pool->capacity] =
+        (Work){.fn = fn, .arg = arg, .group = group};
+
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/*
+ * Wait for every job submitted in the group to be executed, the group can be
+ * reused afterwards
+ */
+void work_group_wait(Work_Group *group)
+{
+    if (atomic_fetch_sub(&group->pending, 1) != 1)
+        while (sem_wait(&group->done) < 0 && errno == EINTR)
+            ;
+
+    atomic_store(&group->pending, 1);
+}
@@ -0,0 +1,53 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define WORKER_MAX_NR 64
+
+/*
+ * Group of jobs submitted together, the submitter waits on it until every
+ * job of the group has been executed, used to fan out the per-series scans
+ * of a query and gather them back
+ */
+typedef struct work_group {
+    atomic_size_t pending;
+    sem_t done;
+} Work_Group;
+
+typedef struct work {
+    void (*fn)(void *);
+    void *arg;
+    Work_Group *group;
+} Work;
+
+/*
+ * Fixed size pool of worker threads, sharing a FIFO of jobs
+ */
+typedef struct worker_pool {
+    size_t size;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Work *jobs;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+    int stop;
+} Worker_Pool;
+
+int worker_pool_init(Worker_Pool *pool, size_t size);
+
+void worker_pool_stop(Worker_Pool *pool);
+
+int work_group_init(Work_Group *group);
+
+int worker_pool_submit(Worker_Pool *pool, Work_Group *group,
+                       void (*fn)(void *), void *arg);
+
+void work_group_wait(Work_Group *group);
+
+#endif